@@ -27,12 +27,47 @@
 #include <mip/printmsg.h>
 
 #include "protos.h"
+#include "osemthreads.h"
+#include "imgmap.h"
+#include "prjpack.h"
+#include "loadimages.h"
+#include "prjcache.h"
+#include "rebinplan.h"
+
+/* Opens a projection image, either a packed projection file or any image
+	imgio reads. Exactly one of the returned image and *ppsPack is set. */
+static IMAGE *pOpenPrjImage(char *pchName, int *piXdim, int *piYdim, int *piZdim, PackedPrj_t **ppsPack)
+{
+	*ppsPack = NULL;
+	if (bIsPackedPrj(pchName)){
+		*ppsPack = psOpenPackedPrj(pchName, piXdim, piYdim, piZdim);
+		return NULL;
+	}
+	return imgio_openimage(pchName, 'o', piXdim, piYdim, piZdim);
+}
+
+/* The width of the bins of the projection images (binwidth). It may
+	differ from the pixel width of the reconstruction (pixwidth); the
+	projections are then resampled to the pixels. */
+static float fGetPrjBinWidth(float fPixWidth)
+{
+	int bFound;
+	float fBinWidth;
+
+	fBinWidth = (float)dGetDblParm("binwidth", &bFound, fPixWidth);
+	if (fBinWidth != fPixWidth && !(fBinWidth > 0.0f && fPixWidth > 0.0f))
+		vErrorHandler(ECLASS_FATAL, ETYPE_ILLEGAL_VALUE, "GetPrjBinWidth", "binwidth (%g) and pixwidth (%g) must be > 0", fBinWidth, fPixWidth);
+	return fBinWidth;
+}
 
 /**
 	 @brief Gets sizes and number of angles for projection data and
 	 reconstructed/actitity image.
 
 	 These are obtained from the parameter file and the activity image.
+	 For osems the reconstruction has as many pixels as cover the bins of
+	 the projections, which is the number of bins unless binwidth differs
+	 from pixwidth.
 	 
 	 @param *pchActImageName - ptr to the activity image data filename.
 	 @param *psParms - ptr to the IrlParms_t struct.
@@ -44,10 +79,12 @@ void vGetImageSizes(char *pchActImageName, IrlParms_t *psParms, int iMode)
 {
 	int iXdim, iYdim, iZdim, iSliceStart, iSliceEnd, bFound;
 	int iDefaultEndSlice;
+	float fPixWidth, fBinWidth;
 	IMAGE *pImage;
+	PackedPrj_t *psPack;
 
 	vPrintMsg(4,"\nGetImageSizes\n");
-	pImage = imgio_openimage(pchActImageName, 'o', &iXdim, &iYdim, &iZdim);
+	pImage = pOpenPrjImage(pchActImageName, &iXdim, &iYdim, &iZdim, &psPack);
 	vPrintMsg(6,"input image=(%d x %d x %d)\n",iXdim, iYdim, iZdim);
 
 	iSliceStart  = iGetIntParm("slice_start", &bFound, 0);
@@ -66,6 +103,15 @@ void vGetImageSizes(char *pchActImageName, IrlParms_t *psParms, int iMode)
 	iSliceEnd = iGetIntParm("slice_end", &bFound, iDefaultEndSlice); 
 	psParms->NumPixels = iXdim;
 	psParms->NumSlices = iSliceEnd - iSliceStart + 1;
+	if (iMode == 0){
+		fPixWidth = (float)dGetDblParm("pixwidth", &bFound, 0.0);
+		fBinWidth = fGetPrjBinWidth(fPixWidth);
+		psParms->NumPixels = iRebinSize(iXdim, fBinWidth, fPixWidth);
+		if (psParms->NumPixels <= 0)
+			vErrorHandler(ECLASS_FATAL, ETYPE_ILLEGAL_VALUE, "vGetImageSizes", "%d bins of width %g do not cover a pixel of width %g", iXdim, fBinWidth, fPixWidth);
+		if (fBinWidth != fPixWidth)
+			vPrintMsg(6,"%d bins of %g cm resampled to %d pixels of %g cm\n", iXdim, fBinWidth, psParms->NumPixels, fPixWidth);
+	}
 	
 	if (psParms->NumSlices <= 0)
 		vErrorHandler(ECLASS_FATAL, ETYPE_ILLEGAL_VALUE, "vGetImageSizes", "Number of slices must be > 0: start=%d, end=%d, num=%d\n", iSliceStart, iSliceEnd, psParms->NumSlices);
@@ -78,7 +124,163 @@ void vGetImageSizes(char *pchActImageName, IrlParms_t *psParms, int iMode)
 			vErrorHandler(ECLASS_FATAL, ETYPE_ILLEGAL_VALUE, "vGetImageSizes", "X and Y dimension of activity image should be equal : x-dimension = %d, Y-dimension = %d", iXdim, iYdim);
 		vPrintMsg(7,"NumPix=%d, NumSlices=%d \n", psParms->NumPixels, psParms->NumSlices);
 	}
-	imgio_closeimage(pImage);
+	if (psPack != NULL)
+		vClosePackedPrj(psPack);
+	else
+		imgio_closeimage(pImage);
+}
+
+/* The image reads can run on several threads at once (see vLoadImages).
+	imgio is not documented to be reentrant, so every imgio call they make
+	holds sgImgioMutex. They take their scratch memory from malloc instead
+	of pvIrlMalloc, and return what they find wrong instead of calling
+	vErrorHandler, so errors are reported on the calling thread. */
+static OsemMutex_t sgImgioMutex;
+static int bsgImgioMutexInit = FALSE;
+
+// called from the thread that starts the reads
+static void vInitImgioMutex(void)
+{
+	if (!bsgImgioMutexInit){
+		vInitMutex(&sgImgioMutex);
+		bsgImgioMutexInit = TRUE;
+	}
+}
+
+#define PRJ_RING_PER_THREAD 2	// buffers in the read ring for each rebinning thread
+
+/* Projection loading is a pipeline: one thread reads the views in order
+	into a ring of buffers while the rebinning threads take them in the
+	same order, shift them into the output, scale them and sum them.
+	View v goes through ring slot v % iRingSize. Packed projection files
+	have no reading thread: each rebinning thread decodes its own view
+	into the ring slot. */
+typedef struct {
+	IMAGE *pImage;
+	MappedImage_t *psMap;		// the mapped image, or NULL to read with imgio
+	PackedPrj_t *psPack;		// the packed projection file, or NULL
+	int iInNumBins, iInNumSlices, iNumAngles, iStartSlice, iOutNumBins, iOutNumSlices;
+	float fInBinWidth, fOutBinWidth, fScaleFac;
+	PrjView_t *psViews;
+	RebinPlan_t **ppsPlans;		// rebin plan of each view, shared by views with the same Left
+	float *pfPrjPixels;
+	int iRingSize;
+	float **ppfRing;			// buffers of the ring; NULL entries when views are used in place
+	float **ppfSlab;			// requested slices of the view held in each slot
+	int *piSlotView;			// view held in each slot, -1 if the slot is free
+	double *pdPrjSum;			// sum of the requested slices of each view
+	double *pdModSum;			// sum of each output view
+	float fTouched;				// sum of the pixels the reader faulted in, so the reads are kept
+	int bFailed;				// a packed view could not be read
+	char achError[LOAD_MAX_ERROR];	// and why
+	OsemMutex_t sMutex;
+	OsemCond_t sCond;
+} PrjPipeline_t;
+
+// the reading thread: fills the ring slots in view order
+static void vReadPrjViews(void *pvArg)
+{
+	PrjPipeline_t *psPipe = (PrjPipeline_t *)pvArg;
+	int iAngle, iSlot;
+	long l, lSlabLen = (long)psPipe->iInNumBins*psPipe->iOutNumSlices;
+	long lPageLen = 4096/sizeof(float);	// one read per page
+	float fTouch = 0.0f;
+	float *pfSlab;
+
+	for(iAngle=0; iAngle < psPipe->iNumAngles; ++iAngle){
+		iSlot = iAngle % psPipe->iRingSize;
+		vLockMutex(&psPipe->sMutex);
+		while (psPipe->piSlotView[iSlot] != -1)
+			vWaitCond(&psPipe->sCond, &psPipe->sMutex);
+		vUnlockMutex(&psPipe->sMutex);
+
+		if (psPipe->psMap == NULL){
+			// read all pixels in one projection view
+			vLockMutex(&sgImgioMutex);
+			imgio_readslices(psPipe->pImage, iAngle, iAngle, psPipe->ppfRing[iSlot]);
+			vUnlockMutex(&sgImgioMutex);
+			pfSlab = psPipe->ppfRing[iSlot] + psPipe->iStartSlice*psPipe->iInNumBins;
+		}else{
+			pfSlab = (float *)pfMappedRows(psPipe->psMap, iAngle, psPipe->iStartSlice, psPipe->iOutNumSlices, psPipe->ppfRing[iSlot]);
+			// views used in place are faulted in here so the rebinning threads do not wait for the disk
+			if (psPipe->ppfRing[iSlot] == NULL)
+				for (l = 0; l < lSlabLen; l += lPageLen)
+					fTouch += pfSlab[l];
+		}
+
+		vLockMutex(&psPipe->sMutex);
+		psPipe->ppfSlab[iSlot] = pfSlab;
+		psPipe->piSlotView[iSlot] = iAngle;
+		vBroadcastCond(&psPipe->sCond);
+		vUnlockMutex(&psPipe->sMutex);
+	}
+	psPipe->fTouched = fTouch;
+}
+
+// scales iLen pixels by fScaleFac (unless it is 0 or 1) and returns their sum, in one pass
+static double dScaleAndSum(float *pf, int iLen, float fScaleFac)
+{
+	double dSum = 0.0;
+	int i;
+
+	if (fScaleFac == 0.0 || fScaleFac == 1.0){
+		for (i = 0; i < iLen; i++)
+			dSum += pf[i];
+	}else{
+		for (i = 0; i < iLen; i++){
+			pf[i] *= fScaleFac;
+			dSum += pf[i];
+		}
+	}
+	return dSum;
+}
+
+// a rebinning thread: takes one view from the ring and puts it in the output
+static void vRebinPrjView(void *pvArg, int iAngle)
+{
+	PrjPipeline_t *psPipe = (PrjPipeline_t *)pvArg;
+	int iSlot = iAngle % psPipe->iRingSize;
+	int iOutLen = psPipe->iOutNumSlices*psPipe->iOutNumBins;
+	float *pfOut = psPipe->pfPrjPixels + (long)iAngle*iOutLen;
+	float *pfSlab;
+	char achError[LOAD_MAX_ERROR];
+
+	vLockMutex(&psPipe->sMutex);
+	if (psPipe->psPack != NULL){
+		// the views are handed out in order, so the view before in this slot is already being rebinned
+		while (psPipe->piSlotView[iSlot] != -1)
+			vWaitCond(&psPipe->sCond, &psPipe->sMutex);
+		psPipe->piSlotView[iSlot] = iAngle;
+		vUnlockMutex(&psPipe->sMutex);
+		if (iReadPackedRows(psPipe->psPack, iAngle, psPipe->iStartSlice, psPipe->iOutNumSlices, psPipe->ppfRing[iSlot], achError, sizeof(achError))){
+			// the first error is kept for the report; the view is left out
+			vLockMutex(&psPipe->sMutex);
+			if (!psPipe->bFailed){
+				psPipe->bFailed = TRUE;
+				memcpy(psPipe->achError, achError, sizeof(achError));
+			}
+			psPipe->piSlotView[iSlot] = -1;
+			vBroadcastCond(&psPipe->sCond);
+			vUnlockMutex(&psPipe->sMutex);
+			return;
+		}
+		pfSlab = psPipe->ppfRing[iSlot];
+	}else{
+		while (psPipe->piSlotView[iSlot] != iAngle)
+			vWaitCond(&psPipe->sCond, &psPipe->sMutex);
+		pfSlab = psPipe->ppfSlab[iSlot];
+		vUnlockMutex(&psPipe->sMutex);
+	}
+
+	psPipe->pdPrjSum[iAngle] = sum_float(pfSlab, psPipe->iInNumBins*psPipe->iOutNumSlices);
+	// shift only the slices we need into the right place in PrjPixels
+	vApplyRebinPlan(psPipe->ppsPlans[iAngle], psPipe->iOutNumSlices, pfSlab, pfOut);
+	psPipe->pdModSum[iAngle] = dScaleAndSum(pfOut, iOutLen, psPipe->fScaleFac);
+
+	vLockMutex(&psPipe->sMutex);
+	psPipe->piSlotView[iSlot] = -1;
+	vBroadcastCond(&psPipe->sCond);
+	vUnlockMutex(&psPipe->sMutex);
 }
 
 /**
@@ -93,6 +295,11 @@ void vGetImageSizes(char *pchActImageName, IrlParms_t *psParms, int iMode)
 	 iEndSlice have already been checked against the size of the input image.
 
 	 @param *pImage       - image file containing  projection pixels.
+	 @param *psPack       - packed projection file containing them instead, or NULL.
+	 @param *pchImageName - name of that file.
+	 @param bTryMap       - if set and possible the file is mapped into memory
+	                        and only the requested slices of each view are read;
+	                        otherwise whole views are read with imgio.
 	 @param iInNumBins    - number of projection bins (xdim) in input image. 
 	 @param iOutNumBins   - number of bins in output modified projections.
 	 @param iInNumSlices  - number of slices (ydim) in input image.
@@ -105,64 +312,180 @@ void vGetImageSizes(char *pchActImageName, IrlParms_t *psParms, int iMode)
 	 @param *psViews      - structure containing information about cor for each.
 	                        view that is needed to shift the raw projections into
 	                        the output matrix.
+	 @param **ppsPlans    - rebin plan of each view.
+	 @param *pfPrjPixels  - gets the projection data.
+	 @param *pdBytes      - gets the number of bytes read from the file.
+	 @param *pchError     - gets what went wrong, LOAD_MAX_ERROR characters at most.
 
-	 @return ptr to projection data.
+	 @return 0 on success, non-zero if the data could not be read.
 */
-static float *pfReadPrjPix(IMAGE *pImage, int iInNumBins, int iOutNumBins, int iInNumSlices, int iNumAngles, int iStartSlice, int iOutNumSlices, float fInBinWidth, float fOutBinWidth, float fScaleFac, PrjView_t *psViews)
+static int iReadPrjPix(IMAGE *pImage, PackedPrj_t *psPack, char *pchImageName, int bTryMap, int iInNumBins, int iOutNumBins, int iInNumSlices, int iNumAngles, int iStartSlice, int iOutNumSlices, float fInBinWidth, float fOutBinWidth, float fScaleFac, PrjView_t *psViews, RebinPlan_t **ppsPlans, float *pfPrjPixels, double *pdBytes, char *pchError)
 {
-	float *pfPrjPixels; // entire set of projection data needed to reconstruct desired slices
-	float *pfReadPix; // raw projection data for one 2d view
-	int iAngle;
-	float fPrjSum=0.0;
+	PrjPipeline_t sPipe;
+	OsemThread_t sReader;
+	MappedImage_t sMap;
+	float *pfCheck;
+	int i, iBufLen = 0, bMapped = FALSE, iErr = 0;
+	double dPrjSum, dModSum, dStart = dGetWallTime();
 
 	vPrintMsg(6,"\nReadPrjPix\n");
 	vPrintMsg(7,"            InBins=%d, OutBins=%d, InSlices=%d, OutSlices=%d\n", iInNumBins, iOutNumBins, iInNumSlices, iOutNumSlices);
 	vPrintMsg(7,"            NumAngles=%d, StartSlice=%d, normfac=%.3g\n", iNumAngles, iStartSlice,fScaleFac);
-	
-	pfPrjPixels=(float *) pvIrlMalloc(sizeof(float)*iOutNumSlices*iOutNumBins*iNumAngles, "ReadPrjImage:PrjPixels");
-	set_float(pfPrjPixels, iOutNumSlices*iOutNumBins*iNumAngles, 0.0);
-	pfReadPix=(float *) pvIrlMalloc(sizeof(float)*iInNumBins*iInNumSlices,"ReadPrjImage:ReadPix");	// BUG, changed from iInNumBins*iInNumSlices*iNumAngles
-	
-	for(iAngle=0; iAngle < iNumAngles; ++iAngle){
-		// read all pixels in one projection view
-		imgio_readslices(pImage,iAngle,iAngle,pfReadPix);
-		fPrjSum += sum_float(pfReadPix+iStartSlice*iInNumBins, iInNumBins*iOutNumSlices);
-		
-		// shift only the slices we need into the right place in PrjPixels
-		vMeasToModPrj(iInNumBins, iOutNumBins, iOutNumSlices, psViews[iAngle].Left,fInBinWidth,fOutBinWidth, pfReadPix+iStartSlice*iInNumBins, pfPrjPixels+iAngle*iOutNumSlices*iOutNumBins);
+
+	memset(&sPipe, 0, sizeof(PrjPipeline_t));
+	sPipe.pImage = pImage;
+	sPipe.psPack = psPack;
+	sPipe.iInNumBins = iInNumBins;
+	sPipe.iInNumSlices = iInNumSlices;
+	sPipe.iNumAngles = iNumAngles;
+	sPipe.iStartSlice = iStartSlice;
+	sPipe.iOutNumBins = iOutNumBins;
+	sPipe.iOutNumSlices = iOutNumSlices;
+	sPipe.fInBinWidth = fInBinWidth;
+	sPipe.fOutBinWidth = fOutBinWidth;
+	sPipe.fScaleFac = fScaleFac;
+	sPipe.psViews = psViews;
+	sPipe.pfPrjPixels = pfPrjPixels;	// every pixel is written as the views are rebinned
+	sPipe.ppsPlans = ppsPlans;
+
+	// uncompressed float images are read from a memory mapping; anything else through imgio
+	if (bTryMap && psPack == NULL && (pfCheck = (float *)malloc(sizeof(float)*iInNumBins*iInNumSlices)) != NULL){
+		vLockMutex(&sgImgioMutex);
+		bMapped = iMapImage(pchImageName, pImage, iInNumBins, iInNumSlices, iNumAngles, pfCheck, &sMap) == 0;
+		vUnlockMutex(&sgImgioMutex);
+		free(pfCheck);
+	}
+	if (bMapped){
+		sPipe.psMap = &sMap;
+		vAdviseMappedRows(&sMap, iStartSlice, iOutNumSlices);
+		// an aligned mapping is used in place, otherwise the slab is copied out
+		if (!sMap.bAligned)
+			iBufLen = iInNumBins*iOutNumSlices;
+		*pdBytes = (double)sizeof(float)*iInNumBins*iOutNumSlices*iNumAngles;
+	}else if (psPack != NULL){
+		// only the chunks holding the requested slices are read and decoded
+		iBufLen = iInNumBins*iOutNumSlices;
+		*pdBytes = dPackedRowBytes(psPack, iStartSlice, iOutNumSlices);
+	}else{
+		iBufLen = iInNumBins*iInNumSlices;	// BUG, changed from iInNumBins*iInNumSlices*iNumAngles
+		*pdBytes = (double)sizeof(float)*iInNumBins*iInNumSlices*iNumAngles;
 	}
-	if (fScaleFac != 0.0 && fScaleFac != 1.0)
-		scale_float(pfPrjPixels, iOutNumSlices*iOutNumBins*iNumAngles, fScaleFac);
-	vPrintMsg(8,"prjsum=%.2f, modprjsum=%.2f\n",fPrjSum, sum_float(pfPrjPixels,iOutNumSlices*iOutNumBins*iNumAngles)); 
-	IrlFree(pfReadPix);
-	return pfPrjPixels;
+
+	sPipe.iRingSize = PRJ_RING_PER_THREAD*iGetNumThreads();
+	if (sPipe.iRingSize > iNumAngles)
+		sPipe.iRingSize = iNumAngles;
+	sPipe.ppfRing = (float **)calloc(sPipe.iRingSize, sizeof(float *));
+	sPipe.ppfSlab = (float **)malloc(sizeof(float *)*sPipe.iRingSize);
+	sPipe.piSlotView = (int *)malloc(sizeof(int)*sPipe.iRingSize);
+	sPipe.pdPrjSum = (double *)malloc(sizeof(double)*iNumAngles);
+	sPipe.pdModSum = (double *)malloc(sizeof(double)*iNumAngles);
+	if (sPipe.ppfRing == NULL || sPipe.ppfSlab == NULL || sPipe.piSlotView == NULL || sPipe.pdPrjSum == NULL || sPipe.pdModSum == NULL)
+		iErr = 1;
+	for (i = 0; iErr == 0 && i < sPipe.iRingSize; i++){
+		if (iBufLen && (sPipe.ppfRing[i] = (float *)malloc(sizeof(float)*iBufLen)) == NULL)
+			iErr = 1;
+		sPipe.piSlotView[i] = -1;
+	}
+	if (iErr)
+		snprintf(pchError, LOAD_MAX_ERROR, "unable to allocate the read buffers");
+	else{
+		vInitMutex(&sPipe.sMutex);
+		vInitCond(&sPipe.sCond);
+		if (psPack == NULL && iStartThread(&sReader, vReadPrjViews, &sPipe)){
+			snprintf(pchError, LOAD_MAX_ERROR, "unable to start the projection reading thread");
+			iErr = 1;
+		}else{
+			vParallelFor(iNumAngles, vRebinPrjView, &sPipe);
+			if (psPack == NULL)
+				vJoinThread(sReader);
+			if (sPipe.bFailed){
+				memcpy(pchError, sPipe.achError, LOAD_MAX_ERROR);
+				iErr = 1;
+			}
+		}
+		vDestroyCond(&sPipe.sCond);
+		vDestroyMutex(&sPipe.sMutex);
+	}
+
+	if (iErr == 0){
+		// summed in a fixed order so the result does not depend on the number of threads
+		dPrjSum = dTreeSum(sPipe.pdPrjSum, iNumAngles);
+		dModSum = dTreeSum(sPipe.pdModSum, iNumAngles);
+		vPrintMsg(8,"prjsum=%.2f, modprjsum=%.2f\n", dPrjSum, dModSum);
+		if (bMapped && sMap.bAligned)
+			vPrintMsg(9,"mapped views faulted in by the reader, touched pixel sum=%.2f\n", sPipe.fTouched);
+	}
+
+	if (sPipe.ppfRing != NULL)
+		for (i = 0; i < sPipe.iRingSize; i++)
+			free(sPipe.ppfRing[i]);
+	free(sPipe.ppfRing);
+	free(sPipe.ppfSlab);
+	free(sPipe.piSlotView);
+	free(sPipe.pdPrjSum);
+	free(sPipe.pdModSum);
+	if (bMapped)
+		vUnmapImage(&sMap);
+	if (iErr == 0)
+		vPrintMsg(6,"read slices %d-%d of %s in %.3f s%s, %d threads\n", iStartSlice, iStartSlice+iOutNumSlices-1, pchImageName, dGetWallTime() - dStart, bMapped ? " (mapped)" : psPack != NULL ? " (packed)" : "", iGetNumThreads());
+	return iErr;
 }
 
-/**
-	 @brief Opens prj images and calls ReadPrjImages to get projection data
-	 and copy and scale it into the projection image.
+// the cache of modified projections is used if prj_cache_dir is set
+static void vGetPrjCacheParms(ImageLoad_t *psLoad)
+{
+	int bFound;
+	char *pchDir;
 
-	 @return a pointer to the projection data.
+	pchDir = pchGetStrParm("prj_cache_dir", &bFound, "");
+	if (!bFound || pchDir[0] == '\0')
+		return;
+	psLoad->pchCacheDir = pchIrlStrdup(pchDir);
+	psLoad->dCacheMaxBytes = dGetDblParm("prj_cache_mb", &bFound, 4096.0)*1048576.0;
+}
+
+/**
+	 @brief Opens prj images and prepares the read of the projection data
+	 into the modified projection image.
 */
-float *pfGetPrjImage(char *pchPrjImageName, IrlParms_t *psParms, PrjView_t *psViews)
+void vPreparePrjImage(char *pchPrjImageName, IrlParms_t *psParms, PrjView_t *psViews, ImageLoad_t *psLoad)
 {
-	int iXdim, iYdim, iZdim, bFound, iStartSlice;
-	IMAGE *pPrjImage; 
-	float *pfPrjPixels; // entire set of projection data needed to reconstruct desired slices
+	int bFound;
 
 	vPrintMsg(4,"\nGetPrjImage\n");
 	vPrintMsg(6,"reading projection data from %s\n",pchPrjImageName);
-	pPrjImage = imgio_openimage(pchPrjImageName, 'o', &iXdim, &iYdim, &iZdim);
+	memset(psLoad, 0, sizeof(ImageLoad_t));
+	psLoad->eKind = LOAD_PRJ;
+	psLoad->pchWhat = "projections";
+	psLoad->pchName = pchPrjImageName;
+	psLoad->psParms = psParms;
+	psLoad->psViews = psViews;
+	psLoad->pImage = pOpenPrjImage(pchPrjImageName, &psLoad->iXdim, &psLoad->iYdim, &psLoad->iZdim, &psLoad->psPack);
+	psLoad->fInBinWidth = fGetPrjBinWidth(psParms->BinWidth);
 
 	// Do not need to check image size again since those were all checked in vGetImageSizes
-	iStartSlice = iGetIntParm("slice_start", &bFound, 0);
-	vPrintMsg(6,"numbins=%d, numangles=%d, start=%d, end=%d, img=%d x %d x %d\n", psParms->NumPixels, psParms->NumViews, iStartSlice, iStartSlice+psParms->NumViews, iXdim, iYdim, iZdim);
-	
-	// scale by number of angles so reconstructed image is in units of total acquisition time, not time per view
-	pfPrjPixels = pfReadPrjPix(pPrjImage, psParms->NumPixels, psParms->NumPixels, iYdim, psParms->NumViews, iStartSlice, psParms->NumSlices, psParms->BinWidth, psParms->BinWidth, (float)psParms->NumViews, psViews);
+	psLoad->iStartSlice = iGetIntParm("slice_start", &bFound, 0);
+	vPrintMsg(6,"numbins=%d, numangles=%d, start=%d, end=%d, img=%d x %d x %d\n", psParms->NumPixels, psParms->NumViews, psLoad->iStartSlice, psLoad->iStartSlice+psParms->NumViews, psLoad->iXdim, psLoad->iYdim, psLoad->iZdim);
+	// uncompressed float images are read from a memory mapping; anything else through imgio
+	psLoad->bTryMap = bGetBoolParm("mmap_prj", &bFound, TRUE);
+	vGetPrjCacheParms(psLoad);
+	// entire set of projection data needed to reconstruct desired slices
+	psLoad->pfPixels = (float *) pvIrlMalloc(sizeof(float)*psParms->NumSlices*psParms->NumPixels*psParms->NumViews, "ReadPrjImage:PrjPixels");
+}
 
-	imgio_closeimage(pPrjImage);
-	return(pfPrjPixels);
+/**
+	 @brief Opens prj images and calls ReadPrjImages to get projection data
+	 and copy and scale it into the projection image.
+
+	 @return a pointer to the projection data.
+*/
+float *pfGetPrjImage(char *pchPrjImageName, IrlParms_t *psParms, PrjView_t *psViews)
+{
+	ImageLoad_t sLoad;
+
+	vPreparePrjImage(pchPrjImageName, psParms, psViews, &sLoad);
+	vLoadImages(&sLoad, 1, FALSE);
+	return(sLoad.pfPixels);
 }
 
 /**
@@ -177,142 +500,183 @@ float *pfGetPrjImage(char *pchPrjImageName, IrlParms_t *psParms, PrjView_t *psVi
 	 @param iNumSlices  number of slices in output image.
 	 @param iNumPixels  number of pixels (xdim and ydim) in input and 
 	                    output image.
-	 
-	 @return a pointer to these pixels.
+	 @param *pfPixels   gets these pixels.
+
+	 @return 0 on success, non-zero if the scratch slice can not be allocated.
 */
-static float *pfReadIrlImage(IMAGE *pImage, int iStartSlice, int iNumSlices, int iNumPixels)
+static int iReadIrlImage(IMAGE *pImage, int iStartSlice, int iNumSlices, int iNumPixels, float *pfPixels)
 {
-	int		iLen = iNumSlices*iNumPixels*iNumPixels;
-	float	*pfPixels;
-	pfPixels = (float *) pvIrlMalloc(sizeof(float)*iLen, "ReadIrlImage:Pixels");
-	
 #ifndef REORDER_PIXELS
+	vLockMutex(&sgImgioMutex);
 	imgio_readslices(pImage, iStartSlice, iStartSlice+iNumSlices-1, pfPixels);
+	vUnlockMutex(&sgImgioMutex);
 #else
 	float *pfReadSlice;
 	int iX, iY;
-	pfReadSlice = (float *) pvIrlMalloc(sizeof(float)*iNumPixels*iNumPixels,"ReadIrlImage:ReadSlice");
+	if ((pfReadSlice = (float *) malloc(sizeof(float)*iNumPixels*iNumPixels)) == NULL)
+		return 1;
 	for(iSlice=0; iSlice < iNumSlices; ++iSlice){
+		vLockMutex(&sgImgioMutex);
 		imgio_readslices(pImage, iStartSlice+iSlice, iStartSlice+iSlice, pfReadSlice);
+		vUnlockMutex(&sgImgioMutex);
 		for(iY=0; iY<iNumPixels; ++iY)
 			for(iX=0; iX<iNumPixels; ++iX)
 				//store pixels in reordered format
 				pfPixels[iX + iNumPixels*(iSlice + iY*iNumSlices)] = pfReadSlice[iX + iY*iNumPixels];
 	}
-	IrlFree(pfReadSlice);
+	free(pfReadSlice);
 #endif
-	return(pfPixels);
+	return 0;
 }
 
 /**
-	 @brief Reads the attenunation map.
+	 @brief Prepares the read of the attenunation map.
 
 	 @note The output image is NOT in "reordered" (y varying slowest) format
 	       unless REORDER_PIXELS is defined during compilation.
 
 	 @param *pchAtnMapName - Attenuation data file name.
 	 @param *psParms       - Parameters struct.
-
-	 @return ptr to attenuation map.
 */
-float *pfGetAtnMap(char *pchAtnMapName, IrlParms_t *psParms)
+void vPrepareAtnMap(char *pchAtnMapName, IrlParms_t *psParms, ImageLoad_t *psLoad)
 {
-	int iStartSlice, iXdim, iYdim, iZdim, bFound;
-	float *pfAtnPixels;
-	IMAGE *pAtnImage;
+	int bFound;
 
 	vPrintMsg(4,"\nGetAtnMap\n");
 	vPrintMsg(6,"  Atn Map=%s\n",pchAtnMapName);
-	iStartSlice=iGetIntParm("atn_slice_start",&bFound,0);
-	if (iStartSlice < 0)
-		vErrorHandler(ECLASS_FATAL, ETYPE_ILLEGAL_VALUE, "GetAtnMap", "Start Slice for Atn Map must be >= 0, not %d",iStartSlice);
-
-	pAtnImage=imgio_openimage(pchAtnMapName,'o',&iXdim,&iYdim,&iZdim);
-	if (iYdim != iXdim || iXdim != psParms->NumPixels)
+	memset(psLoad, 0, sizeof(ImageLoad_t));
+	psLoad->eKind = LOAD_SLICES;
+	psLoad->pchWhat = "attenuation map";
+	psLoad->pchName = pchAtnMapName;
+	psLoad->psParms = psParms;
+	psLoad->iStartSlice=iGetIntParm("atn_slice_start",&bFound,0);
+	if (psLoad->iStartSlice < 0)
+		vErrorHandler(ECLASS_FATAL, ETYPE_ILLEGAL_VALUE, "GetAtnMap", "Start Slice for Atn Map must be >= 0, not %d",psLoad->iStartSlice);
+
+	psLoad->pImage=imgio_openimage(pchAtnMapName,'o',&psLoad->iXdim,&psLoad->iYdim,&psLoad->iZdim);
+	if (psLoad->iYdim != psLoad->iXdim || psLoad->iXdim != psParms->NumPixels)
 		vErrorHandler(ECLASS_FATAL, ETYPE_ILLEGAL_VALUE, "GetAtnMap", "Atn Map must be same size as reconstructed/activity image");
 	
-	if (iStartSlice + psParms->NumSlices - 1 >= iZdim)
-		vErrorHandler(ECLASS_FATAL, ETYPE_ILLEGAL_VALUE, "GetAtnMap", "Not enough slices in atn map. First slice=%d, last slice needed: %d", iStartSlice, iStartSlice + psParms->NumSlices - 1);
-	
-	pfAtnPixels = pfReadIrlImage(pAtnImage,iStartSlice, psParms->NumSlices, psParms->NumPixels);
+	if (psLoad->iStartSlice + psParms->NumSlices - 1 >= psLoad->iZdim)
+		vErrorHandler(ECLASS_FATAL, ETYPE_ILLEGAL_VALUE, "GetAtnMap", "Not enough slices in atn map. First slice=%d, last slice needed: %d", psLoad->iStartSlice, psLoad->iStartSlice + psParms->NumSlices - 1);
+	psLoad->pfPixels = (float *) pvIrlMalloc(sizeof(float)*psParms->NumSlices*psParms->NumPixels*psParms->NumPixels, "ReadIrlImage:Pixels");
+}
 
-#ifdef DEBUG
-	writeimage("atnimage.im", psParms->NumPixels, psParms->NumSlices, psParms->NumPixels, pfAtnPixels);
-#endif
-	imgio_closeimage(pAtnImage);
-	return(pfAtnPixels);
+/**
+	 @brief Reads the attenunation map.
+
+	 @return ptr to attenuation map.
+*/
+float *pfGetAtnMap(char *pchAtnMapName, IrlParms_t *psParms)
+{
+	ImageLoad_t sLoad;
+
+	vPrepareAtnMap(pchAtnMapName, psParms, &sLoad);
+	vLoadImages(&sLoad, 1, FALSE);
+	return(sLoad.pfPixels);
 }
 
 /**
 	 @brief Determines whether there is an additive scatter estimate and if
-	 so, reads it in and scale it.
+	 so, prepares its read.
 	 
 	 @param *psParms
 	 @param *psViews
 
-	 @return ptr to scaled scatter estimate.
+	 @return TRUE if there is a scatter estimate to read.
 */
-float *pfGetScatterEstimate(IrlParms_t *psParms, PrjView_t *psViews)
+int iPrepareScatterEstimate(IrlParms_t *psParms, PrjView_t *psViews, ImageLoad_t *psLoad)
 {
-	int		iStartSlice, iXdim, iYdim, iZdim, bFound;
+	int		bFound;
 	char	*pchScatterEstimateFile;
-	float	*pfScatterEstimate=NULL;
-	IMAGE	*pScatImage;
 
 	vPrintMsg(4,"\nGetScatterEstimate\n");
 
+	memset(psLoad, 0, sizeof(ImageLoad_t));
 	pchScatterEstimateFile=pchGetStrParm("scat_est_file",&bFound, "");
 	if (!bFound){
 		vPrintMsg(6,"  No scatter estimate file will be used\n");
 		psParms->fScatEstFac = 1;	// Suppose no need, but just in case
-		return NULL;
+		return FALSE;
 	}
 	psParms->fScatEstFac = (float) dGetDblParm("scat_est_fac",&bFound,1.0);
-	iStartSlice=iGetIntParm("scat_startslice",&bFound, iGetIntParm("slice_start", &bFound, 0));
+	psLoad->eKind = LOAD_PRJ;
+	psLoad->pchWhat = "scatter estimate";
+	psLoad->pchName = pchScatterEstimateFile;
+	psLoad->psParms = psParms;
+	psLoad->psViews = psViews;
+	psLoad->iStartSlice=iGetIntParm("scat_startslice",&bFound, iGetIntParm("slice_start", &bFound, 0));
+	psLoad->bTryMap = bGetBoolParm("mmap_prj", &bFound, TRUE);
+	vGetPrjCacheParms(psLoad);
 	
-	pScatImage = imgio_openimage(pchScatterEstimateFile, 'o', &iXdim, &iYdim, &iZdim);
-	if (iXdim != psParms->NumPixels || iZdim != psParms->NumViews)
-		vErrorHandler(ECLASS_FATAL, ETYPE_ILLEGAL_VALUE, "GetScatterEstimate", "Number of bins (%i) or number of angles (%i) in scat est file not correct (%i/%i)\n     Scat est file: %s\n", iXdim, iZdim, psParms->NumPixels, psParms->NumViews, pchScatterEstimateFile);
-	if (iStartSlice < 0 || iStartSlice > iStartSlice + psParms->NumSlices - 1 || iStartSlice + psParms->NumSlices - 1 >= iYdim)
+	psLoad->pImage = pOpenPrjImage(pchScatterEstimateFile, &psLoad->iXdim, &psLoad->iYdim, &psLoad->iZdim, &psLoad->psPack);
+	// the scatter estimate has the bins of the projections
+	psLoad->fInBinWidth = fGetPrjBinWidth(psParms->BinWidth);
+	if (iRebinSize(psLoad->iXdim, psLoad->fInBinWidth, psParms->BinWidth) != psParms->NumPixels || psLoad->iZdim != psParms->NumViews)
+		vErrorHandler(ECLASS_FATAL, ETYPE_ILLEGAL_VALUE, "GetScatterEstimate", "Number of bins (%i) or number of angles (%i) in scat est file not correct (%i/%i)\n     Scat est file: %s\n", psLoad->iXdim, psLoad->iZdim, psParms->NumPixels, psParms->NumViews, pchScatterEstimateFile);
+	if (psLoad->iStartSlice < 0 || psLoad->iStartSlice > psLoad->iStartSlice + psParms->NumSlices - 1 || psLoad->iStartSlice + psParms->NumSlices - 1 >= psLoad->iYdim)
 		vErrorHandler(ECLASS_FATAL, ETYPE_ILLEGAL_VALUE, "GetScatterEstimate", "Start & end values for scatter slice are illegal or inconsistent\n");
-	
-	// get the projection pixels, treat them just as we do the projection data in terms of shifting, Scale them by psParms->NumViews (will scale by fScatEstFac in libirl)
-	pfScatterEstimate = pfReadPrjPix(pScatImage, psParms->NumPixels, psParms->NumPixels, iYdim, psParms->NumViews, iStartSlice, psParms->NumSlices, psParms->BinWidth, psParms->BinWidth, (float)psParms->NumViews, psViews);
-	imgio_closeimage(pScatImage);
-	return (pfScatterEstimate);
+	psLoad->pfPixels = (float *) pvIrlMalloc(sizeof(float)*psParms->NumSlices*psParms->NumPixels*psParms->NumViews, "ReadPrjImage:PrjPixels");
+	return TRUE;
 }
 
 /**
-	 @brief Reads the initial estimate.
+	 @brief Determines whether there is an additive scatter estimate and if
+	 so, reads it in and scale it.
+	 
+	 @return ptr to scaled scatter estimate.
+*/
+float *pfGetScatterEstimate(IrlParms_t *psParms, PrjView_t *psViews)
+{
+	ImageLoad_t sLoad;
+
+	if (!iPrepareScatterEstimate(psParms, psViews, &sLoad))
+		return NULL;
+	vLoadImages(&sLoad, 1, FALSE);
+	return (sLoad.pfPixels);
+}
+
+/**
+	 @brief Prepares the read of the initial estimate.
 	 
 	 @note The output image is NOT in "reordered" (y varying slowest) format
 	       unless REORDER_PIXELS is defined during compilation.
 
 	 @param *pchInitImageName
 	 @param *psParms
-
-	 @return ptr to initial estimate.
 */
-float *pfGetInitialEst(char *pchInitImageName, IrlParms_t *psParms)
+void vPrepareInitialEst(char *pchInitImageName, IrlParms_t *psParms, ImageLoad_t *psLoad)
 {
-	int		iStartSlice, iXdim, iYdim, iZdim, i, bFound;
-	float	*pfPixels, fAvg;
-	IMAGE	*pInitImage;
+	int		bFound;
 
 	vPrintMsg(4,"GetInitialEstimate\n");
-	iStartSlice=iGetIntParm("initest_slice_start",&bFound,0);
-	if (iStartSlice < 0)
-		vErrorHandler(ECLASS_FATAL, ETYPE_ILLEGAL_VALUE, "GetInitialEst", "Start Slice for Atn Map must be >= 0, not %d",iStartSlice);
-
-	pInitImage=imgio_openimage(pchInitImageName,'o',&iXdim,&iYdim,&iZdim);
-	if (iYdim != iXdim || iXdim != psParms->NumPixels)
+	memset(psLoad, 0, sizeof(ImageLoad_t));
+	psLoad->eKind = LOAD_SLICES;
+	psLoad->pchWhat = "initial estimate";
+	psLoad->pchName = pchInitImageName;
+	psLoad->psParms = psParms;
+	psLoad->bInitEst = TRUE;
+	psLoad->iStartSlice=iGetIntParm("initest_slice_start",&bFound,0);
+	if (psLoad->iStartSlice < 0)
+		vErrorHandler(ECLASS_FATAL, ETYPE_ILLEGAL_VALUE, "GetInitialEst", "Start Slice for Atn Map must be >= 0, not %d",psLoad->iStartSlice);
+
+	psLoad->pImage=imgio_openimage(pchInitImageName,'o',&psLoad->iXdim,&psLoad->iYdim,&psLoad->iZdim);
+	if (psLoad->iYdim != psLoad->iXdim || psLoad->iXdim != psParms->NumPixels)
 		vErrorHandler(ECLASS_FATAL, ETYPE_ILLEGAL_VALUE, "GetInitialEst", "Initial Estimate must be same size as reconstructed image");
 	
-	if (iStartSlice + psParms->NumSlices - 1 >= iZdim)
-		vErrorHandler(ECLASS_FATAL, ETYPE_ILLEGAL_VALUE, "GetInitialEst", "Not enough slices in initial est. First slice=%d, last slice needed: %d", iStartSlice, iStartSlice + psParms->NumSlices - 1);
-	pfPixels = pfReadIrlImage(pInitImage,iStartSlice, psParms->NumSlices, psParms->NumPixels);
-	imgio_closeimage(pInitImage);
-	
+	if (psLoad->iStartSlice + psParms->NumSlices - 1 >= psLoad->iZdim)
+		vErrorHandler(ECLASS_FATAL, ETYPE_ILLEGAL_VALUE, "GetInitialEst", "Not enough slices in initial est. First slice=%d, last slice needed: %d", psLoad->iStartSlice, psLoad->iStartSlice + psParms->NumSlices - 1);
+	psLoad->bSaveInitEst = bGetBoolParm("save_initial_estimate", &bFound, FALSE);
+	psLoad->pfPixels = (float *) pvIrlMalloc(sizeof(float)*psParms->NumSlices*psParms->NumPixels*psParms->NumPixels, "ReadIrlImage:Pixels");
+}
+
+// replaces negative pixels of the initial estimate by its mean and saves it if asked to; returns 0 on success
+static int iFixInitialEst(ImageLoad_t *psLoad)
+{
+	IrlParms_t *psParms = psLoad->psParms;
+	float *pfPixels = psLoad->pfPixels, fAvg;
+	int i, iXdim = psLoad->iXdim;
+
 	// compute mean in initial estimate
 	fAvg = sum_float(pfPixels, psParms->NumSlices*psParms->NumPixels*psParms->NumPixels);
 	fAvg /= (float)psParms->NumSlices*psParms->NumPixels*psParms->NumPixels;
@@ -322,20 +686,141 @@ float *pfGetInitialEst(char *pchInitImageName, IrlParms_t *psParms)
 	for (i=0;i<psParms->NumSlices * iXdim * iXdim; ++i)
 		if (pfPixels[i] < 0.0) pfPixels[i] = fAvg;
 	
-	if (bGetBoolParm("save_initial_estimate", &bFound, FALSE)){
+	if (psLoad->bSaveInitEst){
 		float *pfWriteImage;
-		pfWriteImage = (float *) pvIrlMalloc(sizeof(float)*psParms->NumSlices*iXdim*iXdim, "GetInitialEstimate:WriteImage");
+		if ((pfWriteImage = (float *) malloc(sizeof(float)*psParms->NumSlices*iXdim*iXdim)) == NULL)
+			return 1;
 #ifdef REORDER_PIXELS
 		reorder(iXdim, psParms->NumSlices, iXdim, pfPixels, pfWriteImage);	
 #endif
+		vLockMutex(&sgImgioMutex);
 #ifdef IMGIO_NOIM
 		writeimage("initest.img",iXdim, iXdim, psParms->NumSlices,pfWriteImage);
 #else
 		writeimage("initest.im",iXdim, iXdim, psParms->NumSlices,pfWriteImage);
 #endif
-		IrlFree(pfWriteImage);
+		vUnlockMutex(&sgImgioMutex);
+		free(pfWriteImage);
 	}
-	return(pfPixels);
+	return 0;
+}
+
+/**
+	 @brief Reads the initial estimate.
+	 
+	 @return ptr to initial estimate.
+*/
+float *pfGetInitialEst(char *pchInitImageName, IrlParms_t *psParms)
+{
+	ImageLoad_t sLoad;
+
+	vPrepareInitialEst(pchInitImageName, psParms, &sLoad);
+	vLoadImages(&sLoad, 1, FALSE);
+	return(sLoad.pfPixels);
+}
+
+/* Reads one prepared image; runs on one of the vLoadImages threads, so
+	it reports nothing and returns 0 on success or non-zero with the
+	reason in psLoad->achError. */
+static int iReadImageLoad(ImageLoad_t *psLoad)
+{
+	IrlParms_t *psParms = psLoad->psParms;
+	double dStart = dGetWallTime();
+	char achCacheEntry[PRJCACHE_MAX_NAME];
+	int iErr = 0;
+
+	if (psLoad->eKind == LOAD_PRJ && psLoad->pchCacheDir != NULL && iGetCachedPrj(psLoad, achCacheEntry) == 0)
+		psLoad->bCached = TRUE;
+	else if (psLoad->eKind == LOAD_PRJ){
+		// scale by number of angles so reconstructed image is in units of total acquisition time, not time per view
+		iErr = iReadPrjPix(psLoad->pImage, psLoad->psPack, psLoad->pchName, psLoad->bTryMap, psLoad->iXdim, psParms->NumPixels, psLoad->iYdim, psParms->NumViews, psLoad->iStartSlice, psParms->NumSlices, psLoad->fInBinWidth, psParms->BinWidth, (float)psParms->NumViews, psLoad->psViews, psLoad->ppsPlans, psLoad->pfPixels, &psLoad->dBytes, psLoad->achError);
+		if (iErr == 0 && psLoad->pchCacheDir != NULL)
+			vPutCachedPrj(psLoad, achCacheEntry);
+	}else{
+		if ((iErr = iReadIrlImage(psLoad->pImage, psLoad->iStartSlice, psParms->NumSlices, psParms->NumPixels, psLoad->pfPixels)) != 0)
+			snprintf(psLoad->achError, LOAD_MAX_ERROR, "unable to allocate the slice buffer");
+		psLoad->dBytes = (double)sizeof(float)*psParms->NumSlices*psParms->NumPixels*psParms->NumPixels;
+		if (iErr == 0 && psLoad->bInitEst && (iErr = iFixInitialEst(psLoad)) != 0)
+			snprintf(psLoad->achError, LOAD_MAX_ERROR, "unable to allocate the image saved as the initial estimate");
+#ifdef DEBUG
+		else if (!psLoad->bInitEst){
+			vLockMutex(&sgImgioMutex);
+			writeimage("atnimage.im", psParms->NumPixels, psParms->NumSlices, psParms->NumPixels, psLoad->pfPixels);
+			vUnlockMutex(&sgImgioMutex);
+		}
+#endif
+	}
+	psLoad->dTime = dGetWallTime() - dStart;
+	return iErr;
+}
+
+static void vReadImageLoad(void *pvArg, int iLoad)
+{
+	ImageLoad_t *psLoad = (ImageLoad_t *)pvArg + iLoad;
+
+	psLoad->iStatus = iReadImageLoad(psLoad);
+}
+
+/**
+	 @brief Reads prepared images and reports the time and bytes each took.
+
+	 Errors in the reads are reported here, on the calling thread, once
+	 all reads are done.
+
+	 @param bConcurrent - read the images at the same time, each on its
+	        own thread. The reads use no parameters, so this is safe once
+	        they are prepared.
+*/
+void vLoadImages(ImageLoad_t *psLoads, int iNumLoads, int bConcurrent)
+{
+	double dStart, dBytes = 0.0, dSerial = 0.0, dWall;
+	ImageLoad_t *psLoad;
+	int i;
+
+	vInitImgioMutex();
+	// the rebin plans are made here, where running out of memory may be fatal
+	for (i = 0; i < iNumLoads; i++)
+		if (psLoads[i].eKind == LOAD_PRJ)
+			psLoads[i].ppsPlans = ppsMakeViewRebinPlans(psLoads[i].iXdim, psLoads[i].psParms->NumPixels, psLoads[i].psParms->NumViews,
+				psLoads[i].psViews, psLoads[i].fInBinWidth, psLoads[i].psParms->BinWidth);
+	dStart = dGetWallTime();
+	if (bConcurrent && iNumLoads > 1)
+		vParallelForN(iNumLoads, iNumLoads, vReadImageLoad, psLoads);
+	else
+		for (i = 0; i < iNumLoads; i++)
+			vReadImageLoad(psLoads, i);
+	dWall = dGetWallTime() - dStart;
+
+	for (i = 0; i < iNumLoads; i++){
+		psLoad = &psLoads[i];
+		if (psLoad->psPack != NULL)
+			vClosePackedPrj(psLoad->psPack);
+		else
+			imgio_closeimage(psLoad->pImage);
+		psLoad->pImage = NULL;
+		psLoad->psPack = NULL;
+		if (psLoad->ppsPlans != NULL){
+			vFreeViewRebinPlans(psLoad->ppsPlans);
+			psLoad->ppsPlans = NULL;
+		}
+		if (psLoad->pchCacheDir != NULL){
+			IrlFree(psLoad->pchCacheDir);
+			psLoad->pchCacheDir = NULL;
+		}
+	}
+	for (i = 0; i < iNumLoads; i++)
+		if (psLoads[i].iStatus)
+			vErrorHandler(ECLASS_FATAL, ETYPE_IO, "LoadImages", "unable to read the %s from %s: %s", psLoads[i].pchWhat, psLoads[i].pchName, psLoads[i].achError);
+
+	for (i = 0; i < iNumLoads; i++){
+		vPrintMsg(iNumLoads > 1 ? 4 : 6, "  %-17s %s: %.1f MB in %.3f s (%.1f MB/s)%s\n", psLoads[i].pchWhat, psLoads[i].pchName,
+			psLoads[i].dBytes/1048576.0, psLoads[i].dTime, psLoads[i].dTime > 0.0 ? psLoads[i].dBytes/1048576.0/psLoads[i].dTime : 0.0,
+			psLoads[i].bCached ? " from the cache" : "");
+		dBytes += psLoads[i].dBytes;
+		dSerial += psLoads[i].dTime;
+	}
+	if (iNumLoads > 1)
+		vPrintMsg(4, "  loaded %d images, %.1f MB in %.3f s (%.3f s one after another)\n", iNumLoads, dBytes/1048576.0, dWall, dSerial);
 }
 
 /**
@@ -367,7 +852,10 @@ float *pfGetActImage(char *pchActImageName, IrlParms_t *psParms)
 	
 	if (iStartSlice + psParms->NumSlices - 1 >= iZdim)
 		vErrorHandler(ECLASS_FATAL, ETYPE_ILLEGAL_VALUE, "GetActImage", "Not enough slices in activity image. First slice=%d, last slice needed: %d", iStartSlice, iStartSlice + psParms->NumSlices - 1);
-	pfPixels = pfReadIrlImage(pActImage,iStartSlice, psParms->NumSlices, psParms->NumPixels);
+	pfPixels = (float *) pvIrlMalloc(sizeof(float)*psParms->NumSlices*psParms->NumPixels*psParms->NumPixels, "ReadIrlImage:Pixels");
+	vInitImgioMutex();
+	if (iReadIrlImage(pActImage,iStartSlice, psParms->NumSlices, psParms->NumPixels, pfPixels))
+		vErrorHandler(ECLASS_FATAL, ETYPE_MALLOC, "GetActImage", "unable to allocate the slice buffer");
 	imgio_closeimage(pActImage);
 	return(pfPixels);
 }
@@ -3,14 +3,292 @@
 
 	@code $Id: MeasToModPrj.c 53 2010-02-12 20:24:32Z mjs $ @endcode
 
+	Compile with -DSTANDALONE (and osemthreads.c) to get a benchmark that
+	compares the plan based rebinning with the loop it replaced.
 */
 
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <math.h>
 #include <mip/irl.h>
 #include <mip/miputil.h>
+#include <mip/errdefs.h>
 #include <mip/printmsg.h>
 
 #include "protos.h"
+#include "rebinplan.h"
+#include "osemthreads.h"
+
+#if defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+#include <xmmintrin.h>
+#define REBIN_SSE
+#endif
+
+/* the overlap of each pixel with the bins, in the order the bins are
+	summed; the entries are only counted if piBin is NULL */
+static int iRebinEntries(int nBins, int nRotPixs, float Left, float PWid, int *piFirst, int *piBin, float *pfWeight)
+{
+	float PixelLeft, PixelRight, Weight;
+	int BinLeft, BinRight;
+	int iPixel, iBin, iEntry = 0;
+
+	PixelLeft = Left;
+	for (iPixel=0; iPixel<nRotPixs; iPixel++) {
+		PixelRight = PixelLeft + PWid;
+		BinLeft = (int) floor((double)PixelLeft);
+		BinRight = (int) floor((double)PixelRight);
+		if (piFirst != NULL)
+			piFirst[iPixel] = iEntry;
+		for (iBin=BinLeft; iBin<=BinRight; iBin++) {
+			/* bins outside the view add nothing */
+			if (iBin<0 || iBin>=nBins)
+				continue;
+			if (BinLeft == BinRight) /* the pixel is within the bin */
+				Weight = PixelRight-PixelLeft;
+			else if (iBin < PixelLeft)
+				Weight = iBin+1-PixelLeft;
+			else if (iBin+1 > PixelRight)
+				Weight = PixelRight-iBin;
+			else
+				Weight = 1.0f;
+			if (piBin != NULL) {
+				piBin[iEntry] = iBin;
+				pfWeight[iEntry] = Weight;
+			}
+			iEntry++;
+		}
+		PixelLeft = PixelRight;
+	}
+	if (piFirst != NULL)
+		piFirst[nRotPixs] = iEntry;
+	return iEntry;
+}
+
+/* The pixels of the dense run of a plan take iTaps bins each, enough
+	for 7 in 8 pixels, and pixel i starts at bin piDenseStart[i].
+	Pixels that take fewer bins get taps with zero weight after their
+	own, which leaves their sums unchanged. The run is the longest one in
+	which no pixel takes more bins and the taps stay inside the view. */
+static void vFindDenseRun(RebinPlan_t *psPlan)
+{
+	int i, t, iStart, iTaps, iCount, iMaxCount = 0, iBestLen = 0, iCovered, *piNumPixels;
+	int nRotPixs = psPlan->nRotPixs;
+	const int *piFirst = psPlan->piFirst;
+
+	for (i = 0; i < nRotPixs; i++)
+		if (piFirst[i+1] - piFirst[i] > iMaxCount)
+			iMaxCount = piFirst[i+1] - piFirst[i];
+	if (iMaxCount == 0)
+		return;
+	piNumPixels = (int *)calloc(iMaxCount + 1, sizeof(int));
+	if (piNumPixels == NULL)
+		vErrorHandler(ECLASS_FATAL, ETYPE_MALLOC, "MakeRebinPlan", "unable to allocate the plan");
+	for (i = 0; i < nRotPixs; i++)
+		piNumPixels[piFirst[i+1] - piFirst[i]]++;
+	for (iTaps = 1, iCovered = piNumPixels[0] + piNumPixels[1]; iTaps < iMaxCount && 8*iCovered < 7*nRotPixs; )
+		iCovered += piNumPixels[++iTaps];
+	free(piNumPixels);
+
+	for (iStart = 0; iStart < nRotPixs; iStart = i + 1) {
+		for (i = iStart; i < nRotPixs; i++) {
+			iCount = piFirst[i+1] - piFirst[i];
+			if (iCount == 0 || iCount > iTaps || psPlan->piBin[piFirst[i]] + iTaps > psPlan->nBins)
+				break;
+		}
+		if (i - iStart > iBestLen) {
+			iBestLen = i - iStart;
+			psPlan->iDenseFirst = iStart;
+			psPlan->iDenseEnd = i;
+		}
+	}
+	if (iBestLen < REBIN_MIN_DENSE) {
+		psPlan->iDenseFirst = psPlan->iDenseEnd = 0;
+		return;
+	}
+	psPlan->iTaps = iTaps;
+	psPlan->pfDense = (float *)calloc((size_t)iTaps*nRotPixs, sizeof(float));
+	psPlan->piDenseStart = (int *)malloc(sizeof(int)*nRotPixs);
+	if (psPlan->pfDense == NULL || psPlan->piDenseStart == NULL)
+		vErrorHandler(ECLASS_FATAL, ETYPE_MALLOC, "MakeRebinPlan", "unable to allocate the plan");
+	psPlan->bUnitStride = TRUE;
+	for (i = psPlan->iDenseFirst; i < psPlan->iDenseEnd; i++) {
+		psPlan->piDenseStart[i] = psPlan->piBin[piFirst[i]];
+		if (psPlan->piDenseStart[i] != psPlan->piDenseStart[psPlan->iDenseFirst] + i - psPlan->iDenseFirst)
+			psPlan->bUnitStride = FALSE;
+		for (t = 0; t < piFirst[i+1] - piFirst[i]; t++)
+			psPlan->pfDense[t*nRotPixs + i] = psPlan->pfWeight[piFirst[i] + t];
+	}
+}
+
+/**
+	@brief The number of elements of width fToWidth that cover iNum
+	elements of width fFromWidth, the size a view keeps its field of view
+	with when it is resampled.
+*/
+int iRebinSize(int iNum, float fFromWidth, float fToWidth)
+{
+	if (fFromWidth == fToWidth)
+		return iNum;
+	return (int)floor(iNum*(double)fFromWidth/fToWidth + 0.5);
+}
+
+/* where nOut elements PWid wide start so that they are centred on nIn
+	elements, in units of the input elements; 0 when both are the same */
+static float fCentredStart(int nIn, int nOut, float PWid)
+{
+	return (float)(0.5*(nIn - nOut*(double)PWid));
+}
+
+/**
+	@brief Works out which bins each modified projection pixel of a view
+	overlaps and with what weight, as vMeasToModPrj does.
+
+	@return the plan, to be freed with vFreeRebinPlan.
+*/
+RebinPlan_t *psMakeRebinPlan(int nBins, int nRotPixs, float Left, float BinWidth, float PixelWidth)
+{
+	/* pixel width in units of bin width */
+	float PWid = PixelWidth / BinWidth;
+	RebinPlan_t *psPlan;
+	int iNumEntries;
+
+	psPlan = (RebinPlan_t *)calloc(1, sizeof(RebinPlan_t));
+	if (psPlan == NULL)
+		vErrorHandler(ECLASS_FATAL, ETYPE_MALLOC, "MakeRebinPlan", "unable to allocate the plan");
+	psPlan->nBins = nBins;
+	psPlan->nRotPixs = nRotPixs;
+	psPlan->Left = Left;
+	psPlan->BinWidth = BinWidth;
+	psPlan->PixelWidth = PixelWidth;
+	psPlan->Scale = 1.0f;
+
+	iNumEntries = iRebinEntries(nBins, nRotPixs, Left, PWid, NULL, NULL, NULL);
+	psPlan->piFirst = (int *)malloc(sizeof(int)*(nRotPixs + 1));
+	psPlan->piBin = (int *)malloc(sizeof(int)*(iNumEntries + 1));
+	psPlan->pfWeight = (float *)malloc(sizeof(float)*(iNumEntries + 1));
+	if (psPlan->piFirst == NULL || psPlan->piBin == NULL || psPlan->pfWeight == NULL)
+		vErrorHandler(ECLASS_FATAL, ETYPE_MALLOC, "MakeRebinPlan", "unable to allocate the plan");
+	iRebinEntries(nBins, nRotPixs, Left, PWid, psPlan->piFirst, psPlan->piBin, psPlan->pfWeight);
+	vFindDenseRun(psPlan);
+	return psPlan;
+}
+
+void vFreeRebinPlan(RebinPlan_t *psPlan)
+{
+	free(psPlan->piFirst);
+	free(psPlan->piBin);
+	free(psPlan->pfWeight);
+	free(psPlan->pfDense);
+	free(psPlan->piDenseStart);
+	free(psPlan);
+}
+
+/**
+	@brief Makes the rebin plans for a set of views, one for each distinct
+	Left.
+
+	The nRotPixs pixels are centred on the nBins bins, shifted by the Left
+	of each view, so bins and pixels of different widths and numbers line
+	up as they do when both are the same.
+
+	@return the plan of each view, to be freed with vFreeViewRebinPlans.
+*/
+RebinPlan_t **ppsMakeViewRebinPlans(int nBins, int nRotPixs, int nViews, const PrjView_t *psViews, float BinWidth, float PixelWidth)
+{
+	RebinPlan_t **ppsPlans, *psPlan, *psLast = NULL;
+	float Left, Centre = fCentredStart(nBins, nRotPixs, PixelWidth / BinWidth);
+	int iView;
+
+	ppsPlans = (RebinPlan_t **)malloc(sizeof(RebinPlan_t *)*(nViews > 0 ? nViews : 1));
+	if (ppsPlans == NULL)
+		vErrorHandler(ECLASS_FATAL, ETYPE_MALLOC, "MakeViewRebinPlans", "unable to allocate the plans");
+	ppsPlans[0] = NULL;
+	for (iView = 0; iView < nViews; iView++) {
+		Left = psViews[iView].Left + Centre;
+		for (psPlan = ppsPlans[0]; psPlan != NULL && psPlan->Left != Left; psPlan = psPlan->psNext)
+			;
+		if (psPlan == NULL) {
+			psPlan = psMakeRebinPlan(nBins, nRotPixs, Left, BinWidth, PixelWidth);
+			if (psLast != NULL)
+				psLast->psNext = psPlan;
+			psLast = psPlan;
+		}
+		ppsPlans[iView] = psPlan;
+	}
+	return ppsPlans;
+}
+
+void vFreeViewRebinPlans(RebinPlan_t **ppsPlans)
+{
+	RebinPlan_t *psPlan, *psNext;
+
+	for (psPlan = ppsPlans[0]; psPlan != NULL; psPlan = psNext) {
+		psNext = psPlan->psNext;
+		vFreeRebinPlan(psPlan);
+	}
+	free(ppsPlans);
+}
+
+/* the pixels of the dense run of one slice, a few at a time; the sums
+	are formed in the same order as for the other pixels */
+static void vApplyDenseRun(const RebinPlan_t *psPlan, const float *pfRaw, float *pfMod)
+{
+	const float *pfDense = psPlan->pfDense;
+	const int *piStart = psPlan->piDenseStart;
+	int nRotPixs = psPlan->nRotPixs;
+	int i = psPlan->iDenseFirst, t;
+	float Sum;
+#ifdef REBIN_SSE
+	__m128 vSum, vRaw;
+
+	for (; i + 4 <= psPlan->iDenseEnd; i += 4) {
+		vSum = _mm_setzero_ps();
+		for (t = 0; t < psPlan->iTaps; t++) {
+			// with PixelWidth = BinWidth the four pixels take neighbouring bins
+			if (psPlan->bUnitStride)
+				vRaw = _mm_loadu_ps(pfRaw + piStart[i] + t);
+			else
+				vRaw = _mm_setr_ps(pfRaw[piStart[i] + t], pfRaw[piStart[i+1] + t], pfRaw[piStart[i+2] + t], pfRaw[piStart[i+3] + t]);
+			vSum = _mm_add_ps(vSum, _mm_mul_ps(_mm_loadu_ps(pfDense + t*nRotPixs + i), vRaw));
+		}
+		_mm_storeu_ps(pfMod + i, vSum);
+	}
+#endif
+	for (; i < psPlan->iDenseEnd; i++) {
+		Sum = 0.0f;
+		for (t = 0; t < psPlan->iTaps; t++)
+			Sum += pfDense[t*nRotPixs + i] * pfRaw[piStart[i] + t];
+		pfMod[i] = Sum;
+	}
+}
+
+/**
+	@brief Rebins nSlices slices of a view with a plan made by
+	psMakeRebinPlan; every pixel of ModPrjData is set.
+*/
+void vApplyRebinPlan(const RebinPlan_t *psPlan, int nSlices, const float *RawPrjData, float *ModPrjData)
+{
+	int iSlice, iPixel, iEntry;
+	const float *pfRaw;
+	float *pfMod, Sum;
+
+	for (iSlice=0; iSlice<nSlices; iSlice++) {
+		pfRaw = RawPrjData + (long)iSlice*psPlan->nBins;
+		pfMod = ModPrjData + (long)iSlice*psPlan->nRotPixs;
+		for (iPixel=0; iPixel<psPlan->nRotPixs; iPixel++) {
+			if (iPixel == psPlan->iDenseFirst && psPlan->iTaps) {
+				vApplyDenseRun(psPlan, pfRaw, pfMod);
+				iPixel = psPlan->iDenseEnd - 1;
+				continue;
+			}
+			Sum = 0.0f;
+			for (iEntry = psPlan->piFirst[iPixel]; iEntry < psPlan->piFirst[iPixel+1]; iEntry++)
+				Sum += psPlan->pfWeight[iEntry] * pfRaw[psPlan->piBin[iEntry]];
+			pfMod[iPixel] = Sum;
+		}
+	}
+}
 
 void vMeasToModPrj(
 			 int nBins,
@@ -23,15 +301,7 @@ void vMeasToModPrj(
 		    float *ModPrjData
 		    )
 {
-#define raw_ptr(iSlice, iBin) ((iSlice)*nBins+(iBin))
-#define mod_ptr(iSlice, iBin) ((iSlice)*nRotPixs+(iBin))
-  
-  /* pixel width in units of bin width */ 
-	float PWid = PixelWidth / BinWidth;
-	float PixelLeft, PixelRight;
-	int	BinLeft,   BinRight;
-	float BinValue;
-	int iSlice, iPixel, iBin;
+	RebinPlan_t *psPlan;
 	
   /********************************************************************** 
     
@@ -72,60 +342,82 @@ void vMeasToModPrj(
     ( Rotated Image Grid )
     
     **********************************************************************/
-  
-	set_float(ModPrjData, nSlices*nRotPixs, 0.0);
-	
-	PixelLeft = Left;
+
 	vPrintMsg(8,"MeasToModPrj\n");
 	vPrintMsg(9,"  left=%.2f, nrotpix=%d, nbins=%d, nslices=%d\n",
 		Left, nRotPixs, nBins, nSlices);
-	
-	for (iPixel=0; iPixel<nRotPixs; iPixel++) {
-		PixelRight = PixelLeft + PWid;
-		BinLeft = (int) floor((double)PixelLeft);
-		BinRight = (int) floor((double)PixelRight);
-		
-		for (iSlice=0; iSlice<nSlices; iSlice++) {
-			if ((BinLeft<0 && BinRight<0) || (BinLeft>=nBins && BinRight>=nBins))
-				continue;
-			if (BinLeft == BinRight) /* the pixel is within the bin */
-				ModPrjData[mod_ptr(iSlice,iPixel)]+=((PixelRight-PixelLeft) * 
-							 RawPrjData[raw_ptr(iSlice, BinLeft)]);
-			else /* the pixel covers more than one bin */
-				for (iBin=BinLeft; iBin<=BinRight; iBin++) {
-					if (iBin<0 || iBin>=nBins)
-						BinValue = 0.0;
-					else
-						BinValue = RawPrjData[raw_ptr(iSlice, iBin)];
-					
-					if (iBin < PixelLeft)
-						ModPrjData[mod_ptr(iSlice, iPixel)] += ((iBin+1-PixelLeft) * 
-											BinValue);
-					else if (iBin+1 > PixelRight)
-						ModPrjData[mod_ptr(iSlice, iPixel)] += ((PixelRight-iBin) * 
-											BinValue);
-					else
-						ModPrjData[mod_ptr(iSlice, iPixel)] +=	BinValue;
-				}
-		}
-		PixelLeft = PixelRight;
-	}
+
+	psPlan = psMakeRebinPlan(nBins, nRotPixs, Left, BinWidth, PixelWidth);
+	vApplyRebinPlan(psPlan, nSlices, RawPrjData, ModPrjData);
+	vFreeRebinPlan(psPlan);
 }
-	
-#undef raw_ptr
-#undef mod_ptr
 
 
 
+/* the plans of Interp_bck, newest first */
+#define INTERP_MAX_PLANS 1024
+static RebinPlan_t *pssgInterpPlans = NULL;
+static int isgNumInterpPlans = 0;
+
+/* the plan that resamples nRotPixs pixels of a view into nBins bins: the
+	rebinning of vMeasToModPrj with the pixels as input and with the
+	weights multiplied by Fac */
+static RebinPlan_t *psGetInterpPlan(int nRotPixs, int nBins, float Left, float PixelWidth, float BinWidth, float Fac)
+{
+	/* bin width in units of pixel width */
+	float BWid = BinWidth / PixelWidth;
+	float BinLeft = -Left*BWid + fCentredStart(nRotPixs, nBins, BWid);
+	RebinPlan_t *psPlan;
+	int i;
+
+	for (psPlan = pssgInterpPlans; psPlan != NULL; psPlan = psPlan->psNext)
+		if (psPlan->nBins == nRotPixs && psPlan->nRotPixs == nBins && psPlan->Left == BinLeft &&
+			psPlan->BinWidth == PixelWidth && psPlan->PixelWidth == BinWidth && psPlan->Scale == Fac)
+			return psPlan;
+	psPlan = psMakeRebinPlan(nRotPixs, nBins, BinLeft, PixelWidth, BinWidth);
+	psPlan->Scale = Fac;
+	for (i = 0; i < psPlan->piFirst[nBins]; i++)
+		psPlan->pfWeight[i] *= Fac;
+	if (psPlan->pfDense != NULL)
+		for (i = 0; i < psPlan->iTaps*nBins; i++)
+			psPlan->pfDense[i] *= Fac;
+	psPlan->psNext = pssgInterpPlans;
+	pssgInterpPlans = psPlan;
+	isgNumInterpPlans++;
+	return psPlan;
+}
+
+/**
+	@brief Frees the plans Interp_bck keeps between calls.
+*/
+void vFreeInterpPlans(void)
+{
+	RebinPlan_t *psPlan, *psNext;
+
+	for (psPlan = pssgInterpPlans; psPlan != NULL; psPlan = psNext) {
+		psNext = psPlan->psNext;
+		vFreeRebinPlan(psPlan);
+	}
+	pssgInterpPlans = NULL;
+	isgNumInterpPlans = 0;
+}
 
 /*
 	Interp_bck 10 2005-05-27 modified duyong$
 	
    To interpolate output of irlGenprj with pixel size equals pixelwidth 
    to user specified binwidth.
-   Process only one view.
-   Since currently only support BinWidth=PixelWidth, what this function does
-   is only to normalize the projections with 1/NumViews
+   Process only one view. There is no batched form for the views of a
+   subset: no program in this tree calls Interp_bck, so one would have
+   no caller.
+   The output has NumPixels bins of psParm->BinWidth, as it always had;
+   vInterpBckBinned takes the number and width of the bins.
+   The bins are centred on the pixels and cover the same field of view
+   when iRebinSize gives their number. The weights are fractions of a
+   pixel, so the counts are kept and the projections are only normalized
+   with 1/NumViews, which is folded into the weights.
+   The plans are kept between calls (see vFreeInterpPlans); this is not
+   thread safe.
 
 */
 
@@ -137,25 +429,6 @@ void Interp_bck(
 						float *Sum
                )
 {
-#define usr_ptr(iSlice, iBin) ((iSlice)*nBins + (iBin))
-#define gen_ptr(iSlice, iBin) ((iSlice)*nRotPixs + (iBin))
-
-	/* bin width in units of pixel width */ 
-   /* float BWid = psParm->BinWidth / psParm->PixelWidth; 
-      require Binwidth = PixelWidth */
-   float BWid = 1.0;
-
-	float BinLeft, BinRight;
-	int	PixelLeft, PixelRight;
-	float PixelValue;
-	int	i, iSlice, iBin, iPixel;
-	int 	nAngs = psParm->NumViews;
-	int 	nRotPixs = psParm->NumPixels;
-	int 	nBins = psParm->NumPixels;
-	int 	nSlices = psParm->NumSlices;
-   float	Fac = BWid/nAngs;  /* or 1/(PWid*nAngs) */
-
-
 /********************************************************************** 
 
 							  ( Usr Data:UsrPrjData )
@@ -196,55 +469,210 @@ void Interp_bck(
 
 **********************************************************************/
 
-	set_float(OutPrjData, nSlices*nBins, 0.0);
+	vInterpBckBinned(InPrjData, OutPrjData, psParm, psView, psParm->NumPixels, psParm->BinWidth, Sum);
+}
 
-	(*Sum) = 0.0;
+/**
+	@brief Interp_bck into nBins bins of BinWidth, such as those genprjs
+	gets from vGetPrjBinning.
+*/
+void vInterpBckBinned(float *InPrjData, float *OutPrjData, IrlParms_t *psParm, PrjView_t psView, int nBins, float BinWidth, float *Sum)
+{
+	RebinPlan_t *psPlan;
+	double dSum = 0.0;
+	int i;
 
-	BinLeft = -psView.Left*BWid;
+	if (isgNumInterpPlans >= INTERP_MAX_PLANS)
+		vFreeInterpPlans();
+	psPlan = psGetInterpPlan(psParm->NumPixels, nBins, psView.Left, psParm->BinWidth, BinWidth, 1.0f/psParm->NumViews);
+	vApplyRebinPlan(psPlan, psParm->NumSlices, InPrjData, OutPrjData);
+	for (i = 0; i < nBins*psParm->NumSlices; i++)
+		dSum += OutPrjData[i];
+	*Sum = (float)dSum;
+}
 
-	for (iBin=0; iBin<nBins; iBin++) {
-		BinRight = BinLeft + BWid;
-		PixelLeft  = (int) floor((double)BinLeft);
-		PixelRight = (int) floor((double)BinRight);
+#ifdef STANDALONE
 
-		for (iSlice=0; iSlice<nSlices; iSlice++) {
-			if ((PixelLeft<0 && PixelRight<0) || 
-				(PixelLeft>=nRotPixs && PixelRight>=nRotPixs)) {
-				continue;
+typedef struct {
+	float *pfInPrj, *pfOutPrj;
+	int nRotPixs, nBins, nSlices;
+	RebinPlan_t **ppsPlans;
+	double *pdSums;
+} InterpViews_t;
+
+// one view of the rebinning of the loader; its sum is a partial sum of the thread that runs it
+static void vInterpView(void *pvArg, int iView)
+{
+	InterpViews_t *psViews = (InterpViews_t *)pvArg;
+	float *pfOut = psViews->pfOutPrj + (long)iView*psViews->nBins*psViews->nSlices;
+	double dSum = 0.0;
+	int i;
+
+	vApplyRebinPlan(psViews->ppsPlans[iView], psViews->nSlices, psViews->pfInPrj + (long)iView*psViews->nRotPixs*psViews->nSlices, pfOut);
+	for (i = 0; i < psViews->nBins*psViews->nSlices; i++)
+		dSum += pfOut[i];
+	psViews->pdSums[iView] = dSum;
+}
 
-			} else if (PixelLeft == PixelRight){ /* the bin is within the pixel */
-				OutPrjData[usr_ptr(iSlice, iBin)] += ((BinRight-BinLeft) * 
-													InPrjData[gen_ptr(iSlice, PixelLeft)]);
 
-			} else { /* the bin covers more than one pixel */
-				for (iPixel=PixelLeft; iPixel<=PixelRight; iPixel++) {
-					if (iPixel<0 || iPixel>=nRotPixs)
-						PixelValue = 0.0;
+/* the loop previously used in vMeasToModPrj */
+static void vLegacyMeasToModPrj(int nBins, int nRotPixs, int nSlices, float Left, float BinWidth, float PixelWidth, float *RawPrjData, float *ModPrjData)
+{
+	float PWid = PixelWidth / BinWidth;
+	float PixelLeft, PixelRight;
+	int	BinLeft,   BinRight;
+	float BinValue;
+	int iSlice, iPixel, iBin;
+
+	memset(ModPrjData, 0, sizeof(float)*nSlices*nRotPixs);
+	PixelLeft = Left;
+	for (iPixel=0; iPixel<nRotPixs; iPixel++) {
+		PixelRight = PixelLeft + PWid;
+		BinLeft = (int) floor((double)PixelLeft);
+		BinRight = (int) floor((double)PixelRight);
+		for (iSlice=0; iSlice<nSlices; iSlice++) {
+			if ((BinLeft<0 && BinRight<0) || (BinLeft>=nBins && BinRight>=nBins))
+				continue;
+			if (BinLeft == BinRight)
+				ModPrjData[iSlice*nRotPixs+iPixel] += (PixelRight-PixelLeft)*RawPrjData[iSlice*nBins+BinLeft];
+			else
+				for (iBin=BinLeft; iBin<=BinRight; iBin++) {
+					if (iBin<0 || iBin>=nBins)
+						BinValue = 0.0;
 					else
-						PixelValue = InPrjData[gen_ptr(iSlice, iPixel)];
-
-					if (iPixel < BinLeft)
-						OutPrjData[usr_ptr(iSlice, iBin)] += ((iPixel+1-BinLeft) * 
-																	PixelValue);
-					else if (iPixel+1 > BinRight)
-						OutPrjData[usr_ptr(iSlice, iBin)] += ((BinRight-iPixel) * 
-																	PixelValue);
+						BinValue = RawPrjData[iSlice*nBins+iBin];
+					if (iBin < PixelLeft)
+						ModPrjData[iSlice*nRotPixs+iPixel] += (iBin+1-PixelLeft)*BinValue;
+					else if (iBin+1 > PixelRight)
+						ModPrjData[iSlice*nRotPixs+iPixel] += (PixelRight-iBin)*BinValue;
 					else
-						OutPrjData[usr_ptr(iSlice, iBin)] += PixelValue;
+						ModPrjData[iSlice*nRotPixs+iPixel] += BinValue;
 				}
-			}
+		}
+		PixelLeft = PixelRight;
+	}
+}
 
-			(*Sum) += OutPrjData[usr_ptr(iSlice, iBin)];
+int main(int argc, char **argv)
+{
+	static const float afWidths[] = {1.0f, 1.0f, 0.75f, 1.6f};	// output pixel width for each case
+	static const int abSameLeft[] = {1, 0, 0, 0};
+	static const char *apchCases[] = {"one cor", "cor per view", "narrow pixels", "wide pixels"};
+	int nBins, nRotPixs, nSlices, nViews, iCase, iView, iRep, iNumReps = 5, iNumPlans;
+	size_t i, lRawLen, lModLen;
+	float *pfRaw, *pfLegacy, *pfPlan;
+	PrjView_t *psViews;
+	RebinPlan_t **ppsPlans, *psPlan;
+	float fCentre;
+	double dStart, dLegacy, dPlan, dShared;
+	int bSame;
+	InterpViews_t sViews;
+	double dRebinSum, dOneRebinSum = 0.0, dOnePlan = 0.0;
+	int iThreads;
+
+	if (argc != 5){
+		fprintf(stderr, "usage: MeasToModPrj bins pixels slices views\n");
+		exit(1);
+	}
+	nBins = atoi(argv[1]);
+	nRotPixs = atoi(argv[2]);
+	nSlices = atoi(argv[3]);
+	nViews = atoi(argv[4]);
+	lRawLen = (size_t)nBins*nSlices;
+	lModLen = (size_t)nRotPixs*nSlices;
+	pfRaw = (float *)malloc(sizeof(float)*lRawLen*nViews);
+	pfLegacy = (float *)malloc(sizeof(float)*lModLen*nViews);
+	pfPlan = (float *)malloc(sizeof(float)*lModLen*nViews);
+	psViews = (PrjView_t *)calloc(nViews, sizeof(PrjView_t));
+	if (pfRaw == NULL || pfLegacy == NULL || pfPlan == NULL || psViews == NULL){
+		fprintf(stderr, "unable to allocate %d views\n", nViews);
+		exit(1);
+	}
+	srand(1);
+	for (i = 0; i < lRawLen*nViews; i++)
+		pfRaw[i] = (i & 1) ? (float)(rand() % 50) : (float)rand()/RAND_MAX*40.0f;
+
+	printf("%d bins, %d pixels, %d slices, %d views\n", nBins, nRotPixs, nSlices, nViews);
+	for (iCase = 0; iCase < 4; iCase++){
+		// a fractional shift that differs per view unless there is one cor; the view plans centre the pixels on the bins
+		for (iView = 0; iView < nViews; iView++)
+			psViews[iView].Left = abSameLeft[iCase] ? 0.37f : (float)(iView % 17)/17.0f - 0.5f;
+		fCentre = fCentredStart(nBins, nRotPixs, afWidths[iCase]);
+
+		dStart = dGetWallTime();
+		for (iRep = 0; iRep < iNumReps; iRep++)
+			for (iView = 0; iView < nViews; iView++)
+				vLegacyMeasToModPrj(nBins, nRotPixs, nSlices, psViews[iView].Left + fCentre, 1.0f, afWidths[iCase], pfRaw + iView*lRawLen, pfLegacy + iView*lModLen);
+		dLegacy = (dGetWallTime() - dStart)/iNumReps;
+
+		dStart = dGetWallTime();
+		for (iRep = 0; iRep < iNumReps; iRep++)
+			for (iView = 0; iView < nViews; iView++)
+				vMeasToModPrj(nBins, nRotPixs, nSlices, psViews[iView].Left + fCentre, 1.0f, afWidths[iCase], pfRaw + iView*lRawLen, pfPlan + iView*lModLen);
+		dPlan = (dGetWallTime() - dStart)/iNumReps;
+		bSame = memcmp(pfLegacy, pfPlan, sizeof(float)*lModLen*nViews) == 0;
+
+		memset(pfPlan, 0xff, sizeof(float)*lModLen*nViews);
+		dStart = dGetWallTime();
+		for (iRep = 0; iRep < iNumReps; iRep++){
+			ppsPlans = ppsMakeViewRebinPlans(nBins, nRotPixs, nViews, psViews, 1.0f, afWidths[iCase]);
+			for (iView = 0; iView < nViews; iView++)
+				vApplyRebinPlan(ppsPlans[iView], nSlices, pfRaw + iView*lRawLen, pfPlan + iView*lModLen);
+			if (iRep < iNumReps - 1)
+				vFreeViewRebinPlans(ppsPlans);
 		}
+		dShared = (dGetWallTime() - dStart)/iNumReps;
+		for (iNumPlans = 0, psPlan = ppsPlans[0]; psPlan != NULL; psPlan = psPlan->psNext)
+			iNumPlans++;
+		vFreeViewRebinPlans(ppsPlans);
+		if (memcmp(pfLegacy, pfPlan, sizeof(float)*lModLen*nViews))
+			bSame = FALSE;
 
-		BinLeft = BinRight;
+		printf("%-13s legacy %8.2f ms  plan per view %8.2f ms (%5.1fx)  shared plans %8.2f ms (%5.1fx, %d plans)  %s\n",
+			apchCases[iCase], 1e3*dLegacy, 1e3*dPlan, dLegacy/dPlan, 1e3*dShared, dLegacy/dShared, iNumPlans,
+			bSame ? "identical" : "MISMATCH");
 	}
 
-	for (i=0; i<nSlices*nBins; i++)
-			OutPrjData[i] *= Fac;
-		
-   (*Sum) *= Fac;
+	/* thread scaling of the rebinning of the loader, which is the Interp
+		loop with the roles of bins and pixels swapped. Every thread count
+		must give the results of one thread bit for bit */
+	sViews.pdSums = (double *)malloc(sizeof(double)*nViews);
+	if (sViews.pdSums == NULL){
+		fprintf(stderr, "unable to allocate %d views\n", nViews);
+		exit(1);
+	}
+	fCentre = fCentredStart(nBins, nRotPixs, 1.0f);
+	ppsPlans = ppsMakeViewRebinPlans(nBins, nRotPixs, nViews, psViews, 1.0f, 1.0f);
+	sViews.pfInPrj = pfRaw;
+	sViews.pfOutPrj = pfPlan;
+	sViews.nRotPixs = nBins;
+	sViews.nBins = nRotPixs;
+	sViews.nSlices = nSlices;
+	sViews.ppsPlans = ppsPlans;
+	printf("threads   rebin views\n");
+	for (iThreads = 1; iThreads <= 32; iThreads *= 2){
+		vSetNumThreads(iThreads);
+		dStart = dGetWallTime();
+		for (iRep = 0; iRep < iNumReps; iRep++)
+			vParallelFor(nViews, vInterpView, &sViews);
+		dPlan = (dGetWallTime() - dStart)/iNumReps;
+		dRebinSum = dTreeSum(sViews.pdSums, nViews);
 
-#undef usr_ptr
-#undef gen_ptr
+		if (iThreads == 1){
+			memcpy(pfLegacy, pfPlan, sizeof(float)*lModLen*nViews);
+			dOneRebinSum = dRebinSum;
+			dOnePlan = dPlan;
+		}
+		bSame = memcmp(pfLegacy, pfPlan, sizeof(float)*lModLen*nViews) == 0 && dRebinSum == dOneRebinSum;
+		printf("%7d %8.2f ms (%5.1fx)  %s\n", iThreads, 1e3*dPlan, dOnePlan/dPlan,
+			bSame ? "identical" : "MISMATCH");
+	}
+	vFreeViewRebinPlans(ppsPlans);
+	free(sViews.pdSums);
+	free(pfRaw);
+	free(pfLegacy);
+	free(pfPlan);
+	free(psViews);
+	return 0;
 }
+#endif
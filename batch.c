@@ -0,0 +1,641 @@
+/*
+	batch.c
+
+	osems --batch manifest: reconstructs many studies in one run. Each
+	line of the manifest is
+
+		parfile prjimage atnmap initest outbase
+
+	with - for an unused attenuation map or initial estimate. Blank lines
+	and lines starting with # are skipped.
+
+	Studies whose parameter files have the same content, whose tables,
+	kernels, orbit and scatter files are unchanged and whose projections
+	have the same size share one session, so the views,
+	collimator model and scatter estimate are set up once per worker.
+	The FFTW plans, DRF tables and normalization are still made by
+	libirl in every IrlOsem call. libirl keeps global state, so on POSIX
+	systems the studies run in forked worker processes, each with its own
+	sessions, even if there is only one worker, so a study that dies in a
+	fatal error does not take the batch with it. An idle worker is
+	preferably given a study whose session it already holds; a study is
+	only started when its estimated memory fits in the budget together
+	with the studies already running. Without fork (WIN32) the studies
+	run one after the other in this process.
+
+	A timing summary with one line per study is written at the end. On
+	WIN32 the summary file is also rewritten before each study, so it
+	survives a fatal error.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#ifndef WIN32
+#include <unistd.h>
+#include <sys/wait.h>
+#include <sys/select.h>
+#endif
+
+#include <mip/errdefs.h>
+#include <mip/printmsg.h>
+#include <mip/miputil.h>
+#include <mip/getparms.h>
+#include <mip/imgio.h>
+#include <mip/irl.h>
+#include <mip/osemhooks.h>
+
+#include "protos.h"
+#include "osemthreads.h"
+#include "convergence.h"
+#include "sysmat.h"
+#include "session.h"
+#include "batch.h"
+#include "loadimages.h"
+#include "prjpack.h"
+
+// sessions opened by this process, matched by parameter file content and projection size
+static OsemSession_t **ppsgSessions = NULL;
+static unsigned long long *plsgSessionKeys = NULL;
+static int isgNumSessions = 0;
+
+static char *pchNoDash(char *pch)
+{
+	return strcmp(pch, "-") == 0 ? NULL : pchIrlStrdup(pch);
+}
+
+/**
+	@brief Parses a manifest line into psStudy.
+
+	@return 1 for a study, 0 for a blank or comment line, -1 if the line
+		does not have the five fields.
+*/
+int iParseStudyLine(char *pchLine, Study_t *psStudy)
+{
+	char *apchFields[5], *pch;
+	int iNumFields;
+
+	for (iNumFields = 0, pch = strtok(pchLine, " \t\r\n"); pch != NULL && iNumFields < 5; pch = strtok(NULL, " \t\r\n"))
+		apchFields[iNumFields++] = pch;
+	if (iNumFields == 0 || *apchFields[0] == '#')
+		return 0;
+	if (iNumFields != 5 || pch != NULL)
+		return -1;
+	psStudy->pchParmFile = pchIrlStrdup(apchFields[0]);
+	psStudy->pchPrjImage = pchIrlStrdup(apchFields[1]);
+	psStudy->pchAtnImage = pchNoDash(apchFields[2]);
+	psStudy->pchInitImage = pchNoDash(apchFields[3]);
+	psStudy->pchOutBase = pchIrlStrdup(pchStripExt(apchFields[4], IMAGE_EXTENSION));
+	psStudy->dMemMB = 0.0;
+	return 1;
+}
+
+void vFreeStudy(Study_t *psStudy)
+{
+	IrlFree(psStudy->pchParmFile);
+	IrlFree(psStudy->pchPrjImage);
+	if (psStudy->pchAtnImage) IrlFree(psStudy->pchAtnImage);
+	if (psStudy->pchInitImage) IrlFree(psStudy->pchInitImage);
+	IrlFree(psStudy->pchOutBase);
+}
+
+// Reads the manifest and returns the number of studies in *piNumStudies.
+static Study_t *psReadManifest(char *pchManifest, int *piNumStudies)
+{
+	FILE *fp;
+	char achLine[MAX_STUDY_LINE];
+	Study_t *psStudies = NULL;
+	int iNumStudies = 0, iMaxStudies = 0, iLine = 0, iParsed;
+
+	if ((fp = fopen(pchManifest, "r")) == NULL)
+		vErrorHandler(ECLASS_FATAL, ETYPE_IO, "ReadManifest", "unable to open manifest %s", pchManifest);
+	while (fgets(achLine, sizeof(achLine), fp) != NULL){
+		iLine++;
+		if (iNumStudies == iMaxStudies){
+			iMaxStudies = iMaxStudies ? 2*iMaxStudies : 64;
+			psStudies = (Study_t *)realloc(psStudies, sizeof(Study_t)*iMaxStudies);
+			if (psStudies == NULL)
+				vErrorHandler(ECLASS_FATAL, ETYPE_MALLOC, "ReadManifest", "unable to allocate %d studies", iMaxStudies);
+		}
+		iParsed = iParseStudyLine(achLine, &psStudies[iNumStudies]);
+		if (iParsed == 0)
+			continue;
+		if (iParsed < 0)
+			vErrorHandler(ECLASS_FATAL, ETYPE_SYNTAX, "ReadManifest",
+				"%s:%d: expected parfile prjimage atnmap initest outbase, with - for an unused image", pchManifest, iLine);
+		iNumStudies++;
+	}
+	fclose(fp);
+	*piNumStudies = iNumStudies;
+	return psStudies;
+}
+
+/* Estimates the memory for a study from the size of its projections: the
+	projections, reconstruction, attenuation map, initial estimate and the
+	working images of IrlOsem. Only used to decide how many studies run at once.
+	Returns -1 if the projections can not be opened. */
+double dEstimateStudyMB(Study_t *psStudy)
+{
+	int iXdim, iYdim, iZdim;
+	IMAGE *pImage;
+	PackedPrj_t *psPack;
+	FILE *fp;
+
+	// imgio treats a missing file as fatal, which a server can not afford
+	if ((fp = fopen(psStudy->pchPrjImage, "rb")) == NULL)
+		return -1.0;
+	fclose(fp);
+	// packed projections have their sizes in their own header
+	if (bIsPackedPrj(psStudy->pchPrjImage)){
+		psPack = psOpenPackedPrj(psStudy->pchPrjImage, &iXdim, &iYdim, &iZdim);
+		vClosePackedPrj(psPack);
+	}else{
+		pImage = imgio_openimage(psStudy->pchPrjImage, 'o', &iXdim, &iYdim, &iZdim);
+		imgio_closeimage(pImage);
+	}
+	return 4.0*(2.0*iXdim*iYdim*iZdim + 6.0*iXdim*iXdim*iYdim)/(1024.0*1024.0);
+}
+
+static void vHashBytes(unsigned long long *plHash, const void *pvData, size_t lLen)
+{
+	const unsigned char *puch = (const unsigned char *)pvData;
+	size_t l;
+
+	for (l = 0; l < lLen; l++){
+		*plHash ^= puch[l];
+		*plHash *= 1099511628211ULL;
+	}
+}
+
+/* FNV-1a hash of the parameter file, so a session is reused for the same
+	parameters under any file name, and of the name, size and modification
+	time of each file the session is set up from, so a table or kernel
+	that is rewritten under the same name gives a new session. The
+	parameter file must be read in. */
+static unsigned long long lGetSessionKey(char *pchParmFile)
+{
+	static const char *apchFileParms[] = { "drf_tab_file", "srf_krnl_file", "orbit_file", "scat_est_file" };
+	unsigned long long lHash = 14695981039346656037ULL;
+	struct stat sStat;
+	char achBuf[4096], *pchFile;
+	FILE *fp;
+	size_t lLen;
+	int i, bFound;
+
+	if ((fp = fopen(pchParmFile, "rb")) == NULL)
+		vErrorHandler(ECLASS_FATAL, ETYPE_IO, "GetSessionKey", "unable to open %s", pchParmFile);
+	while ((lLen = fread(achBuf, 1, sizeof(achBuf), fp)) > 0)
+		vHashBytes(&lHash, achBuf, lLen);
+	fclose(fp);
+	for (i = 0; i < (int)(sizeof(apchFileParms)/sizeof(apchFileParms[0])); i++){
+		pchFile = pchGetStrParm((char *)apchFileParms[i], &bFound, "");
+		if (!bFound)
+			continue;
+		vHashBytes(&lHash, pchFile, strlen(pchFile) + 1);
+		if (stat(pchFile, &sStat) == 0){
+			vHashBytes(&lHash, &sStat.st_size, sizeof(sStat.st_size));
+			vHashBytes(&lHash, &sStat.st_mtime, sizeof(sStat.st_mtime));
+		}
+	}
+	return lHash;
+}
+
+// The session key of a study: its parameter file key and its projection size.
+static unsigned long long lGetStudyKey(Study_t *psStudy)
+{
+	IrlParms_t sSizes;
+	unsigned long long lKey;
+
+	vReadParmsFile(psStudy->pchParmFile);
+	vGetImageSizes(psStudy->pchPrjImage, &sSizes, 0);
+	lKey = lGetSessionKey(psStudy->pchParmFile);
+	iDoneWithParms();
+	vHashBytes(&lKey, &sSizes.NumSlices, sizeof(sSizes.NumSlices));
+	vHashBytes(&lKey, &sSizes.NumPixels, sizeof(sSizes.NumPixels));
+	vHashBytes(&lKey, &sSizes.NumViews, sizeof(sSizes.NumViews));
+	return lKey;
+}
+
+static OsemSession_t *psGetSession(char *pchParmFile, unsigned long long lKey, IrlParms_t *psSizes, int *pbReused)
+{
+	OsemSession_t *psSession;
+	int i;
+
+	for (i = 0; i < isgNumSessions; i++){
+		psSession = ppsgSessions[i];
+		if (plsgSessionKeys[i] == lKey && psSession->sIrlParms.NumSlices == psSizes->NumSlices &&
+			psSession->sIrlParms.NumPixels == psSizes->NumPixels && psSession->sIrlParms.NumViews == psSizes->NumViews){
+			*pbReused = TRUE;
+			return psSession;
+		}
+	}
+	ppsgSessions = (OsemSession_t **)realloc(ppsgSessions, sizeof(OsemSession_t *)*(isgNumSessions + 1));
+	plsgSessionKeys = (unsigned long long *)realloc(plsgSessionKeys, sizeof(unsigned long long)*(isgNumSessions + 1));
+	if (ppsgSessions == NULL || plsgSessionKeys == NULL)
+		vErrorHandler(ECLASS_FATAL, ETYPE_MALLOC, "GetSession", "unable to allocate the session table");
+	psSession = psOpenSession(pchParmFile, psSizes->NumSlices, psSizes->NumPixels, psSizes->NumViews);
+	ppsgSessions[isgNumSessions] = psSession;
+	plsgSessionKeys[isgNumSessions++] = lKey;
+	*pbReused = FALSE;
+	return psSession;
+}
+
+void vCloseStudySessions(void)
+{
+	int i;
+
+	for (i = 0; i < isgNumSessions; i++)
+		vCloseSession(ppsgSessions[i]);
+	free(ppsgSessions);
+	free(plsgSessionKeys);
+	ppsgSessions = NULL;
+	plsgSessionKeys = NULL;
+	isgNumSessions = 0;
+}
+
+// Reconstructs one study in this process and writes outbase.im.
+void vRunStudy(Study_t *psStudy, int iStudy, StudyResult_t *psResult)
+{
+	OsemSession_t *psSession;
+	IrlParms_t sSizes, sIrlParms;
+	float *pfPrjImage, *pfAtnMap = NULL, *pfActImage;
+	char *pchOutName;
+	ImageLoad_t asLoads[3];
+	int bInitEst, bFound, iNumLoads = 0;
+	unsigned long long lKey;
+	double dStart = dGetWallTime(), dTime;
+
+	memset(psResult, 0, sizeof(StudyResult_t));
+	psResult->iStudy = iStudy;
+#ifndef WIN32
+	psResult->iPid = (int)getpid();
+#endif
+	vPrintMsg(4, "batch: study %d: %s %s -> %s\n", iStudy + 1, psStudy->pchParmFile, psStudy->pchPrjImage, psStudy->pchOutBase);
+
+	vReadParmsFile(psStudy->pchParmFile);
+	vGetImageSizes(psStudy->pchPrjImage, &sSizes, 0);
+	lKey = lGetSessionKey(psStudy->pchParmFile);
+	iDoneWithParms();
+	psSession = psGetSession(psStudy->pchParmFile, lKey, &sSizes, &psResult->bReusedSetup);
+	dTime = dGetWallTime();
+	psResult->dSetupTime = dTime - dStart;
+
+	// the image readers take their slice ranges and scale factors from the parameter file
+	vReadParmsFile(psStudy->pchParmFile);
+	sIrlParms = psSession->sIrlParms;
+	if ((psSession->bModelAtn || psSession->bModelSrf) && psStudy->pchAtnImage == NULL){
+		vErrorHandler(ECLASS_WARN, ETYPE_USAGE, "RunStudy", "study %d: attenuation map is required for Atn or Srf Compensation", iStudy + 1);
+		iDoneWithParms();
+		psResult->iErrNum = -1;
+		return;
+	}
+	vPreparePrjImage(psStudy->pchPrjImage, &sIrlParms, psSession->psViews, &asLoads[iNumLoads++]);
+	if (psSession->bModelAtn || psSession->bModelSrf)
+		vPrepareAtnMap(psStudy->pchAtnImage, &sIrlParms, &asLoads[iNumLoads++]);
+	bInitEst = psStudy->pchInitImage != NULL;
+	if (bInitEst)
+		vPrepareInitialEst(psStudy->pchInitImage, &sIrlParms, &asLoads[iNumLoads++]);
+	vLoadImages(asLoads, iNumLoads, bGetBoolParm("parallel_load", &bFound, TRUE));
+	iDoneWithParms();
+	pfPrjImage = asLoads[0].pfPixels;
+	if (psSession->bModelAtn || psSession->bModelSrf)
+		pfAtnMap = asLoads[1].pfPixels;
+	if (bInitEst)
+		pfActImage = asLoads[iNumLoads - 1].pfPixels;
+	else
+		pfActImage = (float *)pvIrlMalloc(sizeof(float)*sIrlParms.NumPixels*sIrlParms.NumPixels*sIrlParms.NumSlices, "RunStudy:pfActImage");
+	psResult->dLoadTime = dGetWallTime() - dTime;
+
+	dTime = dGetWallTime();
+	psResult->iErrNum = iSessionRecon(psSession, pfPrjImage, pfAtnMap, pfActImage, bInitEst, NULL, NULL, NULL, NULL);
+	psResult->dReconTime = dGetWallTime() - dTime;
+
+	dTime = dGetWallTime();
+	pchOutName = (char *)pvIrlMalloc(strlen(psStudy->pchOutBase) + strlen(IMAGE_EXTENSION) + 1, "RunStudy:pchOutName");
+	sprintf(pchOutName, "%s%s", psStudy->pchOutBase, IMAGE_EXTENSION);
+	writeimage(pchOutName, sIrlParms.NumPixels, sIrlParms.NumPixels, sIrlParms.NumSlices, pfActImage);
+	psResult->dWriteTime = dGetWallTime() - dTime;
+
+	IrlFree(pchOutName);
+	IrlFree(pfPrjImage);
+	IrlFree(pfActImage);
+	if (pfAtnMap) IrlFree(pfAtnMap);
+}
+
+static void vWriteSummary(char *pchSummary, Study_t *psStudies, StudyResult_t *psResults, int *pbDone, int iNumStudies, double dTotalTime)
+{
+	FILE *fp;
+	double dSum = 0.0;
+	int i;
+
+	fp = pchSummary != NULL ? fopen(pchSummary, "w") : stderr;
+	if (fp == NULL){
+		vErrorHandler(ECLASS_WARN, ETYPE_IO, "WriteSummary", "unable to open %s, writing the summary to stderr", pchSummary);
+		fp = stderr;
+	}
+	fprintf(fp, "# study pid reused setup_s load_s recon_s write_s total_s status outbase\n");
+	for (i = 0; i < iNumStudies; i++){
+		StudyResult_t *psResult = &psResults[i];
+		double dTotal = psResult->dSetupTime + psResult->dLoadTime + psResult->dReconTime + psResult->dWriteTime;
+
+		dSum += dTotal;
+		fprintf(fp, "%d %d %s %.3f %.3f %.3f %.3f %.3f %s %s\n", i + 1, psResult->iPid, psResult->bReusedSetup ? "yes" : "no",
+			psResult->dSetupTime, psResult->dLoadTime, psResult->dReconTime, psResult->dWriteTime, dTotal,
+			!pbDone[i] ? "failed" : psResult->iErrNum ? "error" : "ok", psStudies[i].pchOutBase);
+	}
+	fprintf(fp, "# %d studies in %.2f s wall time, %.2f s summed over studies\n", iNumStudies, dTotalTime, dSum);
+	if (fp != stderr)
+		fclose(fp);
+}
+
+#ifndef WIN32
+// reads exactly iSize bytes; returns FALSE at end of file or on an error
+static int bReadAll(int iFd, void *pv, int iSize)
+{
+	char *pch = (char *)pv;
+	int iRead;
+
+	while (iSize > 0){
+		if ((iRead = (int)read(iFd, pch, iSize)) <= 0)
+			return FALSE;
+		pch += iRead;
+		iSize -= iRead;
+	}
+	return TRUE;
+}
+
+static int bWriteAll(int iFd, const void *pv, int iSize)
+{
+	const char *pch = (const char *)pv;
+	int iWritten;
+
+	while (iSize > 0){
+		if ((iWritten = (int)write(iFd, pch, iSize)) <= 0)
+			return FALSE;
+		pch += iWritten;
+		iSize -= iWritten;
+	}
+	return TRUE;
+}
+
+// Sends a study to an idle worker as its number and its manifest line. Returns 0 on success.
+int iSendStudy(Worker_t *psWorker, int iStudy, Study_t *psStudy)
+{
+	char achLine[MAX_STUDY_LINE];
+	int aiHeader[2];
+
+	aiHeader[0] = iStudy;
+	aiHeader[1] = snprintf(achLine, sizeof(achLine), "%s %s %s %s %s", psStudy->pchParmFile, psStudy->pchPrjImage,
+		psStudy->pchAtnImage ? psStudy->pchAtnImage : "-", psStudy->pchInitImage ? psStudy->pchInitImage : "-", psStudy->pchOutBase);
+	if (aiHeader[1] >= (int)sizeof(achLine))
+		return 1;
+	if (!bWriteAll(psWorker->iCmdFd, aiHeader, sizeof(aiHeader)) || !bWriteAll(psWorker->iCmdFd, achLine, aiHeader[1]))
+		return 1;
+	psWorker->iStudy = iStudy;
+	return 0;
+}
+
+// Reads the result of a worker's study. Returns 0 on success, non-zero if the worker died.
+int iReadResult(Worker_t *psWorker, StudyResult_t *psResult)
+{
+	if (!bReadAll(psWorker->iResultFd, psResult, sizeof(StudyResult_t)))
+		return 1;
+	psWorker->iStudy = -1;
+	return 0;
+}
+
+static void vWorkerMain(int iCmdFd, int iResultFd)
+{
+	StudyResult_t sResult;
+	Study_t sStudy;
+	char achLine[MAX_STUDY_LINE];
+	int aiHeader[2];
+
+	while (bReadAll(iCmdFd, aiHeader, sizeof(aiHeader)) && aiHeader[1] >= 0 && aiHeader[1] < MAX_STUDY_LINE &&
+		bReadAll(iCmdFd, achLine, aiHeader[1])){
+		achLine[aiHeader[1]] = '\0';
+		if (iParseStudyLine(achLine, &sStudy) != 1){
+			memset(&sResult, 0, sizeof(sResult));
+			sResult.iStudy = aiHeader[0];
+			sResult.iErrNum = -1;
+		}else{
+			vRunStudy(&sStudy, aiHeader[0], &sResult);
+			vFreeStudy(&sStudy);
+		}
+		if (!bWriteAll(iResultFd, &sResult, sizeof(sResult)))
+			break;
+	}
+	exit(0);
+}
+
+// Forks a worker process. psWorkers are the other workers, whose pipes the new one closes,
+// and piCloseFds other descriptors of the parent, such as sockets, that it closes as well.
+void vStartWorker(Worker_t *psWorker, Worker_t *psWorkers, int iNumWorkers, const int *piCloseFds, int iNumCloseFds)
+{
+	int aiCmd[2], aiResult[2], i;
+
+	if (pipe(aiCmd) || pipe(aiResult))
+		vErrorHandler(ECLASS_FATAL, ETYPE_IO, "StartWorker", "unable to create pipes");
+	fflush(NULL);
+	psWorker->iPid = fork();
+	if (psWorker->iPid < 0)
+		vErrorHandler(ECLASS_FATAL, ETYPE_IO, "StartWorker", "unable to fork a worker");
+	if (psWorker->iPid == 0){
+		// the worker only keeps its own ends of its own pipes
+		for (i = 0; i < iNumWorkers; i++)
+			if (&psWorkers[i] != psWorker && psWorkers[i].iPid > 0){
+				close(psWorkers[i].iCmdFd);
+				close(psWorkers[i].iResultFd);
+			}
+		for (i = 0; i < iNumCloseFds; i++)
+			if (piCloseFds[i] >= 0)
+				close(piCloseFds[i]);
+		close(aiCmd[1]);
+		close(aiResult[0]);
+		vWorkerMain(aiCmd[0], aiResult[1]);
+	}
+	close(aiCmd[0]);
+	close(aiResult[1]);
+	psWorker->iCmdFd = aiCmd[1];
+	psWorker->iResultFd = aiResult[0];
+	psWorker->iStudy = -1;
+}
+
+// Closes the worker's pipes, which makes it exit, and waits for it.
+void vStopWorker(Worker_t *psWorker)
+{
+	close(psWorker->iCmdFd);
+	close(psWorker->iResultFd);
+	waitpid(psWorker->iPid, NULL, 0);
+	psWorker->iPid = 0;
+}
+
+/* Picks the study for idle worker iWorker: the first waiting study whose
+	session the worker already holds, else the first whose session no
+	worker holds, else the first waiting study. Returns -1 if none is
+	waiting. */
+static int iPickStudy(Study_t *psStudies, int iNumStudies, const int *pbStarted,
+	unsigned long long *plHeldKeys, const int *piNumHeld, int iWorker, int iNumWorkers)
+{
+	int i, j, k, bHeld, iUnheld = -1, iFirst = -1;
+
+	for (i = 0; i < iNumStudies; i++){
+		if (pbStarted[i])
+			continue;
+		if (iFirst < 0)
+			iFirst = i;
+		bHeld = FALSE;
+		for (j = 0; j < iNumWorkers; j++)
+			for (k = 0; k < piNumHeld[j]; k++)
+				if (plHeldKeys[j*iNumStudies + k] == psStudies[i].lSessionKey){
+					if (j == iWorker)
+						return i;
+					bHeld = TRUE;
+				}
+		if (!bHeld && iUnheld < 0)
+			iUnheld = i;
+	}
+	return iUnheld >= 0 ? iUnheld : iFirst;
+}
+
+// Hands the studies out to iNumWorkers processes, keeping the estimated memory in use below dMemBudgetMB.
+static void vRunWorkers(Study_t *psStudies, int iNumStudies, int iNumWorkers, double dMemBudgetMB, StudyResult_t *psResults, int *pbDone)
+{
+	Worker_t *psWorkers;
+	StudyResult_t sResult;
+	fd_set sReadFds;
+	double dMemInUse = 0.0;
+	unsigned long long *plHeldKeys;
+	int i, k, iStudy, iNumStarted = 0, iNumRunning = 0, iMaxFd, *pbStarted, *piNumHeld;
+
+	psWorkers = (Worker_t *)pvIrlMalloc(sizeof(Worker_t)*iNumWorkers, "RunWorkers:psWorkers");
+	memset(psWorkers, 0, sizeof(Worker_t)*iNumWorkers);
+	// the session keys each worker holds, at most one per study
+	plHeldKeys = (unsigned long long *)pvIrlMalloc(sizeof(unsigned long long)*iNumWorkers*iNumStudies, "RunWorkers:plHeldKeys");
+	piNumHeld = (int *)pvIrlMalloc(sizeof(int)*iNumWorkers, "RunWorkers:piNumHeld");
+	pbStarted = (int *)pvIrlMalloc(sizeof(int)*iNumStudies, "RunWorkers:pbStarted");
+	memset(piNumHeld, 0, sizeof(int)*iNumWorkers);
+	memset(pbStarted, 0, sizeof(int)*iNumStudies);
+	for (i = 0; i < iNumWorkers; i++)
+		vStartWorker(&psWorkers[i], psWorkers, iNumWorkers, NULL, 0);
+
+	while (iNumStarted < iNumStudies || iNumRunning > 0){
+		// start studies on idle workers while they fit in the budget; a study that is larger than the whole budget runs alone
+		for (i = 0; i < iNumWorkers && iNumStarted < iNumStudies; i++){
+			if (psWorkers[i].iStudy >= 0)
+				continue;
+			iStudy = iPickStudy(psStudies, iNumStudies, pbStarted, plHeldKeys, piNumHeld, i, iNumWorkers);
+			if (iNumRunning > 0 && dMemBudgetMB > 0 && dMemInUse + psStudies[iStudy].dMemMB > dMemBudgetMB)
+				break;
+			if (iSendStudy(&psWorkers[i], iStudy, &psStudies[iStudy]))
+				vErrorHandler(ECLASS_FATAL, ETYPE_IO, "RunWorkers", "unable to send study %d to worker %d", iStudy + 1, (int)psWorkers[i].iPid);
+			for (k = 0; k < piNumHeld[i] && plHeldKeys[i*iNumStudies + k] != psStudies[iStudy].lSessionKey; k++)
+				;
+			if (k == piNumHeld[i])
+				plHeldKeys[i*iNumStudies + piNumHeld[i]++] = psStudies[iStudy].lSessionKey;
+			pbStarted[iStudy] = TRUE;
+			dMemInUse += psStudies[iStudy].dMemMB;
+			iNumStarted++;
+			iNumRunning++;
+		}
+
+		FD_ZERO(&sReadFds);
+		iMaxFd = -1;
+		for (i = 0; i < iNumWorkers; i++)
+			if (psWorkers[i].iStudy >= 0){
+				FD_SET(psWorkers[i].iResultFd, &sReadFds);
+				if (psWorkers[i].iResultFd > iMaxFd)
+					iMaxFd = psWorkers[i].iResultFd;
+			}
+		if (select(iMaxFd + 1, &sReadFds, NULL, NULL, NULL) < 0)
+			continue;
+		for (i = 0; i < iNumWorkers; i++){
+			if (psWorkers[i].iStudy < 0 || !FD_ISSET(psWorkers[i].iResultFd, &sReadFds))
+				continue;
+			dMemInUse -= psStudies[psWorkers[i].iStudy].dMemMB;
+			iNumRunning--;
+			if (iReadResult(&psWorkers[i], &sResult) == 0){
+				psResults[sResult.iStudy] = sResult;
+				pbDone[sResult.iStudy] = TRUE;
+			}else{
+				// the worker died, most likely in a fatal error; its study failed and a new worker, without sessions, takes its place
+				fprintf(stderr, "batch: worker %d died while reconstructing study %d\n", (int)psWorkers[i].iPid, psWorkers[i].iStudy + 1);
+				vStopWorker(&psWorkers[i]);
+				vStartWorker(&psWorkers[i], psWorkers, iNumWorkers, NULL, 0);
+				piNumHeld[i] = 0;
+			}
+		}
+	}
+
+	for (i = 0; i < iNumWorkers; i++)
+		vStopWorker(&psWorkers[i]);
+	IrlFree(psWorkers);
+	IrlFree(plHeldKeys);
+	IrlFree(piNumHeld);
+	IrlFree(pbStarted);
+}
+#endif
+
+/**
+	@brief Reconstructs all studies in a manifest.
+
+	@param pchManifest - manifest file name.
+	@param iNumWorkers - number of studies reconstructed at once; 0 for the number of processors.
+	@param dMemBudgetMB - estimated memory the running studies may use, 0 for no limit.
+	@param pchSummary - file for the timing summary, NULL for stderr.
+
+	@return the number of studies that failed.
+*/
+int iRunBatch(char *pchManifest, int iNumWorkers, double dMemBudgetMB, char *pchSummary)
+{
+	Study_t *psStudies;
+	StudyResult_t *psResults;
+	int i, iNumStudies, iNumFailed = 0, *pbDone;
+	double dStart = dGetWallTime();
+
+	psStudies = psReadManifest(pchManifest, &iNumStudies);
+	if (iNumStudies == 0){
+		fprintf(stderr, "batch: no studies in %s\n", pchManifest);
+		return 0;
+	}
+	for (i = 0; i < iNumStudies; i++){
+		if ((psStudies[i].dMemMB = dEstimateStudyMB(&psStudies[i])) < 0)
+			vErrorHandler(ECLASS_FATAL, ETYPE_IO, "RunBatch", "study %d: unable to open %s", i + 1, psStudies[i].pchPrjImage);
+		psStudies[i].lSessionKey = lGetStudyKey(&psStudies[i]);
+	}
+	psResults = (StudyResult_t *)pvIrlMalloc(sizeof(StudyResult_t)*iNumStudies, "RunBatch:psResults");
+	pbDone = (int *)pvIrlMalloc(sizeof(int)*iNumStudies, "RunBatch:pbDone");
+	memset(psResults, 0, sizeof(StudyResult_t)*iNumStudies);
+	memset(pbDone, 0, sizeof(int)*iNumStudies);
+	if (iNumWorkers <= 0)
+		iNumWorkers = iGetNumThreads();
+	if (iNumWorkers > iNumStudies)
+		iNumWorkers = iNumStudies;
+	fprintf(stderr, "batch: %d studies from %s on %d workers\n", iNumStudies, pchManifest, iNumWorkers);
+
+#ifndef WIN32
+	vRunWorkers(psStudies, iNumStudies, iNumWorkers, dMemBudgetMB, psResults, pbDone);
+#else
+	// a fatal error ends this process, so the summary so far, with this study as failed, is written first
+	for (i = 0; i < iNumStudies; i++){
+		if (pchSummary != NULL)
+			vWriteSummary(pchSummary, psStudies, psResults, pbDone, i + 1, dGetWallTime() - dStart);
+		vRunStudy(&psStudies[i], i, &psResults[i]);
+		pbDone[i] = TRUE;
+	}
+#endif
+
+	vWriteSummary(pchSummary, psStudies, psResults, pbDone, iNumStudies, dGetWallTime() - dStart);
+	for (i = 0; i < iNumStudies; i++){
+		if (!pbDone[i] || psResults[i].iErrNum)
+			iNumFailed++;
+		vFreeStudy(&psStudies[i]);
+	}
+	vCloseStudySessions();
+	free(psStudies);
+	IrlFree(psResults);
+	IrlFree(pbDone);
+	return iNumFailed;
+}
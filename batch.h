@@ -0,0 +1,57 @@
+/*
+	batch.h
+
+	Studies and the pool of forked worker processes shared by the batch
+	mode (osems --batch) and the reconstruction server (osems --serve).
+*/
+
+#ifndef BATCH_H
+#define BATCH_H
+
+#ifndef WIN32
+#include <sys/types.h>
+#endif
+
+#define MAX_STUDY_LINE 4096
+
+// parfile prjimage atnmap initest outbase, with - for an unused image
+typedef struct {
+	char *pchParmFile;
+	char *pchPrjImage;
+	char *pchAtnImage;		// NULL if not given
+	char *pchInitImage;		// NULL if not given
+	char *pchOutBase;
+	double dMemMB;			// estimated memory needed to reconstruct the study
+	unsigned long long lSessionKey;	// studies with the same key can share a session
+} Study_t;
+
+// sent from a worker when a study is done
+typedef struct {
+	int iStudy;
+	int iErrNum;			// IrlOsem error number, -1 if the study could not be read
+	int bReusedSetup;
+	int iPid;
+	double dSetupTime, dLoadTime, dReconTime, dWriteTime;
+} StudyResult_t;
+
+int iParseStudyLine(char *pchLine, Study_t *psStudy);
+void vFreeStudy(Study_t *psStudy);
+double dEstimateStudyMB(Study_t *psStudy);
+void vRunStudy(Study_t *psStudy, int iStudy, StudyResult_t *psResult);
+void vCloseStudySessions(void);
+
+#ifndef WIN32
+typedef struct {
+	pid_t iPid;
+	int iCmdFd;		// studies to the worker
+	int iResultFd;	// StudyResult_t from the worker
+	int iStudy;		// study being reconstructed, -1 if idle
+} Worker_t;
+
+void vStartWorker(Worker_t *psWorker, Worker_t *psWorkers, int iNumWorkers, const int *piCloseFds, int iNumCloseFds);
+void vStopWorker(Worker_t *psWorker);
+int iSendStudy(Worker_t *psWorker, int iStudy, Study_t *psStudy);
+int iReadResult(Worker_t *psWorker, StudyResult_t *psResult);
+#endif
+
+#endif
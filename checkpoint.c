@@ -0,0 +1,322 @@
+/*
+	checkpoint.c
+
+	Writes the current estimate every checkpoint_int iterations so a
+	reconstruction that is killed can be resumed from the last one.
+
+	A checkpoint is an image, <base>.<iteration>.im, plus a small text
+	file, <base>, that names it together with the iteration it was taken
+	after and the sizes and number of subsets it is valid for. Both are
+	written to a temporary name, flushed to disk and renamed into place,
+	and the previous image is only removed after the text file points to
+	the new one, so a job killed at any point, or a machine that goes
+	down, leaves a complete checkpoint behind.
+
+	The iteration callback only copies the estimate; the files are
+	written by a background thread so the reconstruction does not wait
+	for the disk. If a checkpoint is still being written when the next
+	one is due, the newer estimate replaces the one waiting to be
+	written.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifndef WIN32
+#include <unistd.h>
+#include <fcntl.h>
+#else
+#include <io.h>
+#include <fcntl.h>
+#endif
+
+#include <mip/errdefs.h>
+#include <mip/printmsg.h>
+#include <mip/miputil.h>
+#include <mip/imgio.h>
+#include <mip/irl.h>
+
+#include "protos.h"
+#include "osemthreads.h"
+#include "checkpoint.h"
+
+static int bsgRunning = FALSE;
+static char *pchsgBase = NULL;
+static char *pchsgNameBuf = NULL;
+static char *pchsgTmpBuf = NULL;
+static int isgInterval = 0;
+static int isgNumIterations = 0;
+static int isgNumPixels = 0;
+static int isgNumSlices = 0;
+static int isgAngPerSubset = 0;
+static int isgNumSubsets = 0;
+static long lsgNumVoxels = 0;
+
+// the writer thread and what it is handed, protected by sgMutex
+static OsemMutex_t sgMutex;
+static OsemCond_t sgCond;
+static OsemThread_t sgWriter;
+static float *pfsgPending = NULL;	// estimate waiting to be written
+static float *pfsgWriting = NULL;	// estimate being written
+static int isgPendingIter = 0;		// iteration of pfsgPending, 0 if nothing is waiting
+static int bsgQuit = FALSE;
+static int isgLastWritten = 0;		// iteration of the checkpoint on disk, 0 if none
+
+// replaces pchTo by pchFrom in one step
+static int iReplaceFile(char *pchFrom, char *pchTo)
+{
+#ifdef WIN32
+	return MoveFileExA(pchFrom, pchTo, MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH) ? 0 : -1;
+#else
+	return rename(pchFrom, pchTo);
+#endif
+}
+
+// flushes a file written by imgio, which keeps no handle open, to the disk
+static int iSyncFile(char *pchName)
+{
+	int iFd, iErr;
+
+#ifdef WIN32
+	if ((iFd = _open(pchName, _O_RDWR | _O_BINARY)) < 0)
+		return -1;
+	iErr = _commit(iFd);
+	_close(iFd);
+#else
+	if ((iFd = open(pchName, O_RDONLY)) < 0)
+		return -1;
+	iErr = fsync(iFd);
+	close(iFd);
+#endif
+	return iErr;
+}
+
+static void vCheckpointImageName(char *pchName, int iIteration)
+{
+	sprintf(pchName, "%s.%d%s", pchsgBase, iIteration, IMAGE_EXTENSION);
+}
+
+// writes the image, then the file pointing to it, then removes the previous image
+static void vWriteCheckpoint(int iIteration, float *pfEstimate)
+{
+	double dStart = dGetWallTime();
+	FILE *fp;
+
+	sprintf(pchsgTmpBuf, "%s.tmp%s", pchsgBase, IMAGE_EXTENSION);
+	writeimage(pchsgTmpBuf, isgNumPixels, isgNumPixels, isgNumSlices, pfEstimate);
+	// the image must be on disk before the text file can point to it
+	if (iSyncFile(pchsgTmpBuf)){
+		vErrorHandler(ECLASS_WARN, ETYPE_IO, "WriteCheckpoint", "unable to flush %s", pchsgTmpBuf);
+		remove(pchsgTmpBuf);
+		return;
+	}
+	vCheckpointImageName(pchsgNameBuf, iIteration);
+	if (iReplaceFile(pchsgTmpBuf, pchsgNameBuf)){
+		vErrorHandler(ECLASS_WARN, ETYPE_IO, "WriteCheckpoint", "unable to rename %s to %s", pchsgTmpBuf, pchsgNameBuf);
+		return;
+	}
+
+	sprintf(pchsgTmpBuf, "%s.tmp", pchsgBase);
+	if ((fp = fopen(pchsgTmpBuf, "w")) == NULL){
+		vErrorHandler(ECLASS_WARN, ETYPE_IO, "WriteCheckpoint", "unable to open %s", pchsgTmpBuf);
+		return;
+	}
+	fprintf(fp, "iteration=%d\n", iIteration);
+	fprintf(fp, "num_subsets=%d\n", isgNumSubsets);
+	fprintf(fp, "num_iterations=%d\n", isgNumIterations);
+	fprintf(fp, "ndim=%d\n", isgNumPixels);
+	fprintf(fp, "nslices=%d\n", isgNumSlices);
+	fprintf(fp, "image=%s\n", pchsgNameBuf);
+	fflush(fp);
+#ifdef WIN32
+	_commit(_fileno(fp));
+#else
+	fsync(fileno(fp));
+#endif
+	if (ferror(fp) | fclose(fp) || iReplaceFile(pchsgTmpBuf, pchsgBase)){
+		vErrorHandler(ECLASS_WARN, ETYPE_IO, "WriteCheckpoint", "unable to write %s", pchsgBase);
+		remove(pchsgTmpBuf);
+		return;
+	}
+
+	if (isgLastWritten > 0 && isgLastWritten != iIteration){
+		vCheckpointImageName(pchsgNameBuf, isgLastWritten);
+		remove(pchsgNameBuf);
+	}
+	isgLastWritten = iIteration;
+	vPrintMsg(6, "checkpoint of iteration %d written to %s in %.2f s\n", iIteration, pchsgBase, dGetWallTime() - dStart);
+}
+
+static void vCheckpointWriter(void *pvArg)
+{
+	float *pfTmp;
+	int iIteration;
+
+	(void)pvArg;	// the writer's state is in the statics above
+	vLockMutex(&sgMutex);
+	for (;;){
+		while (isgPendingIter == 0 && !bsgQuit)
+			vWaitCond(&sgCond, &sgMutex);
+		if (isgPendingIter == 0)
+			break;
+		pfTmp = pfsgWriting;
+		pfsgWriting = pfsgPending;
+		pfsgPending = pfTmp;
+		iIteration = isgPendingIter;
+		isgPendingIter = 0;
+		vUnlockMutex(&sgMutex);
+
+		vWriteCheckpoint(iIteration, pfsgWriting);
+
+		vLockMutex(&sgMutex);
+	}
+	vUnlockMutex(&sgMutex);
+}
+
+/**
+	@brief Starts writing a checkpoint every iInterval iterations.
+
+	@param pchBase - name of the checkpoint file; the images are written
+		to pchBase.<iteration>.im.
+	@param iInterval - iterations between checkpoints, 0 for none.
+	@param psParms - sizes, number of iterations and subsets of the reconstruction.
+*/
+void vStartCheckpoints(char *pchBase, int iInterval, IrlParms_t *psParms)
+{
+	if (iInterval <= 0 || bsgRunning)
+		return;
+	pchsgBase = pchIrlStrdup(pchBase);
+	pchsgNameBuf = (char *)pvIrlMalloc((int)strlen(pchBase) + 16 + (int)strlen(IMAGE_EXTENSION), "StartCheckpoints:NameBuf");
+	pchsgTmpBuf = (char *)pvIrlMalloc((int)strlen(pchBase) + 16 + (int)strlen(IMAGE_EXTENSION), "StartCheckpoints:TmpBuf");
+	isgInterval = iInterval;
+	isgNumIterations = psParms->NumIterations;
+	isgNumPixels = psParms->NumPixels;
+	isgNumSlices = psParms->NumSlices;
+	isgAngPerSubset = psParms->NumAngPerSubset;
+	isgNumSubsets = isgAngPerSubset > 0 ? psParms->NumViews/isgAngPerSubset : 1;
+	lsgNumVoxels = (long)isgNumPixels*isgNumPixels*isgNumSlices;
+	pfsgPending = (float *)pvIrlMalloc(sizeof(float)*lsgNumVoxels, "StartCheckpoints:pfPending");
+	pfsgWriting = (float *)pvIrlMalloc(sizeof(float)*lsgNumVoxels, "StartCheckpoints:pfWriting");
+	isgPendingIter = isgLastWritten = 0;
+	bsgQuit = FALSE;
+
+	vInitMutex(&sgMutex);
+	vInitCond(&sgCond);
+	if (iStartThread(&sgWriter, vCheckpointWriter, NULL))
+		vErrorHandler(ECLASS_FATAL, ETYPE_IO, "StartCheckpoints", "unable to start the checkpoint writer");
+	bsgRunning = TRUE;
+	vPrintMsg(4, "writing a checkpoint every %d iterations to %s\n", iInterval, pchBase);
+}
+
+/**
+	@brief Iteration callback hook: hands the estimate to the writer if a
+	checkpoint is due after this iteration.
+
+	No checkpoint is taken after the last iteration, since the
+	reconstruction is written then anyway.
+*/
+void vCheckpointIteration(int iIteration, float *pfCurrentEstimate)
+{
+	if (!bsgRunning || iIteration % isgInterval != 0 || iIteration >= isgNumIterations)
+		return;
+	vLockMutex(&sgMutex);
+	if (isgPendingIter != 0)
+		vPrintMsg(6, "checkpoint of iteration %d replaced by iteration %d before it was written\n", isgPendingIter, iIteration);
+	memcpy(pfsgPending, pfCurrentEstimate, sizeof(float)*lsgNumVoxels);
+	isgPendingIter = iIteration;
+	vSignalCond(&sgCond);
+	vUnlockMutex(&sgMutex);
+}
+
+/**
+	@brief Waits for the writer to finish and stops it.
+
+	@param bCompleted - the reconstruction finished, so the checkpoint is
+		no longer needed: what is waiting is dropped and the checkpoint on
+		disk is removed. Otherwise the last checkpoint is written first.
+*/
+void vStopCheckpoints(int bCompleted)
+{
+	if (!bsgRunning)
+		return;
+	vLockMutex(&sgMutex);
+	if (bCompleted)
+		isgPendingIter = 0;
+	bsgQuit = TRUE;
+	vSignalCond(&sgCond);
+	vUnlockMutex(&sgMutex);
+	vJoinThread(sgWriter);
+	vDestroyCond(&sgCond);
+	vDestroyMutex(&sgMutex);
+
+	if (bCompleted && isgLastWritten > 0){
+		remove(pchsgBase);
+		vCheckpointImageName(pchsgNameBuf, isgLastWritten);
+		remove(pchsgNameBuf);
+	}
+	IrlFree(pfsgPending);
+	IrlFree(pfsgWriting);
+	IrlFree(pchsgNameBuf);
+	IrlFree(pchsgTmpBuf);
+	IrlFree(pchsgBase);
+	pfsgPending = pfsgWriting = NULL;
+	bsgRunning = FALSE;
+}
+
+/**
+	@brief Reads the checkpoint written for a reconstruction with the
+	same sizes and subsets.
+
+	@param pchBase - name of the checkpoint file.
+	@param pfActImage - gets the estimate from the checkpoint.
+
+	@return the iteration the checkpoint was taken after, or 0 if there
+	is no checkpoint.
+*/
+int iReadCheckpoint(char *pchBase, IrlParms_t *psParms, float *pfActImage)
+{
+	char achLine[MAX_CHECKPOINT_LINE], achKey[64], achImage[MAX_CHECKPOINT_LINE];
+	int iValue, iIteration = 0, iNumSubsets = -1, iNumPixels = -1, iNumSlices = -1;
+	int iExpectSubsets = psParms->NumAngPerSubset > 0 ? psParms->NumViews/psParms->NumAngPerSubset : 1;
+	int iXdim, iYdim, iZdim;
+	IMAGE *pImage;
+	FILE *fp;
+
+	if ((fp = fopen(pchBase, "r")) == NULL)
+		return 0;
+	achImage[0] = '\0';
+	while (fgets(achLine, sizeof(achLine), fp) != NULL){
+		if (sscanf(achLine, "image=%[^\r\n]", achImage) == 1)
+			continue;
+		if (sscanf(achLine, "%63[^=]=%d", achKey, &iValue) != 2)
+			continue;
+		if (strcmp(achKey, "iteration") == 0)
+			iIteration = iValue;
+		else if (strcmp(achKey, "num_subsets") == 0)
+			iNumSubsets = iValue;
+		else if (strcmp(achKey, "ndim") == 0)
+			iNumPixels = iValue;
+		else if (strcmp(achKey, "nslices") == 0)
+			iNumSlices = iValue;
+	}
+	fclose(fp);
+
+	if (iIteration < 1 || achImage[0] == '\0')
+		vErrorHandler(ECLASS_FATAL, ETYPE_ILLEGAL_VALUE, "ReadCheckpoint", "%s is not a complete checkpoint", pchBase);
+	if (iNumPixels != psParms->NumPixels || iNumSlices != psParms->NumSlices || iNumSubsets != iExpectSubsets)
+		vErrorHandler(ECLASS_FATAL, ETYPE_ILLEGAL_VALUE, "ReadCheckpoint",
+			"checkpoint %s is for %d x %d x %d pixels and %d subsets, not %d x %d x %d and %d subsets",
+			pchBase, iNumPixels, iNumPixels, iNumSlices, iNumSubsets,
+			psParms->NumPixels, psParms->NumPixels, psParms->NumSlices, iExpectSubsets);
+	if (iIteration >= psParms->NumIterations)
+		vErrorHandler(ECLASS_FATAL, ETYPE_ILLEGAL_VALUE, "ReadCheckpoint",
+			"checkpoint %s is after iteration %d, but only %d iterations are to be done", pchBase, iIteration, psParms->NumIterations);
+
+	pImage = imgio_openimage(achImage, 'o', &iXdim, &iYdim, &iZdim);
+	if (iXdim != psParms->NumPixels || iYdim != psParms->NumPixels || iZdim != psParms->NumSlices)
+		vErrorHandler(ECLASS_FATAL, ETYPE_ILLEGAL_VALUE, "ReadCheckpoint", "checkpoint image %s is %d x %d x %d", achImage, iXdim, iYdim, iZdim);
+	imgio_readslices(pImage, 0, iZdim - 1, pfActImage);
+	imgio_closeimage(pImage);
+	vPrintMsg(4, "resuming from the checkpoint after iteration %d in %s\n", iIteration, achImage);
+	return iIteration;
+}
@@ -0,0 +1,22 @@
+/*
+	checkpoint.h
+
+	Periodic checkpoints of a running reconstruction so that a job that
+	is killed can be resumed with osems --resume instead of starting
+	over.
+
+	Include mip/irl.h before this file.
+*/
+
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+#define CHECKPOINT_EXTENSION ".ckpt"
+#define MAX_CHECKPOINT_LINE 1024
+
+void vStartCheckpoints(char *pchBase, int iInterval, IrlParms_t *psParms);
+void vCheckpointIteration(int iIteration, float *pfCurrentEstimate);
+void vStopCheckpoints(int bCompleted);
+int iReadCheckpoint(char *pchBase, IrlParms_t *psParms, float *pfActImage);
+
+#endif
@@ -0,0 +1,198 @@
+/*
+	convergence.c
+
+	Computes the relative image change after every iteration from the
+	estimate handed to the iteration callback and stops the
+	reconstruction when it falls below stop_rel_change or when it is
+	cancelled.
+
+	IrlOsem can not be interrupted from its callback, so with a stopping
+	criterion the iterations are run in pieces of stop_check_int
+	iterations, each continuing from the previous estimate through
+	start_iter and the initial estimate option. A run that can be
+	cancelled but has no criterion is split every cancel_check_int
+	iterations instead. The change is measured after every iteration, but
+	a criterion met inside a piece only stops the run at its end.
+
+	Each piece repeats the setup IrlOsem does before its first iteration
+	(reading the DRF table and SRF kernel and normalizing the subsets),
+	so N iterations checked every k cost N/k setups instead of one, hence
+	the coarse default interval. The stopping test
+	is on the image change only: a log-likelihood test would need the
+	forward projection of the estimate, which IrlOsem does not hand out,
+	so it would cost another projection per check. Like IrlOsem itself this
+	uses global state, so only one call can run at a time.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include <mip/errdefs.h>
+#include <mip/printmsg.h>
+#include <mip/miputil.h>
+#include <mip/getparms.h>
+#include <mip/irl.h>
+#include <mip/osemhooks.h>
+
+#include "protos.h"
+#include "convergence.h"
+#include "sysmat.h"
+
+static void (*pfnsgUserCallback)(int iIteration, float *pfCurrentEstimate) = NULL;
+static ReconTrace_t *psgTrace = NULL;
+static float *pfsgPrevEstimate = NULL;
+static int bsgHavePrev = FALSE;
+static int isgMaxTrace = 0;
+static long lsgNumVoxels = 0;
+static double dsgLastChange = 0.0;
+
+/**
+	@brief Reads the stopping criteria from the parameter file.
+*/
+void vGetStopCriteria(StopCriteria_t *psStop)
+{
+	int bFound;
+
+	psStop->dRelChange = dGetDblParm("stop_rel_change", &bFound, 0.0);
+	psStop->iMinIterations = iGetIntParm("stop_min_iterations", &bFound, 1);
+	psStop->iCheckInterval = iGetIntParm("stop_check_int", &bFound, 5);
+	psStop->iCancelInterval = iGetIntParm("cancel_check_int", &bFound, 10);
+	psStop->pbCancel = NULL;
+	if (psStop->iCheckInterval < 1){
+		vErrorHandler(ECLASS_WARN, ETYPE_ILLEGAL_VALUE, "GetStopCriteria",
+			"stop_check_int must be >= 1, setting to 1");
+		psStop->iCheckInterval = 1;
+	}
+	if (psStop->iCancelInterval < 1){
+		vErrorHandler(ECLASS_WARN, ETYPE_ILLEGAL_VALUE, "GetStopCriteria",
+			"cancel_check_int must be >= 1, setting to 1");
+		psStop->iCancelInterval = 1;
+	}
+}
+
+// measures the change from the previous estimate, then calls the user callback
+static void vConvergenceCallback(int iIteration, float *pfCurrentEstimate)
+{
+	double dDiff = 0.0, dNorm = 0.0, d;
+	long l;
+
+	if (bsgHavePrev){
+		for (l = 0; l < lsgNumVoxels; l++){
+			d = (double)pfCurrentEstimate[l] - pfsgPrevEstimate[l];
+			dDiff += d*d;
+			dNorm += (double)pfCurrentEstimate[l]*pfCurrentEstimate[l];
+		}
+		dsgLastChange = dNorm > 0.0 ? sqrt(dDiff/dNorm) : 0.0;
+	}else
+		dsgLastChange = 1.0;	// nothing to compare the first iterate with
+	memcpy(pfsgPrevEstimate, pfCurrentEstimate, sizeof(float)*lsgNumVoxels);
+	bsgHavePrev = TRUE;
+	vPrintMsg(4, "iteration %d: relative image change %.4g\n", iIteration, dsgLastChange);
+
+	if (psgTrace != NULL && psgTrace->iNumIterations < isgMaxTrace)
+		psgTrace->pdRelChange[psgTrace->iNumIterations++] = dsgLastChange;
+	if (pfnsgUserCallback != NULL)
+		pfnsgUserCallback(iIteration, pfCurrentEstimate);
+}
+
+// IrlOsem, or the precomputed system matrix when vSetSysMatOptions enabled it
+static int iRunOsem(IrlParms_t *psIrlParms, Options_t *psOptions, sAdvOptions *psAdvOpts, PrjView_t *psViews,
+	char *pchDrfTabFile, char *pchSrfKrnlFile, void (*pfnCallback)(int iIteration, float *pfCurrentEstimate),
+	float *pfScatterEstimate, float *pfAtnMap, float *pfPrjImage, float *pfActImage, char *pchLogFile, char *pchMsgFile)
+{
+	SysMatOptions_t sSysMat;
+
+	OsemSetAdvOptions(psAdvOpts);
+	vGetSysMatOptions(&sSysMat);
+	if (sSysMat.bEnabled)
+		return iSysMatOsem(psIrlParms, psOptions, psViews, psAdvOpts->iStartIteration, pfnCallback, pfScatterEstimate, pfPrjImage, pfActImage);
+	return IrlOsem(psIrlParms, psOptions, psViews, pchDrfTabFile, pchSrfKrnlFile, pfnCallback,
+		pfScatterEstimate, pfAtnMap, pfPrjImage, pfActImage, pchLogFile, pchMsgFile);
+}
+
+/**
+	@brief Runs IrlOsem, stopping early when psStop is met and recording
+	the relative image change of each iteration in psTrace.
+
+	The arguments up to pchMsgFile are those of IrlOsem. psAdvOpts are
+	the advanced options to run with; iStartIteration is adjusted for
+	each piece of iterations. With approx_sysmat the iterations are run by
+	iSysMatOsem instead.
+
+	@param psStop - stopping criteria, or NULL to do all iterations.
+	@param psTrace - gets the per-iteration trace, or NULL.
+
+	@return the IrlOsem error number (0 on success).
+*/
+int iOsemWithStop(IrlParms_t *psIrlParms, Options_t *psOptions, sAdvOptions *psAdvOpts, PrjView_t *psViews,
+	char *pchDrfTabFile, char *pchSrfKrnlFile, void (*pfnCallback)(int iIteration, float *pfCurrentEstimate),
+	float *pfScatterEstimate, float *pfAtnMap, float *pfPrjImage, float *pfActImage, char *pchLogFile, char *pchMsgFile,
+	const StopCriteria_t *psStop, ReconTrace_t *psTrace)
+{
+	IrlParms_t sIrlParms = *psIrlParms;
+	Options_t sOptions = *psOptions;
+	sAdvOptions sAdvOpts = *psAdvOpts;
+	int iErrNum = 0, iFirst, iLast, iNumDone = 0, iInterval;
+	int bStop = psStop != NULL && psStop->dRelChange > 0.0;
+	int bCancelable = psStop != NULL && psStop->pbCancel != NULL;
+
+	if (psTrace != NULL)
+		psTrace->iNumIterations = 0;
+	if (!bStop && !bCancelable && psTrace == NULL){
+		return iRunOsem(&sIrlParms, &sOptions, &sAdvOpts, psViews, pchDrfTabFile, pchSrfKrnlFile, pfnCallback,
+			pfScatterEstimate, pfAtnMap, pfPrjImage, pfActImage, pchLogFile, pchMsgFile);
+	}
+
+	lsgNumVoxels = (long)psIrlParms->NumPixels*psIrlParms->NumPixels*psIrlParms->NumSlices;
+	pfsgPrevEstimate = (float *)pvIrlMalloc(sizeof(float)*lsgNumVoxels, "OsemWithStop:pfPrevEstimate");
+	bsgHavePrev = FALSE;
+	pfnsgUserCallback = pfnCallback;
+	psgTrace = psTrace;
+	isgMaxTrace = psIrlParms->NumIterations;
+
+	// every piece repeats the setup IrlOsem does before its first iteration,
+	// so a run that can only be cancelled is split more coarsely
+	if (bStop)
+		iInterval = psStop->iCheckInterval;
+	else if (bCancelable)
+		iInterval = psStop->iCancelInterval;
+	else
+		iInterval = psIrlParms->NumIterations;
+	iFirst = psAdvOpts->iStartIteration > 0 ? psAdvOpts->iStartIteration : 1;
+	while (iFirst <= psIrlParms->NumIterations){
+		if (bCancelable && *psStop->pbCancel){
+			vPrintMsg(4, "OsemWithStop: cancelled before iteration %d\n", iFirst);
+			break;
+		}
+		iLast = iFirst + iInterval - 1;
+		if (iLast > psIrlParms->NumIterations)
+			iLast = psIrlParms->NumIterations;
+		// each piece continues from the estimate left in pfActImage by the previous one
+		sIrlParms = *psIrlParms;
+		sIrlParms.NumIterations = iLast;
+		sOptions = *psOptions;
+		if (iNumDone > 0)
+			sOptions.bReconIsInitEst = TRUE;
+		sAdvOpts.iStartIteration = iFirst;
+		iErrNum = iRunOsem(&sIrlParms, &sOptions, &sAdvOpts, psViews, pchDrfTabFile, pchSrfKrnlFile, vConvergenceCallback,
+			pfScatterEstimate, pfAtnMap, pfPrjImage, pfActImage, pchLogFile, pchMsgFile);
+		if (iErrNum)
+			break;
+		iNumDone += iLast - iFirst + 1;
+		iFirst = iLast + 1;
+		if (bStop && iNumDone >= psStop->iMinIterations && dsgLastChange < psStop->dRelChange){
+			if (iFirst <= psIrlParms->NumIterations)
+				vPrintMsg(4, "OsemWithStop: relative image change %.4g < %.4g, stopped after iteration %d of %d\n",
+					dsgLastChange, psStop->dRelChange, iLast, psIrlParms->NumIterations);
+			break;
+		}
+	}
+
+	IrlFree(pfsgPrevEstimate);
+	pfsgPrevEstimate = NULL;
+	pfnsgUserCallback = NULL;
+	psgTrace = NULL;
+	return iErrNum;
+}
@@ -0,0 +1,36 @@
+/*
+	convergence.h
+
+	Relative image change between iterations and early termination of
+	the reconstruction once it falls below a threshold.
+
+	Include mip/irl.h and mip/osemhooks.h before this file.
+*/
+
+#ifndef CONVERGENCE_H
+#define CONVERGENCE_H
+
+typedef struct {
+	double dRelChange;		// stop_rel_change: stop when the relative image change is below this; 0 never stops early
+	int iMinIterations;		// stop_min_iterations: iterations done before stopping is considered
+	int iCheckInterval;		// stop_check_int: iterations per IrlOsem run between checks
+	int iCancelInterval;	// cancel_check_int: iterations per run between checks when only pbCancel is set
+	volatile int *pbCancel;	// if not NULL, the reconstruction stops at the next check once it is set
+} StopCriteria_t;
+
+// per-iteration trace of one reconstruction
+typedef struct {
+	int iNumIterations;		// iterations done; fewer than NumIterations if stopped early
+	double *pdRelChange;	// ||x(k)-x(k-1)||/||x(k)|| for each iteration, NumIterations entries allocated by the caller
+} ReconTrace_t;
+
+void vGetStopCriteria(StopCriteria_t *psStop);
+int iOsemWithStop(IrlParms_t *psIrlParms, Options_t *psOptions, sAdvOptions *psAdvOpts, PrjView_t *psViews,
+	char *pchDrfTabFile, char *pchSrfKrnlFile, void (*pfnCallback)(int iIteration, float *pfCurrentEstimate),
+	float *pfScatterEstimate, float *pfAtnMap, float *pfPrjImage, float *pfActImage, char *pchLogFile, char *pchMsgFile,
+	const StopCriteria_t *psStop, ReconTrace_t *psTrace);
+
+// setup.c
+void vGetCmdLineRunOpts(sAdvOptions *psAdvOpts, StopCriteria_t *psStop, int *piCheckpointInterval);
+
+#endif
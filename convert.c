@@ -0,0 +1,463 @@
+/*
+	convert.c
+
+	Converts column-major arrays of any of the MATLAB numeric classes to
+	row-major, scaled float arrays. Each slice is transposed in square
+	tiles: a tile is first widened and scaled from contiguous input
+	columns into a small buffer, then written out row by row, so both the
+	reads and the writes stay within the cache. Tiles of all slices are
+	handed out to the threads in osemthreads.c.
+
+	The reverse direction, used to return the reconstruction, is done
+	either in place on square float slices or into a double array.
+
+	Projections of count data can also be kept as 16 bit counts with one
+	scale, half the size of the float projections, and widened again when
+	they are needed.
+
+	Compile with -DSTANDALONE (and osemthreads.c) to get a benchmark that
+	compares the tiled conversions with the straightforward triple loops.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <math.h>
+
+#include "convert.h"
+#include "osemthreads.h"
+
+#define CONVERT_TILE 32
+
+typedef struct {
+	const void *pvIn;
+	PixType_t ePixType;
+	int iRows;
+	int iCols;
+	int iNumColTiles;
+	double dScale;
+	float *pfOut;
+} Convert_t;
+
+/* Defines the conversion of one tile for a given input type. The products
+	are formed in double, exactly as the old per-class loops did, so the
+	output is identical to theirs. */
+#define DEFINE_CONVERT_TILE(NAME, TYPE) \
+static void NAME(const TYPE *pIn, int iRows, int iCols, int iRow0, int iCol0, double dScale, float *pfOut) \
+{ \
+	float afTile[CONVERT_TILE][CONVERT_TILE]; \
+	int iRow, iCol, iNumRows, iNumCols; \
+	\
+	iNumRows = iRows - iRow0 < CONVERT_TILE ? iRows - iRow0 : CONVERT_TILE; \
+	iNumCols = iCols - iCol0 < CONVERT_TILE ? iCols - iCol0 : CONVERT_TILE; \
+	for (iCol=0; iCol<iNumCols; ++iCol){ \
+		const TYPE *pCol = pIn + (size_t)(iCol0+iCol)*iRows + iRow0; \
+		for (iRow=0; iRow<iNumRows; ++iRow) \
+			afTile[iCol][iRow] = (float)(pCol[iRow]*dScale); \
+	} \
+	for (iRow=0; iRow<iNumRows; ++iRow){ \
+		float *pfRow = pfOut + (size_t)(iRow0+iRow)*iCols + iCol0; \
+		for (iCol=0; iCol<iNumCols; ++iCol) \
+			pfRow[iCol] = afTile[iCol][iRow]; \
+	} \
+}
+
+DEFINE_CONVERT_TILE(vConvertTileDouble, double)
+DEFINE_CONVERT_TILE(vConvertTileSingle, float)
+DEFINE_CONVERT_TILE(vConvertTileInt8, int8_t)
+DEFINE_CONVERT_TILE(vConvertTileUint8, uint8_t)
+DEFINE_CONVERT_TILE(vConvertTileInt16, int16_t)
+DEFINE_CONVERT_TILE(vConvertTileUint16, uint16_t)
+DEFINE_CONVERT_TILE(vConvertTileInt32, int32_t)
+DEFINE_CONVERT_TILE(vConvertTileUint32, uint32_t)
+DEFINE_CONVERT_TILE(vConvertTileInt64, int64_t)
+DEFINE_CONVERT_TILE(vConvertTileUint64, uint64_t)
+
+#undef DEFINE_CONVERT_TILE
+
+/* Converts one column strip (CONVERT_TILE columns of one slice). */
+static void vConvertStrip(void *pvConvert, int iItem)
+{
+	Convert_t *psConv = (Convert_t *)pvConvert;
+	int iSlice = iItem / psConv->iNumColTiles;
+	int iCol0 = (iItem % psConv->iNumColTiles)*CONVERT_TILE;
+	size_t lSliceOff = (size_t)iSlice*psConv->iRows*psConv->iCols;
+	float *pfOut = psConv->pfOut + lSliceOff;
+	int iRow0;
+
+	for (iRow0=0; iRow0<psConv->iRows; iRow0 += CONVERT_TILE){
+		switch (psConv->ePixType){
+			case PIX_DOUBLE:
+				vConvertTileDouble((const double *)psConv->pvIn + lSliceOff, psConv->iRows, psConv->iCols, iRow0, iCol0, psConv->dScale, pfOut);
+				break;
+			case PIX_SINGLE:
+				vConvertTileSingle((const float *)psConv->pvIn + lSliceOff, psConv->iRows, psConv->iCols, iRow0, iCol0, psConv->dScale, pfOut);
+				break;
+			case PIX_INT8:
+				vConvertTileInt8((const int8_t *)psConv->pvIn + lSliceOff, psConv->iRows, psConv->iCols, iRow0, iCol0, psConv->dScale, pfOut);
+				break;
+			case PIX_UINT8:
+				vConvertTileUint8((const uint8_t *)psConv->pvIn + lSliceOff, psConv->iRows, psConv->iCols, iRow0, iCol0, psConv->dScale, pfOut);
+				break;
+			case PIX_INT16:
+				vConvertTileInt16((const int16_t *)psConv->pvIn + lSliceOff, psConv->iRows, psConv->iCols, iRow0, iCol0, psConv->dScale, pfOut);
+				break;
+			case PIX_UINT16:
+				vConvertTileUint16((const uint16_t *)psConv->pvIn + lSliceOff, psConv->iRows, psConv->iCols, iRow0, iCol0, psConv->dScale, pfOut);
+				break;
+			case PIX_INT32:
+				vConvertTileInt32((const int32_t *)psConv->pvIn + lSliceOff, psConv->iRows, psConv->iCols, iRow0, iCol0, psConv->dScale, pfOut);
+				break;
+			case PIX_UINT32:
+				vConvertTileUint32((const uint32_t *)psConv->pvIn + lSliceOff, psConv->iRows, psConv->iCols, iRow0, iCol0, psConv->dScale, pfOut);
+				break;
+			case PIX_INT64:
+				vConvertTileInt64((const int64_t *)psConv->pvIn + lSliceOff, psConv->iRows, psConv->iCols, iRow0, iCol0, psConv->dScale, pfOut);
+				break;
+			case PIX_UINT64:
+				vConvertTileUint64((const uint64_t *)psConv->pvIn + lSliceOff, psConv->iRows, psConv->iCols, iRow0, iCol0, psConv->dScale, pfOut);
+				break;
+		}
+	}
+}
+
+/* Converts iNumSlices column-major iRows x iCols slices at pvIn to
+	row-major order in pfOut, multiplying each value by dScale. Element
+	(iRow, iCol) of slice s goes to pfOut[s*iRows*iCols + iRow*iCols + iCol].
+*/
+void vConvertToRowMajor(const void *pvIn, PixType_t ePixType, int iRows, int iCols, int iNumSlices, double dScale, float *pfOut)
+{
+	Convert_t sConv;
+
+	sConv.pvIn = pvIn;
+	sConv.ePixType = ePixType;
+	sConv.dScale = dScale;
+	sConv.pfOut = pfOut;
+	if (iRows == 1 || iCols == 1){
+		// the transpose is a no-op, so treat each slice as a single column
+		sConv.iRows = iRows*iCols;
+		sConv.iCols = 1;
+	}else{
+		sConv.iRows = iRows;
+		sConv.iCols = iCols;
+	}
+	sConv.iNumColTiles = (sConv.iCols + CONVERT_TILE - 1)/CONVERT_TILE;
+	vParallelFor(iNumSlices*sConv.iNumColTiles, vConvertStrip, &sConv);
+}
+
+/* returns TRUE (1) if vConvertToRowMajor would produce an exact copy of
+	its input, in which case the caller can use the input directly */
+int bConvertIsIdentity(PixType_t ePixType, int iRows, int iCols, double dScale)
+{
+	return ePixType == PIX_SINGLE && dScale == 1.0 && (iRows == 1 || iCols == 1);
+}
+
+typedef struct {
+	float *pfImage;
+	const float *pfIn;
+	double *pdOut;
+	int iRows;
+	int iCols;
+	int iNumRowTiles;
+} Transpose_t;
+
+/* Transposes the tiles in one tile row of a square slice with the tiles
+	in the matching tile column, i.e. tile (i,j) with tile (j,i) for j>=i. */
+static void vTransposeTileRow(void *pvTrans, int iItem)
+{
+	Transpose_t *psTrans = (Transpose_t *)pvTrans;
+	int iSize = psTrans->iRows;
+	int iRow0 = (iItem % psTrans->iNumRowTiles)*CONVERT_TILE;
+	float *pfSlice = psTrans->pfImage + (size_t)(iItem / psTrans->iNumRowTiles)*iSize*iSize;
+	float afTile[CONVERT_TILE][CONVERT_TILE];
+	int iCol0, iRow, iCol, iNumRows, iNumCols;
+	float fTmp;
+
+	iNumRows = iSize - iRow0 < CONVERT_TILE ? iSize - iRow0 : CONVERT_TILE;
+	// diagonal tile: swap in place
+	for (iRow=0; iRow<iNumRows; ++iRow)
+		for (iCol=iRow+1; iCol<iNumRows; ++iCol){
+			fTmp = pfSlice[(size_t)(iRow0+iRow)*iSize + iRow0+iCol];
+			pfSlice[(size_t)(iRow0+iRow)*iSize + iRow0+iCol] = pfSlice[(size_t)(iRow0+iCol)*iSize + iRow0+iRow];
+			pfSlice[(size_t)(iRow0+iCol)*iSize + iRow0+iRow] = fTmp;
+		}
+	for (iCol0=iRow0+CONVERT_TILE; iCol0<iSize; iCol0 += CONVERT_TILE){
+		iNumCols = iSize - iCol0 < CONVERT_TILE ? iSize - iCol0 : CONVERT_TILE;
+		// save tile (i,j), copy the transpose of tile (j,i) over it, then write the saved tile transposed to (j,i)
+		for (iRow=0; iRow<iNumRows; ++iRow)
+			for (iCol=0; iCol<iNumCols; ++iCol)
+				afTile[iRow][iCol] = pfSlice[(size_t)(iRow0+iRow)*iSize + iCol0+iCol];
+		for (iRow=0; iRow<iNumRows; ++iRow)
+			for (iCol=0; iCol<iNumCols; ++iCol)
+				pfSlice[(size_t)(iRow0+iRow)*iSize + iCol0+iCol] = pfSlice[(size_t)(iCol0+iCol)*iSize + iRow0+iRow];
+		for (iCol=0; iCol<iNumCols; ++iCol)
+			for (iRow=0; iRow<iNumRows; ++iRow)
+				pfSlice[(size_t)(iCol0+iCol)*iSize + iRow0+iRow] = afTile[iRow][iCol];
+	}
+}
+
+/* Transposes each of the iNumSlices iSize x iSize slices in pfImage in place. */
+void vTransposeSquareSlices(float *pfImage, int iSize, int iNumSlices)
+{
+	Transpose_t sTrans;
+
+	sTrans.pfImage = pfImage;
+	sTrans.iRows = sTrans.iCols = iSize;
+	sTrans.iNumRowTiles = (iSize + CONVERT_TILE - 1)/CONVERT_TILE;
+	vParallelFor(iNumSlices*sTrans.iNumRowTiles, vTransposeTileRow, &sTrans);
+}
+
+/* Converts one tile row of a row-major float slice to column-major double. */
+static void vToColMajorTileRow(void *pvTrans, int iItem)
+{
+	Transpose_t *psTrans = (Transpose_t *)pvTrans;
+	int iRows = psTrans->iRows, iCols = psTrans->iCols;
+	size_t lSliceOff = (size_t)(iItem / psTrans->iNumRowTiles)*iRows*iCols;
+	int iRow0 = (iItem % psTrans->iNumRowTiles)*CONVERT_TILE;
+	const float *pfIn = psTrans->pfIn + lSliceOff;
+	double *pdOut = psTrans->pdOut + lSliceOff;
+	int iCol0, iRow, iCol, iNumRows, iNumCols;
+
+	iNumRows = iRows - iRow0 < CONVERT_TILE ? iRows - iRow0 : CONVERT_TILE;
+	for (iCol0=0; iCol0<iCols; iCol0 += CONVERT_TILE){
+		iNumCols = iCols - iCol0 < CONVERT_TILE ? iCols - iCol0 : CONVERT_TILE;
+		// the input tile is at most 4 kB, so the strided reads hit the cache
+		for (iCol=0; iCol<iNumCols; ++iCol){
+			double *pdCol = pdOut + (size_t)(iCol0+iCol)*iRows + iRow0;
+			const float *pfCol = pfIn + (size_t)iRow0*iCols + iCol0+iCol;
+			for (iRow=0; iRow<iNumRows; ++iRow)
+				pdCol[iRow] = pfCol[(size_t)iRow*iCols];
+		}
+	}
+}
+
+/* The inverse of vConvertToRowMajor for float to double: element
+	pfIn[s*iRows*iCols + iRow*iCols + iCol] goes to
+	pdOut[s*iRows*iCols + iCol*iRows + iRow]. */
+void vConvertToColMajorDouble(const float *pfIn, int iRows, int iCols, int iNumSlices, double *pdOut)
+{
+	Transpose_t sTrans;
+
+	sTrans.pfIn = pfIn;
+	sTrans.pdOut = pdOut;
+	sTrans.iRows = iRows;
+	sTrans.iCols = iCols;
+	sTrans.iNumRowTiles = (iRows + CONVERT_TILE - 1)/CONVERT_TILE;
+	vParallelFor(iNumSlices*sTrans.iNumRowTiles, vToColMajorTileRow, &sTrans);
+}
+
+typedef struct {
+	const float *pfPrj;
+	uint16_t *pusCounts;
+	double dScale;
+	int iViewSize;
+	int *pbViewPacked;
+} PackCounts_t;
+
+/* Packs one view; a value is kept as count q only if (float)(q*scale)
+	gives back exactly the same float. */
+static void vPackView(void *pvPack, int iView)
+{
+	PackCounts_t *psPack = (PackCounts_t *)pvPack;
+	size_t lOff = (size_t)iView*psPack->iViewSize;
+	const float *pfIn = psPack->pfPrj + lOff;
+	uint16_t *pusOut = psPack->pusCounts + lOff;
+	double dScale = psPack->dScale, dCount;
+	int i;
+
+	psPack->pbViewPacked[iView] = 0;
+	if (!(dScale > 0.0))
+		return;
+	for (i=0; i<psPack->iViewSize; ++i){
+		dCount = floor(pfIn[i]/dScale + 0.5);
+		if (dCount < 0.0 || dCount > 65535.0 || (float)(dCount*dScale) != pfIn[i])
+			return;
+		pusOut[i] = (uint16_t)dCount;
+	}
+	psPack->pbViewPacked[iView] = 1;
+}
+
+/* Stores iNumViews row-major views of iViewSize scaled projection values
+	as 16 bit counts, multiples of dScale. Returns TRUE (1) if every value
+	is such a multiple of at most 65535, so that vUnpackCounts reproduces
+	pfPrj bit for bit; otherwise pusCounts is undefined and the
+	projections have to be kept in float. */
+int bPackCounts(const float *pfPrj, int iViewSize, int iNumViews, double dScale, uint16_t *pusCounts)
+{
+	PackCounts_t sPack;
+	int iView, bPacked = 1;
+
+	sPack.pfPrj = pfPrj;
+	sPack.pusCounts = pusCounts;
+	sPack.dScale = dScale;
+	sPack.iViewSize = iViewSize;
+	sPack.pbViewPacked = (int *)malloc(iNumViews*sizeof(int));
+	if (sPack.pbViewPacked == NULL)
+		return 0;
+	vParallelFor(iNumViews, vPackView, &sPack);
+	for (iView=0; iView<iNumViews; ++iView)
+		bPacked = bPacked && sPack.pbViewPacked[iView];
+	free(sPack.pbViewPacked);
+	return bPacked;
+}
+
+typedef struct {
+	const uint16_t *pusCounts;
+	double dScale;
+	int iViewSize;
+	float *pfOut;
+} UnpackCounts_t;
+
+static void vUnpackView(void *pvUnpack, int iView)
+{
+	UnpackCounts_t *psUnpack = (UnpackCounts_t *)pvUnpack;
+	size_t lOff = (size_t)iView*psUnpack->iViewSize;
+	const uint16_t *pusIn = psUnpack->pusCounts + lOff;
+	float *pfOut = psUnpack->pfOut + lOff;
+	double dScale = psUnpack->dScale;
+	int i;
+
+	for (i=0; i<psUnpack->iViewSize; ++i)
+		pfOut[i] = (float)(pusIn[i]*dScale);
+}
+
+/* Widens counts packed by bPackCounts back to scaled float projections. */
+void vUnpackCounts(const uint16_t *pusCounts, int iViewSize, int iNumViews, double dScale, float *pfOut)
+{
+	UnpackCounts_t sUnpack;
+
+	sUnpack.pusCounts = pusCounts;
+	sUnpack.dScale = dScale;
+	sUnpack.iViewSize = iViewSize;
+	sUnpack.pfOut = pfOut;
+	vParallelFor(iNumViews, vUnpackView, &sUnpack);
+}
+
+#ifdef STANDALONE
+/* the loop previously used in ToFloatArray for each class */
+#define LEGACY_CONVERT(TYPE) \
+	{ \
+		const TYPE *inptr = (const TYPE *)pvIn; \
+		int i = 0, s, n, m; \
+		for (s = 0; s < iNumSlices; s++) \
+		for (n = 0; n < iCols; n++) \
+		for (m = 0; m < iRows; m++) \
+		{ \
+			pfOut[s*iRows*iCols + m*iCols + n] = inptr[i]*dScale; \
+			i++; \
+		} \
+	}
+
+static void vLegacyConvert(const void *pvIn, PixType_t ePixType, int iRows, int iCols, int iNumSlices, double dScale, float *pfOut)
+{
+	switch (ePixType){
+		case PIX_DOUBLE: LEGACY_CONVERT(double) break;
+		case PIX_SINGLE: LEGACY_CONVERT(float) break;
+		case PIX_UINT16: LEGACY_CONVERT(uint16_t) break;
+		default: break;
+	}
+}
+
+int main(int argc, char **argv)
+{
+	static const PixType_t aeTypes[] = {PIX_DOUBLE, PIX_SINGLE, PIX_UINT16};
+	static const char *apchTypes[] = {"double", "single", "uint16"};
+	static const int aiSizes[] = {8, 4, 2};
+	int iRows, iCols, iNumSlices, iType, iRep, iNumReps=5;
+	size_t i, lNum;
+	void *pvIn;
+	float *pfLegacy, *pfTiled;
+	double dStart, dLegacy, dTiled;
+
+	if (argc != 4 && argc != 5){
+		fprintf(stderr, "usage: convert rows cols slices [threads]  (cols is also the size of the returned square slices)\n");
+		exit(1);
+	}
+	iRows = atoi(argv[1]);
+	iCols = atoi(argv[2]);
+	iNumSlices = atoi(argv[3]);
+	if (argc == 5)
+		vSetNumThreads(atoi(argv[4]));
+	lNum = (size_t)(iRows > iCols ? iRows : iCols)*iCols*iNumSlices;
+	pvIn = malloc(lNum*8);
+	pfLegacy = (float *)malloc(lNum*sizeof(float));
+	pfTiled = (float *)malloc(lNum*sizeof(float));
+	lNum = (size_t)iRows*iCols*iNumSlices;
+	if (pvIn == NULL || pfLegacy == NULL || pfTiled == NULL){
+		fprintf(stderr, "unable to allocate %lu pixels\n", (unsigned long)lNum);
+		exit(1);
+	}
+
+	printf("%d x %d x %d, %d threads\n", iRows, iCols, iNumSlices, iGetNumThreads());
+	for (iType=0; iType<3; ++iType){
+		for (i=0; i<lNum; ++i){
+			if (aeTypes[iType] == PIX_DOUBLE)
+				((double *)pvIn)[i] = (double)(i % 1000)/7.0;
+			else if (aeTypes[iType] == PIX_SINGLE)
+				((float *)pvIn)[i] = (float)(i % 1000)/7.0f;
+			else
+				((uint16_t *)pvIn)[i] = (uint16_t)(i % 1000);
+		}
+		dStart = dGetWallTime();
+		for (iRep=0; iRep<iNumReps; ++iRep)
+			vLegacyConvert(pvIn, aeTypes[iType], iRows, iCols, iNumSlices, 120.0, pfLegacy);
+		dLegacy = (dGetWallTime() - dStart)/iNumReps;
+		dStart = dGetWallTime();
+		for (iRep=0; iRep<iNumReps; ++iRep)
+			vConvertToRowMajor(pvIn, aeTypes[iType], iRows, iCols, iNumSlices, 120.0, pfTiled);
+		dTiled = (dGetWallTime() - dStart)/iNumReps;
+		for (i=0; i<lNum; ++i)
+			if (pfLegacy[i] != pfTiled[i])
+				break;
+		printf("%-7s legacy %8.2f ms (%6.0f MB/s)  tiled %8.2f ms (%6.0f MB/s)  speedup %5.1fx  %s\n",
+			apchTypes[iType], 1e3*dLegacy, lNum*aiSizes[iType]/dLegacy/1e6,
+			1e3*dTiled, lNum*aiSizes[iType]/dTiled/1e6, dLegacy/dTiled,
+			i == lNum ? "identical" : "MISMATCH");
+	}
+
+	// result return: old scatter loop into double vs. tiled double and in-place single
+	{
+		double *pdLegacy = (double *)pvIn, *pdTiled;
+		int s, m, n, iSize = iCols;
+
+		lNum = (size_t)iSize*iSize*iNumSlices;
+		pdTiled = (double *)malloc(lNum*sizeof(double));
+		for (i=0; i<lNum; ++i){
+			pfTiled[i] = pfLegacy[i] = (float)(i % 1000)/7.0f;
+			pdLegacy[i] = pdTiled[i] = 0.0;
+		}
+		vConvertToColMajorDouble(pfLegacy, iSize, iSize, iNumSlices, pdTiled);
+		dStart = dGetWallTime();
+		for (iRep=0; iRep<iNumReps; ++iRep){
+			i = 0;
+			for (s = 0; s < iNumSlices; s++)
+			for (m = 0; m < iSize; m++)
+			for (n = 0; n < iSize; n++){
+				pdLegacy[s*iSize*iSize + n*iSize + m] = pfLegacy[i];
+				i++;
+			}
+		}
+		dLegacy = (dGetWallTime() - dStart)/iNumReps;
+		dStart = dGetWallTime();
+		for (iRep=0; iRep<iNumReps; ++iRep)
+			vConvertToColMajorDouble(pfLegacy, iSize, iSize, iNumSlices, pdTiled);
+		dTiled = (dGetWallTime() - dStart)/iNumReps;
+		for (i=0; i<lNum; ++i)
+			if (pdLegacy[i] != pdTiled[i])
+				break;
+		printf("return  legacy %8.2f ms  tiled double %8.2f ms  %s\n", 1e3*dLegacy, 1e3*dTiled, i == lNum ? "identical" : "MISMATCH");
+		dStart = dGetWallTime();
+		vTransposeSquareSlices(pfTiled, iSize, iNumSlices);
+		dTiled = dGetWallTime() - dStart;
+		for (i=0; i<lNum; ++i)
+			if ((double)pfTiled[i] != pdLegacy[i])
+				break;
+		printf("                           in-place single %8.2f ms  %s\n", 1e3*dTiled, i == lNum ? "identical" : "MISMATCH");
+		free(pdTiled);
+	}
+	free(pvIn);
+	free(pfLegacy);
+	free(pfTiled);
+	return 0;
+}
+#endif
@@ -0,0 +1,34 @@
+/*
+	convert.h
+
+	Conversion of column-major (MATLAB ordered) numeric arrays to the
+	row-major float arrays used by libirl, and the 16 bit storage of
+	count projections.
+*/
+
+#ifndef CONVERT_H
+#define CONVERT_H
+
+#include <stdint.h>
+
+typedef enum {
+	PIX_DOUBLE,
+	PIX_SINGLE,
+	PIX_INT8,
+	PIX_UINT8,
+	PIX_INT16,
+	PIX_UINT16,
+	PIX_INT32,
+	PIX_UINT32,
+	PIX_INT64,
+	PIX_UINT64
+} PixType_t;
+
+void vConvertToRowMajor(const void *pvIn, PixType_t ePixType, int iRows, int iCols, int iNumSlices, double dScale, float *pfOut);
+void vTransposeSquareSlices(float *pfImage, int iSize, int iNumSlices);
+void vConvertToColMajorDouble(const float *pfIn, int iRows, int iCols, int iNumSlices, double *pdOut);
+int bConvertIsIdentity(PixType_t ePixType, int iRows, int iCols, double dScale);
+int bPackCounts(const float *pfPrj, int iViewSize, int iNumViews, double dScale, uint16_t *pusCounts);
+void vUnpackCounts(const uint16_t *pusCounts, int iViewSize, int iNumViews, double dScale, float *pfOut);
+
+#endif
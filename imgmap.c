@@ -0,0 +1,226 @@
+/*
+	imgmap.c
+
+	Maps uncompressed .im images into memory so the projection reader
+	can take the slices it needs from each view straight from the page
+	cache instead of reading whole views through imgio into a scratch
+	buffer.
+
+	The header of an .im file starts with a table of 32 bit byte offsets
+	in native byte order. Entries 4 to 7 give the number of dimensions,
+	the dimensions (slowest varying first), the first pixel and the end
+	of the pixel data. An image is only mapped if that table agrees with
+	the sizes imgio reports, the pixel data is exactly xdim*ydim*zdim
+	floats, and its first and last slices read the same through imgio.
+	Everything else (compressed images, other pixel types, files from a
+	machine with the other byte order) is left to imgio.
+
+	POSIX systems map the file with mmap and WIN32 with CreateFileMapping.
+	Only the POSIX mapping is told which rows will be used; on WIN32 the
+	pages are simply read as they are touched.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#ifdef WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#endif
+
+#include <mip/irl.h>
+#include <mip/imgio.h>
+#include <mip/printmsg.h>
+
+#include "imgmap.h"
+
+#define IM_HDR_NDIMS	4	// header entries holding byte offsets
+#define IM_HDR_DIMS		5
+#define IM_HDR_PIXELS	6
+#define IM_HDR_END		7
+#define IM_HDR_ENTRIES	8
+
+// checks that iLen bytes at iOffset lie inside the mapping
+static int bInMap(MappedImage_t *psMap, int iOffset, size_t lLen)
+{
+	return iOffset >= 0 && (size_t)iOffset <= psMap->lMapSize && lLen <= psMap->lMapSize - (size_t)iOffset;
+}
+
+// compares one slice of the mapping with what imgio reads
+static int bSliceMatches(MappedImage_t *psMap, IMAGE *pImage, int iSlice, float *pfScratch)
+{
+	size_t lSliceSize = sizeof(float)*psMap->iXdim*psMap->iYdim;
+
+	imgio_readslices(pImage, iSlice, iSlice, pfScratch);
+	return memcmp(pfScratch, psMap->pchPixels + iSlice*lSliceSize, lSliceSize) == 0;
+}
+
+static int iCheckMappedImage(MappedImage_t *psMap, IMAGE *pImage, float *pfScratch)
+{
+	const unsigned char *pchBase = (const unsigned char *)psMap->pvMap;
+	int32_t aiHdr[IM_HDR_ENTRIES], iNumDims, aiDims[3];
+	size_t lPixelSize = sizeof(float)*psMap->iXdim*psMap->iYdim*psMap->iZdim;
+
+	if (psMap->lMapSize < sizeof(aiHdr))
+		return 1;
+	memcpy(aiHdr, pchBase, sizeof(aiHdr));
+	if (!bInMap(psMap, aiHdr[IM_HDR_NDIMS], sizeof(int32_t)))
+		return 1;
+	memcpy(&iNumDims, pchBase + aiHdr[IM_HDR_NDIMS], sizeof(int32_t));
+	if (iNumDims < 2 || iNumDims > 3 || !bInMap(psMap, aiHdr[IM_HDR_DIMS], iNumDims*sizeof(int32_t)))
+		return 1;
+	memcpy(aiDims, pchBase + aiHdr[IM_HDR_DIMS], iNumDims*sizeof(int32_t));
+	if (iNumDims == 2){
+		aiDims[2] = aiDims[1];
+		aiDims[1] = aiDims[0];
+		aiDims[0] = 1;
+	}
+	if (aiDims[0] != psMap->iZdim || aiDims[1] != psMap->iYdim || aiDims[2] != psMap->iXdim)
+		return 1;
+	if (!bInMap(psMap, aiHdr[IM_HDR_PIXELS], lPixelSize) || (size_t)aiHdr[IM_HDR_END] - aiHdr[IM_HDR_PIXELS] != lPixelSize)
+		return 1;
+	psMap->pchPixels = pchBase + aiHdr[IM_HDR_PIXELS];
+
+	return bSliceMatches(psMap, pImage, 0, pfScratch) && bSliceMatches(psMap, pImage, psMap->iZdim - 1, pfScratch) ? 0 : 1;
+}
+
+/**
+	@brief Maps an image that imgio has already opened.
+
+	@param pchName - file name of the image.
+	@param pImage - the image opened with imgio_openimage, used to check the mapping.
+	@param iXdim, iYdim, iZdim - sizes returned by imgio_openimage.
+	@param pfScratch - room for one slice, used to check the mapping. The
+		caller allocates it, so that it comes from the allocator of the
+		thread that loads the image.
+	@param psMap - the mapping; free it with vUnmapImage.
+
+	@return 0 if the image was mapped, 1 if it has to be read with imgio.
+*/
+int iMapImage(char *pchName, IMAGE *pImage, int iXdim, int iYdim, int iZdim, float *pfScratch, MappedImage_t *psMap)
+{
+#ifdef WIN32
+	HANDLE hFile, hMapping;
+	LARGE_INTEGER sSize;
+#else
+	struct stat sStat;
+	int iFd;
+#endif
+
+	memset(psMap, 0, sizeof(MappedImage_t));
+	psMap->iXdim = iXdim;
+	psMap->iYdim = iYdim;
+	psMap->iZdim = iZdim;
+	if (iXdim <= 0 || iYdim <= 0 || iZdim <= 0)
+		return 1;
+#ifdef WIN32
+	hFile = CreateFileA(pchName, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (hFile == INVALID_HANDLE_VALUE)
+		return 1;
+	if (!GetFileSizeEx(hFile, &sSize) || sSize.QuadPart <= 0 || (uint64_t)sSize.QuadPart > (uint64_t)SIZE_MAX){
+		CloseHandle(hFile);
+		return 1;
+	}
+	psMap->lMapSize = (size_t)sSize.QuadPart;
+	hMapping = CreateFileMappingA(hFile, NULL, PAGE_READONLY, 0, 0, NULL);
+	CloseHandle(hFile);
+	if (hMapping == NULL)
+		return 1;
+	// the view keeps the mapping open once it is mapped
+	psMap->pvMap = MapViewOfFile(hMapping, FILE_MAP_READ, 0, 0, 0);
+	CloseHandle(hMapping);
+	if (psMap->pvMap == NULL)
+		return 1;
+#else
+	if ((iFd = open(pchName, O_RDONLY)) < 0)
+		return 1;
+	if (fstat(iFd, &sStat) || sStat.st_size <= 0){
+		close(iFd);
+		return 1;
+	}
+	psMap->lMapSize = (size_t)sStat.st_size;
+	psMap->pvMap = mmap(NULL, psMap->lMapSize, PROT_READ, MAP_SHARED, iFd, 0);
+	close(iFd);
+	if (psMap->pvMap == MAP_FAILED){
+		psMap->pvMap = NULL;
+		return 1;
+	}
+#endif
+	if (iCheckMappedImage(psMap, pImage, pfScratch)){
+		vPrintMsg(6, "%s can not be mapped, reading it with imgio\n", pchName);
+		vUnmapImage(psMap);
+		return 1;
+	}
+	psMap->bAligned = (uintptr_t)psMap->pchPixels % sizeof(float) == 0;
+	vPrintMsg(6, "mapped %s, pixels at offset %ld%s\n", pchName, (long)(psMap->pchPixels - (const unsigned char *)psMap->pvMap),
+		psMap->bAligned ? "" : " (unaligned, rows are copied out)");
+	return 0;
+}
+
+/**
+	@brief Tells the kernel which rows of each slice will be used.
+
+	For whole slices the file is read ahead sequentially. For a slab of
+	rows only the pages holding those rows are requested and read-ahead
+	is turned off, so the rows outside the slab are never read from disk.
+*/
+void vAdviseMappedRows(MappedImage_t *psMap, int iStartRow, int iNumRows)
+{
+#ifndef WIN32
+	size_t lPageSize = (size_t)sysconf(_SC_PAGESIZE);
+	size_t lRowSize = sizeof(float)*psMap->iXdim;
+	size_t lFirst, lLast;
+	const unsigned char *pchMap = (const unsigned char *)psMap->pvMap;
+	int iSlice;
+
+	if (iStartRow == 0 && iNumRows == psMap->iYdim){
+		madvise(psMap->pvMap, psMap->lMapSize, MADV_SEQUENTIAL);
+		madvise(psMap->pvMap, psMap->lMapSize, MADV_WILLNEED);
+		return;
+	}
+	madvise(psMap->pvMap, psMap->lMapSize, MADV_RANDOM);
+	for (iSlice = 0; iSlice < psMap->iZdim; iSlice++){
+		lFirst = (size_t)(psMap->pchPixels - pchMap) + lRowSize*((size_t)iSlice*psMap->iYdim + iStartRow);
+		lLast = lFirst + lRowSize*iNumRows;
+		lFirst -= lFirst % lPageSize;
+		madvise((void *)(pchMap + lFirst), lLast - lFirst, MADV_WILLNEED);
+	}
+#endif
+}
+
+/**
+	@brief Returns a pointer to rows [iStartRow,iStartRow+iNumRows) of one
+	slice of a mapped image.
+
+	@param pfScratch - room for iNumRows rows; only used if the pixels in
+		the file are not float aligned and have to be copied out.
+*/
+const float *pfMappedRows(MappedImage_t *psMap, int iSlice, int iStartRow, int iNumRows, float *pfScratch)
+{
+	size_t lRowSize = sizeof(float)*psMap->iXdim;
+	const unsigned char *pchRows = psMap->pchPixels + lRowSize*((size_t)iSlice*psMap->iYdim + iStartRow);
+
+	if (psMap->bAligned)
+		return (const float *)pchRows;
+	memcpy(pfScratch, pchRows, lRowSize*iNumRows);
+	return pfScratch;
+}
+
+void vUnmapImage(MappedImage_t *psMap)
+{
+#ifdef WIN32
+	if (psMap->pvMap != NULL)
+		UnmapViewOfFile(psMap->pvMap);
+#else
+	if (psMap->pvMap != NULL)
+		munmap(psMap->pvMap, psMap->lMapSize);
+#endif
+	psMap->pvMap = NULL;
+	psMap->pchPixels = NULL;
+}
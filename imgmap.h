@@ -0,0 +1,28 @@
+/*
+	imgmap.h
+
+	Read-only memory mapping of uncompressed single precision .im
+	images, so their slices can be used without going through imgio.
+
+	Include mip/imgio.h before this file.
+*/
+
+#ifndef IMGMAP_H
+#define IMGMAP_H
+
+#include <stddef.h>
+
+typedef struct {
+	void *pvMap;				// start of the mapping
+	size_t lMapSize;
+	const unsigned char *pchPixels;	// first pixel of the image
+	int iXdim, iYdim, iZdim;
+	int bAligned;				// pixels are float aligned and can be used in place
+} MappedImage_t;
+
+int iMapImage(char *pchName, IMAGE *pImage, int iXdim, int iYdim, int iZdim, float *pfScratch, MappedImage_t *psMap);
+void vAdviseMappedRows(MappedImage_t *psMap, int iStartRow, int iNumRows);
+const float *pfMappedRows(MappedImage_t *psMap, int iSlice, int iStartRow, int iNumRows, float *pfScratch);
+void vUnmapImage(MappedImage_t *psMap);
+
+#endif
@@ -0,0 +1,53 @@
+/*
+	loadimages.h
+
+	Reads of the input images that have been prepared (parameters looked
+	up, file opened and checked, output allocated) so that the reads
+	themselves can run at the same time.
+
+	Include mip/irl.h and mip/imgio.h before this file.
+*/
+
+#ifndef LOADIMAGES_H
+#define LOADIMAGES_H
+
+#define LOAD_MAX_ERROR 256
+
+typedef enum {
+	LOAD_PRJ,		// views shifted and scaled into the modified projections
+	LOAD_SLICES		// square slices of a reconstruction sized image
+} LoadKind_t;
+
+typedef struct {
+	LoadKind_t eKind;
+	char *pchWhat;			// what is loaded, for the report
+	char *pchName;			// file name
+	IMAGE *pImage;			// opened when prepared, closed after the read
+	struct PackedPrj_s *psPack;	// LOAD_PRJ: the packed projection file (prjpack.h) instead of pImage, or NULL
+	int iXdim, iYdim, iZdim;
+	int iStartSlice;		// first slice read, or first row of each view for LOAD_PRJ
+	IrlParms_t *psParms;
+	PrjView_t *psViews;		// LOAD_PRJ only
+	float fInBinWidth;		// LOAD_PRJ: width of the bins in the file (binwidth)
+	int bTryMap;			// LOAD_PRJ: read through a memory mapping if possible (mmap_prj)
+	char *pchCacheDir;		// LOAD_PRJ: directory of the modified projection cache (prj_cache_dir), or NULL
+	double dCacheMaxBytes;	// and its size limit (prj_cache_mb)
+	int bCached;			// LOAD_PRJ: the modified projections came from the cache
+	int bInitEst;			// LOAD_SLICES: replace negative pixels by the mean
+	int bSaveInitEst;		// and write the result to initest.im (save_initial_estimate)
+	struct RebinPlan_s **ppsPlans;	// LOAD_PRJ: rebin plan of each view (rebinplan.h), made by vLoadImages
+	float *pfPixels;		// the image, allocated when prepared
+	double dBytes;			// bytes read from the file
+	double dTime;			// seconds spent reading
+	int iStatus;			// 0 if the read succeeded
+	char achError[LOAD_MAX_ERROR];	// otherwise what went wrong
+} ImageLoad_t;
+
+// GetImages.c
+void vPreparePrjImage(char *pchPrjImageName, IrlParms_t *psParms, PrjView_t *psViews, ImageLoad_t *psLoad);
+void vPrepareAtnMap(char *pchAtnMapName, IrlParms_t *psParms, ImageLoad_t *psLoad);
+void vPrepareInitialEst(char *pchInitImageName, IrlParms_t *psParms, ImageLoad_t *psLoad);
+int iPrepareScatterEstimate(IrlParms_t *psParms, PrjView_t *psViews, ImageLoad_t *psLoad);
+void vLoadImages(ImageLoad_t *psLoads, int iNumLoads, int bConcurrent);
+
+#endif
@@ -1,12 +1,41 @@
 mex   -DWIN32 '-IC:\mip\include' '-LC:\mip\lib64' -llibmiputil.lib -llibcl.lib -llibirl.lib ... 
       -llibfftw3-3.lib -llibfftw3f-3.lib -llibfft-fftw3.lib -llibim.lib -llibimgio.lib  ...
-     osem.c setup.c GetImages.c MeasToModPrj.c saveitercheck.c
+     osem.c setup.c GetImages.c MeasToModPrj.c saveitercheck.c convert.c osemthreads.c session.c convergence.c batch.c server.c checkpoint.c imgmap.c prjpack.c ricecode.c prjcache.c slab.c sysmat.c
  
 
 clear; close all;
 prj=readim('prj.im');
 recon=osem('osem.par',prj);figure;imshow(recon,[]);title('recon');
 
+% repeated reconstructions with the same geometry share one setup
+h=osem('open','osem.par',size(prj));
+for k=1:3
+    recon2=osem('recon',h,prj);
+end
+osem('close',h);
+figure;imshow(recon2-recon,[]);title('session - single call');
+
+% a batch of frames, 4-D [slices,bins,views,frames] or a cell array, is reconstructed in one call
+frames=cat(4,prj,prj,prj,prj);
+h=osem('open','osem.par',size(prj));
+tic;for k=1:size(frames,4), recon3(:,:,:,k)=osem('recon',h,frames(:,:,:,k)); end;tloop=toc;
+tic;recon4=osem('recon',h,frames);tbatch=toc;
+osem('close',h);
+fprintf('loop %.2f s, batch %.2f s\n',tloop,tbatch);
+
+% iterates picked by save_int/save_iterations in osem.par come back in memory
+[recon5,info]=osem('osem.par',prj,'singleiter');
+for k=1:numel(info.iterations)
+    figure;imshow(info.iterates(:,:,end/2,k),[]);title(sprintf('iteration %d',info.iterations(k)));
+end
+figure;semilogy(info.relchange);xlabel('iteration');ylabel('relative image change');
+
+% reconstruct in the background while the next study is loaded
+job=osem('submit','osem.par',prj,'compact');  % 'compact' keeps the projection counts in 16 bits until the job runs
+prjnext=readim('prj.im');
+while ~strcmp(osem('status',job),'done'), pause(0.1); end
+[recon6,info6]=osem('fetch',job);
+
 
 
 
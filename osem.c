@@ -14,11 +14,20 @@ $Id: osem.c 106 2014-07-06 16:07:53Z frey $
 #include <mip/miputil.h>
 #include <mip/imgio.h>
 #include <mip/irl.h>
+#include <mip/osemhooks.h>
 #ifndef WIN32
 #include "buildinfo.h"
 #endif
 #include "protos.h"
 #include "saveitercheck.h"
+#include "convert.h"
+#include "convergence.h"
+#include "sysmat.h"
+#include "session.h"
+#include "osemthreads.h"
+#include "checkpoint.h"
+#include "prjpack.h"
+#include "slab.h"
 #include "mex.h"
 
 struct {
@@ -28,6 +37,15 @@ struct {
 	char *pchOutNameBuf;
 } sIterationCallbackData;
 
+// options given as strings after the images in the mex call
+typedef struct {
+	int bRowMajor;	// images have been permuted so x (bins) varies fastest
+	int bSingleOut;	// return single precision results
+	int bSingleIter;	// return the saved iterates in single precision
+	int bKeepIterates;	// keep the saved iterates of a submitted job for osem('fetch',...)
+	int bCompactPrj;	// keep the projections of a submitted job as 16 bit counts
+} MexOptions_t;
+
 
 void vSetCallBackData(int iNumPixels, int iNumSlices, char *pchOutBase);
 void vSetCallBackData(int iNumPixels, int iNumSlices, char *pchOutBase)
@@ -40,25 +58,22 @@ void vSetCallBackData(int iNumPixels, int iNumSlices, char *pchOutBase)
 	sIterationCallbackData.pchOutNameBuf = (char *)pvIrlMalloc((int)strlen(pchOutBase) + 13 + (int)strlen(IMAGE_EXTENSION), "SetCallBackData:OutNameBuf");
 }
 
+// IrlOsem writes the save_int/save_iterations images itself, so the callback only takes checkpoints
 void vIterationCallback(int iIteration, float *pfCurrentEstimate);
 void vIterationCallback(int iIteration, float *pfCurrentEstimate)
 {
-	/* 	char *pchOutName;
-	int iNumPix=sIterationCallbackData.iNumPixels;
-	int iNumSlices=sIterationCallbackData.iNumSlices;
-
-	pchOutName=sIterationCallbackData.pchOutNameBuf;
-	fprintf(stderr ,"writing output image to %s.%d%s ... ", sIterationCallbackData.pchOutBase, iIteration, IMAGE_EXTENSION);
-	sprintf(pchOutName,"%s.%d%s",sIterationCallbackData.pchOutBase, iIteration, IMAGE_EXTENSION);
-	if (bCheckIfSaveIteration(iIteration))
-	writeimage(pchOutName, iNumPix, iNumPix, iNumSlices, pfCurrentEstimate);
-	fprintf(stderr ,"done!\n"); */
+	vCheckpointIteration(iIteration, pfCurrentEstimate);
 }
 
 char *pUsageMsg(void);
 char *pUsageMsg(void)
 {
-	return("usage: osems parmfile [options] prjimage [atnmap] [initest] recon\n");
+	return("usage: osems [--resume] parmfile [options] prjimage [atnmap] [initest] recon\n"
+		"       osems --batch manifest [--workers n] [--mem megabytes] [--summary file]\n"
+		"       osems --serve socket [--workers n] [--mem megabytes]\n"
+		"       osems --client socket recon parfile prjimage atnmap|- initest|- outbase | status | shutdown\n"
+		"       osems --pack prjimage packed" PRJPACK_EXTENSION " [slices per chunk]\n"
+		"       OSEM_SLAB_TOKEN=token osems --rank host port\n");
 }
 
 /**
@@ -67,12 +82,16 @@ char *pUsageMsg(void)
 */
 int main(int iArgc, char **ppchArgv)
 {
-	int i;
+	int i, iIter, iCheckpointInt, iResumeIter = 0, bResume = FALSE;
 	float *pfPrjImage = NULL, *pfAtnMap = NULL, *pfReconImage = NULL, *pfScatterEstimate = NULL;
-	char  *pchDrfTabFile = NULL, *pchSrfKrnlFile = NULL, *pchLogFile = NULL, *pchMsgFile = NULL, *pchOutBase = NULL;
+	char  *pchDrfTabFile = NULL, *pchSrfKrnlFile = NULL, *pchLogFile = NULL, *pchMsgFile = NULL, *pchOutBase = NULL, *pchCheckpoint;
 	PrjView_t *psViews;
 	Options_t sOptions;
 	IrlParms_t sIrlParms;
+	sAdvOptions sAdvOpts;
+	StopCriteria_t sStop;
+	ReconTrace_t sTrace;
+	SlabParms_t sSlabs;
 	int iMsgLevel = 4;/* default message level*/
 
 #ifndef WIN32
@@ -105,6 +124,48 @@ int main(int iArgc, char **ppchArgv)
 		fprintf(stderr, "%s ", ppchArgv[i]);
 	fprintf(stderr, "\n\n");
 
+	if (iArgc >= 4 && strcmp(ppchArgv[1], "--pack") == 0)
+		exit(iPackPrjImage(ppchArgv[2], ppchArgv[3], iArgc >= 5 ? atoi(ppchArgv[4]) : PRJPACK_CHUNK_ROWS));
+	if (iArgc >= 4 && strcmp(ppchArgv[1], "--rank") == 0)
+		exit(iRunSlabRank(ppchArgv[2], ppchArgv[3]));
+	if (iArgc >= 4 && strcmp(ppchArgv[1], "--client") == 0)
+		exit(iRunClient(ppchArgv[2], iArgc - 3, ppchArgv + 3));
+	if (iArgc >= 3 && (strcmp(ppchArgv[1], "--batch") == 0 || strcmp(ppchArgv[1], "--serve") == 0))
+	{
+		int iNumWorkers = 0;
+		double dMemBudgetMB = 0.0;
+		char *pchSummary = NULL;
+
+		for (i = 3; i + 1 < iArgc; i += 2)
+		{
+			if (strcmp(ppchArgv[i], "--workers") == 0)
+				iNumWorkers = atoi(ppchArgv[i + 1]);
+			else if (strcmp(ppchArgv[i], "--mem") == 0)
+				dMemBudgetMB = atof(ppchArgv[i + 1]);
+			else if (strcmp(ppchArgv[i], "--summary") == 0 && strcmp(ppchArgv[1], "--batch") == 0)
+				pchSummary = ppchArgv[i + 1];
+			else
+				break;
+		}
+		if (i != iArgc)
+		{
+			fprintf(stderr, "%s", pUsageMsg());
+			exit(1);
+		}
+		vSetMsgLevel(iMsgLevel);
+		if (strcmp(ppchArgv[1], "--serve") == 0)
+			exit(iRunServer(ppchArgv[2], iNumWorkers, dMemBudgetMB));
+		exit(iRunBatch(ppchArgv[2], iNumWorkers, dMemBudgetMB, pchSummary) ? 1 : 0);
+	}
+	if (iArgc >= 2 && strcmp(ppchArgv[1], "--resume") == 0)
+	{
+		// drop the switch so the rest is parsed as a normal command line
+		bResume = TRUE;
+		ppchArgv[1] = ppchArgv[0];
+		ppchArgv++;
+		iArgc--;
+	}
+
 	if (iSetupFromCmdLine(iArgc, ppchArgv, &sIrlParms, &sOptions, &psViews,
 		&pchSrfKrnlFile, &pchDrfTabFile, &pchLogFile, &pchMsgFile, &pchOutBase,
 		&pfPrjImage, &pfAtnMap, &pfReconImage, &pfScatterEstimate, NULL, 0, pUsageMsg))
@@ -119,10 +180,47 @@ int main(int iArgc, char **ppchArgv)
 
 	PrintTimes("Start IrlOsem");
 
-	i = IrlOsem(&sIrlParms, &sOptions, psViews, pchDrfTabFile, pchSrfKrnlFile, vIterationCallback, pfScatterEstimate, pfAtnMap, pfPrjImage, pfReconImage, pchLogFile, pchMsgFile);
+	vGetCmdLineRunOpts(&sAdvOpts, &sStop, &iCheckpointInt);
+	vGetCmdLineSlabParms(&sSlabs);
+	pchCheckpoint = (char *)pvIrlMalloc((int)strlen(pchOutBase) + (int)strlen(CHECKPOINT_EXTENSION) + 1, "main:pchCheckpoint");
+	sprintf(pchCheckpoint, "%s%s", pchOutBase, CHECKPOINT_EXTENSION);
+	if (bResume)
+	{
+		// continue after the checkpointed iteration, with its estimate as the initial estimate
+		iResumeIter = iReadCheckpoint(pchCheckpoint, &sIrlParms, pfReconImage);
+		if (iResumeIter > 0)
+		{
+			sOptions.bReconIsInitEst = TRUE;
+			sAdvOpts.iStartIteration = iResumeIter + 1;
+		}
+		else
+			fprintf(stderr, "no checkpoint %s, starting from the beginning\n", pchCheckpoint);
+	}
+	// the slabs are reconstructed on their own, so there is no estimate of the whole volume to checkpoint
+	if (sSlabs.iNumSlabs <= 1)
+		vStartCheckpoints(pchCheckpoint, iCheckpointInt, &sIrlParms);
+	else if (iCheckpointInt > 0)
+		fprintf(stderr, "checkpoint_int is ignored with %d slabs\n", sSlabs.iNumSlabs);
+
+	sTrace.pdRelChange = (double *)pvIrlMalloc(sizeof(double)*(sIrlParms.NumIterations + 1), "main:pdRelChange");
+	if (sSlabs.iNumSlabs > 1)
+	{
+		// the slabs are reconstructed on their own, so there is no per-iteration trace or checkpoint of the volume
+		i = iSlabOsem(&sSlabs, &sIrlParms, &sOptions, &sAdvOpts, psViews, pchDrfTabFile, pchSrfKrnlFile, pfScatterEstimate, pfAtnMap, pfPrjImage, pfReconImage, &sStop);
+		sTrace.iNumIterations = 0;
+	}
+	else
+		i = iOsemWithStop(&sIrlParms, &sOptions, &sAdvOpts, psViews, pchDrfTabFile, pchSrfKrnlFile, vIterationCallback, pfScatterEstimate, pfAtnMap, pfPrjImage, pfReconImage, pchLogFile, pchMsgFile, &sStop, &sTrace);
 	vSetMsgFilePtr(3, stderr);	// has to reset since it was set to NULL or msg_file in IrlOsem 
+	vStopCheckpoints(i == 0);
 	PrintTimes("Done");
 
+	if (sSlabs.iNumSlabs <= 1)
+		fprintf(stderr, "relative image change per iteration (%d of %d iterations done):\n", iResumeIter + sTrace.iNumIterations, sIrlParms.NumIterations);
+	for (iIter = 0; iIter < sTrace.iNumIterations; iIter++)
+		fprintf(stderr, "  %d %.6g\n", iResumeIter + iIter + 1, sTrace.pdRelChange[iIter]);
+	IrlFree(sTrace.pdRelChange);
+
 	fprintf(stderr, "sum of pfRecn after IrlOsem=%.4g (%d x %d x %d)\n", sum_float(pfReconImage, sIrlParms.NumPixels*sIrlParms.NumPixels*sIrlParms.NumSlices), sIrlParms.NumPixels, sIrlParms.NumPixels, sIrlParms.NumSlices);
 	if (i)
 		fprintf(stderr, "fatal error in IrlOsem: ErrNum=%d\n      %s", i, pchIrlErrorString());
@@ -132,6 +230,7 @@ int main(int iArgc, char **ppchArgv)
 	IrlFree(sIterationCallbackData.pchOutNameBuf);
 	IrlFree(psViews);
 	IrlFree(pchOutBase);
+	IrlFree(pchCheckpoint);
 	IrlFree(pfPrjImage);
 	IrlFree(pfReconImage);
 	if (pfAtnMap) IrlFree(pfAtnMap);
@@ -168,19 +267,19 @@ int exists(const char *fname)
 	return 0;
 }
 
-void vGetmxImageSizesForRecon(mxArray *prjImg, IrlParms_t *psParms)
+void vGetmxImageSizesForRecon(const mxArray *prjImg, IrlParms_t *psParms, int bRowMajor)
 {
 	int iXdim, iYdim, iZdim;
 	int bFound;
 	int ndim = mxGetNumberOfDimensions(prjImg);
 	const mwSize *dims = mxGetDimensions(prjImg);
 
-	if (ndim != 3)
+	if (ndim != 3 && ndim != 4)
 		vErrorHandler(ECLASS_FATAL, ETYPE_ILLEGAL_VALUE, "vGetmxImageSizesForPrj",
-		"Image Dimension = %d. The input activity image should be 3D", ndim);
+		"Image Dimension = %d. The input projection image should be 3D, or 4D for several frames", ndim);
 
-	psParms->NumSlices = dims[0]; // The slice selection in the parameter file is disabled.
-	psParms->NumPixels = dims[1];
+	psParms->NumSlices = dims[bRowMajor ? 1 : 0]; // The slice selection in the parameter file is disabled.
+	psParms->NumPixels = dims[bRowMajor ? 0 : 1];
 	psParms->NumViews = dims[2];
 }
 
@@ -197,301 +296,981 @@ mxArray* mxScale(const mxArray*input, const double scaler)
 }
 
 
-float* ToFloatArray(const mxArray* input, const double scale)
+static PixType_t eGetPixType(const mxArray* input)
 {
-	float* output;
-	int i;
-	mwSize ndim = mxGetNumberOfDimensions(input);
-	mwSize *tdims = mxGetDimensions(input);
-	unsigned int numel = mxGetNumberOfElements(input);
+	switch (mxGetClassID(input))
+	{
+	case mxDOUBLE_CLASS:	return PIX_DOUBLE;
+	case mxSINGLE_CLASS:	return PIX_SINGLE;
+	case mxINT8_CLASS:		return PIX_INT8;
+	case mxUINT8_CLASS:		return PIX_UINT8;
+	case mxINT16_CLASS:		return PIX_INT16;
+	case mxUINT16_CLASS:	return PIX_UINT16;
+	case mxINT32_CLASS:		return PIX_INT32;
+	case mxUINT32_CLASS:	return PIX_UINT32;
+	case mxINT64_CLASS:		return PIX_INT64;
+	case mxUINT64_CLASS:	return PIX_UINT64;
+	default:
+		mexErrMsgTxt("The class of input array is not numerical.");
+	}
+	return PIX_DOUBLE;
+}
 
-	output = pvLocalMalloc(numel*sizeof(float), "ToFloatArray:output");
+// Gets the sizes of the slices to transpose. With bRowMajor the input has
+// already been permuted so x varies fastest and the slices are just copied.
+static void vGetConvertDims(const mxArray* input, int bRowMajor, int *piRows, int *piCols, int *piSlices)
+{
+	mwSize ndim = mxGetNumberOfDimensions(input);
+	const mwSize *tdims = mxGetDimensions(input);
 
-	mwSize dims[3];
-	dims[0] = tdims[0];
-	dims[1] = tdims[1];
 	if (ndim == 2)
-	{
-		dims[2] = 1;
-	}
+		*piSlices = 1;
 	else if (ndim == 3)
-	{
-		dims[2] = tdims[2];
-	}
+		*piSlices = (int)tdims[2];
 	else
 		mexErrMsgTxt("Input image matrix must be 2d or 3d.");
+	if (bRowMajor){
+		*piRows = 1;
+		*piCols = (int)(tdims[0] * tdims[1]);
+	}
+	else{
+		*piRows = (int)tdims[0];
+		*piCols = (int)tdims[1];
+	}
+}
 
+// Converts the input to a newly allocated row-major float array multiplied by scale.
+float* ToFloatArray(const mxArray* input, const double scale, int bRowMajor)
+{
+	float* output;
+	int iRows, iCols, iSlices;
+	unsigned int numel = mxGetNumberOfElements(input);
+	PixType_t ePixType = eGetPixType(input);
 
-	switch (mxGetClassID(input))
-	{
-	case mxDOUBLE_CLASS:
-	{
-						   double* inptr = (double*)mxGetData(input);
-						   i = 0;
-						   //Reorder the matrix into row major.
-						   for (int s = 0; s < dims[2]; s++)
-						   for (int n = 0; n < dims[1]; n++)
-						   for (int m = 0; m < dims[0]; m++)
-						   {
-							   output[s*dims[0] * dims[1] + m*dims[1] + n] = inptr[i]*scale;
-							   i++;
-						   }
-						   break;
-	}
-	case mxSINGLE_CLASS:
-	{
-						   float *inptr = (float*)mxGetData(input);
-						   i = 0;
-						   //Reorder the matrix into row major.
-						   for (int s = 0; s < dims[2]; s++)
-						   for (int n = 0; n < dims[1]; n++)
-						   for (int m = 0; m < dims[0]; m++)
-						   {
-							   output[s*dims[0] * dims[1] + m*dims[1] + n] = inptr[i]*scale;
-							   i++;
-						   }
-						   break;
-	}
-	case mxINT8_CLASS:
-	{
-						 signed char* inptr = (signed char*)mxGetData(input);
-						 i = 0;
-						 //Reorder the matrix into row major.
-						 for (int s = 0; s < dims[2]; s++)
-						 for (int n = 0; n < dims[1]; n++)
-						 for (int m = 0; m < dims[0]; m++)
-						 {
-							 output[s*dims[0] * dims[1] + m*dims[1] + n] = inptr[i]*scale;
-							 i++;
-						 }
-						 break;
-	}
-	case mxUINT8_CLASS:
-	{
-						  unsigned char* inptr = (unsigned char*)mxGetData(input);
-						  i = 0;
-						  //Reorder the matrix into row major.
-						  for (int s = 0; s < dims[2]; s++)
-						  for (int n = 0; n < dims[1]; n++)
-						  for (int m = 0; m < dims[0]; m++)
-						  {
-							  output[s*dims[0] * dims[1] + m*dims[1] + n] = inptr[i]*scale;
-							  i++;
-						  }
-						  break;
-	}
-	case mxINT16_CLASS:
-	{
-						  short int* inptr = (short int*)mxGetData(input);
-						  i = 0;
-						  //Reorder the matrix into row major.
-						  for (int s = 0; s < dims[2]; s++)
-						  for (int n = 0; n < dims[1]; n++)
-						  for (int m = 0; m < dims[0]; m++)
-						  {
-							  output[s*dims[0] * dims[1] + m*dims[1] + n] = inptr[i]*scale;
-							  i++;
-						  }
-						  break;
-	}
-	case mxUINT16_CLASS:
-	{
-						   unsigned short int* inptr = (unsigned short int*)mxGetData(input);
-						   i = 0;
-						   //Reorder the matrix into row major.
-						   for (int s = 0; s < dims[2]; s++)
-						   for (int n = 0; n < dims[1]; n++)
-						   for (int m = 0; m < dims[0]; m++)
-						   {
-							   output[s*dims[0] * dims[1] + m*dims[1] + n] = inptr[i]*scale;
-							   i++;
-						   }
-						   break;
-	}
-	case mxINT32_CLASS:
-	{
-						  int* inptr = (int*)mxGetData(input);
-						  i = 0;
-						  //Reorder the matrix into row major.
-						  for (int s = 0; s < dims[2]; s++)
-						  for (int n = 0; n < dims[1]; n++)
-						  for (int m = 0; m < dims[0]; m++)
-						  {
-							  output[s*dims[0] * dims[1] + m*dims[1] + n] = inptr[i]*scale;
-							  i++;
-						  }
-						  break;
-	}
-	case mxUINT32_CLASS:
-	{
-						   unsigned int* inptr = (unsigned int*)mxGetData(input);
-						   i = 0;
-						   //Reorder the matrix into row major.
-						   for (int s = 0; s < dims[2]; s++)
-						   for (int n = 0; n < dims[1]; n++)
-						   for (int m = 0; m < dims[0]; m++)
-						   {
-							   output[s*dims[0] * dims[1] + m*dims[1] + n] = inptr[i]*scale;
-							   i++;
-						   }
-						   break;
-	}
-
-	case mxINT64_CLASS:
-	{
-						  int64_T* inptr = (int64_T*)mxGetData(input);
-						  i = 0;
-						  //Reorder the matrix into row major.
-						  for (int s = 0; s < dims[2]; s++)
-						  for (int n = 0; n < dims[1]; n++)
-						  for (int m = 0; m < dims[0]; m++)
-						  {
-							  output[s*dims[0] * dims[1] + m*dims[1] + n] = inptr[i]*scale;
-							  i++;
-						  }
-						  break;
-	}
-	case mxUINT64_CLASS:
-	{
-						   uint64_T* inptr = (uint64_T*)mxGetData(input);
-						   i = 0;
-						   //Reorder the matrix into row major.
-						   for (int s = 0; s < dims[2]; s++)
-						   for (int n = 0; n < dims[1]; n++)
-						   for (int m = 0; m < dims[0]; m++)
-						   {
-							   output[s*dims[0] * dims[1] + m*dims[1] + n] = inptr[i]*scale;
-							   i++;
-						   }
-						   break;
+	vGetConvertDims(input, bRowMajor, &iRows, &iCols, &iSlices);
+	output = pvLocalMalloc(numel*sizeof(float), "ToFloatArray:output");
+	vConvertToRowMajor(mxGetData(input), ePixType, iRows, iCols, iSlices, scale, output);
+	return output;
+}
+
+// Same as ToFloatArray(input, 1.0, bRowMajor) for inputs that are only read. When
+// the input is single precision and already in row-major order its data is
+// returned directly and *pbOwned is set to FALSE, so it must not be freed.
+float* ToFloatArrayView(const mxArray* input, int bRowMajor, int *pbOwned)
+{
+	int iRows, iCols, iSlices;
+
+	vGetConvertDims(input, bRowMajor, &iRows, &iCols, &iSlices);
+	if (bConvertIsIdentity(eGetPixType(input), iRows, iCols, 1.0)){
+		*pbOwned = FALSE;
+		return (float *)mxGetData(input);
 	}
+	*pbOwned = TRUE;
+	return ToFloatArray(input, 1.0, bRowMajor);
+}
 
-	default:
-		mexErrMsgTxt("The class of input array is not numerical.");
-		break;
+// Removes the option strings at the end of the argument list and returns
+// the number of arguments that remain.
+static int iGetMexOptions(int nrhs, const mxArray *prhs[], MexOptions_t *psMexOpts)
+{
+	char achOpt[32];
+
+	memset(psMexOpts, 0, sizeof(MexOptions_t));
+	while (nrhs > 2 && mxIsChar(prhs[nrhs - 1])){
+		if (mxGetString(prhs[nrhs - 1], achOpt, sizeof(achOpt)))
+			mexErrMsgTxt("Invalid option string.");
+		if (strcmp(achOpt, "rowmajor") == 0)
+			psMexOpts->bRowMajor = TRUE;
+		else if (strcmp(achOpt, "single") == 0)
+			psMexOpts->bSingleOut = TRUE;
+		else if (strcmp(achOpt, "singleiter") == 0)
+			psMexOpts->bSingleIter = TRUE;
+		else if (strcmp(achOpt, "iterates") == 0)
+			psMexOpts->bKeepIterates = TRUE;
+		else if (strcmp(achOpt, "compact") == 0)
+			psMexOpts->bCompactPrj = TRUE;
+		else
+			mexErrMsgIdAndTxt("osem:option", "Unknown option '%s'.", achOpt);
+		nrhs--;
 	}
+	return nrhs;
+}
 
-	return output;
+// Sessions opened with osem('open',...). A handle is the index in the table plus one.
+static OsemSession_t **ppsgSessions = NULL;
+static int isgMaxSessions = 0;
+static int isgNumOpenSessions = 0;
+
+static void vCancelAllJobs(void);
+
+static void vCloseAllSessions(void)
+{
+	int i;
+
+	vCancelAllJobs();
+	for (i = 0; i < isgMaxSessions; i++)
+		vCloseSession(ppsgSessions[i]);
+	free(ppsgSessions);
+	ppsgSessions = NULL;
+	isgMaxSessions = isgNumOpenSessions = 0;
 }
 
+static int iAddSession(OsemSession_t *psSession)
+{
+	int i;
 
-// The matlab interface function
- void mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[])
-{ // recon=osems("osem.par",prj,[atnmap],[initest])
-	if (nrhs<2 || nrhs>4 || !mxIsChar(prhs[0])){
-		mexErrMsgTxt("Invalid input. \nUsage:prjimg=genprj('genprj.par',actimg,[atnmap])");
+	for (i = 0; i < isgMaxSessions && ppsgSessions[i] != NULL; i++)
+		;
+	if (i == isgMaxSessions)
+	{
+		isgMaxSessions = isgMaxSessions ? 2 * isgMaxSessions : 8;
+		ppsgSessions = (OsemSession_t **)realloc(ppsgSessions, isgMaxSessions*sizeof(OsemSession_t *));
+		if (ppsgSessions == NULL)
+			mexErrMsgTxt("Unable to allocate the session table.");
+		memset(ppsgSessions + i, 0, (isgMaxSessions - i)*sizeof(OsemSession_t *));
+	}
+	ppsgSessions[i] = psSession;
+	// keep the mex file, and the sessions, in memory while any session is open
+	if (isgNumOpenSessions++ == 0)
+	{
+		mexLock();
+		mexAtExit(vCloseAllSessions);
 	}
+	return i + 1;
+}
 
+static int iGetSessionHandle(const mxArray *handle)
+{
+	int iHandle;
+
+	if (!mxIsNumeric(handle) || mxGetNumberOfElements(handle) != 1)
+		mexErrMsgTxt("Invalid session handle.");
+	iHandle = (int)mxGetScalar(handle);
+	if (iHandle < 1 || iHandle > isgMaxSessions || ppsgSessions[iHandle - 1] == NULL)
+		mexErrMsgIdAndTxt("osem:handle", "No open session with handle %d.", iHandle);
+	return iHandle;
+}
 
-	IrlParms_t sIrlParms;
-	Options_t sOptions;
-	PrjView_t *psViews;
-	float *pfPrjImage = NULL, *pfAtnMap = NULL, *pfActImage = NULL, *pfScatterEstimate = NULL;
-	char *pchDrfTabFile = NULL, *pchSrfKrnlFile = NULL, *pchLogFile = NULL, *pchMsgFile = NULL, *paraFileName = NULL,*pchPrjImageName=NULL;
-	float fPrimaryFac = 1;
-	int iMsgLevel = 4, bFound, bModelAtn = 0, bModelSrf = 0, bModelDrf = 0;
+static void vRemoveSession(int iHandle)
+{
+	vCloseSession(ppsgSessions[iHandle - 1]);
+	ppsgSessions[iHandle - 1] = NULL;
+	if (--isgNumOpenSessions == 0)
+		mexUnlock();
+}
 
+static char *pchGetParmFileName(const mxArray *name)
+{
+	char *paraFileName;
 
-	long m = mxGetM(prhs[0]); long n = mxGetN(prhs[0]);
+	if (!mxIsChar(name))
+		mexErrMsgTxt("Invalid input. The parameter file name must be a string.");
+	long n = mxGetN(name);
 	paraFileName = (char*)mxCalloc(n + 1, sizeof(char));
-	int status = mxGetString(prhs[0], paraFileName, n + 1);
+	int status = mxGetString(name, paraFileName, n + 1);
 	if (status != 0)
 		mexErrMsgTxt("Failed to get the parameter file name! \n");
 	if (!exists(paraFileName))
 		mexErrMsgTxt("Parameter file does not exist! \n");
+	return paraFileName;
+}
 
-	vReadParmsFile(paraFileName);
-	iMsgLevel = iGetIntParm("debug_level", &bFound, iMsgLevel);
-	vSetMsgLevel(iMsgLevel);
+// Everything the frame workers need, taken from the mxArrays on the MATLAB thread.
+typedef struct {
+	OsemSession_t *psSession;
+	int bSingleOut;
+	int bRowMajor;
+	const void **ppvPrjFrames;	// projection data of each frame
+	PixType_t *pePrjTypes;
+	double *pdCountScales;		// NULL, or for each frame the scale of its 16 bit counts, 0 if it is kept in float
+	int iPrjRows, iPrjCols;
+	double dPrjScale;			// the projections are multiplied by this, the number of views unless already done
+	float *pfAtnMap;
+	const void *pvInitEst;		// NULL if there is no initial estimate
+	PixType_t eInitType;
+	void *pvOut;				// output, all frames; float or double
+	void *pvIterates;			// saved iterates, all frames, or NULL; float if bSingleIter
+	int bSingleIter;
+	int iNumSaved;				// saved iterates per frame
+	double *pdRelChange;		// relative image change, NumIterations per frame, or NULL
+	int *piNumIterations;		// iterations done in each frame
+	int *piErrNums;
+	volatile int *pbCancel;		// NULL, or set to stop the frames at the next check
+	int iNumSlots;				// buffers for the frames being reconstructed, one per frame worker
+	float **ppfPrjSlots;
+	float **ppfActSlots;		// NULL in single mode, where the output array is used
+	int *pbSlotBusy;
+	OsemMutex_t sSlotMutex;
+} MexFrames_t;
+
+// Where the iterates of one frame that the save_int/save_iterations schedule picks are copied to.
+typedef struct {
+	int iNumPixels, iNumSlices;
+	int bSingle, bRowMajor;
+	void *pvIterates;	// [P,P,S,iMaxSaved] in the mex output, float or double
+	int iMaxSaved;
+	int iNumSaved;
+} IterCapture_t;
+
+// Copies the estimate into the preallocated iterates output, so nothing is allocated or written to disk per iteration.
+static void vCaptureIteration(void *pvCapture, int iIteration, float *pfCurrentEstimate)
+{
+	IterCapture_t *psCapture = (IterCapture_t *)pvCapture;
+	int iNumPixels = psCapture->iNumPixels;
+	size_t lNumVoxels = (size_t)iNumPixels*iNumPixels*psCapture->iNumSlices;
+
+	if (!bCheckIfSaveIteration(iIteration) || psCapture->iNumSaved >= psCapture->iMaxSaved)
+		return;
+	if (psCapture->bSingle)
+	{
+		float *pfOut = (float *)psCapture->pvIterates + psCapture->iNumSaved*lNumVoxels;
+		memcpy(pfOut, pfCurrentEstimate, sizeof(float)*lNumVoxels);
+		if (!psCapture->bRowMajor)
+			vTransposeSquareSlices(pfOut, iNumPixels, psCapture->iNumSlices);
+	}
+	else
+	{
+		double *pdOut = (double *)psCapture->pvIterates + psCapture->iNumSaved*lNumVoxels;
+		if (psCapture->bRowMajor)
+			vConvertToColMajorDouble(pfCurrentEstimate, 1, iNumPixels*iNumPixels, psCapture->iNumSlices, pdOut);
+		else
+			vConvertToColMajorDouble(pfCurrentEstimate, iNumPixels, iNumPixels, psCapture->iNumSlices, pdOut);
+	}
+	psCapture->iNumSaved++;
+}
 
+// Gets the projection data of each frame from a 3-D image, a 4-D array of images
+// (frame is the last index) or a cell array of 3-D images and returns the number of frames.
+static int iGetPrjFrames(const mxArray *prjImg, int bRowMajor, IrlParms_t *psSizes, const void ***pppvFrames, PixType_t **ppeTypes)
+{
+	int iFrame, iNumFrames;
+	IrlParms_t sFrameSizes;
+	const mxArray *frame;
+
+	if (mxIsCell(prjImg))
+		iNumFrames = (int)mxGetNumberOfElements(prjImg);
+	else if (mxGetNumberOfDimensions(prjImg) == 4)
+		iNumFrames = (int)mxGetDimensions(prjImg)[3];
+	else
+		iNumFrames = 1;
+	if (iNumFrames < 1)
+		mexErrMsgTxt("No projection data.");
 
+	*pppvFrames = (const void **)mxCalloc(iNumFrames, sizeof(void *));
+	*ppeTypes = (PixType_t *)mxCalloc(iNumFrames, sizeof(PixType_t));
+	for (iFrame = 0; iFrame < iNumFrames; iFrame++)
+	{
+		if (mxIsCell(prjImg))
+		{
+			frame = mxGetCell(prjImg, iFrame);
+			if (frame == NULL || mxGetNumberOfDimensions(frame) != 3)
+				mexErrMsgIdAndTxt("osem:frame", "Frame %d is not a 3-D projection image.", iFrame + 1);
+			vGetmxImageSizesForRecon(frame, iFrame ? &sFrameSizes : psSizes, bRowMajor);
+			if (iFrame && (sFrameSizes.NumSlices != psSizes->NumSlices || sFrameSizes.NumPixels != psSizes->NumPixels || sFrameSizes.NumViews != psSizes->NumViews))
+				mexErrMsgIdAndTxt("osem:frame", "Frame %d has a different size than the first frame.", iFrame + 1);
+			(*pppvFrames)[iFrame] = mxGetData(frame);
+			(*ppeTypes)[iFrame] = eGetPixType(frame);
+		}
+		else
+		{
+			if (iFrame == 0)
+				vGetmxImageSizesForRecon(prjImg, psSizes, bRowMajor);
+			(*pppvFrames)[iFrame] = (const char *)mxGetData(prjImg) +
+				(size_t)iFrame*psSizes->NumSlices*psSizes->NumPixels*psSizes->NumViews*mxGetElementSize(prjImg);
+			(*ppeTypes)[iFrame] = eGetPixType(prjImg);
+		}
+	}
+	return iNumFrames;
+}
+
+// Converts the initial estimate into the image IrlOsem starts from.
+static void vGetInitEst(const MexFrames_t *psFrames, float *pfActImage)
+{
+	int iNumPixels = psFrames->psSession->sIrlParms.NumPixels;
 
-	vGetEffectsToModel(&bModelAtn, &bModelDrf, &bModelSrf);
-	sOptions.bModelDrf = bModelDrf;
+	vConvertToRowMajor(psFrames->pvInitEst, psFrames->eInitType, psFrames->bRowMajor ? 1 : iNumPixels,
+		psFrames->bRowMajor ? iNumPixels*iNumPixels : iNumPixels, psFrames->psSession->sIrlParms.NumSlices, 1.0, pfActImage);
+}
 
+// Allocates the buffers of the frame workers on the calling thread, so the workers allocate nothing.
+static void vAllocFrameSlots(MexFrames_t *psFrames, int iNumFrames)
+{
+	IrlParms_t *psIrlParms = &psFrames->psSession->sIrlParms;
+	size_t lNumVoxels = (size_t)psIrlParms->NumPixels*psIrlParms->NumPixels*psIrlParms->NumSlices;
+	size_t lPrjSize = (size_t)psIrlParms->NumSlices*psIrlParms->NumPixels*psIrlParms->NumViews;
+	int i;
 
-	vGetmxImageSizesForRecon(prhs[1], &sIrlParms);
-	vGetParms(&sIrlParms, &sOptions, 0);
+	psFrames->iNumSlots = psFrames->psSession->iNumFrameWorkers < iNumFrames ? psFrames->psSession->iNumFrameWorkers : iNumFrames;
+	psFrames->ppfPrjSlots = (float **)pvIrlMalloc(psFrames->iNumSlots*sizeof(float *), "AllocFrameSlots:ppfPrjSlots");
+	psFrames->pbSlotBusy = (int *)pvIrlMalloc(psFrames->iNumSlots*sizeof(int), "AllocFrameSlots:pbSlotBusy");
+	psFrames->ppfActSlots = NULL;
+	if (!psFrames->bSingleOut)
+		psFrames->ppfActSlots = (float **)pvIrlMalloc(psFrames->iNumSlots*sizeof(float *), "AllocFrameSlots:ppfActSlots");
+	for (i = 0; i < psFrames->iNumSlots; i++)
+	{
+		psFrames->ppfPrjSlots[i] = (float *)pvIrlMalloc(sizeof(float)*lPrjSize, "AllocFrameSlots:pfPrjImage");
+		if (psFrames->ppfActSlots != NULL)
+			psFrames->ppfActSlots[i] = (float *)pvIrlMalloc(sizeof(float)*lNumVoxels, "AllocFrameSlots:pfActImage");
+		psFrames->pbSlotBusy[i] = FALSE;
+	}
+	vInitMutex(&psFrames->sSlotMutex);
+}
 
+static void vFreeFrameSlots(MexFrames_t *psFrames)
+{
+	int i;
 
-	if (bModelAtn || bModelSrf){
-		if (nrhs < 3)
-			mexErrMsgTxt("\n The attenuation map must be provided to model attenuation or scatter. \n");
-		//Todo: check the size of attenuation map
-		pfAtnMap = ToFloatArray(prhs[2],1.0);
+	if (psFrames->ppfPrjSlots == NULL)
+		return;
+	for (i = 0; i < psFrames->iNumSlots; i++)
+	{
+		IrlFree(psFrames->ppfPrjSlots[i]);
+		if (psFrames->ppfActSlots != NULL)
+			IrlFree(psFrames->ppfActSlots[i]);
 	}
+	IrlFree(psFrames->ppfPrjSlots);
+	if (psFrames->ppfActSlots != NULL)
+		IrlFree(psFrames->ppfActSlots);
+	IrlFree(psFrames->pbSlotBusy);
+	vDestroyMutex(&psFrames->sSlotMutex);
+	psFrames->ppfPrjSlots = NULL;
+	psFrames->ppfActSlots = NULL;
+	psFrames->pbSlotBusy = NULL;
+	psFrames->iNumSlots = 0;
+}
+
+// Takes a free slot; there are as many as frame workers, so one is always free.
+static int iTakeFrameSlot(MexFrames_t *psFrames)
+{
+	int i;
+
+	vLockMutex(&psFrames->sSlotMutex);
+	for (i = 0; i < psFrames->iNumSlots - 1 && psFrames->pbSlotBusy[i]; i++)
+		;
+	psFrames->pbSlotBusy[i] = TRUE;
+	vUnlockMutex(&psFrames->sSlotMutex);
+	return i;
+}
 
-	psViews = psSetupPrjViews(&sIrlParms);
-	sIrlParms.pchNormImageBase = NULL;
-	pfPrjImage = ToFloatArray(prhs[1],sIrlParms.NumViews);
+static void vReleaseFrameSlot(MexFrames_t *psFrames, int iSlot)
+{
+	vLockMutex(&psFrames->sSlotMutex);
+	psFrames->pbSlotBusy[iSlot] = FALSE;
+	vUnlockMutex(&psFrames->sSlotMutex);
+}
 
+// Converts, reconstructs and returns one frame. Runs on the frame workers, so no mx calls or allocations in here.
+static void vReconFrame(void *pvFrames, int iFrame)
+{
+	MexFrames_t *psFrames = (MexFrames_t *)pvFrames;
+	IrlParms_t *psIrlParms = &psFrames->psSession->sIrlParms;
+	int iNumPixels = psIrlParms->NumPixels, iNumSlices = psIrlParms->NumSlices;
+	size_t lNumVoxels = (size_t)iNumPixels*iNumPixels*iNumSlices;
+	float *pfPrjImage, *pfActImage;
+	IterCapture_t sCapture;
+	ReconTrace_t sTrace;
+	int iSlot;
+
+	if (psFrames->pbCancel != NULL && *psFrames->pbCancel)
+		return;
+	iSlot = iTakeFrameSlot(psFrames);
+	pfPrjImage = psFrames->ppfPrjSlots[iSlot];
+	if (psFrames->pdCountScales != NULL && psFrames->pdCountScales[iFrame] > 0.0)
+		vUnpackCounts((const uint16_t *)psFrames->ppvPrjFrames[iFrame], psIrlParms->NumSlices*psIrlParms->NumPixels, psIrlParms->NumViews,
+			psFrames->pdCountScales[iFrame], pfPrjImage);
+	else
+		vConvertToRowMajor(psFrames->ppvPrjFrames[iFrame], psFrames->pePrjTypes[iFrame], psFrames->iPrjRows, psFrames->iPrjCols, psIrlParms->NumViews, psFrames->dPrjScale, pfPrjImage);
+
+	// in single mode IrlOsem reconstructs directly into the output array, which is transposed in place afterwards
+	if (psFrames->bSingleOut)
+		pfActImage = (float *)psFrames->pvOut + iFrame*lNumVoxels;
+	else
+		pfActImage = psFrames->ppfActSlots[iSlot];
+	if (psFrames->pvInitEst != NULL)
+		vGetInitEst(psFrames, pfActImage);
+
+	if (psFrames->pvIterates != NULL)
+	{
+		sCapture.iNumPixels = iNumPixels;
+		sCapture.iNumSlices = iNumSlices;
+		sCapture.bSingle = psFrames->bSingleIter;
+		sCapture.bRowMajor = psFrames->bRowMajor;
+		sCapture.iMaxSaved = psFrames->iNumSaved;
+		sCapture.iNumSaved = 0;
+		sCapture.pvIterates = (char *)psFrames->pvIterates + iFrame*psFrames->iNumSaved*lNumVoxels*(psFrames->bSingleIter ? sizeof(float) : sizeof(double));
+	}
+	if (psFrames->pdRelChange != NULL)
+		sTrace.pdRelChange = psFrames->pdRelChange + (size_t)iFrame*psIrlParms->NumIterations;
+	psFrames->piErrNums[iFrame] = iSessionRecon(psFrames->psSession, pfPrjImage, psFrames->pfAtnMap, pfActImage, psFrames->pvInitEst != NULL,
+		psFrames->pvIterates != NULL ? vCaptureIteration : NULL, &sCapture, psFrames->pdRelChange != NULL ? &sTrace : NULL, psFrames->pbCancel);
+	psFrames->piNumIterations[iFrame] = psFrames->pdRelChange != NULL ? sTrace.iNumIterations : psIrlParms->NumIterations;
+
+	// Generate the output reconstructed image. With 'rowmajor' it is returned in the IRL order, x varying fastest.
+	if (psFrames->bSingleOut)
+	{
+		if (!psFrames->bRowMajor)
+			vTransposeSquareSlices(pfActImage, iNumPixels, iNumSlices);
+	}
+	else
+	{
+		double *pdOut = (double *)psFrames->pvOut + iFrame*lNumVoxels;
+		if (psFrames->bRowMajor)
+			vConvertToColMajorDouble(pfActImage, 1, iNumPixels*iNumPixels, iNumSlices, pdOut);
+		else
+			vConvertToColMajorDouble(pfActImage, iNumPixels, iNumPixels, iNumSlices, pdOut);
+	}
+	vReleaseFrameSlot(psFrames, iSlot);
+}
 
-	if (nrhs == 4)
+// Checks the inputs against the session and points psFrames at their data. The attenuation map is
+// converted, or used in place if *pbAtnMapOwned is returned FALSE. Returns the number of frames.
+static int iPrepareFrames(OsemSession_t *psSession, const MexOptions_t *psMexOpts, const mxArray *prjImg, const mxArray *atnMap, const mxArray *initEst, MexFrames_t *psFrames, int *pbAtnMapOwned)
+{
+	IrlParms_t sPrjSizes;
+	int iNumFrames;
+	int iNumPixels = psSession->sIrlParms.NumPixels;
+	int iNumSlices = psSession->sIrlParms.NumSlices;
+
+	memset(psFrames, 0, sizeof(MexFrames_t));
+	psFrames->psSession = psSession;
+	psFrames->bSingleOut = psMexOpts->bSingleOut;
+	psFrames->bRowMajor = psMexOpts->bRowMajor;
+	psFrames->dPrjScale = psSession->sIrlParms.NumViews;
+	*pbAtnMapOwned = TRUE;
+
+	iNumFrames = iGetPrjFrames(prjImg, psMexOpts->bRowMajor, &sPrjSizes, &psFrames->ppvPrjFrames, &psFrames->pePrjTypes);
+	if (sPrjSizes.NumSlices != iNumSlices || sPrjSizes.NumPixels != iNumPixels || sPrjSizes.NumViews != psSession->sIrlParms.NumViews)
+		mexErrMsgIdAndTxt("osem:size", "Projection data (%d slices, %d bins, %d views) do not match the session (%d slices, %d bins, %d views).",
+			sPrjSizes.NumSlices, sPrjSizes.NumPixels, sPrjSizes.NumViews, iNumSlices, iNumPixels, psSession->sIrlParms.NumViews);
+	if (psMexOpts->bRowMajor)
 	{
-		pfActImage = ToFloatArray(prhs[3],1.0);
-		sOptions.bReconIsInitEst = TRUE;
+		psFrames->iPrjRows = 1;
+		psFrames->iPrjCols = sPrjSizes.NumPixels*sPrjSizes.NumSlices;
 	}
 	else
 	{
-		sOptions.bReconIsInitEst = FALSE;
-		pfActImage = (float *)pvIrlMalloc(sizeof(float)*sIrlParms.NumPixels*sIrlParms.NumPixels*sIrlParms.NumSlices, "mexfunction: pfActImage");
+		psFrames->iPrjRows = sPrjSizes.NumSlices;
+		psFrames->iPrjCols = sPrjSizes.NumPixels;
+	}
+
+	if (psSession->bModelAtn || psSession->bModelSrf){
+		if (atnMap == NULL)
+			mexErrMsgTxt("\n The attenuation map must be provided to model attenuation or scatter. \n");
+		if (mxGetNumberOfElements(atnMap) != (size_t)iNumPixels*iNumPixels*iNumSlices)
+			mexErrMsgTxt("The attenuation map must have the size of the reconstructed image.");
+		// IrlOsem only reads the map, so unscaled single data can be used in place
+		if (psSession->sIrlParms.fAtnScaleFac == 1.0)
+			psFrames->pfAtnMap = ToFloatArrayView(atnMap, psMexOpts->bRowMajor, pbAtnMapOwned);
+		else
+			psFrames->pfAtnMap = ToFloatArray(atnMap, 1.0, psMexOpts->bRowMajor);
 	}
 
-	pchSrfKrnlFile = bModelSrf ? pchGetSrfKrnlFname() : NULL;
-	pchDrfTabFile = bModelDrf ? pchGetDrfTabFname() : NULL;
+	if (initEst != NULL)
+	{
+		if (mxGetNumberOfElements(initEst) != (size_t)iNumPixels*iNumPixels*iNumSlices)
+			mexErrMsgTxt("The initial estimate must have the size of the reconstructed image.");
+		psFrames->pvInitEst = mxGetData(initEst);
+		psFrames->eInitType = eGetPixType(initEst);
+	}
+	return iNumFrames;
+}
+
+// Reconstructs the projection image(s) prjImg with the setup in psSession and returns the result in plhs[0].
+// prjImg is a 3-D image, or a 4-D array or cell array of frames, which gives a 4-D result.
+// atnMap and initEst can be NULL; they are shared by all frames.
+// With nlhs > 1, plhs[1] is a struct with the iterates saved by the save_int/save_iterations
+// schedule, [P,P,S,K] or [P,P,S,K,frames], and their iteration numbers, the relative image change
+// of each iteration [NumIterations,frames] and the number of iterations done in each frame, which
+// is smaller than NumIterations if stop_rel_change ended the reconstruction early. Iterates and
+// changes after the stop are left at zero and NaN.
+static void vMexRecon(OsemSession_t *psSession, const MexOptions_t *psMexOpts, int nlhs, mxArray *plhs[], const mxArray *prjImg, const mxArray *atnMap, const mxArray *initEst)
+{
+	MexFrames_t sFrames;
+	int iFrame, iNumFrames, bAtnMapOwned;
+	int iNumPixels = psSession->sIrlParms.NumPixels;
+	int iNumSlices = psSession->sIrlParms.NumSlices;
+	double dStart = dGetWallTime();
+
+	iNumFrames = iPrepareFrames(psSession, psMexOpts, prjImg, atnMap, initEst, &sFrames, &bAtnMapOwned);
+
+	int bFrameDim = iNumFrames > 1 || mxIsCell(prjImg);
+	mwSize actdims[5];
+	actdims[0] = iNumPixels;
+	actdims[1] = iNumPixels;
+	actdims[2] = iNumSlices;
+	actdims[3] = iNumFrames;
+	plhs[0] = mxCreateNumericArray(bFrameDim ? 4 : 3, actdims, psMexOpts->bSingleOut ? mxSINGLE_CLASS : mxDOUBLE_CLASS, mxREAL);
+	sFrames.pvOut = mxGetData(plhs[0]);
+
+	if (nlhs > 1)
+	{
+		const char *apchFields[] = { "iterates", "iterations", "relchange", "numiterations" };
+		mxArray *iterates, *iterations, *relchange;
+		int i, *piIterations;
+
+		piIterations = (int *)mxCalloc(psSession->sIrlParms.NumIterations + 1, sizeof(int));
+		sFrames.iNumSaved = iSessionNumSavedIterations(psSession, piIterations);
+		sFrames.bSingleIter = psMexOpts->bSingleOut || psMexOpts->bSingleIter;
+		actdims[3] = sFrames.iNumSaved;
+		actdims[4] = iNumFrames;
+		iterates = mxCreateNumericArray(bFrameDim ? 5 : 4, actdims, sFrames.bSingleIter ? mxSINGLE_CLASS : mxDOUBLE_CLASS, mxREAL);
+		sFrames.pvIterates = mxGetData(iterates);
+		iterations = mxCreateDoubleMatrix(1, sFrames.iNumSaved, mxREAL);
+		for (i = 0; i < sFrames.iNumSaved; i++)
+			mxGetPr(iterations)[i] = piIterations[i];
+		mxFree(piIterations);
+		relchange = mxCreateDoubleMatrix(psSession->sIrlParms.NumIterations, iNumFrames, mxREAL);
+		sFrames.pdRelChange = mxGetPr(relchange);
+		for (i = 0; i < psSession->sIrlParms.NumIterations*iNumFrames; i++)
+			sFrames.pdRelChange[i] = mxGetNaN();
+		plhs[1] = mxCreateStructMatrix(1, 1, 4, apchFields);
+		mxSetField(plhs[1], 0, "iterates", iterates);
+		mxSetField(plhs[1], 0, "iterations", iterations);
+		mxSetField(plhs[1], 0, "relchange", relchange);
+	}
+	sFrames.piNumIterations = (int *)mxCalloc(iNumFrames, sizeof(int));
+	sFrames.piErrNums = (int *)mxCalloc(iNumFrames, sizeof(int));
+
+	// the frame workers overlap the conversions of some frames with the reconstruction of another; the reconstructions are serialized
+	vAllocFrameSlots(&sFrames, iNumFrames);
+	vParallelForN(iNumFrames, psSession->iNumFrameWorkers, vReconFrame, &sFrames);
+	vFreeFrameSlots(&sFrames);
+
+	if (sFrames.pfAtnMap && bAtnMapOwned) IrlFree(sFrames.pfAtnMap);
+	for (iFrame = 0; iFrame < iNumFrames; iFrame++)
+		if (sFrames.piErrNums[iFrame])
+			mexPrintf("osem: IrlOsem failed for frame %d: ErrNum=%d\n", iFrame + 1, sFrames.piErrNums[iFrame]);
+	if (nlhs > 1)
+	{
+		mxArray *numiterations = mxCreateDoubleMatrix(1, iNumFrames, mxREAL);
+		for (iFrame = 0; iFrame < iNumFrames; iFrame++)
+			mxGetPr(numiterations)[iFrame] = sFrames.piNumIterations[iFrame];
+		mxSetField(plhs[1], 0, "numiterations", numiterations);
+	}
+	if (iNumFrames > 1)
+		mexPrintf("osem: reconstructed %d frames one after another in %.2f s\n", iNumFrames, dGetWallTime() - dStart);
+	mxFree(sFrames.piErrNums);
+	mxFree(sFrames.piNumIterations);
+	mxFree(sFrames.ppvPrjFrames);
+	mxFree(sFrames.pePrjTypes);
+}
 
+// Reconstructions started with osem('submit',...) that run on a background thread. Their inputs
+// are converted to native single precision, row major buffers when they are submitted and the
+// results are copied to mxArrays by osem('fetch',...), so the thread never touches MATLAB data.
+// A handle is the index in the table plus one. osem('cancel',...) only marks a job; it stops at
+// its next check and stays in the table until osem('fetch',...) or the mex file is cleared.
+enum { JOB_RUNNING, JOB_DONE, JOB_CANCELLED };
+
+typedef struct {
+	MexFrames_t sFrames;			// all buffers owned by the job
+	MexOptions_t sMexOpts;			// options of the submit call, applied when fetching
+	OsemSession_t *psOwnSession;	// session opened for the job, or NULL if it uses an open session
+	int iNumFrames;
+	int bFrameDim;					// the result has a frame dimension
+	int *piIterations;				// iteration numbers of the saved iterates
+	volatile int iState;
+	volatile int bCancel;
+	double dStart, dEnd;
+	OsemThread_t sThread;
+} MexJob_t;
+
+static MexJob_t **ppsgJobs = NULL;
+static int isgMaxJobs = 0;
+
+static void vJobMain(void *pvJob)
+{
+	MexJob_t *psJob = (MexJob_t *)pvJob;
 
-	//Scatter Estimate to be added to computed projection data
-	pfScatterEstimate = pfGetScatterEstimate(&sIrlParms, psViews);
+	vParallelForN(psJob->iNumFrames, psJob->sFrames.psSession->iNumFrameWorkers, vReconFrame, &psJob->sFrames);
+	psJob->dEnd = dGetWallTime();
+	psJob->iState = psJob->bCancel ? JOB_CANCELLED : JOB_DONE;
+}
 
+static void vFreeJob(int iHandle)
+{
+	MexJob_t *psJob = ppsgJobs[iHandle - 1];
+	MexFrames_t *psFrames = &psJob->sFrames;
+	int iFrame;
+
+	for (iFrame = 0; iFrame < psJob->iNumFrames; iFrame++)
+		IrlFree((void *)psFrames->ppvPrjFrames[iFrame]);
+	vFreeFrameSlots(psFrames);
+	IrlFree(psFrames->ppvPrjFrames);
+	if (psFrames->pdCountScales) IrlFree(psFrames->pdCountScales);
+	IrlFree(psFrames->pePrjTypes);
+	if (psFrames->pfAtnMap) IrlFree(psFrames->pfAtnMap);
+	if (psFrames->pvInitEst) IrlFree((void *)psFrames->pvInitEst);
+	IrlFree(psFrames->pvOut);
+	if (psFrames->pvIterates) IrlFree(psFrames->pvIterates);
+	if (psJob->piIterations) IrlFree(psJob->piIterations);
+	IrlFree(psFrames->pdRelChange);
+	IrlFree(psFrames->piNumIterations);
+	IrlFree(psFrames->piErrNums);
+	vCloseSession(psJob->psOwnSession);
+	IrlFree(psJob);
+	ppsgJobs[iHandle - 1] = NULL;
+	mexUnlock();
+}
 
-	char* pch = pchGetStrParm("msg_file", &bFound, "");
-	//pchMsgFile = (pch == NULL || *pch == '\0') ? NULL : pchIrlStrdup(pch);
-	pchMsgFile = NULL;
+// Stops all jobs, at the next check for cancellation, and frees them.
+static void vCancelAllJobs(void)
+{
+	int i;
 
+	for (i = 0; i < isgMaxJobs; i++)
+		if (ppsgJobs[i] != NULL)
+		{
+			ppsgJobs[i]->bCancel = TRUE;
+			vJoinThread(ppsgJobs[i]->sThread);
+			vFreeJob(i + 1);
+		}
+	free(ppsgJobs);
+	ppsgJobs = NULL;
+	isgMaxJobs = 0;
+}
 
-	pch = pchGetStrParm("log_file", &bFound, "");
-	//pchLogFile = (pch == NULL || *pch == '\0') ? NULL : pchIrlStrdup(pch);
-	pchLogFile = NULL;
-	
-	iDoneWithParms();
+static int bSessionHasJobs(const OsemSession_t *psSession)
+{
+	int i;
 
-	int err_num = IrlOsem(&sIrlParms, &sOptions, psViews,
-		pchDrfTabFile, pchSrfKrnlFile,
-		vIterationCallback, pfScatterEstimate, pfAtnMap, pfPrjImage, pfActImage, pchLogFile, pchMsgFile);
-		//vIterationCallback, pfScatterEstimate, pfAtnMap, pfPrjImage, pfActImage, "log.txt", "msg.txt");
-	fprintf(stderr, "sum of pfRecn after IrlOsem=%.4g (%d x %d x %d)\n", sum_float(pfActImage, sIrlParms.NumPixels*sIrlParms.NumPixels*sIrlParms.NumSlices), sIrlParms.NumPixels, sIrlParms.NumPixels, sIrlParms.NumSlices);
-	if (err_num) fprintf(stderr, "fatal error in IrlOsem: ErrNum=%d\n      %s", err_num, pchIrlErrorString());
+	for (i = 0; i < isgMaxJobs; i++)
+		if (ppsgJobs[i] != NULL && ppsgJobs[i]->sFrames.psSession == psSession)
+			return TRUE;
+	return FALSE;
+}
 
-	// Generate the output projection image
-	nlhs = 1;
-	mwSize actdims[3];
-	actdims[0] = sIrlParms.NumPixels;
-	actdims[1] = sIrlParms.NumPixels;
-	actdims[2] = sIrlParms.NumSlices;
-	plhs[0] = mxCreateNumericArray(3, actdims, mxDOUBLE_CLASS, mxREAL);
-	double *pOut = mxGetData(plhs[0]);
+static int iGetJobHandle(const mxArray *handle)
+{
+	int iHandle;
+
+	if (!mxIsNumeric(handle) || mxGetNumberOfElements(handle) != 1)
+		mexErrMsgTxt("Invalid job handle.");
+	iHandle = (int)mxGetScalar(handle);
+	if (iHandle < 1 || iHandle > isgMaxJobs || ppsgJobs[iHandle - 1] == NULL)
+		mexErrMsgIdAndTxt("osem:job", "No job with handle %d.", iHandle);
+	return iHandle;
+}
 
-	int i = 0;
-	for (int s = 0; s < actdims[2]; s++)
-	for (int m = 0; m < actdims[0]; m++)
-	for (int n = 0; n < actdims[1]; n++)
+// Copies the inputs of a reconstruction into a new job and starts it on a background thread.
+// psOwnSession, if not NULL, is psSession and is closed with the job. Returns the job handle.
+static int iSubmitJob(OsemSession_t *psSession, OsemSession_t *psOwnSession, const MexOptions_t *psMexOpts, const mxArray *prjImg, const mxArray *atnMap, const mxArray *initEst)
+{
+	MexJob_t *psJob;
+	MexFrames_t sMxFrames, *psFrames;
+	IrlParms_t *psIrlParms = &psSession->sIrlParms;
+	size_t lNumVoxels = (size_t)psIrlParms->NumPixels*psIrlParms->NumPixels*psIrlParms->NumSlices;
+	size_t lPrjSize = (size_t)psIrlParms->NumSlices*psIrlParms->NumPixels*psIrlParms->NumViews;
+	int i, iFrame, bAtnMapOwned, iNumCompact = 0;
+	float *pfPrj = NULL;
+	uint16_t *pusCounts;
+
+	iFrame = iPrepareFrames(psSession, psMexOpts, prjImg, atnMap, initEst, &sMxFrames, &bAtnMapOwned);
+	psJob = (MexJob_t *)pvIrlMalloc(sizeof(MexJob_t), "SubmitJob:psJob");
+	memset(psJob, 0, sizeof(MexJob_t));
+	psJob->sMexOpts = *psMexOpts;
+	psJob->psOwnSession = psOwnSession;
+	psJob->iNumFrames = iFrame;
+	psJob->bFrameDim = psJob->iNumFrames > 1 || mxIsCell(prjImg);
+
+	// the job works on row major single precision copies, with the projections already scaled
+	psFrames = &psJob->sFrames;
+	psFrames->psSession = psSession;
+	psFrames->bSingleOut = TRUE;
+	psFrames->bSingleIter = TRUE;
+	psFrames->bRowMajor = TRUE;
+	psFrames->dPrjScale = 1.0;
+	psFrames->iPrjRows = 1;
+	psFrames->iPrjCols = psIrlParms->NumPixels*psIrlParms->NumSlices;
+	psFrames->pbCancel = &psJob->bCancel;
+	psFrames->ppvPrjFrames = (const void **)pvIrlMalloc(psJob->iNumFrames*sizeof(void *), "SubmitJob:ppvPrjFrames");
+	psFrames->pePrjTypes = (PixType_t *)pvIrlMalloc(psJob->iNumFrames*sizeof(PixType_t), "SubmitJob:pePrjTypes");
+	if (psMexOpts->bCompactPrj)
 	{
-		pOut[s*actdims[0] * actdims[1] + n*actdims[0] + m] = pfActImage[i];
-		i++;
+		psFrames->pdCountScales = (double *)pvIrlMalloc(psJob->iNumFrames*sizeof(double), "SubmitJob:pdCountScales");
+		memset(psFrames->pdCountScales, 0, psJob->iNumFrames*sizeof(double));
+	}
+	for (iFrame = 0; iFrame < psJob->iNumFrames; iFrame++)
+	{
+		if (pfPrj == NULL)
+			pfPrj = (float *)pvIrlMalloc(sizeof(float)*lPrjSize, "SubmitJob:pfPrj");
+		vConvertToRowMajor(sMxFrames.ppvPrjFrames[iFrame], sMxFrames.pePrjTypes[iFrame], sMxFrames.iPrjRows, sMxFrames.iPrjCols, psIrlParms->NumViews, sMxFrames.dPrjScale, pfPrj);
+		psFrames->pePrjTypes[iFrame] = PIX_SINGLE;
+		if (psMexOpts->bCompactPrj)
+		{
+			// keep the counts, the scaled projections divided by dPrjScale; frames that are not counts stay in float
+			pusCounts = (uint16_t *)pvIrlMalloc(sizeof(uint16_t)*lPrjSize, "SubmitJob:pusCounts");
+			if (bPackCounts(pfPrj, psIrlParms->NumSlices*psIrlParms->NumPixels, psIrlParms->NumViews, sMxFrames.dPrjScale, pusCounts))
+			{
+				psFrames->ppvPrjFrames[iFrame] = pusCounts;
+				psFrames->pdCountScales[iFrame] = sMxFrames.dPrjScale;
+				iNumCompact++;
+				continue;
+			}
+			IrlFree(pusCounts);
+		}
+		psFrames->ppvPrjFrames[iFrame] = pfPrj;
+		pfPrj = NULL;
+	}
+	if (pfPrj != NULL)
+		IrlFree(pfPrj);
+	if (psMexOpts->bCompactPrj && iNumCompact < psJob->iNumFrames)
+		mexPrintf("osem: %d of %d frames are not counts below 65536 and are kept in single precision\n", psJob->iNumFrames - iNumCompact, psJob->iNumFrames);
+	mxFree(sMxFrames.ppvPrjFrames);
+	mxFree(sMxFrames.pePrjTypes);
+	if (sMxFrames.pfAtnMap != NULL)
+	{
+		if (bAtnMapOwned)
+			psFrames->pfAtnMap = sMxFrames.pfAtnMap;
+		else
+		{
+			psFrames->pfAtnMap = (float *)pvIrlMalloc(sizeof(float)*lNumVoxels, "SubmitJob:pfAtnMap");
+			memcpy(psFrames->pfAtnMap, sMxFrames.pfAtnMap, sizeof(float)*lNumVoxels);
+		}
+	}
+	if (sMxFrames.pvInitEst != NULL)
+	{
+		float *pfInitEst = (float *)pvIrlMalloc(sizeof(float)*lNumVoxels, "SubmitJob:pfInitEst");
+		vGetInitEst(&sMxFrames, pfInitEst);
+		psFrames->pvInitEst = pfInitEst;
+		psFrames->eInitType = PIX_SINGLE;
 	}
 
-	vFreeIterSaveString();
-	IrlFree(psViews);
-	IrlFree(pfPrjImage);
-	IrlFree(pfActImage);
-	if (pfAtnMap) IrlFree(pfAtnMap);
-	if (pfScatterEstimate) IrlFree(pfScatterEstimate);
-	if (pchSrfKrnlFile) IrlFree(pchSrfKrnlFile);
-	if (pchDrfTabFile) IrlFree(pchDrfTabFile);
-	if (pchLogFile)	IrlFree(pchLogFile);
-	if (pchMsgFile)	IrlFree(pchMsgFile);
+	psFrames->pvOut = pvIrlMalloc(sizeof(float)*lNumVoxels*psJob->iNumFrames, "SubmitJob:pvOut");
+	if (psMexOpts->bKeepIterates)
+	{
+		psJob->piIterations = (int *)pvIrlMalloc(sizeof(int)*(psIrlParms->NumIterations + 1), "SubmitJob:piIterations");
+		psFrames->iNumSaved = iSessionNumSavedIterations(psSession, psJob->piIterations);
+		psFrames->pvIterates = pvIrlMalloc(sizeof(float)*lNumVoxels*psFrames->iNumSaved*psJob->iNumFrames, "SubmitJob:pvIterates");
+	}
+	psFrames->pdRelChange = (double *)pvIrlMalloc(sizeof(double)*(psIrlParms->NumIterations*psJob->iNumFrames + 1), "SubmitJob:pdRelChange");
+	for (i = 0; i < psIrlParms->NumIterations*psJob->iNumFrames; i++)
+		psFrames->pdRelChange[i] = mxGetNaN();
+	psFrames->piNumIterations = (int *)pvIrlMalloc(sizeof(int)*psJob->iNumFrames, "SubmitJob:piNumIterations");
+	psFrames->piErrNums = (int *)pvIrlMalloc(sizeof(int)*psJob->iNumFrames, "SubmitJob:piErrNums");
+	memset(psFrames->piNumIterations, 0, sizeof(int)*psJob->iNumFrames);
+	memset(psFrames->piErrNums, 0, sizeof(int)*psJob->iNumFrames);
+	vAllocFrameSlots(psFrames, psJob->iNumFrames);
+
+	for (i = 0; i < isgMaxJobs && ppsgJobs[i] != NULL; i++)
+		;
+	if (i == isgMaxJobs)
+	{
+		isgMaxJobs = isgMaxJobs ? 2 * isgMaxJobs : 8;
+		ppsgJobs = (MexJob_t **)realloc(ppsgJobs, isgMaxJobs*sizeof(MexJob_t *));
+		if (ppsgJobs == NULL)
+			mexErrMsgTxt("Unable to allocate the job table.");
+		memset(ppsgJobs + i, 0, (isgMaxJobs - i)*sizeof(MexJob_t *));
+	}
+	ppsgJobs[i] = psJob;
+	// the thread uses the mex file's code, so keep it in memory until the job is fetched
+	mexLock();
+	mexAtExit(vCloseAllSessions);
+
+	psJob->iState = JOB_RUNNING;
+	psJob->dStart = dGetWallTime();
+	if (iStartThread(&psJob->sThread, vJobMain, psJob))
+	{
+		psJob->psOwnSession = NULL;	// the caller still closes it
+		vFreeJob(i + 1);
+		mexErrMsgTxt("Unable to start the reconstruction thread.");
+	}
+	return i + 1;
+}
+
+// Copies iNumImages row major reconstructions to the mex output, as single or double
+// and with or without 'rowmajor'.
+static void vCopyImagesOut(const float *pfIn, int iNumImages, int iNumPixels, int iNumSlices, const MexOptions_t *psMexOpts, int bSingle, void *pvOut)
+{
+	size_t lNumVoxels = (size_t)iNumPixels*iNumPixels*iNumSlices;
+	int iImage;
+
+	for (iImage = 0; iImage < iNumImages; iImage++)
+	{
+		if (bSingle)
+		{
+			float *pfOut = (float *)pvOut + iImage*lNumVoxels;
+			memcpy(pfOut, pfIn + iImage*lNumVoxels, sizeof(float)*lNumVoxels);
+			if (!psMexOpts->bRowMajor)
+				vTransposeSquareSlices(pfOut, iNumPixels, iNumSlices);
+		}
+		else if (psMexOpts->bRowMajor)
+			vConvertToColMajorDouble(pfIn + iImage*lNumVoxels, 1, iNumPixels*iNumPixels, iNumSlices, (double *)pvOut + iImage*lNumVoxels);
+		else
+			vConvertToColMajorDouble(pfIn + iImage*lNumVoxels, iNumPixels, iNumPixels, iNumSlices, (double *)pvOut + iImage*lNumVoxels);
+	}
+}
+
+// Waits for a job, returns its results like osem('recon',...) and frees it; a cancelled job is
+// freed with an error.
+static void vFetchJob(int iHandle, int nlhs, mxArray *plhs[])
+{
+	MexJob_t *psJob = ppsgJobs[iHandle - 1];
+	MexFrames_t *psFrames = &psJob->sFrames;
+	const MexOptions_t *psMexOpts = &psJob->sMexOpts;
+	IrlParms_t *psIrlParms = &psFrames->psSession->sIrlParms;
+	int i, iFrame, iNumPixels = psIrlParms->NumPixels, iNumSlices = psIrlParms->NumSlices;
+	mwSize actdims[5];
+
+	vJoinThread(psJob->sThread);
+	if (psJob->iState == JOB_CANCELLED)
+	{
+		vFreeJob(iHandle);
+		mexErrMsgIdAndTxt("osem:cancelled", "Job %d was cancelled.", iHandle);
+	}
+
+	actdims[0] = iNumPixels;
+	actdims[1] = iNumPixels;
+	actdims[2] = iNumSlices;
+	actdims[3] = psJob->iNumFrames;
+	plhs[0] = mxCreateNumericArray(psJob->bFrameDim ? 4 : 3, actdims, psMexOpts->bSingleOut ? mxSINGLE_CLASS : mxDOUBLE_CLASS, mxREAL);
+	vCopyImagesOut((float *)psFrames->pvOut, psJob->iNumFrames, iNumPixels, iNumSlices, psMexOpts, psMexOpts->bSingleOut, mxGetData(plhs[0]));
+
+	if (nlhs > 1)
+	{
+		const char *apchFields[] = { "iterates", "iterations", "relchange", "numiterations" };
+		mxArray *iterates, *iterations, *relchange, *numiterations;
+		int bSingleIter = psMexOpts->bSingleOut || psMexOpts->bSingleIter;
+
+		// the iterates are only kept for jobs submitted with 'iterates'
+		actdims[3] = psFrames->iNumSaved;
+		actdims[4] = psJob->iNumFrames;
+		iterates = mxCreateNumericArray(psJob->bFrameDim ? 5 : 4, actdims, bSingleIter ? mxSINGLE_CLASS : mxDOUBLE_CLASS, mxREAL);
+		if (psFrames->pvIterates != NULL)
+			vCopyImagesOut((float *)psFrames->pvIterates, psFrames->iNumSaved*psJob->iNumFrames, iNumPixels, iNumSlices, psMexOpts, bSingleIter, mxGetData(iterates));
+		iterations = mxCreateDoubleMatrix(1, psFrames->iNumSaved, mxREAL);
+		for (i = 0; i < psFrames->iNumSaved; i++)
+			mxGetPr(iterations)[i] = psJob->piIterations[i];
+		relchange = mxCreateDoubleMatrix(psIrlParms->NumIterations, psJob->iNumFrames, mxREAL);
+		memcpy(mxGetPr(relchange), psFrames->pdRelChange, sizeof(double)*psIrlParms->NumIterations*psJob->iNumFrames);
+		numiterations = mxCreateDoubleMatrix(1, psJob->iNumFrames, mxREAL);
+		for (iFrame = 0; iFrame < psJob->iNumFrames; iFrame++)
+			mxGetPr(numiterations)[iFrame] = psFrames->piNumIterations[iFrame];
+		plhs[1] = mxCreateStructMatrix(1, 1, 4, apchFields);
+		mxSetField(plhs[1], 0, "iterates", iterates);
+		mxSetField(plhs[1], 0, "iterations", iterations);
+		mxSetField(plhs[1], 0, "relchange", relchange);
+		mxSetField(plhs[1], 0, "numiterations", numiterations);
+	}
+
+	for (iFrame = 0; iFrame < psJob->iNumFrames; iFrame++)
+		if (psFrames->piErrNums[iFrame])
+			mexPrintf("osem: IrlOsem failed for frame %d: ErrNum=%d\n", iFrame + 1, psFrames->piErrNums[iFrame]);
+	mexPrintf("osem: job %d took %.2f s\n", iHandle, psJob->dEnd - psJob->dStart);
+	vFreeJob(iHandle);
+}
+
+// The matlab interface function
+//   [recon,info]=osem('osem.par',prj,[atnmap],[initest],[options...])
+//   h=osem('open','osem.par',size(prj)), [recon,info]=osem('recon',h,prj,[atnmap],[initest],[options...]), osem('close',h)
+//   job=osem('submit',h or 'osem.par',prj,[atnmap],[initest],[options...]), [state,seconds]=osem('status',job),
+//   [recon,info]=osem('fetch',job), osem('cancel',job), which returns at once: 'status' reports
+//   cancelling until the job stops, then cancelled, and 'fetch' frees it
+ void mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[])
+{
+	MexOptions_t sMexOpts;
+	char achCmd[8] = "";
 
+	if (nrhs >= 2)
+		nrhs = iGetMexOptions(nrhs, prhs, &sMexOpts);
+	if (nrhs<2 || !mxIsChar(prhs[0])){
+		mexErrMsgTxt("Invalid input. \nUsage:[recon,info]=osem('osem.par',prj,[atnmap],[initest],['rowmajor'],['single'],['singleiter'])");
+	}
+	if (mxGetNumberOfElements(prhs[0]) < sizeof(achCmd))
+		mxGetString(prhs[0], achCmd, sizeof(achCmd));
+
+	if (strcmp(achCmd, "open") == 0)
+	{
+		const mxArray *size;
+		int iNumSlices, iNumPixels, iNumViews;
+
+		if (nrhs != 3 || !mxIsDouble(prhs[2]) || mxGetNumberOfElements(prhs[2]) != 3)
+			mexErrMsgTxt("Usage: h=osem('open','osem.par',size(prj),['rowmajor'])");
+		size = prhs[2];
+		iNumSlices = (int)mxGetPr(size)[sMexOpts.bRowMajor ? 1 : 0];
+		iNumPixels = (int)mxGetPr(size)[sMexOpts.bRowMajor ? 0 : 1];
+		iNumViews = (int)mxGetPr(size)[2];
+		plhs[0] = mxCreateDoubleScalar(iAddSession(psOpenSession(pchGetParmFileName(prhs[1]), iNumSlices, iNumPixels, iNumViews)));
+	}
+	else if (strcmp(achCmd, "recon") == 0)
+	{
+		OsemSession_t *psSession;
+
+		if (nrhs < 3 || nrhs > 5)
+			mexErrMsgTxt("Usage: [recon,info]=osem('recon',h,prj,[atnmap],[initest],['rowmajor'],['single'],['singleiter'])");
+		psSession = ppsgSessions[iGetSessionHandle(prhs[1]) - 1];
+		vMexRecon(psSession, &sMexOpts, nlhs, plhs, prhs[2], nrhs > 3 ? prhs[3] : NULL, nrhs > 4 ? prhs[4] : NULL);
+		mexPrintf("osem: reused session setup, saved %.2f s (%.2f s over %d reconstructions)\n",
+			psSession->dSetupTime, psSession->dSetupTime*psSession->iNumRecons, psSession->iNumRecons);
+	}
+	else if (strcmp(achCmd, "close") == 0)
+	{
+		if (nrhs != 2)
+			mexErrMsgTxt("Usage: osem('close',h)");
+		if (bSessionHasJobs(ppsgSessions[iGetSessionHandle(prhs[1]) - 1]))
+			mexErrMsgTxt("The session is used by a submitted job; fetch it first, after cancelling it if need be.");
+		vRemoveSession(iGetSessionHandle(prhs[1]));
+	}
+	else if (strcmp(achCmd, "submit") == 0)
+	{
+		OsemSession_t *psSession, *psOwnSession = NULL;
+		IrlParms_t sPrjSizes;
+
+		if (nrhs < 3 || nrhs > 5)
+			mexErrMsgTxt("Usage: job=osem('submit',h or 'osem.par',prj,[atnmap],[initest],['rowmajor'],['single'],['singleiter'],['iterates'],['compact'])");
+		if (mxIsChar(prhs[1]))
+		{
+			if (mxIsCell(prhs[2]) && mxGetNumberOfElements(prhs[2]) > 0)
+				vGetmxImageSizesForRecon(mxGetCell(prhs[2], 0), &sPrjSizes, sMexOpts.bRowMajor);
+			else
+				vGetmxImageSizesForRecon(prhs[2], &sPrjSizes, sMexOpts.bRowMajor);
+			psSession = psOwnSession = psOpenSession(pchGetParmFileName(prhs[1]), sPrjSizes.NumSlices, sPrjSizes.NumPixels, sPrjSizes.NumViews);
+		}
+		else
+			psSession = ppsgSessions[iGetSessionHandle(prhs[1]) - 1];
+		plhs[0] = mxCreateDoubleScalar(iSubmitJob(psSession, psOwnSession, &sMexOpts, prhs[2], nrhs > 3 ? prhs[3] : NULL, nrhs > 4 ? prhs[4] : NULL));
+	}
+	else if (strcmp(achCmd, "status") == 0)
+	{
+		static const char *apchStates[] = { "running", "done", "cancelled" };
+		MexJob_t *psJob;
+
+		if (nrhs != 2)
+			mexErrMsgTxt("Usage: [state,seconds]=osem('status',job)");
+		psJob = ppsgJobs[iGetJobHandle(prhs[1]) - 1];
+		plhs[0] = mxCreateString(psJob->iState == JOB_RUNNING && psJob->bCancel ? "cancelling" : apchStates[psJob->iState]);
+		if (nlhs > 1)
+			plhs[1] = mxCreateDoubleScalar((psJob->iState == JOB_RUNNING ? dGetWallTime() : psJob->dEnd) - psJob->dStart);
+	}
+	else if (strcmp(achCmd, "fetch") == 0)
+	{
+		if (nrhs != 2)
+			mexErrMsgTxt("Usage: [recon,info]=osem('fetch',job)");
+		vFetchJob(iGetJobHandle(prhs[1]), nlhs, plhs);
+	}
+	else if (strcmp(achCmd, "cancel") == 0)
+	{
+		if (nrhs != 2)
+			mexErrMsgTxt("Usage: osem('cancel',job)");
+		// the job stops at its next check, between frames or every stop_check_int or cancel_check_int
+		// iterations; it is joined and freed by 'fetch', or when the mex file is cleared
+		ppsgJobs[iGetJobHandle(prhs[1]) - 1]->bCancel = TRUE;
+	}
+	else
+	{
+		OsemSession_t *psSession;
+		IrlParms_t sPrjSizes;
+
+		if (nrhs > 4)
+			mexErrMsgTxt("Invalid input. \nUsage:[recon,info]=osem('osem.par',prj,[atnmap],[initest],['rowmajor'],['single'],['singleiter'])");
+		if (mxIsCell(prhs[1]) && mxGetNumberOfElements(prhs[1]) > 0)
+			vGetmxImageSizesForRecon(mxGetCell(prhs[1], 0), &sPrjSizes, sMexOpts.bRowMajor);
+		else
+			vGetmxImageSizesForRecon(prhs[1], &sPrjSizes, sMexOpts.bRowMajor);
+		psSession = psOpenSession(pchGetParmFileName(prhs[0]), sPrjSizes.NumSlices, sPrjSizes.NumPixels, sPrjSizes.NumViews);
+		vMexRecon(psSession, &sMexOpts, nlhs, plhs, prhs[1], nrhs > 2 ? prhs[2] : NULL, nrhs > 3 ? prhs[3] : NULL);
+		vCloseSession(psSession);
+	}
 } 
 //
 
@@ -0,0 +1,333 @@
+/*
+	osemthreads.c
+
+	Thread, mutex and condition variable wrappers plus a simple
+	parallel-for used by the data conversion, loading and frame stages.
+	A team keeps its threads between parallel-fors, for stages that run
+	many short ones.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#ifndef WIN32
+#include <unistd.h>
+#include <sys/time.h>
+#endif
+
+#include "osemthreads.h"
+
+static int isgNumThreads=0;	// 0 means use the number of online processors
+
+typedef struct {
+	void (*pfnMain)(void *pvArg);
+	void *pvArg;
+} ThreadStart_t;
+
+typedef struct {
+	OsemWorkFn_t pfnWork;
+	void *pvArg;
+	int iNumItems;
+	int iNextItem;
+	OsemMutex_t sMutex;
+} ParallelFor_t;
+
+struct OsemTeam {
+	int iNumThreads;		// including the thread that started the team
+	int iNumStarted;		// helper threads
+	OsemThread_t *psThreads;
+	ParallelFor_t sFor;		// the parallel-for being run
+	OsemMutex_t sMutex;
+	OsemCond_t sWork;		// a new parallel-for, or the end of the team
+	OsemCond_t sDone;		// all helpers finished the parallel-for
+	int iGeneration;		// number of parallel-fors started
+	int iNumBusy;			// helpers still working on the current one
+	int bStop;
+};
+
+static int iNumProcessors(void)
+{
+#ifdef WIN32
+	SYSTEM_INFO sInfo;
+	GetSystemInfo(&sInfo);
+	return (int)sInfo.dwNumberOfProcessors;
+#else
+	long lNum = sysconf(_SC_NPROCESSORS_ONLN);
+	return lNum > 0 ? (int)lNum : 1;
+#endif
+}
+
+int iGetNumThreads(void)
+{
+	if (isgNumThreads <= 0)
+		isgNumThreads = iNumProcessors();
+	return isgNumThreads;
+}
+
+void vSetNumThreads(int iNumThreads)
+{
+	isgNumThreads = iNumThreads;
+}
+
+#ifdef WIN32
+static DWORD WINAPI ThreadTrampoline(LPVOID pvStart)
+#else
+static void *ThreadTrampoline(void *pvStart)
+#endif
+{
+	ThreadStart_t sStart = *(ThreadStart_t *)pvStart;
+
+	free(pvStart);
+	sStart.pfnMain(sStart.pvArg);
+	return 0;
+}
+
+// returns 0 on success, non-zero if the thread could not be created
+int iStartThread(OsemThread_t *psThread, void (*pfnMain)(void *pvArg), void *pvArg)
+{
+	ThreadStart_t *psStart;
+
+	psStart = (ThreadStart_t *)malloc(sizeof(ThreadStart_t));
+	if (psStart == NULL)
+		return 1;
+	psStart->pfnMain = pfnMain;
+	psStart->pvArg = pvArg;
+#ifdef WIN32
+	*psThread = CreateThread(NULL, 0, ThreadTrampoline, psStart, 0, NULL);
+	if (*psThread == NULL){
+#else
+	if (pthread_create(psThread, NULL, ThreadTrampoline, psStart)){
+#endif
+		free(psStart);
+		return 1;
+	}
+	return 0;
+}
+
+void vJoinThread(OsemThread_t sThread)
+{
+#ifdef WIN32
+	WaitForSingleObject(sThread, INFINITE);
+	CloseHandle(sThread);
+#else
+	pthread_join(sThread, NULL);
+#endif
+}
+
+#ifdef WIN32
+void vInitMutex(OsemMutex_t *psMutex)	{ InitializeCriticalSection(psMutex); }
+void vLockMutex(OsemMutex_t *psMutex)	{ EnterCriticalSection(psMutex); }
+void vUnlockMutex(OsemMutex_t *psMutex)	{ LeaveCriticalSection(psMutex); }
+void vDestroyMutex(OsemMutex_t *psMutex)	{ DeleteCriticalSection(psMutex); }
+
+void vInitCond(OsemCond_t *psCond)	{ InitializeConditionVariable(psCond); }
+void vWaitCond(OsemCond_t *psCond, OsemMutex_t *psMutex)	{ SleepConditionVariableCS(psCond, psMutex, INFINITE); }
+void vSignalCond(OsemCond_t *psCond)	{ WakeConditionVariable(psCond); }
+void vBroadcastCond(OsemCond_t *psCond)	{ WakeAllConditionVariable(psCond); }
+void vDestroyCond(OsemCond_t *psCond)	{ }
+#else
+void vInitMutex(OsemMutex_t *psMutex)	{ pthread_mutex_init(psMutex, NULL); }
+void vLockMutex(OsemMutex_t *psMutex)	{ pthread_mutex_lock(psMutex); }
+void vUnlockMutex(OsemMutex_t *psMutex)	{ pthread_mutex_unlock(psMutex); }
+void vDestroyMutex(OsemMutex_t *psMutex)	{ pthread_mutex_destroy(psMutex); }
+
+void vInitCond(OsemCond_t *psCond)	{ pthread_cond_init(psCond, NULL); }
+void vWaitCond(OsemCond_t *psCond, OsemMutex_t *psMutex)	{ pthread_cond_wait(psCond, psMutex); }
+void vSignalCond(OsemCond_t *psCond)	{ pthread_cond_signal(psCond); }
+void vBroadcastCond(OsemCond_t *psCond)	{ pthread_cond_broadcast(psCond); }
+void vDestroyCond(OsemCond_t *psCond)	{ pthread_cond_destroy(psCond); }
+#endif
+
+static void vParallelForWorker(void *pvFor)
+{
+	ParallelFor_t *psFor = (ParallelFor_t *)pvFor;
+	int iItem;
+
+	for (;;){
+		vLockMutex(&psFor->sMutex);
+		iItem = psFor->iNextItem++;
+		vUnlockMutex(&psFor->sMutex);
+		if (iItem >= psFor->iNumItems)
+			break;
+		psFor->pfnWork(psFor->pvArg, iItem);
+	}
+}
+
+/* Adds iNum values, such as the partial sums of the items of a
+	vParallelFor, pairwise in a fixed order: halves are summed and then
+	added. The result is the same whatever the number of threads that
+	produced the values, and the rounding error grows only with log iNum.
+*/
+double dTreeSum(const double *pdValues, int iNum)
+{
+	int iHalf = iNum/2;
+
+	if (iNum <= 0)
+		return 0.0;
+	if (iNum == 1)
+		return pdValues[0];
+	return dTreeSum(pdValues, iHalf) + dTreeSum(pdValues + iHalf, iNum - iHalf);
+}
+
+/* Calls pfnWork(pvArg, i) for every i in [0, iNumItems). Items are handed
+	out dynamically to up to iGetNumThreads() threads, one of which is the
+	calling thread. Returns when all items are done. If threads can not be
+	created the remaining items are simply done on the calling thread.
+*/
+void vParallelFor(int iNumItems, OsemWorkFn_t pfnWork, void *pvArg)
+{
+	vParallelForN(iNumItems, iGetNumThreads(), pfnWork, pvArg);
+}
+
+// same as vParallelFor but with at most iNumThreads threads
+void vParallelForN(int iNumItems, int iNumThreads, OsemWorkFn_t pfnWork, void *pvArg)
+{
+	ParallelFor_t sFor;
+	OsemThread_t *psThreads;
+	int i, iNumStarted=0;
+
+	if (iNumItems <= 0)
+		return;
+	if (iNumThreads > iNumItems)
+		iNumThreads = iNumItems;
+	if (iNumThreads <= 1){
+		for (i=0; i<iNumItems; ++i)
+			pfnWork(pvArg, i);
+		return;
+	}
+
+	sFor.pfnWork = pfnWork;
+	sFor.pvArg = pvArg;
+	sFor.iNumItems = iNumItems;
+	sFor.iNextItem = 0;
+	vInitMutex(&sFor.sMutex);
+	psThreads = (OsemThread_t *)malloc(sizeof(OsemThread_t)*(iNumThreads-1));
+	if (psThreads != NULL)
+		for (iNumStarted=0; iNumStarted<iNumThreads-1; ++iNumStarted)
+			if (iStartThread(&psThreads[iNumStarted], vParallelForWorker, &sFor))
+				break;
+	vParallelForWorker(&sFor);
+	for (i=0; i<iNumStarted; ++i)
+		vJoinThread(psThreads[i]);
+	free(psThreads);
+	vDestroyMutex(&sFor.sMutex);
+}
+
+static void vTeamMain(void *pvTeam)
+{
+	OsemTeam_t *psTeam = (OsemTeam_t *)pvTeam;
+	int iGeneration = 0;
+
+	vLockMutex(&psTeam->sMutex);
+	for (;;){
+		while (psTeam->iGeneration == iGeneration && !psTeam->bStop)
+			vWaitCond(&psTeam->sWork, &psTeam->sMutex);
+		if (psTeam->bStop)
+			break;
+		iGeneration = psTeam->iGeneration;
+		vUnlockMutex(&psTeam->sMutex);
+		vParallelForWorker(&psTeam->sFor);
+		vLockMutex(&psTeam->sMutex);
+		if (--psTeam->iNumBusy == 0)
+			vSignalCond(&psTeam->sDone);
+	}
+	vUnlockMutex(&psTeam->sMutex);
+}
+
+/* Starts a team of up to iNumThreads threads, the calling thread and
+	helpers that wait for vTeamFor. Fewer helpers are started if threads
+	can not be created. Returns NULL if the team can not be allocated;
+	vTeamFor then runs on the calling thread alone.
+*/
+OsemTeam_t *psStartTeam(int iNumThreads)
+{
+	OsemTeam_t *psTeam;
+
+	psTeam = (OsemTeam_t *)calloc(1, sizeof(OsemTeam_t));
+	if (psTeam == NULL)
+		return NULL;
+	vInitMutex(&psTeam->sMutex);
+	vInitMutex(&psTeam->sFor.sMutex);
+	vInitCond(&psTeam->sWork);
+	vInitCond(&psTeam->sDone);
+	if (iNumThreads > 1)
+		psTeam->psThreads = (OsemThread_t *)malloc(sizeof(OsemThread_t)*(iNumThreads-1));
+	if (psTeam->psThreads != NULL)
+		for (psTeam->iNumStarted=0; psTeam->iNumStarted<iNumThreads-1; ++psTeam->iNumStarted)
+			if (iStartThread(&psTeam->psThreads[psTeam->iNumStarted], vTeamMain, psTeam))
+				break;
+	psTeam->iNumThreads = psTeam->iNumStarted + 1;
+	return psTeam;
+}
+
+// the number of threads of the team, at least 1
+int iTeamSize(const OsemTeam_t *psTeam)
+{
+	return psTeam != NULL ? psTeam->iNumThreads : 1;
+}
+
+/* vParallelFor on the threads of the team: pfnWork(pvArg, i) is called for
+	every i in [0, iNumItems) and it returns when all items are done. Only
+	the thread that started the team may call it.
+*/
+void vTeamFor(OsemTeam_t *psTeam, int iNumItems, OsemWorkFn_t pfnWork, void *pvArg)
+{
+	int i;
+
+	if (psTeam == NULL || psTeam->iNumStarted == 0 || iNumItems <= 1){
+		for (i=0; i<iNumItems; ++i)
+			pfnWork(pvArg, i);
+		return;
+	}
+	vLockMutex(&psTeam->sMutex);
+	psTeam->sFor.pfnWork = pfnWork;
+	psTeam->sFor.pvArg = pvArg;
+	psTeam->sFor.iNumItems = iNumItems;
+	psTeam->sFor.iNextItem = 0;
+	psTeam->iNumBusy = psTeam->iNumStarted;
+	psTeam->iGeneration++;
+	vBroadcastCond(&psTeam->sWork);
+	vUnlockMutex(&psTeam->sMutex);
+
+	vParallelForWorker(&psTeam->sFor);
+
+	vLockMutex(&psTeam->sMutex);
+	while (psTeam->iNumBusy > 0)
+		vWaitCond(&psTeam->sDone, &psTeam->sMutex);
+	vUnlockMutex(&psTeam->sMutex);
+}
+
+// stops and joins the helpers of the team and frees it
+void vStopTeam(OsemTeam_t *psTeam)
+{
+	int i;
+
+	if (psTeam == NULL)
+		return;
+	vLockMutex(&psTeam->sMutex);
+	psTeam->bStop = 1;
+	vBroadcastCond(&psTeam->sWork);
+	vUnlockMutex(&psTeam->sMutex);
+	for (i=0; i<psTeam->iNumStarted; ++i)
+		vJoinThread(psTeam->psThreads[i]);
+	free(psTeam->psThreads);
+	vDestroyCond(&psTeam->sWork);
+	vDestroyCond(&psTeam->sDone);
+	vDestroyMutex(&psTeam->sFor.sMutex);
+	vDestroyMutex(&psTeam->sMutex);
+	free(psTeam);
+}
+
+// wall clock time in seconds from an arbitrary origin
+double dGetWallTime(void)
+{
+#ifdef WIN32
+	LARGE_INTEGER sCount, sFreq;
+	QueryPerformanceCounter(&sCount);
+	QueryPerformanceFrequency(&sFreq);
+	return (double)sCount.QuadPart/(double)sFreq.QuadPart;
+#else
+	struct timeval sTime;
+	gettimeofday(&sTime, NULL);
+	return sTime.tv_sec + 1e-6*sTime.tv_usec;
+#endif
+}
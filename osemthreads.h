@@ -0,0 +1,55 @@
+/*
+	osemthreads.h
+
+	Small portability layer over Win32 and POSIX threads used by the
+	parallel stages of osems and the osem mex file.
+*/
+
+#ifndef OSEMTHREADS_H
+#define OSEMTHREADS_H
+
+#ifdef WIN32
+#include <windows.h>
+typedef CRITICAL_SECTION OsemMutex_t;
+typedef CONDITION_VARIABLE OsemCond_t;
+typedef HANDLE OsemThread_t;
+#else
+#include <pthread.h>
+typedef pthread_mutex_t OsemMutex_t;
+typedef pthread_cond_t OsemCond_t;
+typedef pthread_t OsemThread_t;
+#endif
+
+// work function for vParallelFor: called once for each item in [0,iNumItems)
+typedef void (*OsemWorkFn_t)(void *pvArg, int iItem);
+
+int iGetNumThreads(void);
+void vSetNumThreads(int iNumThreads);
+void vParallelFor(int iNumItems, OsemWorkFn_t pfnWork, void *pvArg);
+void vParallelForN(int iNumItems, int iNumThreads, OsemWorkFn_t pfnWork, void *pvArg);
+double dTreeSum(const double *pdValues, int iNum);
+
+// threads kept between parallel-fors
+typedef struct OsemTeam OsemTeam_t;
+OsemTeam_t *psStartTeam(int iNumThreads);
+int iTeamSize(const OsemTeam_t *psTeam);
+void vTeamFor(OsemTeam_t *psTeam, int iNumItems, OsemWorkFn_t pfnWork, void *pvArg);
+void vStopTeam(OsemTeam_t *psTeam);
+
+int iStartThread(OsemThread_t *psThread, void (*pfnMain)(void *pvArg), void *pvArg);
+void vJoinThread(OsemThread_t sThread);
+
+void vInitMutex(OsemMutex_t *psMutex);
+void vLockMutex(OsemMutex_t *psMutex);
+void vUnlockMutex(OsemMutex_t *psMutex);
+void vDestroyMutex(OsemMutex_t *psMutex);
+
+void vInitCond(OsemCond_t *psCond);
+void vWaitCond(OsemCond_t *psCond, OsemMutex_t *psMutex);
+void vSignalCond(OsemCond_t *psCond);
+void vBroadcastCond(OsemCond_t *psCond);
+void vDestroyCond(OsemCond_t *psCond);
+
+double dGetWallTime(void);
+
+#endif
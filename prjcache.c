@@ -0,0 +1,328 @@
+/*
+	prjcache.c
+
+	Cache of modified projections in a local directory (prj_cache_dir).
+
+	The key of an entry is a 64 bit FNV-1a hash of the content hash of
+	the input file, the sizes of the input, the slice range, the bin
+	widths, the scale factor and the Left edge of every view. The content
+	hash of a file is remembered in a small <hash>.hash file keyed by the
+	file's name, inode, size and modification time (to the nanosecond
+	where stat has it), so an unchanged input is only hashed once.
+
+	An entry, <key>.prjc, is a 64 byte header followed by the floats of
+	the modified projections. It is written to a temporary file that is
+	renamed into place, so concurrent runs never see half an entry. On a
+	hit the entry is mapped and copied into the projection array, which
+	the callers own and free with IrlFree, and its modification time is
+	refreshed, as is that of a memo that is used. After an entry is added
+	the least recently used entries and memos are removed until the cache
+	is at most prj_cache_mb megabytes.
+
+	The cache needs POSIX file and directory calls; it is not used on
+	WIN32.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#ifndef WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <utime.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#endif
+
+#include <mip/irl.h>
+#include <mip/imgio.h>
+#include <mip/errdefs.h>
+#include <mip/printmsg.h>
+
+#include "loadimages.h"
+#include "prjcache.h"
+
+#define PRJCACHE_MAGIC		"OSEMPRJC"
+#define PRJCACHE_VERSION	1
+#define PRJCACHE_HDR_SIZE	64
+#define FNV_OFFSET			0xcbf29ce484222325ULL
+#define FNV_PRIME			0x100000001b3ULL
+#define HASH_BLOCK			(1 << 20)
+#define HASH_EXTENSION		".hash"
+
+// nanoseconds of the modification time, 0 where stat only has seconds
+#if defined(__APPLE__)
+#define MTIME_NSEC(psStat)	((long)(psStat)->st_mtimespec.tv_nsec)
+#elif defined(__linux__)
+#define MTIME_NSEC(psStat)	((long)(psStat)->st_mtim.tv_nsec)
+#else
+#define MTIME_NSEC(psStat)	0L
+#endif
+
+typedef struct {
+	char achMagic[8];
+	uint32_t uVersion;
+	uint32_t uPad;
+	uint64_t lKey;
+	uint64_t lNumFloats;
+} CacheHeader_t;
+
+#ifndef WIN32
+static uint64_t lFnv(uint64_t lHash, const void *pv, size_t lLen)
+{
+	const unsigned char *pch = (const unsigned char *)pv;
+
+	while (lLen--){
+		lHash ^= *pch++;
+		lHash *= FNV_PRIME;
+	}
+	return lHash;
+}
+
+// the content hash of a file, from the memo in the cache directory if the file has not changed
+static int iGetContentHash(char *pchDir, char *pchName, uint64_t *plHash)
+{
+	char achMemo[PRJCACHE_MAX_NAME];
+	struct stat sStat;
+	unsigned char *pchBuf;
+	uint64_t lMemoKey;
+	unsigned long long llHash;
+	long lNsec;
+	size_t lRead;
+	FILE *pFile;
+
+	if (stat(pchName, &sStat))
+		return 1;
+	lMemoKey = lFnv(FNV_OFFSET, pchName, strlen(pchName));
+	lMemoKey = lFnv(lMemoKey, &sStat.st_size, sizeof(sStat.st_size));
+	lMemoKey = lFnv(lMemoKey, &sStat.st_mtime, sizeof(sStat.st_mtime));
+	lNsec = MTIME_NSEC(&sStat);
+	lMemoKey = lFnv(lMemoKey, &lNsec, sizeof(lNsec));
+	lMemoKey = lFnv(lMemoKey, &sStat.st_ino, sizeof(sStat.st_ino));
+	snprintf(achMemo, sizeof(achMemo), "%s/%016llx%s", pchDir, (unsigned long long)lMemoKey, HASH_EXTENSION);
+	if ((pFile = fopen(achMemo, "r")) != NULL){
+		lRead = fscanf(pFile, "%llx", &llHash);
+		fclose(pFile);
+		if (lRead == 1){
+			*plHash = (uint64_t)llHash;
+			// a memo in use is recent for the eviction
+			utime(achMemo, NULL);
+			return 0;
+		}
+	}
+
+	if ((pFile = fopen(pchName, "rb")) == NULL)
+		return 1;
+	pchBuf = (unsigned char *)malloc(HASH_BLOCK);
+	if (pchBuf == NULL){
+		fclose(pFile);
+		return 1;
+	}
+	*plHash = FNV_OFFSET;
+	while ((lRead = fread(pchBuf, 1, HASH_BLOCK, pFile)) > 0)
+		*plHash = lFnv(*plHash, pchBuf, lRead);
+	fclose(pFile);
+	free(pchBuf);
+
+	if ((pFile = fopen(achMemo, "w")) != NULL){
+		fprintf(pFile, "%016llx\n", (unsigned long long)*plHash);
+		fclose(pFile);
+	}
+	return 0;
+}
+
+// the key of the modified projections that psLoad will read
+static uint64_t lCacheKey(ImageLoad_t *psLoad, uint64_t lContentHash)
+{
+	IrlParms_t *psParms = psLoad->psParms;
+	int aiSizes[7], iView;
+	float afWidths[3];
+	uint64_t lKey = FNV_OFFSET;
+
+	aiSizes[0] = psLoad->iXdim;
+	aiSizes[1] = psLoad->iYdim;
+	aiSizes[2] = psLoad->iZdim;
+	aiSizes[3] = psLoad->iStartSlice;
+	aiSizes[4] = psParms->NumSlices;
+	aiSizes[5] = psParms->NumPixels;
+	aiSizes[6] = psParms->NumViews;
+	// the input and output bin widths and the scale factor, as vReadImageLoad passes them
+	afWidths[0] = psLoad->fInBinWidth;
+	afWidths[1] = psParms->BinWidth;
+	afWidths[2] = (float)psParms->NumViews;
+	lKey = lFnv(lKey, &lContentHash, sizeof(lContentHash));
+	lKey = lFnv(lKey, aiSizes, sizeof(aiSizes));
+	lKey = lFnv(lKey, afWidths, sizeof(afWidths));
+	for (iView = 0; iView < psParms->NumViews; iView++)
+		lKey = lFnv(lKey, &psLoad->psViews[iView].Left, sizeof(float));
+	return lKey;
+}
+
+static size_t lNumPrjFloats(ImageLoad_t *psLoad)
+{
+	return (size_t)psLoad->psParms->NumSlices*psLoad->psParms->NumPixels*psLoad->psParms->NumViews;
+}
+
+typedef struct {
+	char achName[PRJCACHE_MAX_NAME];
+	off_t lSize;
+	double dTime;		// modification time in seconds
+} CacheEntry_t;
+
+static int iCompareEntryTimes(const void *pv1, const void *pv2)
+{
+	const CacheEntry_t *ps1 = (const CacheEntry_t *)pv1, *ps2 = (const CacheEntry_t *)pv2;
+
+	return ps1->dTime < ps2->dTime ? -1 : ps1->dTime > ps2->dTime ? 1 : 0;
+}
+
+// TRUE if pchName ends in pchExt and has something before it
+static int bHasExtension(const char *pchName, const char *pchExt)
+{
+	size_t lNameLen = strlen(pchName), lExtLen = strlen(pchExt);
+
+	return lNameLen > lExtLen && strcmp(pchName + lNameLen - lExtLen, pchExt) == 0;
+}
+
+// removes the least recently used entries and memos until the cache fits in dMaxBytes
+static void vEvictCachedPrj(char *pchDir, double dMaxBytes)
+{
+	DIR *pDir;
+	struct dirent *psDirEnt;
+	struct stat sStat;
+	CacheEntry_t *psEntries = NULL, *psNew;
+	int i, iNumEntries = 0, iMaxEntries = 0;
+	double dTotal = 0.0;
+
+	if ((pDir = opendir(pchDir)) == NULL)
+		return;
+	while ((psDirEnt = readdir(pDir)) != NULL){
+		if (!bHasExtension(psDirEnt->d_name, PRJCACHE_EXTENSION) && !bHasExtension(psDirEnt->d_name, HASH_EXTENSION))
+			continue;
+		if (iNumEntries == iMaxEntries){
+			iMaxEntries = iMaxEntries ? 2*iMaxEntries : 64;
+			if ((psNew = (CacheEntry_t *)realloc(psEntries, sizeof(CacheEntry_t)*iMaxEntries)) == NULL)
+				break;
+			psEntries = psNew;
+		}
+		snprintf(psEntries[iNumEntries].achName, PRJCACHE_MAX_NAME, "%s/%s", pchDir, psDirEnt->d_name);
+		if (stat(psEntries[iNumEntries].achName, &sStat))
+			continue;
+		psEntries[iNumEntries].lSize = sStat.st_size;
+		psEntries[iNumEntries].dTime = (double)sStat.st_mtime + 1e-9*MTIME_NSEC(&sStat);
+		dTotal += (double)sStat.st_size;
+		iNumEntries++;
+	}
+	closedir(pDir);
+
+	if (dTotal > dMaxBytes){
+		qsort(psEntries, iNumEntries, sizeof(CacheEntry_t), iCompareEntryTimes);
+		for (i = 0; i < iNumEntries && dTotal > dMaxBytes; i++)
+			if (unlink(psEntries[i].achName) == 0){
+				dTotal -= (double)psEntries[i].lSize;
+				vPrintMsg(6, "prj cache: evicted %s\n", psEntries[i].achName);
+			}
+	}
+	free(psEntries);
+}
+#endif
+
+/**
+	@brief Looks for the modified projections of a prepared LOAD_PRJ in the
+	cache and copies them into psLoad->pfPixels if they are there.
+
+	@param pchEntry - gets the name of the entry (PRJCACHE_MAX_NAME chars),
+		to pass to vPutCachedPrj on a miss; empty if the input could not
+		be hashed.
+
+	@return 0 on a hit, 1 if the projections have to be read.
+*/
+int iGetCachedPrj(ImageLoad_t *psLoad, char *pchEntry)
+{
+#ifdef WIN32
+	pchEntry[0] = '\0';
+	return 1;
+#else
+	CacheHeader_t sHdr;
+	struct stat sStat;
+	uint64_t lContentHash, lKey;
+	size_t lDataSize = sizeof(float)*lNumPrjFloats(psLoad);
+	void *pvMap;
+	int iFd;
+
+	pchEntry[0] = '\0';
+	if (iGetContentHash(psLoad->pchCacheDir, psLoad->pchName, &lContentHash))
+		return 1;
+	lKey = lCacheKey(psLoad, lContentHash);
+	snprintf(pchEntry, PRJCACHE_MAX_NAME, "%s/%016llx%s", psLoad->pchCacheDir, (unsigned long long)lKey, PRJCACHE_EXTENSION);
+
+	if ((iFd = open(pchEntry, O_RDONLY)) < 0)
+		return 1;
+	if (fstat(iFd, &sStat) || (size_t)sStat.st_size != PRJCACHE_HDR_SIZE + lDataSize){
+		close(iFd);
+		return 1;
+	}
+	pvMap = mmap(NULL, (size_t)sStat.st_size, PROT_READ, MAP_SHARED, iFd, 0);
+	close(iFd);
+	if (pvMap == MAP_FAILED)
+		return 1;
+	memcpy(&sHdr, pvMap, sizeof(sHdr));
+	if (memcmp(sHdr.achMagic, PRJCACHE_MAGIC, sizeof(sHdr.achMagic)) || sHdr.uVersion != PRJCACHE_VERSION
+		|| sHdr.lKey != lKey || sHdr.lNumFloats != lNumPrjFloats(psLoad)){
+		munmap(pvMap, (size_t)sStat.st_size);
+		return 1;
+	}
+	madvise(pvMap, (size_t)sStat.st_size, MADV_SEQUENTIAL);
+	memcpy(psLoad->pfPixels, (const char *)pvMap + PRJCACHE_HDR_SIZE, lDataSize);
+	munmap(pvMap, (size_t)sStat.st_size);
+	// the modification time orders the entries for eviction
+	utime(pchEntry, NULL);
+	psLoad->dBytes = (double)sStat.st_size;
+	vPrintMsg(6, "prj cache: %s of %s from %s\n", psLoad->pchWhat, psLoad->pchName, pchEntry);
+	return 0;
+#endif
+}
+
+/**
+	@brief Stores the modified projections of psLoad as entry pchEntry
+	(from iGetCachedPrj) and evicts old entries. Failures only give a
+	warning; the projections are still used.
+*/
+void vPutCachedPrj(ImageLoad_t *psLoad, char *pchEntry)
+{
+#ifndef WIN32
+	char achTmp[PRJCACHE_MAX_NAME + 32];
+	unsigned char achHdr[PRJCACHE_HDR_SIZE];
+	CacheHeader_t sHdr;
+	size_t lNumFloats = lNumPrjFloats(psLoad);
+	FILE *pFile;
+	int bWritten;
+
+	if (pchEntry[0] == '\0')
+		return;
+	memset(&sHdr, 0, sizeof(sHdr));
+	memcpy(sHdr.achMagic, PRJCACHE_MAGIC, sizeof(sHdr.achMagic));
+	sHdr.uVersion = PRJCACHE_VERSION;
+	sHdr.lKey = strtoull(strrchr(pchEntry, '/') + 1, NULL, 16);
+	sHdr.lNumFloats = lNumFloats;
+	memset(achHdr, 0, sizeof(achHdr));
+	memcpy(achHdr, &sHdr, sizeof(sHdr));
+
+	snprintf(achTmp, sizeof(achTmp), "%s.tmp.%d", pchEntry, (int)getpid());
+	if ((pFile = fopen(achTmp, "wb")) == NULL){
+		vErrorHandler(ECLASS_WARN, ETYPE_IO, "PutCachedPrj", "unable to write %s", achTmp);
+		return;
+	}
+	bWritten = fwrite(achHdr, sizeof(achHdr), 1, pFile) == 1 && fwrite(psLoad->pfPixels, sizeof(float), lNumFloats, pFile) == lNumFloats;
+	if (fclose(pFile) || !bWritten || rename(achTmp, pchEntry)){
+		vErrorHandler(ECLASS_WARN, ETYPE_IO, "PutCachedPrj", "unable to write %s", pchEntry);
+		unlink(achTmp);
+		return;
+	}
+	vPrintMsg(6, "prj cache: stored %s of %s in %s\n", psLoad->pchWhat, psLoad->pchName, pchEntry);
+	vEvictCachedPrj(psLoad->pchCacheDir, psLoad->dCacheMaxBytes);
+#endif
+}
@@ -0,0 +1,22 @@
+/*
+	prjcache.h
+
+	Cache of modified (shifted, rebinned and scaled) projections and
+	scatter estimates, so that reconstructing the same data again with
+	other iteration or subset settings does not redo that work. Entries
+	are keyed by the content of the input file and by every parameter
+	that affects the modified projections.
+
+	Include mip/irl.h, mip/imgio.h and loadimages.h before this file.
+*/
+
+#ifndef PRJCACHE_H
+#define PRJCACHE_H
+
+#define PRJCACHE_EXTENSION	".prjc"
+#define PRJCACHE_MAX_NAME	1024
+
+int iGetCachedPrj(ImageLoad_t *psLoad, char *pchEntry);
+void vPutCachedPrj(ImageLoad_t *psLoad, char *pchEntry);
+
+#endif
@@ -0,0 +1,386 @@
+/*
+	prjpack.c
+
+	Packed projection files. The file starts with a header (magic,
+	version, byte order mark, xdim, ydim, zdim and rows per chunk, all 32
+	bit and in native byte order like the .im header), followed by an
+	index with one entry per chunk (64 bit offset, 32 bit size, 32 bit
+	codec) and the chunks. Chunk c holds rows
+	[(c%n)*iChunkRows, (c%n+1)*iChunkRows) of view c/n, where n is the
+	number of chunks in a view, so any rows of any view can be found
+	without reading the rest of the file.
+
+	A chunk is Rice coded (ricecode.c), as counts if all of its values
+	are integer counts and as float bit patterns otherwise, unless that
+	does not make it smaller; then it is stored as plain floats. Either
+	way the pixels read back are exactly the pixels packed.
+
+	Offsets are 64 bit, so the file is positioned with fseeko (with a 64
+	bit off_t) or _fseeki64 on WIN32; fseek takes a long, which is 32
+	bits on WIN32.
+*/
+
+#ifndef WIN32
+#define _FILE_OFFSET_BITS 64
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#ifndef WIN32
+#include <sys/types.h>
+#endif
+
+#include <mip/irl.h>
+#include <mip/imgio.h>
+#include <mip/errdefs.h>
+#include <mip/printmsg.h>
+
+#include "osemthreads.h"
+#include "ricecode.h"
+#include "prjpack.h"
+
+// positions fp at a 64 bit offset from the start; returns 0 on success
+static int iSeekTo(FILE *fp, uint64_t lOffset)
+{
+#ifdef WIN32
+	return _fseeki64(fp, (__int64)lOffset, SEEK_SET);
+#else
+	return fseeko(fp, (off_t)lOffset, SEEK_SET);
+#endif
+}
+
+#define PRJPACK_MAGIC		"OSEMPRJZ"
+#define PRJPACK_VERSION		1
+#define PRJPACK_BYTE_ORDER	0x01020304
+
+enum { CHUNK_FLOAT, CHUNK_RICE_COUNTS, CHUNK_RICE_FLOAT, NUM_CHUNK_CODECS };
+
+typedef struct {
+	char achMagic[8];
+	uint32_t uVersion;
+	uint32_t uByteOrder;
+	int32_t iXdim, iYdim, iZdim;
+	int32_t iChunkRows;
+} PackHeader_t;
+
+typedef struct {
+	uint64_t lOffset;
+	uint32_t uSize;
+	uint32_t uCodec;
+} PackChunk_t;
+
+struct PackedPrj_s {
+	FILE *pFile;
+	char *pchName;
+	PackHeader_t sHdr;
+	int iChunksPerView;
+	PackChunk_t *psChunks;
+	OsemMutex_t sMutex;			// the decoding threads share the file position
+};
+
+static int bReadHeader(FILE *pFile, PackHeader_t *psHdr)
+{
+	return fread(psHdr, sizeof(PackHeader_t), 1, pFile) == 1 && memcmp(psHdr->achMagic, PRJPACK_MAGIC, sizeof(psHdr->achMagic)) == 0;
+}
+
+/**
+	@brief Tells whether a file is a packed projection file, from its header.
+*/
+int bIsPackedPrj(char *pchName)
+{
+	PackHeader_t sHdr;
+	FILE *pFile;
+	int bPacked;
+
+	if ((pFile = fopen(pchName, "rb")) == NULL)
+		return FALSE;
+	bPacked = bReadHeader(pFile, &sHdr);
+	fclose(pFile);
+	return bPacked;
+}
+
+// room needed to read any one chunk of the file
+static size_t lChunkBufSize(PackedPrj_t *psPack)
+{
+	int iNumValues = psPack->sHdr.iXdim*psPack->sHdr.iChunkRows;
+
+	return lRiceBound(iNumValues) > sizeof(float)*iNumValues ? lRiceBound(iNumValues) : sizeof(float)*iNumValues;
+}
+
+/**
+	@brief Opens a packed projection file and reads its index.
+
+	@param piXdim, piYdim, piZdim - get the number of bins, slices and views.
+*/
+PackedPrj_t *psOpenPackedPrj(char *pchName, int *piXdim, int *piYdim, int *piZdim)
+{
+	PackedPrj_t *psPack;
+	int iNumChunks, i;
+
+	psPack = (PackedPrj_t *)pvIrlMalloc(sizeof(PackedPrj_t), "OpenPackedPrj:psPack");
+	memset(psPack, 0, sizeof(PackedPrj_t));
+	psPack->pchName = pchName;
+	if ((psPack->pFile = fopen(pchName, "rb")) == NULL)
+		vErrorHandler(ECLASS_FATAL, ETYPE_IO, "OpenPackedPrj", "unable to open %s", pchName);
+	if (!bReadHeader(psPack->pFile, &psPack->sHdr))
+		vErrorHandler(ECLASS_FATAL, ETYPE_IO, "OpenPackedPrj", "%s is not a packed projection file", pchName);
+	if (psPack->sHdr.uByteOrder != PRJPACK_BYTE_ORDER || psPack->sHdr.uVersion != PRJPACK_VERSION)
+		vErrorHandler(ECLASS_FATAL, ETYPE_IO, "OpenPackedPrj", "%s was written with version %u or on a machine with the other byte order", pchName, (unsigned)psPack->sHdr.uVersion);
+	if (psPack->sHdr.iXdim <= 0 || psPack->sHdr.iYdim <= 0 || psPack->sHdr.iZdim <= 0 || psPack->sHdr.iChunkRows <= 0)
+		vErrorHandler(ECLASS_FATAL, ETYPE_IO, "OpenPackedPrj", "%s has an invalid header", pchName);
+
+	psPack->iChunksPerView = (psPack->sHdr.iYdim + psPack->sHdr.iChunkRows - 1)/psPack->sHdr.iChunkRows;
+	iNumChunks = psPack->iChunksPerView*psPack->sHdr.iZdim;
+	psPack->psChunks = (PackChunk_t *)pvIrlMalloc(sizeof(PackChunk_t)*iNumChunks, "OpenPackedPrj:psChunks");
+	if (fread(psPack->psChunks, sizeof(PackChunk_t), iNumChunks, psPack->pFile) != (size_t)iNumChunks)
+		vErrorHandler(ECLASS_FATAL, ETYPE_IO, "OpenPackedPrj", "%s: the chunk index is truncated", pchName);
+	for (i = 0; i < iNumChunks; i++)
+		if (psPack->psChunks[i].uCodec >= NUM_CHUNK_CODECS || psPack->psChunks[i].uSize > lChunkBufSize(psPack))
+			vErrorHandler(ECLASS_FATAL, ETYPE_IO, "OpenPackedPrj", "%s: chunk %d is invalid (codec %u, %u bytes)", pchName, i, (unsigned)psPack->psChunks[i].uCodec, (unsigned)psPack->psChunks[i].uSize);
+	vInitMutex(&psPack->sMutex);
+
+	*piXdim = psPack->sHdr.iXdim;
+	*piYdim = psPack->sHdr.iYdim;
+	*piZdim = psPack->sHdr.iZdim;
+	return psPack;
+}
+
+// the rows of a view that chunk iChunk (of the view) holds
+static int iChunkNumRows(PackedPrj_t *psPack, int iChunk)
+{
+	int iLeft = psPack->sHdr.iYdim - iChunk*psPack->sHdr.iChunkRows;
+
+	return iLeft < psPack->sHdr.iChunkRows ? iLeft : psPack->sHdr.iChunkRows;
+}
+
+/**
+	@brief Returns the bytes that have to be read from the file to get rows
+	[iStartRow,iStartRow+iNumRows) of every view.
+*/
+double dPackedRowBytes(PackedPrj_t *psPack, int iStartRow, int iNumRows)
+{
+	int iView, iChunk, iFirst = iStartRow/psPack->sHdr.iChunkRows, iLast = (iStartRow + iNumRows - 1)/psPack->sHdr.iChunkRows;
+	double dBytes = 0.0;
+
+	for (iView = 0; iView < psPack->sHdr.iZdim; iView++)
+		for (iChunk = iFirst; iChunk <= iLast; iChunk++)
+			dBytes += psPack->psChunks[iView*psPack->iChunksPerView + iChunk].uSize;
+	return dBytes;
+}
+
+// decodes one chunk into pfOut; safe to call from several threads at once. Returns 0 on success.
+static int iReadChunk(PackedPrj_t *psPack, int iView, int iChunk, unsigned char *pchBuf, float *pfOut, char *pchError, int iErrorLen)
+{
+	PackChunk_t *psChunk = psPack->psChunks + iView*psPack->iChunksPerView + iChunk;
+	int iNumValues = psPack->sHdr.iXdim*iChunkNumRows(psPack, iChunk);
+	int bRead;
+
+	vLockMutex(&psPack->sMutex);
+	bRead = iSeekTo(psPack->pFile, psChunk->lOffset) == 0 && fread(pchBuf, 1, psChunk->uSize, psPack->pFile) == psChunk->uSize;
+	vUnlockMutex(&psPack->sMutex);
+	if (!bRead){
+		snprintf(pchError, iErrorLen, "%s: unable to read chunk %d of view %d", psPack->pchName, iChunk, iView);
+		return 1;
+	}
+
+	if (psChunk->uCodec == CHUNK_FLOAT){
+		if (psChunk->uSize != sizeof(float)*iNumValues){
+			snprintf(pchError, iErrorLen, "%s: chunk %d of view %d has the wrong size", psPack->pchName, iChunk, iView);
+			return 1;
+		}
+		memcpy(pfOut, pchBuf, psChunk->uSize);
+	}else if (iRiceDecode(pchBuf, psChunk->uSize, iNumValues, psPack->sHdr.iXdim, psChunk->uCodec == CHUNK_RICE_COUNTS, pfOut)){
+		snprintf(pchError, iErrorLen, "%s: chunk %d of view %d is corrupt", psPack->pchName, iChunk, iView);
+		return 1;
+	}
+	return 0;
+}
+
+/**
+	@brief Reads and decodes rows [iStartRow,iStartRow+iNumRows) of one
+	view. Only the chunks holding those rows are read. Several threads can
+	read from the same file at once.
+
+	Errors are not reported here, so it can run on worker threads.
+
+	@param pfRows - gets iNumRows rows of xdim pixels.
+	@param pchError - gets what went wrong, at most iErrorLen characters.
+
+	@return 0 on success, non-zero if a chunk can not be read or decoded.
+*/
+int iReadPackedRows(PackedPrj_t *psPack, int iView, int iStartRow, int iNumRows, float *pfRows, char *pchError, int iErrorLen)
+{
+	int iXdim = psPack->sHdr.iXdim, iChunkRows = psPack->sHdr.iChunkRows;
+	int iChunk, iChunkStart, iChunkEnd, iLo, iHi, iFirst, iLast, iErr = 0;
+	unsigned char *pchBuf;
+	float *pfChunk = NULL;
+
+	iFirst = iStartRow/iChunkRows;
+	iLast = (iStartRow + iNumRows - 1)/iChunkRows;
+	pchBuf = (unsigned char *)malloc(lChunkBufSize(psPack));
+	if (pchBuf == NULL){
+		snprintf(pchError, iErrorLen, "unable to allocate the chunk buffer");
+		return 1;
+	}
+	for (iChunk = iFirst; iChunk <= iLast && iErr == 0; iChunk++){
+		iChunkStart = iChunk*iChunkRows;
+		iChunkEnd = iChunkStart + iChunkNumRows(psPack, iChunk);
+		iLo = iChunkStart > iStartRow ? iChunkStart : iStartRow;
+		iHi = iChunkEnd < iStartRow + iNumRows ? iChunkEnd : iStartRow + iNumRows;
+		if (iLo == iChunkStart && iHi == iChunkEnd){
+			// chunks inside the requested rows are decoded in place
+			iErr = iReadChunk(psPack, iView, iChunk, pchBuf, pfRows + (long)(iChunkStart - iStartRow)*iXdim, pchError, iErrorLen);
+			continue;
+		}
+		if (pfChunk == NULL && (pfChunk = (float *)malloc(sizeof(float)*iXdim*iChunkRows)) == NULL){
+			snprintf(pchError, iErrorLen, "unable to allocate the chunk buffer");
+			iErr = 1;
+			break;
+		}
+		if ((iErr = iReadChunk(psPack, iView, iChunk, pchBuf, pfChunk, pchError, iErrorLen)) == 0)
+			memcpy(pfRows + (long)(iLo - iStartRow)*iXdim, pfChunk + (long)(iLo - iChunkStart)*iXdim, sizeof(float)*iXdim*(iHi - iLo));
+	}
+	free(pchBuf);
+	if (pfChunk != NULL)
+		free(pfChunk);
+	return iErr;
+}
+
+void vClosePackedPrj(PackedPrj_t *psPack)
+{
+	fclose(psPack->pFile);
+	vDestroyMutex(&psPack->sMutex);
+	IrlFree(psPack->psChunks);
+	IrlFree(psPack);
+}
+
+typedef struct {
+	PackedPrj_t *psPack;
+	float *pfPixels;
+	int *piErr;			// status of each view
+} PackCheck_t;
+
+static void vDecodeView(void *pvCheck, int iView)
+{
+	PackCheck_t *psCheck = (PackCheck_t *)pvCheck;
+	PackHeader_t *psHdr = &psCheck->psPack->sHdr;
+	char achError[256];
+
+	psCheck->piErr[iView] = iReadPackedRows(psCheck->psPack, iView, 0, psHdr->iYdim, psCheck->pfPixels + (long)iView*psHdr->iXdim*psHdr->iYdim, achError, sizeof(achError));
+}
+
+/**
+	@brief Packs a projection image (any image imgio reads) into a packed
+	projection file, checks that it reads back exactly and reports the
+	compression ratio and the decoding speed.
+
+	@param iChunkRows - rows (slices) in a chunk.
+
+	@return 0 on success, 1 if the packed file does not read back the same.
+*/
+int iPackPrjImage(char *pchInName, char *pchOutName, int iChunkRows)
+{
+	IMAGE *pImage;
+	FILE *pFile;
+	PackHeader_t sHdr;
+	PackChunk_t *psChunks;
+	PackCheck_t sCheck;
+	PackedPrj_t *psPack;
+	unsigned char *pchBuf;
+	float *pfPixels, *pfChunk;
+	int iXdim, iYdim, iZdim, iView, iChunk, iChunksPerView, iNumValues, iNumCounts = 0, iNumPlain = 0, bCounts, bSame, bDecoded;
+	long lViewLen;
+	uint64_t lOffset;
+	size_t lSize;
+	double dStart, dDecodeTime, dViewTime, dRawBytes;
+	char achError[256];
+
+	pImage = imgio_openimage(pchInName, 'o', &iXdim, &iYdim, &iZdim);
+	if (iChunkRows <= 0 || iChunkRows > iYdim)
+		iChunkRows = iYdim;
+	lViewLen = (long)iXdim*iYdim;
+	pfPixels = (float *)pvIrlMalloc(sizeof(float)*lViewLen*iZdim, "PackPrjImage:pfPixels");
+	imgio_readslices(pImage, 0, iZdim - 1, pfPixels);
+	imgio_closeimage(pImage);
+
+	memset(&sHdr, 0, sizeof(PackHeader_t));
+	memcpy(sHdr.achMagic, PRJPACK_MAGIC, sizeof(sHdr.achMagic));
+	sHdr.uVersion = PRJPACK_VERSION;
+	sHdr.uByteOrder = PRJPACK_BYTE_ORDER;
+	sHdr.iXdim = iXdim;
+	sHdr.iYdim = iYdim;
+	sHdr.iZdim = iZdim;
+	sHdr.iChunkRows = iChunkRows;
+	iChunksPerView = (iYdim + iChunkRows - 1)/iChunkRows;
+	psChunks = (PackChunk_t *)pvIrlMalloc(sizeof(PackChunk_t)*iChunksPerView*iZdim, "PackPrjImage:psChunks");
+	pchBuf = (unsigned char *)pvIrlMalloc((int)lRiceBound(iXdim*iChunkRows), "PackPrjImage:pchBuf");
+
+	if ((pFile = fopen(pchOutName, "wb")) == NULL)
+		vErrorHandler(ECLASS_FATAL, ETYPE_IO, "PackPrjImage", "unable to create %s", pchOutName);
+	// the index is written once the chunk sizes are known
+	lOffset = sizeof(PackHeader_t) + sizeof(PackChunk_t)*iChunksPerView*iZdim;
+	if (iSeekTo(pFile, lOffset))
+		vErrorHandler(ECLASS_FATAL, ETYPE_IO, "PackPrjImage", "unable to write %s", pchOutName);
+	for (iView = 0; iView < iZdim; iView++)
+		for (iChunk = 0; iChunk < iChunksPerView; iChunk++){
+			PackChunk_t *psChunk = psChunks + iView*iChunksPerView + iChunk;
+
+			pfChunk = pfPixels + iView*lViewLen + (long)iChunk*iChunkRows*iXdim;
+			iNumValues = iXdim*(iYdim - iChunk*iChunkRows < iChunkRows ? iYdim - iChunk*iChunkRows : iChunkRows);
+			bCounts = bRiceCounts(pfChunk, iNumValues);
+			lSize = lRiceEncode(pfChunk, iNumValues, iXdim, bCounts, pchBuf);
+			if (lSize > 0 && lSize < sizeof(float)*iNumValues){
+				psChunk->uCodec = bCounts ? CHUNK_RICE_COUNTS : CHUNK_RICE_FLOAT;
+				iNumCounts += bCounts;
+			}else{
+				psChunk->uCodec = CHUNK_FLOAT;
+				lSize = sizeof(float)*iNumValues;
+				iNumPlain++;
+			}
+			psChunk->lOffset = lOffset;
+			psChunk->uSize = (uint32_t)lSize;
+			if (fwrite(psChunk->uCodec != CHUNK_FLOAT ? (void *)pchBuf : (void *)pfChunk, 1, lSize, pFile) != lSize)
+				vErrorHandler(ECLASS_FATAL, ETYPE_IO, "PackPrjImage", "unable to write %s", pchOutName);
+			lOffset += lSize;
+		}
+	if (fseek(pFile, 0, SEEK_SET) || fwrite(&sHdr, sizeof(PackHeader_t), 1, pFile) != 1
+		|| fwrite(psChunks, sizeof(PackChunk_t), iChunksPerView*iZdim, pFile) != (size_t)(iChunksPerView*iZdim) || fclose(pFile))
+		vErrorHandler(ECLASS_FATAL, ETYPE_IO, "PackPrjImage", "unable to write %s", pchOutName);
+	IrlFree(pchBuf);
+	IrlFree(psChunks);
+
+	// read it back: all views in parallel, then one view on its own
+	psPack = psOpenPackedPrj(pchOutName, &iXdim, &iYdim, &iZdim);
+	sCheck.psPack = psPack;
+	sCheck.pfPixels = (float *)pvIrlMalloc(sizeof(float)*lViewLen*iZdim, "PackPrjImage:pfDecoded");
+	sCheck.piErr = (int *)pvIrlMalloc(sizeof(int)*iZdim, "PackPrjImage:piErr");
+	dStart = dGetWallTime();
+	vParallelFor(iZdim, vDecodeView, &sCheck);
+	dDecodeTime = dGetWallTime() - dStart;
+	dStart = dGetWallTime();
+	vDecodeView(&sCheck, iZdim/2);
+	dViewTime = dGetWallTime() - dStart;
+	// the first view that failed is decoded again here to report why
+	for (iView = 0; iView < iZdim && !sCheck.piErr[iView]; iView++)
+		;
+	bDecoded = iView == iZdim;
+	if (!bDecoded && iReadPackedRows(psPack, iView, 0, iYdim, sCheck.pfPixels + iView*lViewLen, achError, sizeof(achError)))
+		vErrorHandler(ECLASS_WARN, ETYPE_IO, "PackPrjImage", "%s", achError);
+	bSame = bDecoded && memcmp(pfPixels, sCheck.pfPixels, sizeof(float)*lViewLen*iZdim) == 0;
+	vClosePackedPrj(psPack);
+	IrlFree(sCheck.piErr);
+	IrlFree(sCheck.pfPixels);
+	IrlFree(pfPixels);
+
+	dRawBytes = (double)sizeof(float)*lViewLen*iZdim;
+	fprintf(stderr, "pack: %s (%d bins x %d slices x %d views) -> %s: %d chunks of %d slices, %d coded as counts, %d as floats, %d stored plain\n",
+		pchInName, iXdim, iYdim, iZdim, pchOutName, iChunksPerView*iZdim, iChunkRows, iNumCounts, iChunksPerView*iZdim - iNumCounts - iNumPlain, iNumPlain);
+	fprintf(stderr, "pack: %.3f MB of pixels -> %.3f MB, compression ratio %.2f\n", dRawBytes/1048576.0, (double)lOffset/1048576.0, dRawBytes/(double)lOffset);
+	fprintf(stderr, "pack: decoded all views in %.4f s (%.1f MB/s on %d threads), one view in %.3f ms\n",
+		dDecodeTime, dDecodeTime > 0.0 ? dRawBytes/1048576.0/dDecodeTime : 0.0, iGetNumThreads(), dViewTime*1000.0);
+	if (!bSame)
+		vErrorHandler(ECLASS_WARN, ETYPE_IO, "PackPrjImage", "%s does not read back the same as %s", pchOutName, pchInName);
+	return bSame ? 0 : 1;
+}
@@ -0,0 +1,29 @@
+/*
+	prjpack.h
+
+	Packed projection files: each view of a projection image is split
+	into chunks of rows, and each chunk is compressed on its own (Rice
+	coded counts, see ricecode.h, or plain floats) and listed in an index,
+	so single views and slice ranges can be read and decoded in parallel.
+	vGetImageSizes and pfGetPrjImage read them like .im files; osems
+	--pack makes them from an .im file.
+
+	Include mip/imgio.h before this file.
+*/
+
+#ifndef PRJPACK_H
+#define PRJPACK_H
+
+#define PRJPACK_EXTENSION	".imz"
+#define PRJPACK_CHUNK_ROWS	8		// default rows (slices) per chunk
+
+typedef struct PackedPrj_s PackedPrj_t;
+
+int bIsPackedPrj(char *pchName);
+PackedPrj_t *psOpenPackedPrj(char *pchName, int *piXdim, int *piYdim, int *piZdim);
+double dPackedRowBytes(PackedPrj_t *psPack, int iStartRow, int iNumRows);
+int iReadPackedRows(PackedPrj_t *psPack, int iView, int iStartRow, int iNumRows, float *pfRows, char *pchError, int iErrorLen);
+void vClosePackedPrj(PackedPrj_t *psPack);
+int iPackPrjImage(char *pchInName, char *pchOutName, int iChunkRows);
+
+#endif
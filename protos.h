@@ -11,6 +11,8 @@ char *pchGetSrfKrnlFname(void);
 char *pchGetDrfTabFname(void);
 int iSetupFromCmdLine(int iArgc, char **ppchArgv, IrlParms_t *psIrlParms, Options_t *psOptions, PrjView_t **ppsPrjViews, char **ppchSrfKrnlFile, char **ppchDrfTabFile, char **ppchLogFile, char **ppchMsgFile, char **ppchOutBase, float **ppfPrjImage, float **ppfAtnMap, float **ppfReconImage, float **ppfScatterEstimate, float *pfPrimaryFac, int iMode, char *(pUsageMsg(void)));
 void *pvLocalMalloc(int iSize, char *pchName);
+void vGetPrjBinning(int *piNumBins, float *pfBinWidth);
+void vGetThreadParms(void);
 
 // GetImages.c
 void vGetImageSizes(char *pchPrjImageName, IrlParms_t *psParms, int iMode);
@@ -24,4 +26,15 @@ float *pfGetOrbitImage(char *pchFname, IrlParms_t *psParms);
 // MeasToModPrj.c
 void vMeasToModPrj(int nBins, int nRotPixs, int nSlices, float Left, float BinWidth, float PixelWidth, float *RawPrjData, float *ModPrjData);
 void Interp_bck( float *InPrjData, float *OutPrjData, IrlParms_t *psParms, PrjView_t psView, float *Sum);
+// Interp_bck into nBins bins of BinWidth, e.g. from vGetPrjBinning
+void vInterpBckBinned(float *InPrjData, float *OutPrjData, IrlParms_t *psParms, PrjView_t psView, int nBins, float BinWidth, float *Sum);
+void vFreeInterpPlans(void);
+int iRebinSize(int iNum, float fFromWidth, float fToWidth);
+
+// batch.c
+int iRunBatch(char *pchManifest, int iNumWorkers, double dMemBudgetMB, char *pchSummary);
+
+// server.c
+int iRunServer(char *pchSocket, int iNumWorkers, double dMemBudgetMB);
+int iRunClient(char *pchSocket, int iArgc, char **ppchArgv);
 
@@ -0,0 +1,40 @@
+/*
+	rebinplan.h
+
+	Rebin plans: the overlap of the modified projection pixels of a view
+	with the measured bins, worked out once so that vMeasToModPrj does not
+	redo it for every slice. Views with the same Left share a plan.
+	Interp_bck uses the same plans the other way round, with the pixels
+	of the generated projections as the bins and its bins as the pixels.
+
+	Include mip/irl.h before this file.
+*/
+
+#ifndef REBINPLAN_H
+#define REBINPLAN_H
+
+#define REBIN_MIN_DENSE	8	// shortest run of pixels worth the dense kernel
+
+typedef struct RebinPlan_s {
+	int nBins, nRotPixs;
+	float Left, BinWidth, PixelWidth;	// what the plan was made for
+	float Scale;		// factor the weights include
+	int *piFirst;		// entries of pixel i are piFirst[i] to piFirst[i+1]-1
+	int *piBin;			// the bin of each entry, always inside the view
+	float *pfWeight;	// and the weight of that bin
+	/* pixels iDenseFirst to iDenseEnd-1 all take iTaps bins, pixel i
+		starting at bin piDenseStart[i], with the weight of tap t at
+		pfDense[t*nRotPixs + i]; bUnitStride if the starts go up by one */
+	int iTaps, iDenseFirst, iDenseEnd, bUnitStride;
+	int *piDenseStart;
+	float *pfDense;
+	struct RebinPlan_s *psNext;	// next distinct plan of a set made for the views
+} RebinPlan_t;
+
+RebinPlan_t *psMakeRebinPlan(int nBins, int nRotPixs, float Left, float BinWidth, float PixelWidth);
+void vApplyRebinPlan(const RebinPlan_t *psPlan, int nSlices, const float *RawPrjData, float *ModPrjData);
+void vFreeRebinPlan(RebinPlan_t *psPlan);
+RebinPlan_t **ppsMakeViewRebinPlans(int nBins, int nRotPixs, int nViews, const PrjView_t *psViews, float BinWidth, float PixelWidth);
+void vFreeViewRebinPlans(RebinPlan_t **ppsPlans);
+
+#endif
@@ -0,0 +1,302 @@
+/*
+	ricecode.c
+
+	Lossless coding of projection rows with adaptive Rice codes.
+
+	Each value is first turned into a 32 bit symbol. Integer counts below
+	2^24, the values of measured SPECT projections, are their own
+	symbols. Other floats use their bit pattern, mapped so that the order
+	of the symbols is the order of the values; neighbouring values of a
+	smooth view then have nearby symbols.
+
+	The symbols are coded in blocks of RICE_BLOCK. Each block starts with
+	a 7 bit header: 2 bits for the prediction mode and 5 bits for the Rice
+	parameter k. In raw mode the symbols themselves are coded, which is
+	best for low count Poisson data where neighbouring bins are nearly
+	independent. In delta mode the difference from the previous bin of
+	the row is coded (from the first bin of the row above for the first
+	bin of a row), and in linear mode the difference from the line
+	through the two previous bins, which suit smoother views. Differences
+	are taken modulo 2^32 and zigzag coded. The encoder picks the mode
+	and k that give the fewest bits for each block.
+
+	A coded value u is written as u>>k in unary (that many 0 bits and a 1
+	bit) followed by the low k bits of u. Quotients of RICE_ESCAPE or more
+	are written as RICE_ESCAPE 0 bits, a 1 bit and u as a 32 bit literal.
+	Bits are packed starting at the least significant bit of each byte.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+
+#include "ricecode.h"
+
+#define RICE_MAX_K		31
+#define RICE_MAX_COUNT	16777216.0f	// 2^24, all smaller integers are exact in float
+
+enum { MODE_RAW, MODE_DELTA, MODE_LINEAR, NUM_MODES };
+
+typedef struct {
+	unsigned char *pchOut;
+	uint64_t uAcc;
+	int iBits;
+} BitWriter_t;
+
+typedef struct {
+	const unsigned char *pchIn, *pchEnd;
+	uint64_t uAcc;
+	int iBits;
+	int iPadBytes;		// zero bytes added after the end of the input
+} BitReader_t;
+
+// iNumBits <= 32; uValue must fit in iNumBits
+static void vPutBits(BitWriter_t *psW, uint32_t uValue, int iNumBits)
+{
+	psW->uAcc |= (uint64_t)uValue << psW->iBits;
+	psW->iBits += iNumBits;
+	while (psW->iBits >= 8){
+		*psW->pchOut++ = (unsigned char)psW->uAcc;
+		psW->uAcc >>= 8;
+		psW->iBits -= 8;
+	}
+}
+
+static void vFillBits(BitReader_t *psR)
+{
+	uint64_t uByte;
+
+	while (psR->iBits <= 56){
+		if (psR->pchIn < psR->pchEnd)
+			uByte = *psR->pchIn++;
+		else{
+			uByte = 0;
+			psR->iPadBytes++;
+		}
+		psR->uAcc |= uByte << psR->iBits;
+		psR->iBits += 8;
+	}
+}
+
+// iNumBits <= 32
+static uint32_t uGetBits(BitReader_t *psR, int iNumBits)
+{
+	uint32_t uValue;
+
+	if (iNumBits == 0)
+		return 0;
+	if (psR->iBits < iNumBits)
+		vFillBits(psR);
+	uValue = (uint32_t)(psR->uAcc & (((uint64_t)1 << iNumBits) - 1));
+	psR->uAcc >>= iNumBits;
+	psR->iBits -= iNumBits;
+	return uValue;
+}
+
+static int iLowZeros(uint64_t u)
+{
+#if defined(__GNUC__)
+	return __builtin_ctzll(u);
+#else
+	int i = 0;
+
+	while (!(u & 1)){
+		u >>= 1;
+		i++;
+	}
+	return i;
+#endif
+}
+
+static uint32_t uZigzag(uint32_t uDiff)
+{
+	return uDiff & 0x80000000u ? ~(uDiff << 1) : uDiff << 1;
+}
+
+static uint32_t uUnzigzag(uint32_t u)
+{
+	return u & 1 ? ~(u >> 1) : u >> 1;
+}
+
+// float bit patterns mapped to symbols in the order of the values, and back
+static uint32_t uFloatSymbol(float f)
+{
+	uint32_t uBits;
+
+	memcpy(&uBits, &f, sizeof(uBits));
+	return uBits & 0x80000000u ? ~uBits : uBits | 0x80000000u;
+}
+
+static float fSymbolFloat(uint32_t uSym)
+{
+	uint32_t uBits = uSym & 0x80000000u ? uSym & 0x7fffffffu : ~uSym;
+	float f;
+
+	memcpy(&f, &uBits, sizeof(f));
+	return f;
+}
+
+// the symbol bin i is predicted from, modulo 2^32
+static uint32_t uPredict(const uint32_t *puSym, int i, int iRowLen, int iMode)
+{
+	int iCol = i % iRowLen;
+
+	if (iMode == MODE_RAW)
+		return 0;
+	if (iMode == MODE_LINEAR && iCol >= 2)
+		return 2*puSym[i - 1] - puSym[i - 2];
+	if (iCol)
+		return puSym[i - 1];
+	return i >= iRowLen ? puSym[i - iRowLen] : 0;
+}
+
+static uint32_t uCodedValue(const uint32_t *puSym, int i, int iRowLen, int iMode)
+{
+	if (iMode == MODE_RAW)
+		return puSym[i];
+	return uZigzag(puSym[i] - uPredict(puSym, i, iRowLen, iMode));
+}
+
+static unsigned long lCodeBits(uint32_t uValue, int k)
+{
+	uint32_t uQuot = uValue >> k;
+
+	return uQuot < RICE_ESCAPE ? uQuot + 1 + k : RICE_ESCAPE + 1 + 32;
+}
+
+/**
+	@brief Checks that all values are integers in [0,2^24), which can be
+	coded as counts.
+*/
+int bRiceCounts(const float *pfValues, int iNumValues)
+{
+	int i;
+
+	for (i = 0; i < iNumValues; i++)
+		if (!(pfValues[i] >= 0.0f && pfValues[i] < RICE_MAX_COUNT) || signbit(pfValues[i]) || pfValues[i] != (float)(int32_t)pfValues[i])
+			return 0;
+	return 1;
+}
+
+// largest number of bytes lRiceEncode can produce for iNumValues values
+size_t lRiceBound(int iNumValues)
+{
+	return (size_t)iNumValues*8 + 16;
+}
+
+/**
+	@brief Codes iNumValues values.
+
+	@param iRowLen - number of bins in a row, for the predictions.
+	@param bCounts - the values are counts accepted by bRiceCounts; any
+		float values can be coded otherwise.
+	@param pchOut - room for lRiceBound(iNumValues) bytes.
+
+	@return the number of bytes written, or 0 if out of memory.
+*/
+size_t lRiceEncode(const float *pfValues, int iNumValues, int iRowLen, int bCounts, unsigned char *pchOut)
+{
+	BitWriter_t sW;
+	unsigned long lBits, lBestBits;
+	uint32_t uValue, *puSym;
+	int i, iStart, iEnd, k, iMode, iBestK = 0, iBestMode = 0;
+
+	if ((puSym = (uint32_t *)malloc(sizeof(uint32_t)*iNumValues)) == NULL)
+		return 0;
+	for (i = 0; i < iNumValues; i++)
+		puSym[i] = bCounts ? (uint32_t)pfValues[i] : uFloatSymbol(pfValues[i]);
+
+	sW.pchOut = pchOut;
+	sW.uAcc = 0;
+	sW.iBits = 0;
+	for (iStart = 0; iStart < iNumValues; iStart = iEnd){
+		iEnd = iStart + RICE_BLOCK < iNumValues ? iStart + RICE_BLOCK : iNumValues;
+		lBestBits = (unsigned long)-1;
+		for (iMode = 0; iMode < NUM_MODES; iMode++)
+			for (k = 0; k <= RICE_MAX_K; k++){
+				lBits = 0;
+				for (i = iStart; i < iEnd; i++)
+					lBits += lCodeBits(uCodedValue(puSym, i, iRowLen, iMode), k);
+				if (lBits < lBestBits){
+					lBestBits = lBits;
+					iBestK = k;
+					iBestMode = iMode;
+				}
+			}
+		vPutBits(&sW, (uint32_t)(iBestMode | iBestK << 2), 7);
+		for (i = iStart; i < iEnd; i++){
+			uValue = uCodedValue(puSym, i, iRowLen, iBestMode);
+			if ((uValue >> iBestK) < RICE_ESCAPE){
+				vPutBits(&sW, 1u << (uValue >> iBestK), (uValue >> iBestK) + 1);
+				if (iBestK)
+					vPutBits(&sW, uValue & (uint32_t)(((uint64_t)1 << iBestK) - 1), iBestK);
+			}else{
+				vPutBits(&sW, 1u << RICE_ESCAPE, RICE_ESCAPE + 1);
+				vPutBits(&sW, uValue, 32);
+			}
+		}
+	}
+	if (sW.iBits)
+		*sW.pchOut++ = (unsigned char)sW.uAcc;
+	free(puSym);
+	return (size_t)(sW.pchOut - pchOut);
+}
+
+/**
+	@brief Decodes iNumValues values coded by lRiceEncode with the same
+	iRowLen and bCounts.
+
+	@return 0 on success, 1 if the input is corrupt or out of memory.
+*/
+int iRiceDecode(const unsigned char *pchIn, size_t lInSize, int iNumValues, int iRowLen, int bCounts, float *pfValues)
+{
+	BitReader_t sR;
+	uint32_t uHeader, uValue, *puSym;
+	int i, iEnd, k, iMode, iZeros, iErr = 0;
+
+	if ((puSym = (uint32_t *)malloc(sizeof(uint32_t)*iNumValues)) == NULL)
+		return 1;
+	sR.pchIn = pchIn;
+	sR.pchEnd = pchIn + lInSize;
+	sR.uAcc = 0;
+	sR.iBits = 0;
+	sR.iPadBytes = 0;
+	for (i = 0; i < iNumValues && !iErr; ){
+		uHeader = uGetBits(&sR, 7);
+		iMode = uHeader & 3;
+		k = uHeader >> 2;
+		if (iMode >= NUM_MODES){
+			iErr = 1;
+			break;
+		}
+		iEnd = i + RICE_BLOCK < iNumValues ? i + RICE_BLOCK : iNumValues;
+		for (; i < iEnd; i++){
+			vFillBits(&sR);
+			if (!(sR.uAcc & (((uint64_t)1 << (RICE_ESCAPE + 1)) - 1))){
+				iErr = 1;
+				break;
+			}
+			iZeros = iLowZeros(sR.uAcc);
+			sR.uAcc >>= iZeros + 1;
+			sR.iBits -= iZeros + 1;
+			if (iZeros < RICE_ESCAPE)
+				uValue = (uint32_t)((uint64_t)iZeros << k) | uGetBits(&sR, k);
+			else
+				uValue = uGetBits(&sR, 32);
+			puSym[i] = iMode == MODE_RAW ? uValue : uPredict(puSym, i, iRowLen, iMode) + uUnzigzag(uValue);
+			if (bCounts && puSym[i] >= (uint32_t)RICE_MAX_COUNT){
+				iErr = 1;
+				break;
+			}
+		}
+	}
+	// the padding after the end of the input must not have been used
+	if (!iErr && sR.iPadBytes*8 > sR.iBits)
+		iErr = 1;
+	if (!iErr)
+		for (i = 0; i < iNumValues; i++)
+			pfValues[i] = bCounts ? (float)puSym[i] : fSymbolFloat(puSym[i]);
+	free(puSym);
+	return iErr;
+}
@@ -0,0 +1,22 @@
+/*
+	ricecode.h
+
+	Lossless adaptive Rice coding of projection rows, counts or any
+	floats, used for the chunks of packed projection files (see
+	prjpack.h).
+*/
+
+#ifndef RICECODE_H
+#define RICECODE_H
+
+#include <stddef.h>
+
+#define RICE_BLOCK	32	// values that share one coding mode and Rice parameter
+#define RICE_ESCAPE	24	// quotients this large are stored as 32 bit literals
+
+int bRiceCounts(const float *pfValues, int iNumValues);
+size_t lRiceBound(int iNumValues);
+size_t lRiceEncode(const float *pfValues, int iNumValues, int iRowLen, int bCounts, unsigned char *pchOut);
+int iRiceDecode(const unsigned char *pchIn, size_t lInSize, int iNumValues, int iRowLen, int bCounts, float *pfValues);
+
+#endif
@@ -16,6 +16,10 @@ static char *pchsgIterSaveString=NULL;
 static int isgDefaultInterval=1;
 static int isgNumIterations=0;
 static int bsgFirst=TRUE;
+static int isgLastIterChange=0;
+static int isgCrntInterval=0;
+static int isgNextIterChange=0;
+static int isgNextInterval=0;
 
 void vInitIterSaveString(int iDefaultInterval, int iNumIterations, char *pchIterSaveString)
 /* Initializes the IterSaveString package. This package has two publicly accessible functions:
@@ -37,6 +41,10 @@ void vInitIterSaveString(int iDefaultInterval, int iNumIterations, char *pchIter
 	isgNumIterations=iNumIterations;
 	pchsgIterSaveString=pchIrlStrdup(pchIterSaveString);
 	bsgFirst=TRUE;
+	isgLastIterChange=0;
+	isgCrntInterval=0;
+	isgNextIterChange=0;
+	isgNextInterval=0;
 }
 	
 
@@ -100,35 +108,30 @@ int bCheckIfSaveIteration(int iIter)
 	For example, 1 2 5 10/5
 	Would save iterations 1 2 5 10, and every 5th one after that */
 {
-	static int iLastIterChange=0;
-	static int iCrntInterval=0;
-	static int iNextIterChange=0;
-	static int iNextInterval=0;
-
 	if (bsgFirst){
-		iCrntInterval=isgDefaultInterval;
-		iNextInterval=isgDefaultInterval;
+		isgCrntInterval=isgDefaultInterval;
+		isgNextInterval=isgDefaultInterval;
 		bsgFirst=FALSE;
 		if (pchsgIterSaveString == NULL || *pchsgIterSaveString == '\0'){
-			iNextIterChange = iIter-1;
+			isgNextIterChange = iIter-1;
 		}
 	}
-	while (iIter >= iNextIterChange && iNextIterChange >= 0){
-		iLastIterChange=iNextIterChange;
-		iCrntInterval=iNextInterval;
+	while (iIter >= isgNextIterChange && isgNextIterChange >= 0){
+		isgLastIterChange=isgNextIterChange;
+		isgCrntInterval=isgNextInterval;
 		if (pchsgIterSaveString == NULL || *pchsgIterSaveString == '\0'){
-			iNextIterChange = -1;
+			isgNextIterChange = -1;
 		}else{
 			FindNextChangeIter(pchsgIterSaveString,
-				&iNextIterChange, &iNextInterval);
+				&isgNextIterChange, &isgNextInterval);
 		}
 		vPrintMsg(6, "Current Save Interval=%d. On iter. %d will change to %d\n",
-							iCrntInterval, iNextIterChange, iNextInterval);
+							isgCrntInterval, isgNextIterChange, isgNextInterval);
 	}
 	if (iIter == isgNumIterations) return (TRUE);
-	if (iIter == iLastIterChange) return(TRUE);
-	if (iCrntInterval == 0) return (FALSE);
-	return((iIter - iLastIterChange) % iCrntInterval == 0);
+	if (iIter == isgLastIterChange) return(TRUE);
+	if (isgCrntInterval == 0) return (FALSE);
+	return((iIter - isgLastIterChange) % isgCrntInterval == 0);
 }
 
 void vFreeIterSaveString()
@@ -0,0 +1,454 @@
+/*
+	server.c
+
+	osems --serve socket: a long running reconstruction server that takes
+	studies over a local Unix domain socket, and osems --client socket
+	command, a client for it.
+
+	The server hands the studies to a pool of forked worker processes
+	(see batch.c). Each worker keeps the sessions it has set up, keyed by
+	the content of the parameter file, the files it names and the
+	projection size, so a warm worker skips the parameter parsing and the
+	orbit and scatter estimate setup. libirl makes its FFTW plans, DRF
+	tables and normalization inside every IrlOsem call, so those are made
+	again for every study.
+
+	The header of the projections is read in a short lived child to
+	estimate the memory of a study, since imgio and the packed reader
+	treat a bad file as fatal. Finished jobs are dropped from the queue,
+	so a long running server only keeps the queued and running ones.
+
+	The protocol is one line of text per request:
+
+		recon parfile prjimage atnmap initest outbase
+			-> queued id depth, and when the study is done
+			-> done id ok|error wait_s run_s total_s
+		status
+			-> status queued n running n done n failed n mean_latency s
+		shutdown
+			-> bye; the server exits once the queued studies are done
+
+	A request that can not be accepted is answered with error message.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#ifndef WIN32
+#include <unistd.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/select.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#endif
+
+#include <mip/errdefs.h>
+#include <mip/printmsg.h>
+#include <mip/miputil.h>
+#include <mip/irl.h>
+
+#include "protos.h"
+#include "osemthreads.h"
+#include "batch.h"
+
+#ifndef WIN32
+
+#define MAX_CLIENTS 64
+#define ESTIMATE_TIMEOUT 30		// seconds the child that reads a header may take
+
+typedef struct {
+	int iFd;
+	int iLen;						// bytes in achLine
+	int bWaiting;					// the request was read, the connection waits for the done reply
+	char achLine[MAX_STUDY_LINE];
+} Client_t;
+
+typedef struct {
+	Study_t sStudy;
+	int iId;						// number the client was given
+	int iClientFd;					// connection to answer when done, -1 if it was closed
+	int bFinished;					// done or failed, dropped by vReapJobs
+	double dSubmitTime, dStartTime;
+} ServerJob_t;
+
+static ServerJob_t *psgJobs = NULL;
+static int isgNumJobs = 0, isgMaxJobs = 0;
+static int isgNextJob = 0;			// the jobs from here on are queued
+static int isgNumSubmitted = 0;
+static int isgNumDone = 0, isgNumFailed = 0;
+static double dsgSumLatency = 0.0;
+
+static void vReply(int iFd, const char *pchFormat, ...)
+{
+	char achReply[MAX_STUDY_LINE];
+	va_list args;
+	int iLen;
+
+	if (iFd < 0)
+		return;
+	va_start(args, pchFormat);
+	iLen = vsnprintf(achReply, sizeof(achReply), pchFormat, args);
+	va_end(args);
+	if (iLen > 0 && write(iFd, achReply, iLen < (int)sizeof(achReply) ? iLen : (int)sizeof(achReply) - 1) < 0)
+		vPrintMsg(6, "server: reply to a closed connection\n");
+}
+
+static void vCloseClient(Client_t *psClient)
+{
+	int i;
+
+	// a job whose client went away still runs, nobody is told when it is done
+	for (i = 0; i < isgNumJobs; i++)
+		if (psgJobs[i].iClientFd == psClient->iFd)
+			psgJobs[i].iClientFd = -1;
+	close(psClient->iFd);
+	psClient->iFd = -1;
+}
+
+/* dEstimateStudyMB in a child process, so that a file imgio or the
+	packed reader find fatal only ends the child. Returns -1 if the
+	projections could not be read in ESTIMATE_TIMEOUT seconds */
+static double dEstimateInChild(Study_t *psStudy)
+{
+	struct timeval sTimeout;
+	fd_set sReadFds;
+	double dMB = -1.0;
+	pid_t iPid;
+	int aiPipe[2];
+
+	if (pipe(aiPipe))
+		return -1.0;
+	fflush(NULL);
+	if ((iPid = fork()) == 0){
+		close(aiPipe[0]);
+		dMB = dEstimateStudyMB(psStudy);
+		_exit(write(aiPipe[1], &dMB, sizeof(dMB)) == (ssize_t)sizeof(dMB) ? 0 : 1);
+	}
+	close(aiPipe[1]);
+	FD_ZERO(&sReadFds);
+	FD_SET(aiPipe[0], &sReadFds);
+	sTimeout.tv_sec = ESTIMATE_TIMEOUT;
+	sTimeout.tv_usec = 0;
+	if (iPid < 0 || select(aiPipe[0] + 1, &sReadFds, NULL, NULL, &sTimeout) <= 0 ||
+		read(aiPipe[0], &dMB, sizeof(dMB)) != (ssize_t)sizeof(dMB))
+		dMB = -1.0;
+	close(aiPipe[0]);
+	if (iPid > 0){
+		kill(iPid, SIGKILL);
+		waitpid(iPid, NULL, 0);
+	}
+	return dMB;
+}
+
+/* drops the finished jobs, keeping the order of the others, and moves
+	the job numbers of the busy workers with them */
+static void vReapJobs(Worker_t *psWorkers, int iNumWorkers)
+{
+	int i, w, iNew = 0, iNewNext = 0;
+
+	for (i = 0; i < isgNumJobs; i++){
+		if (psgJobs[i].bFinished)
+			continue;
+		for (w = 0; w < iNumWorkers; w++)
+			if (psWorkers[w].iStudy == i)
+				psWorkers[w].iStudy = iNew;
+		if (i < isgNextJob)
+			iNewNext = iNew + 1;
+		psgJobs[iNew++] = psgJobs[i];
+	}
+	isgNextJob = iNewNext;
+	isgNumJobs = iNew;
+}
+
+// Handles one request line; returns TRUE if the connection stays open for a reply later.
+static int bHandleRequest(Client_t *psClient, char *pchLine, int iNumRunning, int *pbShutdown)
+{
+	ServerJob_t *psJob;
+	Study_t sStudy;
+
+	if (strncmp(pchLine, "recon ", 6) == 0){
+		if (*pbShutdown){
+			vReply(psClient->iFd, "error server is shutting down\n");
+			return FALSE;
+		}
+		if (iParseStudyLine(pchLine + 6, &sStudy) != 1){
+			vReply(psClient->iFd, "error expected recon parfile prjimage atnmap initest outbase\n");
+			return FALSE;
+		}
+		if ((sStudy.dMemMB = dEstimateInChild(&sStudy)) < 0){
+			vReply(psClient->iFd, "error unable to read %s\n", sStudy.pchPrjImage);
+			vFreeStudy(&sStudy);
+			return FALSE;
+		}
+		if (isgNumJobs == isgMaxJobs){
+			isgMaxJobs = isgMaxJobs ? 2*isgMaxJobs : 64;
+			psgJobs = (ServerJob_t *)realloc(psgJobs, sizeof(ServerJob_t)*isgMaxJobs);
+			if (psgJobs == NULL)
+				vErrorHandler(ECLASS_FATAL, ETYPE_MALLOC, "Server", "unable to allocate %d jobs", isgMaxJobs);
+		}
+		psJob = &psgJobs[isgNumJobs++];
+		psJob->sStudy = sStudy;
+		psJob->iId = ++isgNumSubmitted;
+		psJob->iClientFd = psClient->iFd;
+		psJob->bFinished = FALSE;
+		psJob->dSubmitTime = dGetWallTime();
+		vReply(psClient->iFd, "queued %d %d\n", psJob->iId, isgNumJobs - isgNextJob);
+		return TRUE;
+	}else if (strcmp(pchLine, "status") == 0){
+		vReply(psClient->iFd, "status queued %d running %d done %d failed %d mean_latency %.3f\n", isgNumJobs - isgNextJob,
+			iNumRunning, isgNumDone, isgNumFailed, isgNumDone + isgNumFailed ? dsgSumLatency/(isgNumDone + isgNumFailed) : 0.0);
+	}else if (strcmp(pchLine, "shutdown") == 0){
+		*pbShutdown = TRUE;
+		vReply(psClient->iFd, "bye\n");
+	}else
+		vReply(psClient->iFd, "error unknown request\n");
+	return FALSE;
+}
+
+static void vJobDone(int iJob, StudyResult_t *psResult, int bDied, int iNumRunning)
+{
+	ServerJob_t *psJob = &psgJobs[iJob];
+	double dEnd = dGetWallTime();
+	int bFailed = bDied || psResult->iErrNum;
+
+	if (bFailed)
+		isgNumFailed++;
+	else
+		isgNumDone++;
+	psJob->bFinished = TRUE;
+	dsgSumLatency += dEnd - psJob->dSubmitTime;
+	fprintf(stderr, "server: job %d %s, waited %.2f s, ran %.2f s (setup %s), queue depth %d, running %d\n", psJob->iId,
+		bFailed ? "failed" : "done", psJob->dStartTime - psJob->dSubmitTime, dEnd - psJob->dStartTime,
+		!bDied && psResult->bReusedSetup ? "reused" : "new", isgNumJobs - isgNextJob, iNumRunning);
+	if (psJob->iClientFd >= 0){
+		vReply(psJob->iClientFd, "done %d %s %.3f %.3f %.3f\n", psJob->iId, bFailed ? "error" : "ok",
+			psJob->dStartTime - psJob->dSubmitTime, dEnd - psJob->dStartTime, dEnd - psJob->dSubmitTime);
+	}
+	vFreeStudy(&psJob->sStudy);
+}
+
+/**
+	@brief Runs the reconstruction server until a shutdown request.
+
+	@param pchSocket - path of the Unix domain socket to listen on.
+	@param iNumWorkers - worker processes; 0 for the number of processors.
+	@param dMemBudgetMB - estimated memory the running studies may use, 0 for no limit.
+
+	@return 0 on a clean shutdown.
+*/
+int iRunServer(char *pchSocket, int iNumWorkers, double dMemBudgetMB)
+{
+	struct sockaddr_un sAddr;
+	Client_t asClients[MAX_CLIENTS];
+	Worker_t *psWorkers;
+	StudyResult_t sResult;
+	fd_set sReadFds;
+	double dMemInUse = 0.0;
+	int i, j, iListenFd, iFd, iMaxFd, iNumRunning = 0, bShutdown = FALSE;
+	int aiServerFds[MAX_CLIENTS + 1];
+	char *pchEnd;
+
+	if (strlen(pchSocket) >= sizeof(sAddr.sun_path))
+		vErrorHandler(ECLASS_FATAL, ETYPE_USAGE, "Server", "socket path too long: %s", pchSocket);
+	signal(SIGPIPE, SIG_IGN);
+	if (iNumWorkers <= 0)
+		iNumWorkers = iGetNumThreads();
+
+	// start the workers before there are sockets for them to inherit
+	psWorkers = (Worker_t *)pvIrlMalloc(sizeof(Worker_t)*iNumWorkers, "Server:psWorkers");
+	memset(psWorkers, 0, sizeof(Worker_t)*iNumWorkers);
+	for (i = 0; i < iNumWorkers; i++)
+		vStartWorker(&psWorkers[i], psWorkers, iNumWorkers, NULL, 0);
+
+	memset(&sAddr, 0, sizeof(sAddr));
+	sAddr.sun_family = AF_UNIX;
+	strcpy(sAddr.sun_path, pchSocket);
+	unlink(pchSocket);
+	if ((iListenFd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0 || bind(iListenFd, (struct sockaddr *)&sAddr, sizeof(sAddr)) || listen(iListenFd, 16))
+		vErrorHandler(ECLASS_FATAL, ETYPE_IO, "Server", "unable to listen on %s", pchSocket);
+	for (i = 0; i < MAX_CLIENTS; i++)
+		asClients[i].iFd = -1;
+	fprintf(stderr, "server: listening on %s with %d workers\n", pchSocket, iNumWorkers);
+
+	while (!bShutdown || isgNextJob < isgNumJobs || iNumRunning > 0){
+		vReapJobs(psWorkers, iNumWorkers);
+		// start queued jobs on idle workers while they fit in the memory budget
+		for (i = 0; i < iNumWorkers && isgNextJob < isgNumJobs; i++){
+			if (psWorkers[i].iStudy >= 0)
+				continue;
+			if (iNumRunning > 0 && dMemBudgetMB > 0 && dMemInUse + psgJobs[isgNextJob].sStudy.dMemMB > dMemBudgetMB)
+				break;
+			if (iSendStudy(&psWorkers[i], isgNextJob, &psgJobs[isgNextJob].sStudy))
+				vErrorHandler(ECLASS_FATAL, ETYPE_IO, "Server", "unable to send job %d to worker %d", psgJobs[isgNextJob].iId, (int)psWorkers[i].iPid);
+			psgJobs[isgNextJob].dStartTime = dGetWallTime();
+			dMemInUse += psgJobs[isgNextJob++].sStudy.dMemMB;
+			iNumRunning++;
+		}
+
+		FD_ZERO(&sReadFds);
+		iMaxFd = -1;
+		if (!bShutdown){
+			FD_SET(iListenFd, &sReadFds);
+			iMaxFd = iListenFd;
+		}
+		for (i = 0; i < MAX_CLIENTS; i++)
+			if (asClients[i].iFd >= 0){
+				FD_SET(asClients[i].iFd, &sReadFds);
+				if (asClients[i].iFd > iMaxFd)
+					iMaxFd = asClients[i].iFd;
+			}
+		for (i = 0; i < iNumWorkers; i++)
+			if (psWorkers[i].iStudy >= 0){
+				FD_SET(psWorkers[i].iResultFd, &sReadFds);
+				if (psWorkers[i].iResultFd > iMaxFd)
+					iMaxFd = psWorkers[i].iResultFd;
+			}
+		if (iMaxFd < 0 || select(iMaxFd + 1, &sReadFds, NULL, NULL, NULL) < 0)
+			continue;
+
+		if (!bShutdown && FD_ISSET(iListenFd, &sReadFds) && (iFd = accept(iListenFd, NULL, NULL)) >= 0){
+			for (i = 0; i < MAX_CLIENTS && asClients[i].iFd >= 0; i++)
+				;
+			if (i == MAX_CLIENTS){
+				vReply(iFd, "error too many connections\n");
+				close(iFd);
+			}else{
+				asClients[i].iFd = iFd;
+				asClients[i].iLen = 0;
+				asClients[i].bWaiting = FALSE;
+			}
+		}
+
+		for (i = 0; i < MAX_CLIENTS; i++){
+			Client_t *psClient = &asClients[i];
+			int iRead;
+
+			if (psClient->iFd < 0 || !FD_ISSET(psClient->iFd, &sReadFds))
+				continue;
+			if (psClient->bWaiting)
+				psClient->iLen = 0;		// anything after the request is ignored
+			iRead = (int)read(psClient->iFd, psClient->achLine + psClient->iLen, sizeof(psClient->achLine) - 1 - psClient->iLen);
+			if (iRead <= 0){
+				vCloseClient(psClient);
+				continue;
+			}
+			if (psClient->bWaiting)
+				continue;
+			psClient->iLen += iRead;
+			psClient->achLine[psClient->iLen] = '\0';
+			if ((pchEnd = strchr(psClient->achLine, '\n')) == NULL){
+				if (psClient->iLen == (int)sizeof(psClient->achLine) - 1){
+					vReply(psClient->iFd, "error request too long\n");
+					vCloseClient(psClient);
+				}
+				continue;
+			}
+			// one request per connection; a recon request keeps it open for the done reply
+			*pchEnd = '\0';
+			if (pchEnd > psClient->achLine && pchEnd[-1] == '\r')
+				pchEnd[-1] = '\0';
+			if (bHandleRequest(psClient, psClient->achLine, iNumRunning, &bShutdown))
+				psClient->bWaiting = TRUE;
+			else
+				vCloseClient(psClient);
+		}
+
+		for (i = 0; i < iNumWorkers; i++){
+			int iJob = psWorkers[i].iStudy;
+
+			if (iJob < 0 || !FD_ISSET(psWorkers[i].iResultFd, &sReadFds))
+				continue;
+			dMemInUse -= psgJobs[iJob].sStudy.dMemMB;
+			iNumRunning--;
+			if (iReadResult(&psWorkers[i], &sResult) == 0)
+				vJobDone(iJob, &sResult, FALSE, iNumRunning);
+			else{
+				fprintf(stderr, "server: worker %d died while running job %d\n", (int)psWorkers[i].iPid, psgJobs[iJob].iId);
+				vStopWorker(&psWorkers[i]);
+				vJobDone(iJob, &sResult, TRUE, iNumRunning);
+				// the new worker must not keep the listening socket or the connections open
+				aiServerFds[0] = iListenFd;
+				for (j = 0; j < MAX_CLIENTS; j++)
+					aiServerFds[j + 1] = asClients[j].iFd;
+				vStartWorker(&psWorkers[i], psWorkers, iNumWorkers, aiServerFds, MAX_CLIENTS + 1);
+			}
+			// the client of a recon request has had its answer
+			for (j = 0; j < MAX_CLIENTS; j++)
+				if (asClients[j].iFd >= 0 && asClients[j].iFd == psgJobs[iJob].iClientFd)
+					vCloseClient(&asClients[j]);
+		}
+	}
+
+	for (i = 0; i < MAX_CLIENTS; i++)
+		if (asClients[i].iFd >= 0)
+			vCloseClient(&asClients[i]);
+	for (i = 0; i < iNumWorkers; i++)
+		vStopWorker(&psWorkers[i]);
+	close(iListenFd);
+	unlink(pchSocket);
+	IrlFree(psWorkers);
+	free(psgJobs);
+	fprintf(stderr, "server: shut down after %d jobs, %d failed\n", isgNumDone + isgNumFailed, isgNumFailed);
+	return 0;
+}
+
+/**
+	@brief Sends one request to the server and prints its replies.
+
+	@param ppchArgv - the request words, e.g. recon parfile prj atn init out.
+
+	@return 0 if the request succeeded.
+*/
+int iRunClient(char *pchSocket, int iArgc, char **ppchArgv)
+{
+	struct sockaddr_un sAddr;
+	char achBuf[MAX_STUDY_LINE];
+	int i, iFd, iLen = 0, iRead, bError = FALSE;
+
+	for (i = 0; i < iArgc; i++)
+		iLen += snprintf(achBuf + iLen, sizeof(achBuf) - iLen, "%s%s", i ? " " : "", ppchArgv[i]);
+	if (iLen >= (int)sizeof(achBuf) - 1 || strlen(pchSocket) >= sizeof(sAddr.sun_path))
+		vErrorHandler(ECLASS_FATAL, ETYPE_USAGE, "Client", "request or socket path too long");
+	achBuf[iLen++] = '\n';
+
+	memset(&sAddr, 0, sizeof(sAddr));
+	sAddr.sun_family = AF_UNIX;
+	strcpy(sAddr.sun_path, pchSocket);
+	if ((iFd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0 || connect(iFd, (struct sockaddr *)&sAddr, sizeof(sAddr))){
+		fprintf(stderr, "client: unable to connect to %s\n", pchSocket);
+		return 1;
+	}
+	if (write(iFd, achBuf, iLen) != iLen){
+		fprintf(stderr, "client: unable to send the request\n");
+		close(iFd);
+		return 1;
+	}
+	// the server closes the connection after its last reply
+	while ((iRead = (int)read(iFd, achBuf, sizeof(achBuf) - 1)) > 0){
+		achBuf[iRead] = '\0';
+		fputs(achBuf, stdout);
+		if (strncmp(achBuf, "error", 5) == 0 || strstr(achBuf, " error ") != NULL)
+			bError = TRUE;
+	}
+	close(iFd);
+	return bError;
+}
+
+#else
+
+int iRunServer(char *pchSocket, int iNumWorkers, double dMemBudgetMB)
+{
+	vErrorHandler(ECLASS_FATAL, ETYPE_USAGE, "Server", "the reconstruction server needs Unix domain sockets and fork");
+	return 1;
+}
+
+int iRunClient(char *pchSocket, int iArgc, char **ppchArgv)
+{
+	vErrorHandler(ECLASS_FATAL, ETYPE_USAGE, "Client", "the reconstruction server needs Unix domain sockets and fork");
+	return 1;
+}
+
+#endif
@@ -0,0 +1,207 @@
+/*
+	session.c
+
+	Reconstruction sessions: parse the parameter file, set up the views,
+	collimator and scatter estimate once, then run IrlOsem as many times
+	as needed on projection data of the same size.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <mip/errdefs.h>
+#include <mip/printmsg.h>
+#include <mip/miputil.h>
+#include <mip/getparms.h>
+#include <mip/irl.h>
+#include <mip/osemhooks.h>
+
+#include "protos.h"
+#include "saveitercheck.h"
+#include "osemthreads.h"
+#include "convergence.h"
+#include "sysmat.h"
+#include "session.h"
+
+/* libirl keeps global state (message files, advanced options, the
+	iteration save schedule), so only one IrlOsem runs at a time. */
+static OsemMutex_t sgIrlMutex;
+static int bsgIrlMutexInit = FALSE;
+
+// callback of the IrlOsem that is running, set while holding sgIrlMutex
+static SessionCallback_t pfnsgCallback = NULL;
+static void *pvsgCallbackData = NULL;
+
+static void vSessionCallback(int iIteration, float *pfCurrentEstimate)
+{
+	if (pfnsgCallback != NULL)
+		pfnsgCallback(pvsgCallbackData, iIteration, pfCurrentEstimate);
+}
+
+/**
+	@brief Reads the parameter file and does all the setup that does not
+	depend on the projection data.
+
+	The parameter database is released before returning, so everything
+	needed later is copied into the session. Waits for a reconstruction
+	that is running in another thread to finish.
+
+	@param pchParmFileName - parameter file name.
+	@param iNumSlices, iNumPixels, iNumViews - size of the projection data.
+
+	@return the new session. Free with vCloseSession.
+*/
+OsemSession_t *psOpenSession(char *pchParmFileName, int iNumSlices, int iNumPixels, int iNumViews)
+{
+	OsemSession_t *psSession;
+	double dStart = dGetWallTime();
+	int bFound, iMsgLevel = 4;
+
+	// sessions are opened from one thread, and the first before any reconstruction runs
+	if (!bsgIrlMutexInit){
+		vInitMutex(&sgIrlMutex);
+		bsgIrlMutexInit = TRUE;
+	}
+	psSession = (OsemSession_t *)pvIrlMalloc(sizeof(OsemSession_t), "OpenSession:Session");
+	memset(psSession, 0, sizeof(OsemSession_t));
+
+	/* the parameter database, message level and thread count, and the
+		image reads of pfGetScatterEstimate, are global state that a
+		running IrlOsem uses as well, so wait for it */
+	vLockMutex(&sgIrlMutex);
+	vReadParmsFile(pchParmFileName);
+	iMsgLevel = iGetIntParm("debug_level", &bFound, iMsgLevel);
+	vSetMsgLevel(iMsgLevel);
+	vGetThreadParms();
+
+	vGetEffectsToModel(&psSession->bModelAtn, &psSession->bModelDrf, &psSession->bModelSrf);
+	psSession->sOptions.bModelDrf = psSession->bModelDrf;
+
+	psSession->sIrlParms.NumSlices = iNumSlices; // The slice selection in the parameter file is disabled.
+	psSession->sIrlParms.NumPixels = iNumPixels;
+	psSession->sIrlParms.NumViews = iNumViews;
+	vGetParms(&psSession->sIrlParms, &psSession->sOptions, 0);
+	// the iteration save schedule is global and may be in use by a running reconstruction; keep what is needed to start it for every reconstruction
+	psSession->iSaveInterval = iGetIntParm("save_int", &bFound, 1);
+	psSession->pchIterSaveString = pchIrlStrdup(pchGetStrParm("save_iterations", &bFound, ""));
+	vGetAdvOpts(&psSession->sAdvOpts);
+	vGetStopCriteria(&psSession->sStop);
+	vReadSysMatOptions(&psSession->sSysMat, psSession->bModelAtn, psSession->bModelSrf);
+	psSession->iNumFrameWorkers = iGetIntParm("frame_workers", &bFound, 1);
+	if (psSession->iNumFrameWorkers < 1)
+		psSession->iNumFrameWorkers = 1;
+
+	psSession->psViews = psSetupPrjViews(&psSession->sIrlParms);
+	psSession->sIrlParms.pchNormImageBase = NULL;
+
+	psSession->pchSrfKrnlFile = psSession->bModelSrf ? pchGetSrfKrnlFname() : NULL;
+	psSession->pchDrfTabFile = psSession->bModelDrf ? pchGetDrfTabFname() : NULL;
+
+	//Scatter Estimate to be added to computed projection data
+	psSession->pfScatterEstimate = pfGetScatterEstimate(&psSession->sIrlParms, psSession->psViews);
+
+	// msg_file and log_file are not used by the mex file, but look them up so they are not reported as unused
+	pchGetStrParm("msg_file", &bFound, "");
+	pchGetStrParm("log_file", &bFound, "");
+	iDoneWithParms();
+	vUnlockMutex(&sgIrlMutex);
+
+	psSession->dSetupTime = dGetWallTime() - dStart;
+	vPrintMsg(6, "OpenSession: setup took %.3f s\n", psSession->dSetupTime);
+	return psSession;
+}
+
+/**
+	@brief Reconstructs one projection data set using the setup in the session.
+
+	@param pfPrjImage - projection data, already scaled by the number of views.
+	@param pfAtnMap - attenuation map, or NULL if not modeled.
+	@param pfActImage - reconstructed image; holds the initial estimate on input if bReconIsInitEst.
+	@param pfnCallback - called after each iteration with pvCallbackData, or NULL.
+		bCheckIfSaveIteration can be used in it to follow the save_int and
+		save_iterations schedule.
+	@param psTrace - gets the relative image change of each iteration, or NULL.
+		The reconstruction stops early when the session's stop_rel_change is met.
+	@param pbCancel - if not NULL, setting it stops the reconstruction at the
+		next check, leaving the last estimate in pfActImage. Checks come every
+		stop_check_int iterations, or cancel_check_int without stop_rel_change.
+
+	May be called from several threads at once; the calls to IrlOsem are
+	serialized.
+
+	@return the IrlOsem error number (0 on success).
+*/
+int iSessionRecon(OsemSession_t *psSession, float *pfPrjImage, float *pfAtnMap, float *pfActImage, int bReconIsInitEst, SessionCallback_t pfnCallback, void *pvCallbackData, ReconTrace_t *psTrace, volatile int *pbCancel)
+{
+	// IrlOsem gets copies so nothing it changes carries over to the next reconstruction
+	IrlParms_t sIrlParms = psSession->sIrlParms;
+	Options_t sOptions = psSession->sOptions;
+	sAdvOptions sAdvOpts = psSession->sAdvOpts;
+	StopCriteria_t sStop = psSession->sStop;
+	int iErrNum;
+
+	if ((psSession->bModelAtn || psSession->bModelSrf) && pfAtnMap == NULL)
+		vErrorHandler(ECLASS_FATAL, ETYPE_ILLEGAL_VALUE, "SessionRecon", "Attenuation map is required for Atn or Srf Compensation");
+
+	sOptions.bReconIsInitEst = bReconIsInitEst;
+	sStop.pbCancel = pbCancel;
+	vLockMutex(&sgIrlMutex);
+	vInitIterSaveString(psSession->iSaveInterval, sIrlParms.NumIterations, psSession->pchIterSaveString);
+	pfnsgCallback = pfnCallback;
+	pvsgCallbackData = pvCallbackData;
+	vSetSysMatOptions(&psSession->sSysMat);
+
+	iErrNum = iOsemWithStop(&sIrlParms, &sOptions, &sAdvOpts, psSession->psViews,
+		psSession->pchDrfTabFile, psSession->pchSrfKrnlFile,
+		vSessionCallback, psSession->pfScatterEstimate, pfAtnMap, pfPrjImage, pfActImage, NULL, NULL,
+		&sStop, psTrace);
+	vSetMsgFilePtr(3, stderr);	// has to reset since it was set to NULL or msg_file in IrlOsem
+	vFreeIterSaveString();
+	pfnsgCallback = NULL;
+	if (iErrNum)
+		fprintf(stderr, "fatal error in IrlOsem: ErrNum=%d\n      %s", iErrNum, pchIrlErrorString());
+	psSession->iNumRecons++;
+	vUnlockMutex(&sgIrlMutex);
+
+	fprintf(stderr, "sum of pfRecn after IrlOsem=%.4g (%d x %d x %d)\n", sum_float(pfActImage, sIrlParms.NumPixels*sIrlParms.NumPixels*sIrlParms.NumSlices), sIrlParms.NumPixels, sIrlParms.NumPixels, sIrlParms.NumSlices);
+	return iErrNum;
+}
+
+/**
+	@brief Counts the iterations that the save_int and save_iterations
+	schedule saves, so their storage can be allocated up front.
+
+	@param piIterations - if not NULL, gets the saved iteration numbers;
+		it must have room for NumIterations entries.
+
+	@return the number of saved iterations.
+*/
+int iSessionNumSavedIterations(OsemSession_t *psSession, int *piIterations)
+{
+	int iIteration, iNumSaved = 0;
+
+	vLockMutex(&sgIrlMutex);
+	vInitIterSaveString(psSession->iSaveInterval, psSession->sIrlParms.NumIterations, psSession->pchIterSaveString);
+	for (iIteration = 1; iIteration <= psSession->sIrlParms.NumIterations; iIteration++)
+		if (bCheckIfSaveIteration(iIteration)){
+			if (piIterations != NULL)
+				piIterations[iNumSaved] = iIteration;
+			iNumSaved++;
+		}
+	vFreeIterSaveString();
+	vUnlockMutex(&sgIrlMutex);
+	return iNumSaved;
+}
+
+void vCloseSession(OsemSession_t *psSession)
+{
+	if (psSession == NULL)
+		return;
+	IrlFree(psSession->psViews);
+	IrlFree(psSession->pchIterSaveString);
+	if (psSession->pfScatterEstimate) IrlFree(psSession->pfScatterEstimate);
+	if (psSession->pchSrfKrnlFile) IrlFree(psSession->pchSrfKrnlFile);
+	if (psSession->pchDrfTabFile) IrlFree(psSession->pchDrfTabFile);
+	IrlFree(psSession);
+}
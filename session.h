@@ -0,0 +1,49 @@
+/*
+	session.h
+
+	A reconstruction session holds everything that is set up from the
+	parameter file and the image sizes, so that several projection data
+	sets with the same geometry can be reconstructed without repeating
+	that setup. Only the views, the collimator model and the scatter
+	estimate are kept; libirl still makes the DRF tables, FFTW plans and
+	normalization images in every IrlOsem call, so each reconstruction
+	pays for them again.
+
+	Include mip/irl.h, mip/osemhooks.h, convergence.h and sysmat.h before this file.
+*/
+
+#ifndef SESSION_H
+#define SESSION_H
+
+typedef struct {
+	IrlParms_t sIrlParms;
+	Options_t sOptions;
+	sAdvOptions sAdvOpts;
+	PrjView_t *psViews;
+	char *pchDrfTabFile;
+	char *pchSrfKrnlFile;
+	float *pfScatterEstimate;
+	int bModelAtn;
+	int bModelDrf;
+	int bModelSrf;
+	int iSaveInterval;			// save_int
+	char *pchIterSaveString;	// save_iterations
+	StopCriteria_t sStop;		// stop_rel_change, stop_min_iterations, stop_check_int, cancel_check_int
+	SysMatOptions_t sSysMat;	// sysmat, max_frac_err, sysmat_cache_dir
+	int iNumFrameWorkers;		// frame_workers: frames of a batch that are converted at once; IrlOsem still runs one at a time
+	double dSetupTime;			// seconds spent in psOpenSession
+	int iNumRecons;				// number of reconstructions done so far
+} OsemSession_t;
+
+// called after each iteration with the pvCallbackData given to iSessionRecon
+typedef void (*SessionCallback_t)(void *pvCallbackData, int iIteration, float *pfCurrentEstimate);
+
+OsemSession_t *psOpenSession(char *pchParmFileName, int iNumSlices, int iNumPixels, int iNumViews);
+int iSessionRecon(OsemSession_t *psSession, float *pfPrjImage, float *pfAtnMap, float *pfActImage, int bReconIsInitEst, SessionCallback_t pfnCallback, void *pvCallbackData, ReconTrace_t *psTrace, volatile int *pbCancel);
+int iSessionNumSavedIterations(OsemSession_t *psSession, int *piIterations);
+void vCloseSession(OsemSession_t *psSession);
+
+// setup.c
+void vGetAdvOpts(sAdvOptions *psAdvOpts);
+
+#endif
@@ -24,10 +24,16 @@
 #include <mip/getparms.h>
 #include <mip/getline.h>
 #include <mip/irl.h>
+#include <mip/imgio.h>
 #include <mip/osemhooks.h>
 
 #include "protos.h"
 #include "saveitercheck.h"
+#include "convergence.h"
+#include "loadimages.h"
+#include "osemthreads.h"
+#include "slab.h"
+#include "sysmat.h"
 
 char *pchGetNormBase(char *pchBase)
 {
@@ -52,11 +58,11 @@ char *pchGetNormBase(char *pchBase)
 
 // get Parameters that are needed for osems or genprjs
 //	 @param iMode - 0 for osems, 1 for genprjs
+//	The iteration save schedule is global state that a session's running
+//	reconstruction uses, so it is set up by the command line program itself.
 void vGetParms(IrlParms_t *psParms, Options_t *psOptions, int iMode)
 {
 	int bFound, bFoundAll, bDrfFromFile, bUseGrfInBck, iNumSubsets, i;
-	int save_interval;
-	char *pchIterSaveString;
 
 	vPrintMsg(4,"\nGetParms\n");
 	psParms->BinWidth = (float)dGetDblParm("pixwidth",&bFound, 0.0);
@@ -65,10 +71,6 @@ void vGetParms(IrlParms_t *psParms, Options_t *psOptions, int iMode)
 	else // osems
 	{
 		psParms->NumIterations = iGetIntParm("iterations", &bFound, 1);
-		save_interval = iGetIntParm("save_int",&bFound,1);
-		pchIterSaveString = pchGetStrParm("save_iterations",&bFound,""); 
-		vInitIterSaveString(save_interval, psParms->NumIterations, pchIterSaveString);
-
 		psParms->NumAngPerSubset = iGetIntParm("num_ang_per_set",&bFound, psParms->NumViews);
 		if (psParms->NumViews % psParms->NumAngPerSubset)
 			vErrorHandler(ECLASS_FATAL, ETYPE_ILLEGAL_VALUE, "GetParms", "No. of angles not an integer multiple of the no. of angles per subset\n NumAngles=%d, NumAngPerSet=%d", psParms->NumViews, psParms->NumAngPerSubset);
@@ -218,10 +220,9 @@ PrjView_t *psSetupPrjViews(IrlParms_t *psParms)
 		fclose(fpOrbitFile);
 	}
 	
-	// with the assumptions that the pixel and bin widths are the same,
-	//	the number of pixels and number of bins are the same,
-	//	and all the transaxial bins were measured, then Left and Right are
-	//	easy to calculate
+	// with the assumption that all the transaxial bins were measured,
+	//	the pixels are centred on the bins, whatever their widths (see
+	//	ppsMakeViewRebinPlans), and Left and Right are easy to calculate
 	for (iAng=0; iAng<iNumAngles; iAng++){
 		psViews[iAng].Left=0;
 		psViews[iAng].Right = (float) psParms->NumPixels-1;
@@ -251,20 +252,76 @@ char *pchGetDrfTabFname(void)
 	return pchIrlStrdup(pch);
 }
 
-void SetAdvOpts(void);
-void SetAdvOpts(void)
+// reads the advanced options from the parameter file
+void vGetAdvOpts(sAdvOptions *psAdvOpts)
 {
 	int bFound;
-	sAdvOptions sAdvOpts;
 
-	sAdvOpts.bFastRotate=bGetBoolParm("fastrotate",&bFound,TRUE);
-	sAdvOpts.iStartIteration=iGetIntParm("start_iter",&bFound,0);
-	if (sAdvOpts.iStartIteration < 0){
+	psAdvOpts->bFastRotate=bGetBoolParm("fastrotate",&bFound,TRUE);
+	psAdvOpts->iStartIteration=iGetIntParm("start_iter",&bFound,0);
+	if (psAdvOpts->iStartIteration < 0){
 		vErrorHandler(ECLASS_WARN, ETYPE_ILLEGAL_VALUE, "SetAdvOpts", 
 				"Start_iter must be >= 0, setting to 0");
-			sAdvOpts.iStartIteration=0;
+			psAdvOpts->iStartIteration=0;
 	}
-	OsemSetAdvOptions(&sAdvOpts);
+}
+
+// options read by SetAdvOpts that the command line program needs again when running IrlOsem
+static sAdvOptions sgAdvOpts;
+static StopCriteria_t sgStopCriteria;
+static int isgCheckpointInterval;
+
+void SetAdvOpts(void);
+void SetAdvOpts(void)
+{
+	int bFound;
+
+	vGetAdvOpts(&sgAdvOpts);
+	OsemSetAdvOptions(&sgAdvOpts);
+	vGetStopCriteria(&sgStopCriteria);
+	isgCheckpointInterval=iGetIntParm("checkpoint_int",&bFound,0);
+}
+
+void vGetCmdLineRunOpts(sAdvOptions *psAdvOpts, StopCriteria_t *psStop, int *piCheckpointInterval)
+{
+	*psAdvOpts = sgAdvOpts;
+	*psStop = sgStopCriteria;
+	*piCheckpointInterval = isgCheckpointInterval;
+}
+
+// slab parameters of the command line program, read once its views are set up
+static SlabParms_t sgSlabParms = {1, 0, FALSE, 0.0, 0, 0, FALSE, ""};
+
+void vGetCmdLineSlabParms(SlabParms_t *psSlabs)
+{
+	*psSlabs = sgSlabParms;
+}
+
+/* the bins of the genprjs projections: the pixels, since binwidth has to
+	equal pixwidth until a caller resamples them with vInterpBckBinned */
+static int isgNumPrjBins;
+static float fsgPrjBinWidth;
+
+void vGetPrjBinning(int *piNumBins, float *pfBinWidth)
+{
+	*piNumBins = isgNumPrjBins;
+	*pfBinWidth = fsgPrjBinWidth;
+}
+
+/**
+	@brief sets the number of threads used to load, resample and convert
+	the data, and to project and backproject the views of a subset with
+	approx_sysmat, from num_threads in the parameter file. 0, the default, uses
+	all the online processors. The projectors in IrlOsem are not affected.
+*/
+void vGetThreadParms(void)
+{
+	int bFound, iNumThreads;
+
+	iNumThreads = iGetIntParm("num_threads", &bFound, 0);
+	if (iNumThreads < 0)
+		vErrorHandler(ECLASS_FATAL, ETYPE_ILLEGAL_VALUE, "GetThreadParms", "num_threads must be 0 or more, not %d", iNumThreads);
+	vSetNumThreads(iNumThreads);
 }
 
 /*
@@ -284,6 +341,9 @@ int iSetupFromCmdLine(int iArgc, char **ppchArgv, IrlParms_t *psIrlParms, Option
 	int		i, bFound, iNextImage, iNumImages,iNumArgs, iMsgLevel=4, bModelAtn=0, bModelSrf=0, bModelDrf=0, iMaxNames;
 	char	**ppchImageNames, *pch, *pchParmFileName=NULL,*pchAtnImageName=NULL, *pchActImageName=NULL, *pchInitImageName=NULL;
 	float	fTrueBinWidth, *pfAtnMap=NULL,*pfActImage=NULL, *pfPrjImage=NULL, *pfScatterEstimate=NULL;
+	ImageLoad_t asLoads[4];	// the input images, read at the same time once they are all prepared
+	int		iNumLoads=0, iAtnLoad=-1, iPrjLoad=-1, iInitLoad=-1, iScatLoad=-1;
+	SysMatOptions_t sSysMat;
 	
 	if (iArgc < 4)
 		return (1);
@@ -301,6 +361,7 @@ int iSetupFromCmdLine(int iArgc, char **ppchArgv, IrlParms_t *psIrlParms, Option
 	
 	iMsgLevel=iGetIntParm("debug_level",&bFound, iMsgLevel);
 	vSetMsgLevel(iMsgLevel);
+	vGetThreadParms();
 
 	iMaxNames = iMode ? 3 : 4;	// genprjs max names is 3, osems max names is 4
 	if ((ppchImageNames = (char **) pvIrlMalloc(sizeof(char *)*iMaxNames, "iSetupFromCmdLine:ppchImageNames")) == NULL)
@@ -346,11 +407,13 @@ int iSetupFromCmdLine(int iArgc, char **ppchArgv, IrlParms_t *psIrlParms, Option
 	vGetImageSizes(pchActImageName, psIrlParms, iMode);
 	
 	vGetParms(psIrlParms, psOptions, iMode);
+	if (iMode == 0)
+		vInitIterSaveString(iGetIntParm("save_int",&bFound,1), psIrlParms->NumIterations, pchGetStrParm("save_iterations",&bFound,""));
 
 	// Get Attenuation image. 
 	if (bModelAtn || bModelSrf){
-		pfAtnMap=pfGetAtnMap(pchAtnImageName, psIrlParms);
-		fprintf(stderr,"  sum atn=%.2f\n", sum_float(pfAtnMap,psIrlParms->NumPixels*psIrlParms->NumPixels*psIrlParms->NumSlices));
+		iAtnLoad=iNumLoads++;
+		vPrepareAtnMap(pchAtnImageName, psIrlParms, &asLoads[iAtnLoad]);
 	}
 	
 	// get orbit information (cor and ror) and stores in views table
@@ -361,18 +424,26 @@ int iSetupFromCmdLine(int iArgc, char **ppchArgv, IrlParms_t *psIrlParms, Option
 	if (iMode == 0) //osems
 	{
 		psIrlParms->pchNormImageBase=pchGetNormBase(*ppchOutBase);
-		pfPrjImage = pfGetPrjImage(pchActImageName, psIrlParms, *ppsPrjViews);
+		iPrjLoad=iNumLoads++;
+		vPreparePrjImage(pchActImageName, psIrlParms, *ppsPrjViews, &asLoads[iPrjLoad]);
 		if (pchInitImageName != NULL && *pchInitImageName != '\0'){
-			pfActImage = pfGetInitialEst(pchInitImageName, psIrlParms);
+			iInitLoad=iNumLoads++;
+			vPrepareInitialEst(pchInitImageName, psIrlParms, &asLoads[iInitLoad]);
 			psOptions->bReconIsInitEst=TRUE;
 		}else{
 			psOptions->bReconIsInitEst=FALSE;
 			pfActImage = (float *) pvIrlMalloc(sizeof(float)*psIrlParms->NumPixels*psIrlParms->NumPixels*psIrlParms->NumSlices,"iSetupFromCmdLine: pfActImage");
 		}
+		vGetSlabParms(&sgSlabParms, psIrlParms, psOptions, *ppsPrjViews, bModelSrf);
+		vReadSysMatOptions(&sSysMat, bModelAtn, bModelSrf);
+		vSetSysMatOptions(&sSysMat);
 	}else { // genprjs
+		// nothing resamples the generated projections to other bins yet, so they stay on the pixels
 		fTrueBinWidth = (float)dGetDblParm("binwidth",&bFound, psIrlParms->BinWidth);
 		if (fTrueBinWidth != psIrlParms->BinWidth)
 			vErrorHandler(ECLASS_FATAL,ETYPE_USAGE,"iSetupFromCmdLine", "%s\n","Bin size must equals pixel size!");
+		isgNumPrjBins = psIrlParms->NumPixels;
+		fsgPrjBinWidth = psIrlParms->BinWidth;
 		pfPrjImage = (float *) pvIrlMalloc(psIrlParms->NumPixels*psIrlParms->NumSlices*psIrlParms->NumViews*sizeof(float), "iSetupFromCmdLine:pfPrjImage");
 		pfActImage = pfGetActImage(pchActImageName, psIrlParms);
 		fprintf(stderr,"  sum act=%.2f\n", sum_float(pfActImage,psIrlParms->NumPixels*psIrlParms->NumPixels*psIrlParms->NumSlices));
@@ -382,7 +453,21 @@ int iSetupFromCmdLine(int iArgc, char **ppchArgv, IrlParms_t *psIrlParms, Option
 	*ppchDrfTabFile = bModelDrf ? pchGetDrfTabFname():NULL;
 	
 	//Scatter Estimate to be added to computed projection data
-	pfScatterEstimate=pfGetScatterEstimate(psIrlParms, *ppsPrjViews);
+	if (iPrepareScatterEstimate(psIrlParms, *ppsPrjViews, &asLoads[iNumLoads]))
+		iScatLoad=iNumLoads++;
+
+	// the files are independent, so read them all at once unless parallel_load is false
+	vLoadImages(asLoads, iNumLoads, bGetBoolParm("parallel_load",&bFound,TRUE));
+	if (iAtnLoad >= 0){
+		pfAtnMap=asLoads[iAtnLoad].pfPixels;
+		fprintf(stderr,"  sum atn=%.2f\n", sum_float(pfAtnMap,psIrlParms->NumPixels*psIrlParms->NumPixels*psIrlParms->NumSlices));
+	}
+	if (iPrjLoad >= 0)
+		pfPrjImage=asLoads[iPrjLoad].pfPixels;
+	if (iInitLoad >= 0)
+		pfActImage=asLoads[iInitLoad].pfPixels;
+	if (iScatLoad >= 0)
+		pfScatterEstimate=asLoads[iScatLoad].pfPixels;
 	
 	vPrintMsg(4,"\nSetupFromCmdLine\n");
 	
@@ -0,0 +1,966 @@
+/*
+	slab.c
+
+	Slab parallel reconstruction. Without scatter modelling a slice only
+	sees its neighbours through the axial part of the collimator
+	response, so the slices can be split into slabs that are
+	reconstructed on their own, each with a halo of slices on either side
+	that is reconstructed with it and then thrown away. The slices the
+	slabs keep are stitched into the result.
+
+	libirl keeps global state, so on POSIX systems each slab runs in a
+	forked process, up to num_threads at a time, that writes its slices
+	straight into a shared mapping. Without fork (WIN32) the slabs run
+	one after the other, which still bounds the memory IrlOsem needs.
+
+	With slab_ranks the slabs are instead sent over TCP to rank
+	processes, osems --rank host port, on this or other nodes. A rank
+	gets the inputs of one slab at a time and sends back the slices the
+	slab keeps, so the nodes need no shared file system apart from the
+	collimator and scatter kernel files, which they open under the same
+	names. The messages are raw structures, so a rank first sends a hello
+	with the layout of this build and the token in OSEM_SLAB_TOKEN, which
+	has to be set to the same value on the root and the ranks; the root
+	drops connections whose hello does not match. It listens on slab_bind
+	only, never on every interface. The token is sent in the clear, so it
+	keeps out strays and other builds, not an eavesdropper: the nodes
+	should share a trusted network. slab_local_ranks starts the ranks as
+	local processes with a random token on the loopback interface, which
+	goes through the same sockets and is how the mode is tested on one
+	machine. The root reports the time each slab spent
+	in transfer, sending its inputs and receiving its slices, and the
+	total against the wall time.
+
+	The ranks split the slices, not the views of a subset: the subset
+	loop of IrlOsem is inside libirl. approx_sysmat splits the views of
+	each subset over local processes itself (sysmat_ranks).
+
+	Compile with -DSTANDALONE (with convergence.c, sysmat.c and
+	osemthreads.c, linked with libirl) to get slab pixels slices views
+	iterations [tolerance], which reconstructs random projections with a
+	collimator response as a whole volume and as 4 slabs on 1 and on 2
+	local ranks (slab 32 64 16 3, say), and fails unless the ranks give the same image bit for
+	bit and it is within the tolerance (1e-3 of the image maximum) of the
+	whole volume.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#ifndef WIN32
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/select.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+#include <signal.h>
+#include <sys/time.h>
+#endif
+
+#include <mip/errdefs.h>
+#include <mip/printmsg.h>
+#include <mip/miputil.h>
+#include <mip/getparms.h>
+#include <mip/irl.h>
+#include <mip/osemhooks.h>
+
+#include "protos.h"
+#include "osemthreads.h"
+#include "convergence.h"
+#include "slab.h"
+#include "sysmat.h"
+
+#define SLAB_DIED	-1	// error number of a slab whose process ended without reporting one
+
+// the volume iSlabOsem was given: the arguments of iOsemWithStop
+typedef struct {
+	IrlParms_t *psIrlParms;
+	Options_t *psOptions;
+	sAdvOptions *psAdvOpts;
+	PrjView_t *psViews;
+	char *pchDrfTabFile, *pchSrfKrnlFile;
+	float *pfScatterEstimate, *pfAtnMap, *pfPrjImage, *pfActImage;
+	const StopCriteria_t *psStop;
+} SlabVolume_t;
+
+// the inputs of one slab, copied out of the volume or received by a rank
+typedef struct {
+	IrlParms_t sIrlParms;	// with the number of slices of the slab
+	float *pfPrj, *pfScat, *pfAtn, *pfAct;
+} SlabInputs_t;
+
+/**
+	@brief Reads the slab parameters and sizes the halo when slab_halo is
+	not given.
+
+	The automatic halo is SLAB_HALO_FWHM times the FWHM of the collimator
+	response at the far edge of the field of view, where it is widest, and
+	never less than axial_pad_length. A Gaussian response falls to 2^-16
+	of its peak at two FWHM. Attenuation alone leaves the slices
+	independent. The scatter kernel reaches much further than the
+	collimator response and a tabulated response has no width here, so
+	in those cases slab_halo has to be given.
+*/
+void vGetSlabParms(SlabParms_t *psSlabs, IrlParms_t *psParms, Options_t *psOptions, PrjView_t *psViews, int bModelSrf)
+{
+	int bFound, iView, iReach;
+	double dMaxDist = 0.0, dFWHM = 0.0;
+
+	psSlabs->iNumRanks = iGetIntParm("slab_ranks", &bFound, 0);
+	psSlabs->iPort = iGetIntParm("slab_port", &bFound, 0);
+	psSlabs->bLocalRanks = bGetBoolParm("slab_local_ranks", &bFound, TRUE);
+	strncpy(psSlabs->achBind, pchGetStrParm("slab_bind", &bFound, ""), SLAB_MAX_HOST - 1);
+	psSlabs->achBind[SLAB_MAX_HOST - 1] = '\0';
+	psSlabs->iNumSlabs = iGetIntParm("slabs", &bFound, psSlabs->iNumRanks > 1 ? psSlabs->iNumRanks : 1);
+	psSlabs->iHalo = iGetIntParm("slab_halo", &bFound, -1);
+	psSlabs->bCheck = bGetBoolParm("slab_check", &bFound, FALSE);
+	psSlabs->dTolerance = dGetDblParm("slab_tolerance", &bFound, 1e-3);
+	if (psSlabs->iNumSlabs < 1 || psSlabs->iNumSlabs > psParms->NumSlices)
+		vErrorHandler(ECLASS_FATAL, ETYPE_ILLEGAL_VALUE, "GetSlabParms", "slabs must be from 1 to the number of slices (%d), not %d", psParms->NumSlices, psSlabs->iNumSlabs);
+	if (psSlabs->iNumRanks < 0 || psSlabs->iPort < 0 || psSlabs->iPort > 65535)
+		vErrorHandler(ECLASS_FATAL, ETYPE_ILLEGAL_VALUE, "GetSlabParms", "slab_ranks must be >= 0 and slab_port from 0 to 65535");
+#ifdef WIN32
+	if (psSlabs->iNumRanks > 0)
+		vErrorHandler(ECLASS_FATAL, ETYPE_USAGE, "GetSlabParms", "slab_ranks needs sockets and fork");
+#endif
+	if (psSlabs->iNumSlabs == 1)
+		return;
+	if (psSlabs->iNumRanks > 0 && !psSlabs->bLocalRanks){
+		if (psSlabs->iPort == 0 || psSlabs->achBind[0] == '\0')
+			vErrorHandler(ECLASS_FATAL, ETYPE_ILLEGAL_VALUE, "GetSlabParms", "slab_port and slab_bind must be given for ranks on other nodes");
+		if (getenv(SLAB_TOKEN_ENV) == NULL || getenv(SLAB_TOKEN_ENV)[0] == '\0' || strlen(getenv(SLAB_TOKEN_ENV)) >= SLAB_MAX_TOKEN)
+			vErrorHandler(ECLASS_FATAL, ETYPE_ILLEGAL_VALUE, "GetSlabParms", "ranks on other nodes need %s set to a shared token of 1 to %d characters", SLAB_TOKEN_ENV, SLAB_MAX_TOKEN - 1);
+	}
+
+	if (psSlabs->iHalo < 0){
+		if (bModelSrf)
+			vErrorHandler(ECLASS_FATAL, ETYPE_ILLEGAL_VALUE, "GetSlabParms", "slab_halo must be given with scatter modelling");
+		psSlabs->iHalo = psOptions->iAxialPadLength;
+		if (psOptions->bModelDrf){
+			if (psParms->fHoleLen <= 0.0f)
+				vErrorHandler(ECLASS_FATAL, ETYPE_ILLEGAL_VALUE, "GetSlabParms", "slab_halo must be given when the collimator response is read from a file");
+			for (iView = 0; iView < psParms->NumViews; iView++)
+				if (psViews[iView].CFCR > dMaxDist)
+					dMaxDist = psViews[iView].CFCR;
+			dMaxDist += 0.5*psParms->NumPixels*psParms->BinWidth;
+			dFWHM = psParms->fHoleDiam*(psParms->fHoleLen + psParms->fBackToDet + dMaxDist)/psParms->fHoleLen;
+			dFWHM = sqrt(dFWHM*dFWHM + (double)psParms->fIntrinsicFWHM*psParms->fIntrinsicFWHM);
+			iReach = (int)ceil(SLAB_HALO_FWHM*dFWHM/psParms->BinWidth);
+			if (iReach > psSlabs->iHalo)
+				psSlabs->iHalo = iReach;
+		}
+	}
+	vPrintMsg(4, "slabs: %d slabs with a halo of %d slices", psSlabs->iNumSlabs, psSlabs->iHalo);
+	if (dFWHM > 0.0)
+		vPrintMsg(4, " (collimator FWHM %.3g cm at %.3g cm)", dFWHM, dMaxDist);
+	vPrintMsg(4, "\n");
+}
+
+/**
+	@brief Splits iNumSlices slices into iNumSlabs slabs of nearly equal
+	size, each widened by iHalo slices on either side where there are
+	slices to take.
+
+	@return the number of slabs, which is at most iNumSlices.
+*/
+int iSplitSlabs(int iNumSlices, int iNumSlabs, int iHalo, Slab_t *psSlabs)
+{
+	int iSlab, iEnd;
+
+	if (iNumSlabs > iNumSlices)
+		iNumSlabs = iNumSlices;
+	for (iSlab = 0; iSlab < iNumSlabs; iSlab++){
+		psSlabs[iSlab].iCoreFirst = (int)((long)iSlab*iNumSlices/iNumSlabs);
+		psSlabs[iSlab].iNumCore = (int)((long)(iSlab + 1)*iNumSlices/iNumSlabs) - psSlabs[iSlab].iCoreFirst;
+		psSlabs[iSlab].iFirst = psSlabs[iSlab].iCoreFirst > iHalo ? psSlabs[iSlab].iCoreFirst - iHalo : 0;
+		iEnd = psSlabs[iSlab].iCoreFirst + psSlabs[iSlab].iNumCore + iHalo;
+		psSlabs[iSlab].iNumSlices = (iEnd < iNumSlices ? iEnd : iNumSlices) - psSlabs[iSlab].iFirst;
+	}
+	return iNumSlabs;
+}
+
+// copies slices iFirst to iFirst+iNum-1 out of iNumBlocks blocks of iNumSlices slices of lSliceLen values
+static float *pfCopySlices(const float *pf, int iNumBlocks, int iNumSlices, long lSliceLen, int iFirst, int iNum, char *pchName)
+{
+	float *pfSlices = (float *)pvIrlMalloc(sizeof(float)*iNumBlocks*iNum*lSliceLen, pchName);
+	int iBlock;
+
+	for (iBlock = 0; iBlock < iNumBlocks; iBlock++)
+		memcpy(pfSlices + iBlock*iNum*lSliceLen, pf + (iBlock*(long)iNumSlices + iFirst)*lSliceLen, sizeof(float)*iNum*lSliceLen);
+	return pfSlices;
+}
+
+// copies the inputs of a slab out of the volume; the projections and scatter estimate are stored view by view, the images slice by slice
+static void vCopySlabInputs(const SlabVolume_t *psVol, const Slab_t *psSlab, SlabInputs_t *psIn)
+{
+	IrlParms_t *psParms = psVol->psIrlParms;
+	long lSliceLen = (long)psParms->NumPixels*psParms->NumPixels;
+
+	psIn->sIrlParms = *psParms;
+	psIn->sIrlParms.NumSlices = psSlab->iNumSlices;
+	psIn->pfPrj = pfCopySlices(psVol->pfPrjImage, psParms->NumViews, psParms->NumSlices, psParms->NumPixels, psSlab->iFirst, psSlab->iNumSlices, "CopySlabInputs:pfPrj");
+	psIn->pfScat = psVol->pfScatterEstimate == NULL ? NULL :
+		pfCopySlices(psVol->pfScatterEstimate, psParms->NumViews, psParms->NumSlices, psParms->NumPixels, psSlab->iFirst, psSlab->iNumSlices, "CopySlabInputs:pfScat");
+	psIn->pfAtn = psVol->pfAtnMap == NULL ? NULL :
+		pfCopySlices(psVol->pfAtnMap, 1, psParms->NumSlices, lSliceLen, psSlab->iFirst, psSlab->iNumSlices, "CopySlabInputs:pfAtn");
+	psIn->pfAct = pfCopySlices(psVol->pfActImage, 1, psParms->NumSlices, lSliceLen, psSlab->iFirst, psSlab->iNumSlices, "CopySlabInputs:pfAct");
+}
+
+static void vFreeSlabInputs(SlabInputs_t *psIn)
+{
+	IrlFree(psIn->pfPrj);
+	if (psIn->pfScat) IrlFree(psIn->pfScat);
+	if (psIn->pfAtn) IrlFree(psIn->pfAtn);
+	IrlFree(psIn->pfAct);
+}
+
+// reconstructs slab iSlab from its inputs, leaving it in psIn->pfAct
+static int iRunSlab(int iSlab, SlabInputs_t *psIn, Options_t *psOptions, sAdvOptions *psAdvOpts, PrjView_t *psViews,
+	char *pchDrfTabFile, char *pchSrfKrnlFile, const StopCriteria_t *psStop)
+{
+	IrlParms_t sIrlParms = psIn->sIrlParms;
+	int iErrNum;
+
+	// normalization images kept on disk need a name of their own for each slab
+	if (psIn->sIrlParms.pchNormImageBase != NULL){
+		sIrlParms.pchNormImageBase = (char *)pvIrlMalloc((int)strlen(psIn->sIrlParms.pchNormImageBase) + 16, "RunSlab:pchNormImageBase");
+		sprintf(sIrlParms.pchNormImageBase, "%s.slab%d", psIn->sIrlParms.pchNormImageBase, iSlab);
+	}
+	iErrNum = iOsemWithStop(&sIrlParms, psOptions, psAdvOpts, psViews, pchDrfTabFile, pchSrfKrnlFile, NULL,
+		psIn->pfScat, psIn->pfAtn, psIn->pfPrj, psIn->pfAct, NULL, NULL, psStop, NULL);
+	if (iErrNum)
+		fprintf(stderr, "fatal error in IrlOsem for slab %d: ErrNum=%d\n      %s", iSlab + 1, iErrNum, pchIrlErrorString());
+	if (sIrlParms.pchNormImageBase != psIn->sIrlParms.pchNormImageBase)
+		IrlFree(sIrlParms.pchNormImageBase);
+	return iErrNum;
+}
+
+// reconstructs one slab and puts the slices it keeps into pfOut, which has all the slices
+static int iReconSlab(const SlabVolume_t *psVol, const Slab_t *psSlab, int iSlab, float *pfOut)
+{
+	long lSliceLen = (long)psVol->psIrlParms->NumPixels*psVol->psIrlParms->NumPixels;
+	SlabInputs_t sIn;
+	int iErrNum;
+
+	vCopySlabInputs(psVol, psSlab, &sIn);
+	iErrNum = iRunSlab(iSlab, &sIn, psVol->psOptions, psVol->psAdvOpts, psVol->psViews, psVol->pchDrfTabFile, psVol->pchSrfKrnlFile, psVol->psStop);
+	if (iErrNum == 0)
+		memcpy(pfOut + psSlab->iCoreFirst*lSliceLen, sIn.pfAct + (psSlab->iCoreFirst - psSlab->iFirst)*lSliceLen, sizeof(float)*psSlab->iNumCore*lSliceLen);
+	vFreeSlabInputs(&sIn);
+	return iErrNum;
+}
+
+/* Reconstructs the whole volume from the same inputs and compares it with
+	the stitched slabs in pfActImage. pfFull holds the initial estimate. */
+static void vCheckSlabs(const SlabParms_t *psSlabParms, const Slab_t *psSlabs, int iNumSlabs, const SlabVolume_t *psVol, float *pfFull, double dSlabTime)
+{
+	IrlParms_t *psParms = psVol->psIrlParms;
+	long l, lSliceLen = (long)psParms->NumPixels*psParms->NumPixels, lNumVoxels = lSliceLen*psParms->NumSlices;
+	double dStart = dGetWallTime(), dMax = 0.0, dDiff, dWorst = 0.0;
+	int iErrNum, iSlab, iWorstSlice = 0;
+
+	iErrNum = iOsemWithStop(psParms, psVol->psOptions, psVol->psAdvOpts, psVol->psViews, psVol->pchDrfTabFile, psVol->pchSrfKrnlFile, NULL,
+		psVol->pfScatterEstimate, psVol->pfAtnMap, psVol->pfPrjImage, pfFull, NULL, NULL, psVol->psStop, NULL);
+	if (iErrNum){
+		vErrorHandler(ECLASS_WARN, ETYPE_ILLEGAL_VALUE, "SlabOsem", "slab_check: the whole volume failed: ErrNum=%d %s", iErrNum, pchIrlErrorString());
+		return;
+	}
+	for (l = 0; l < lNumVoxels; l++)
+		if (fabs(pfFull[l]) > dMax)
+			dMax = fabs(pfFull[l]);
+	for (l = 0; l < lNumVoxels; l++){
+		dDiff = fabs((double)psVol->pfActImage[l] - pfFull[l]);
+		if (dDiff > dWorst){
+			dWorst = dDiff;
+			iWorstSlice = (int)(l/lSliceLen);
+		}
+	}
+	if (dMax > 0.0)
+		dWorst /= dMax;
+	for (iSlab = 0; iSlab < iNumSlabs - 1 && iWorstSlice >= psSlabs[iSlab].iCoreFirst + psSlabs[iSlab].iNumCore; iSlab++)
+		;
+	vPrintMsg(4, "slab_check: whole volume in %.2f s, slabs in %.2f s; largest difference %.3g of the image maximum, in slice %d of slab %d\n",
+		dGetWallTime() - dStart, dSlabTime, dWorst, iWorstSlice, iSlab + 1);
+	if (dWorst > psSlabParms->dTolerance)
+		vErrorHandler(ECLASS_WARN, ETYPE_ILLEGAL_VALUE, "SlabOsem",
+			"the slabs differ from the whole volume by %.3g of the image maximum, more than slab_tolerance=%g; increase slab_halo (%d)",
+			dWorst, psSlabParms->dTolerance, psSlabParms->iHalo);
+}
+
+#ifndef WIN32
+#define SLAB_MAGIC			"OSEMSLAB"
+#define SLAB_VERSION		1
+#define SLAB_HELLO_TIMEOUT	10	// seconds a new connection has to send its hello
+
+// sent by a rank when it connects; everything has to match the root's
+typedef struct {
+	char achMagic[8];
+	int iVersion;
+	int aiSizes[4];		// of SlabJob_t, SlabReply_t, PrjView_t and IrlParms_t in this build
+	char achToken[SLAB_MAX_TOKEN];
+} SlabHello_t;
+
+// sent to a rank for each slab, followed by the file names, the views and the inputs of the slab
+typedef struct {
+	int iSlab;				// -1 tells the rank to exit
+	Slab_t sSlab;
+	IrlParms_t sIrlParms;	// of the slab; the normalization image name follows
+	Options_t sOptions;
+	sAdvOptions sAdvOpts;
+	StopCriteria_t sStop;	// without a cancel flag
+	SysMatOptions_t sSysMat;
+	int bScatter, bAtnMap;
+	int aiNameLens[3];		// lengths of the drf table, srf kernel and normalization image names, -1 for none
+} SlabJob_t;
+
+// sent back by a rank, followed by the slices the slab keeps if iErrNum is 0
+typedef struct {
+	int iSlab;
+	int iErrNum;
+	double dReconTime;
+} SlabReply_t;
+
+static void vMakeHello(const char *pchToken, SlabHello_t *psHello)
+{
+	memset(psHello, 0, sizeof(SlabHello_t));
+	memcpy(psHello->achMagic, SLAB_MAGIC, sizeof(psHello->achMagic));
+	psHello->iVersion = SLAB_VERSION;
+	psHello->aiSizes[0] = (int)sizeof(SlabJob_t);
+	psHello->aiSizes[1] = (int)sizeof(SlabReply_t);
+	psHello->aiSizes[2] = (int)sizeof(PrjView_t);
+	psHello->aiSizes[3] = (int)sizeof(IrlParms_t);
+	strncpy(psHello->achToken, pchToken, SLAB_MAX_TOKEN - 1);
+}
+
+// compares every byte, so the time taken does not tell how much of the token was right
+static int bSameHello(const SlabHello_t *psHello1, const SlabHello_t *psHello2)
+{
+	const unsigned char *puch1 = (const unsigned char *)psHello1, *puch2 = (const unsigned char *)psHello2;
+	unsigned char uchDiff = 0;
+	size_t l;
+
+	for (l = 0; l < sizeof(SlabHello_t); l++)
+		uchDiff |= puch1[l] ^ puch2[l];
+	return uchDiff == 0;
+}
+
+// a random token for ranks started on this machine
+static void vMakeToken(char *pchToken)
+{
+	unsigned char auchBytes[16];
+	FILE *fp = fopen("/dev/urandom", "rb");
+	int i, bOk = fp != NULL && fread(auchBytes, 1, sizeof(auchBytes), fp) == sizeof(auchBytes);
+
+	if (fp != NULL)
+		fclose(fp);
+	if (!bOk)
+		vErrorHandler(ECLASS_FATAL, ETYPE_IO, "SlabRanks", "unable to read /dev/urandom for the rank token");
+	for (i = 0; i < (int)sizeof(auchBytes); i++)
+		sprintf(pchToken + 2*i, "%02x", auchBytes[i]);
+}
+
+static int bSendAll(int iFd, const void *pv, size_t lSize)
+{
+	const char *pch = (const char *)pv;
+	ssize_t lWritten;
+
+	while (lSize > 0){
+		if ((lWritten = write(iFd, pch, lSize)) <= 0)
+			return FALSE;
+		pch += lWritten;
+		lSize -= lWritten;
+	}
+	return TRUE;
+}
+
+static int bRecvAll(int iFd, void *pv, size_t lSize)
+{
+	char *pch = (char *)pv;
+	ssize_t lRead;
+
+	while (lSize > 0){
+		if ((lRead = read(iFd, pch, lSize)) <= 0)
+			return FALSE;
+		pch += lRead;
+		lSize -= lRead;
+	}
+	return TRUE;
+}
+
+// sends a slab to a rank; returns the number of bytes sent, 0 if the rank has gone
+static double dSendSlab(int iFd, int iSlab, const Slab_t *psSlab, const SlabVolume_t *psVol, SlabInputs_t *psIn)
+{
+	SlabJob_t sJob;
+	char *apchNames[3];
+	long lPrjLen = (long)psIn->sIrlParms.NumViews*psIn->sIrlParms.NumSlices*psIn->sIrlParms.NumPixels;
+	long lImgLen = (long)psIn->sIrlParms.NumPixels*psIn->sIrlParms.NumPixels*psIn->sIrlParms.NumSlices;
+	double dBytes;
+	int i, bOk;
+
+	memset(&sJob, 0, sizeof(sJob));
+	sJob.iSlab = iSlab;
+	sJob.sSlab = *psSlab;
+	sJob.sIrlParms = psIn->sIrlParms;
+	sJob.sIrlParms.pchNormImageBase = NULL;
+	sJob.sOptions = *psVol->psOptions;
+	sJob.sAdvOpts = *psVol->psAdvOpts;
+	if (psVol->psStop != NULL)
+		sJob.sStop = *psVol->psStop;
+	sJob.sStop.pbCancel = NULL;
+	vGetSysMatOptions(&sJob.sSysMat);
+	sJob.bScatter = psIn->pfScat != NULL;
+	sJob.bAtnMap = psIn->pfAtn != NULL;
+	apchNames[0] = psVol->pchDrfTabFile;
+	apchNames[1] = psVol->pchSrfKrnlFile;
+	apchNames[2] = psIn->sIrlParms.pchNormImageBase;
+	for (i = 0; i < 3; i++)
+		sJob.aiNameLens[i] = apchNames[i] != NULL ? (int)strlen(apchNames[i]) : -1;
+
+	bOk = bSendAll(iFd, &sJob, sizeof(sJob));
+	for (i = 0; i < 3; i++)
+		if (apchNames[i] != NULL)
+			bOk = bOk && bSendAll(iFd, apchNames[i], sJob.aiNameLens[i]);
+	bOk = bOk && bSendAll(iFd, psVol->psViews, sizeof(PrjView_t)*psIn->sIrlParms.NumViews);
+	bOk = bOk && bSendAll(iFd, psIn->pfPrj, sizeof(float)*lPrjLen);
+	if (sJob.bScatter)
+		bOk = bOk && bSendAll(iFd, psIn->pfScat, sizeof(float)*lPrjLen);
+	if (sJob.bAtnMap)
+		bOk = bOk && bSendAll(iFd, psIn->pfAtn, sizeof(float)*lImgLen);
+	bOk = bOk && bSendAll(iFd, psIn->pfAct, sizeof(float)*lImgLen);
+	dBytes = sizeof(sJob) + sizeof(PrjView_t)*psIn->sIrlParms.NumViews + sizeof(float)*((1 + sJob.bScatter)*(double)lPrjLen + (1 + sJob.bAtnMap)*(double)lImgLen);
+	return bOk ? dBytes : 0.0;
+}
+
+/**
+	@brief Runs a rank for slab_ranks: connects to the reconstruction
+	running on host:port, introduces itself with the token in
+	OSEM_SLAB_TOKEN and reconstructs the slabs it is sent until it is
+	told to stop.
+
+	@return 0 if the rank stopped when it was told to, 1 otherwise.
+*/
+int iRunSlabRank(char *pchHost, char *pchPort)
+{
+	struct addrinfo sHints, *psAddrs, *psAddr;
+	SlabHello_t sHello;
+	SlabJob_t sJob;
+	SlabReply_t sReply;
+	SlabInputs_t sIn;
+	PrjView_t *psViews;
+	char *apchNames[3];
+	long lPrjLen, lImgLen, lSliceLen;
+	double dStart;
+	char *pchToken = getenv(SLAB_TOKEN_ENV);
+	int i, iFd = -1, bOk = TRUE, iNumSlabs = 0, iOne = 1;
+
+	if (pchToken == NULL || pchToken[0] == '\0' || strlen(pchToken) >= SLAB_MAX_TOKEN){
+		fprintf(stderr, "rank: %s has to be set to the token of the root\n", SLAB_TOKEN_ENV);
+		return 1;
+	}
+	memset(&sHints, 0, sizeof(sHints));
+	sHints.ai_family = AF_UNSPEC;
+	sHints.ai_socktype = SOCK_STREAM;
+	if (getaddrinfo(pchHost, pchPort, &sHints, &psAddrs) != 0){
+		fprintf(stderr, "rank: unable to look up %s:%s\n", pchHost, pchPort);
+		return 1;
+	}
+	for (psAddr = psAddrs; psAddr != NULL && iFd < 0; psAddr = psAddr->ai_next)
+		if ((iFd = socket(psAddr->ai_family, psAddr->ai_socktype, psAddr->ai_protocol)) >= 0 && connect(iFd, psAddr->ai_addr, psAddr->ai_addrlen)){
+			close(iFd);
+			iFd = -1;
+		}
+	freeaddrinfo(psAddrs);
+	if (iFd < 0){
+		fprintf(stderr, "rank: unable to connect to %s:%s\n", pchHost, pchPort);
+		return 1;
+	}
+	// the header of a reply is a small write of its own
+	setsockopt(iFd, IPPROTO_TCP, TCP_NODELAY, &iOne, sizeof(iOne));
+	signal(SIGPIPE, SIG_IGN);
+	vMakeHello(pchToken, &sHello);
+	sJob.iSlab = 0;
+	if (!bSendAll(iFd, &sHello, sizeof(sHello)))
+		bOk = FALSE;
+
+	while (bOk && bRecvAll(iFd, &sJob, sizeof(sJob)) && sJob.iSlab >= 0){
+		// the root passed the hello, but a bad size should not turn into a huge allocation
+		if (sJob.sIrlParms.NumPixels <= 0 || sJob.sIrlParms.NumSlices <= 0 || sJob.sIrlParms.NumViews <= 0 ||
+			sJob.sIrlParms.NumPixels > 4096 || sJob.sIrlParms.NumSlices > 4096 || sJob.sIrlParms.NumViews > 4096 ||
+			sJob.aiNameLens[0] >= 4096 || sJob.aiNameLens[1] >= 4096 || sJob.aiNameLens[2] >= 4096){
+			fprintf(stderr, "rank: slab %d has an invalid size\n", sJob.iSlab + 1);
+			bOk = FALSE;
+			break;
+		}
+		for (i = 0; i < 3; i++){
+			apchNames[i] = NULL;
+			if (sJob.aiNameLens[i] >= 0){
+				apchNames[i] = (char *)pvIrlMalloc(sJob.aiNameLens[i] + 1, "SlabRank:pchName");
+				bOk = bOk && bRecvAll(iFd, apchNames[i], sJob.aiNameLens[i]);
+				apchNames[i][sJob.aiNameLens[i]] = '\0';
+			}
+		}
+		sIn.sIrlParms = sJob.sIrlParms;
+		sIn.sIrlParms.pchNormImageBase = apchNames[2];
+		lPrjLen = (long)sIn.sIrlParms.NumViews*sIn.sIrlParms.NumSlices*sIn.sIrlParms.NumPixels;
+		lSliceLen = (long)sIn.sIrlParms.NumPixels*sIn.sIrlParms.NumPixels;
+		lImgLen = lSliceLen*sIn.sIrlParms.NumSlices;
+		psViews = (PrjView_t *)pvIrlMalloc(sizeof(PrjView_t)*sIn.sIrlParms.NumViews, "SlabRank:psViews");
+		sIn.pfPrj = (float *)pvIrlMalloc(sizeof(float)*lPrjLen, "SlabRank:pfPrj");
+		sIn.pfScat = sJob.bScatter ? (float *)pvIrlMalloc(sizeof(float)*lPrjLen, "SlabRank:pfScat") : NULL;
+		sIn.pfAtn = sJob.bAtnMap ? (float *)pvIrlMalloc(sizeof(float)*lImgLen, "SlabRank:pfAtn") : NULL;
+		sIn.pfAct = (float *)pvIrlMalloc(sizeof(float)*lImgLen, "SlabRank:pfAct");
+		bOk = bOk && bRecvAll(iFd, psViews, sizeof(PrjView_t)*sIn.sIrlParms.NumViews);
+		bOk = bOk && bRecvAll(iFd, sIn.pfPrj, sizeof(float)*lPrjLen);
+		if (sJob.bScatter)
+			bOk = bOk && bRecvAll(iFd, sIn.pfScat, sizeof(float)*lPrjLen);
+		if (sJob.bAtnMap)
+			bOk = bOk && bRecvAll(iFd, sIn.pfAtn, sizeof(float)*lImgLen);
+		bOk = bOk && bRecvAll(iFd, sIn.pfAct, sizeof(float)*lImgLen);
+
+		if (bOk){
+			vSetSysMatOptions(&sJob.sSysMat);
+			dStart = dGetWallTime();
+			sReply.iSlab = sJob.iSlab;
+			sReply.iErrNum = iRunSlab(sJob.iSlab, &sIn, &sJob.sOptions, &sJob.sAdvOpts, psViews, apchNames[0], apchNames[1], &sJob.sStop);
+			sReply.dReconTime = dGetWallTime() - dStart;
+			bOk = bSendAll(iFd, &sReply, sizeof(sReply));
+			if (sReply.iErrNum == 0)
+				bOk = bOk && bSendAll(iFd, sIn.pfAct + (long)(sJob.sSlab.iCoreFirst - sJob.sSlab.iFirst)*lSliceLen, sizeof(float)*sJob.sSlab.iNumCore*lSliceLen);
+			iNumSlabs++;
+		}
+		vFreeSlabInputs(&sIn);
+		IrlFree(psViews);
+		for (i = 0; i < 3; i++)
+			if (apchNames[i]) IrlFree(apchNames[i]);
+		if (!bOk)
+			break;
+	}
+	close(iFd);
+	fprintf(stderr, "rank: %s after %d slabs\n", bOk && sJob.iSlab < 0 ? "done" : "lost the connection", iNumSlabs);
+	return bOk && sJob.iSlab < 0 ? 0 : 1;
+}
+
+/* listens on pchBind:iPort, or a free port if iPort is 0, and puts the
+	port in pchPort; returns the socket */
+static int iListenOn(const char *pchBind, int iPort, int iBacklog, char *pchPort)
+{
+	struct addrinfo sHints, *psAddrs, *psAddr;
+	struct sockaddr_storage sAddr;
+	socklen_t iAddrLen = sizeof(sAddr);
+	char achService[16];
+	int iFd = -1, iOne = 1;
+
+	memset(&sHints, 0, sizeof(sHints));
+	sHints.ai_family = AF_UNSPEC;
+	sHints.ai_socktype = SOCK_STREAM;
+	sHints.ai_flags = AI_NUMERICSERV;
+	sprintf(achService, "%d", iPort);
+	if (getaddrinfo(pchBind, achService, &sHints, &psAddrs) != 0)
+		vErrorHandler(ECLASS_FATAL, ETYPE_IO, "SlabRanks", "unable to look up slab_bind %s", pchBind);
+	for (psAddr = psAddrs; psAddr != NULL && iFd < 0; psAddr = psAddr->ai_next)
+		if ((iFd = socket(psAddr->ai_family, psAddr->ai_socktype, psAddr->ai_protocol)) >= 0 &&
+			(setsockopt(iFd, SOL_SOCKET, SO_REUSEADDR, &iOne, sizeof(iOne)) || bind(iFd, psAddr->ai_addr, psAddr->ai_addrlen) || listen(iFd, iBacklog))){
+			close(iFd);
+			iFd = -1;
+		}
+	freeaddrinfo(psAddrs);
+	if (iFd < 0 || getsockname(iFd, (struct sockaddr *)&sAddr, &iAddrLen) ||
+		getnameinfo((struct sockaddr *)&sAddr, iAddrLen, NULL, 0, pchPort, 16, NI_NUMERICSERV))
+		vErrorHandler(ECLASS_FATAL, ETYPE_IO, "SlabRanks", "unable to listen on %s port %d", pchBind, iPort);
+	return iFd;
+}
+
+/* accepts a connection whose hello matches psHello, dropping the others;
+	a connection has SLAB_HELLO_TIMEOUT seconds to send its hello */
+static int iAcceptRank(int iListenFd, const SlabHello_t *psHello, int iRank)
+{
+	SlabHello_t sGot;
+	struct timeval sTimeout;
+	int iFd, iOne = 1;
+
+	for (;;){
+		if ((iFd = accept(iListenFd, NULL, NULL)) < 0)
+			vErrorHandler(ECLASS_FATAL, ETYPE_IO, "SlabRanks", "unable to accept rank %d", iRank);
+		sTimeout.tv_sec = SLAB_HELLO_TIMEOUT;
+		sTimeout.tv_usec = 0;
+		setsockopt(iFd, SOL_SOCKET, SO_RCVTIMEO, &sTimeout, sizeof(sTimeout));
+		if (bRecvAll(iFd, &sGot, sizeof(sGot)) && bSameHello(&sGot, psHello))
+			break;
+		vErrorHandler(ECLASS_WARN, ETYPE_IO, "SlabRanks", "dropped a connection with the wrong token or osems build");
+		close(iFd);
+	}
+	sTimeout.tv_sec = 0;
+	setsockopt(iFd, SOL_SOCKET, SO_RCVTIMEO, &sTimeout, sizeof(sTimeout));
+	setsockopt(iFd, IPPROTO_TCP, TCP_NODELAY, &iOne, sizeof(iOne));
+	return iFd;
+}
+
+/* Hands the slabs out to slab_ranks ranks over TCP and collects the
+	slices they keep into pfOut, reporting the time spent sending and
+	receiving each slab. */
+static void vRunSlabRanks(const SlabParms_t *psSlabParms, const Slab_t *psSlabs, int iNumSlabs, const SlabVolume_t *psVol, float *pfOut, int *piErrNums)
+{
+	long lSliceLen = (long)psVol->psIrlParms->NumPixels*psVol->psIrlParms->NumPixels;
+	int iNumRanks = psSlabParms->iNumRanks, iListenFd, iRank, iSlab, iNextSlab = 0, iNumRunning = 0, iNumLive, iMaxFd;
+	int *piFds, *piRankSlab;
+	pid_t *piPids = NULL;
+	SlabHello_t sHello;
+	SlabJob_t sStop;
+	SlabReply_t sReply;
+	SlabInputs_t sIn;
+	fd_set sReadFds;
+	char achPort[16], achToken[SLAB_MAX_TOKEN];
+	double dStart = dGetWallTime(), dTime, dBytes, dRecvTime, dCommTime = 0.0;
+	double *pdSendTime, *pdSendMB;
+
+	signal(SIGPIPE, SIG_IGN);
+	if (psSlabParms->bLocalRanks)
+		vMakeToken(achToken);
+	else{
+		strncpy(achToken, getenv(SLAB_TOKEN_ENV), SLAB_MAX_TOKEN - 1);
+		achToken[SLAB_MAX_TOKEN - 1] = '\0';
+	}
+	vMakeHello(achToken, &sHello);
+	iListenFd = iListenOn(psSlabParms->bLocalRanks ? "127.0.0.1" : psSlabParms->achBind, psSlabParms->iPort, iNumRanks, achPort);
+
+	if (psSlabParms->bLocalRanks){
+		piPids = (pid_t *)pvIrlMalloc(sizeof(pid_t)*iNumRanks, "SlabRanks:piPids");
+		for (iRank = 0; iRank < iNumRanks; iRank++){
+			fflush(NULL);
+			if ((piPids[iRank] = fork()) < 0)
+				vErrorHandler(ECLASS_FATAL, ETYPE_IO, "SlabRanks", "unable to fork rank %d", iRank);
+			if (piPids[iRank] == 0){
+				close(iListenFd);
+				setenv(SLAB_TOKEN_ENV, achToken, 1);
+				exit(iRunSlabRank("127.0.0.1", achPort));
+			}
+		}
+	}else
+		vPrintMsg(4, "slabs: waiting for %d ranks: %s=<token> osems --rank %s %s\n", iNumRanks, SLAB_TOKEN_ENV, psSlabParms->achBind, achPort);
+
+	piFds = (int *)pvIrlMalloc(sizeof(int)*iNumRanks, "SlabRanks:piFds");
+	piRankSlab = (int *)pvIrlMalloc(sizeof(int)*iNumRanks, "SlabRanks:piRankSlab");
+	pdSendTime = (double *)pvIrlMalloc(sizeof(double)*iNumSlabs, "SlabRanks:pdSendTime");
+	pdSendMB = (double *)pvIrlMalloc(sizeof(double)*iNumSlabs, "SlabRanks:pdSendMB");
+	for (iRank = 0; iRank < iNumRanks; iRank++){
+		piFds[iRank] = iAcceptRank(iListenFd, &sHello, iRank);
+		piRankSlab[iRank] = -1;
+	}
+	close(iListenFd);
+	vPrintMsg(4, "slabs: %d slabs of %d slices on %d ranks (port %s), connected in %.2f s\n", iNumSlabs, psVol->psIrlParms->NumSlices, iNumRanks, achPort, dGetWallTime() - dStart);
+
+	iNumLive = iNumRanks;
+	while ((iNextSlab < iNumSlabs && iNumLive > 0) || iNumRunning > 0){
+		// each idle rank gets the next slab
+		for (iRank = 0; iRank < iNumRanks && iNextSlab < iNumSlabs; iRank++){
+			if (piFds[iRank] < 0 || piRankSlab[iRank] >= 0)
+				continue;
+			vCopySlabInputs(psVol, &psSlabs[iNextSlab], &sIn);
+			dTime = dGetWallTime();
+			dBytes = dSendSlab(piFds[iRank], iNextSlab, &psSlabs[iNextSlab], psVol, &sIn);
+			pdSendTime[iNextSlab] = dGetWallTime() - dTime;
+			pdSendMB[iNextSlab] = dBytes/1048576.0;
+			vFreeSlabInputs(&sIn);
+			if (dBytes == 0.0){
+				fprintf(stderr, "slabs: rank %d has gone\n", iRank);
+				close(piFds[iRank]);
+				piFds[iRank] = -1;
+				iNumLive--;
+				continue;
+			}
+			piRankSlab[iRank] = iNextSlab++;
+			iNumRunning++;
+		}
+
+		FD_ZERO(&sReadFds);
+		iMaxFd = -1;
+		for (iRank = 0; iRank < iNumRanks; iRank++)
+			if (piRankSlab[iRank] >= 0){
+				FD_SET(piFds[iRank], &sReadFds);
+				if (piFds[iRank] > iMaxFd)
+					iMaxFd = piFds[iRank];
+			}
+		if (iMaxFd < 0 || select(iMaxFd + 1, &sReadFds, NULL, NULL, NULL) < 0)
+			continue;
+		for (iRank = 0; iRank < iNumRanks; iRank++){
+			if ((iSlab = piRankSlab[iRank]) < 0 || !FD_ISSET(piFds[iRank], &sReadFds))
+				continue;
+			piRankSlab[iRank] = -1;
+			iNumRunning--;
+			dTime = dGetWallTime();
+			if (!bRecvAll(piFds[iRank], &sReply, sizeof(sReply)) || sReply.iSlab != iSlab ||
+				(sReply.iErrNum == 0 && !bRecvAll(piFds[iRank], pfOut + psSlabs[iSlab].iCoreFirst*lSliceLen, sizeof(float)*psSlabs[iSlab].iNumCore*lSliceLen))){
+				fprintf(stderr, "slabs: rank %d died while reconstructing slab %d\n", iRank, iSlab + 1);
+				close(piFds[iRank]);
+				piFds[iRank] = -1;
+				iNumLive--;
+				continue;
+			}
+			dRecvTime = dGetWallTime() - dTime;
+			dCommTime += pdSendTime[iSlab] + dRecvTime;
+			piErrNums[iSlab] = sReply.iErrNum;
+			vPrintMsg(4, "slab %d: slices %d-%d from %d-%d on rank %d: reconstructed in %.2f s, transfer %.3f s (sent %.1f MB in %.3f s, returned %.1f MB in %.3f s)\n",
+				iSlab + 1, psSlabs[iSlab].iCoreFirst, psSlabs[iSlab].iCoreFirst + psSlabs[iSlab].iNumCore - 1,
+				psSlabs[iSlab].iFirst, psSlabs[iSlab].iFirst + psSlabs[iSlab].iNumSlices - 1, iRank, sReply.dReconTime,
+				pdSendTime[iSlab] + dRecvTime, pdSendMB[iSlab], pdSendTime[iSlab], sizeof(float)*psSlabs[iSlab].iNumCore*lSliceLen/1048576.0, dRecvTime);
+		}
+	}
+
+	memset(&sStop, 0, sizeof(sStop));
+	sStop.iSlab = -1;
+	for (iRank = 0; iRank < iNumRanks; iRank++)
+		if (piFds[iRank] >= 0){
+			bSendAll(piFds[iRank], &sStop, sizeof(sStop));
+			close(piFds[iRank]);
+		}
+	if (piPids != NULL){
+		for (iRank = 0; iRank < iNumRanks; iRank++)
+			waitpid(piPids[iRank], NULL, 0);
+		IrlFree(piPids);
+	}
+	vPrintMsg(4, "slabs: %.2f s of transfer, %.3f s per slab, in %.2f s on %d ranks\n", dCommTime, dCommTime/iNumSlabs, dGetWallTime() - dStart, iNumRanks);
+	IrlFree(piFds);
+	IrlFree(piRankSlab);
+	IrlFree(pdSendTime);
+	IrlFree(pdSendMB);
+}
+
+#else
+
+int iRunSlabRank(char *pchHost, char *pchPort)
+{
+	vErrorHandler(ECLASS_FATAL, ETYPE_USAGE, "SlabRank", "ranks need sockets and fork");
+	return 1;
+}
+
+#endif
+
+/**
+	@brief Reconstructs the volume as psSlabParms->iNumSlabs slabs and
+	stitches them into pfActImage.
+
+	The arguments from psIrlParms on are those of iOsemWithStop, without
+	the iteration callback, the log and message files and the trace,
+	which do not apply to the volume as a whole. Each slab stops on its
+	own when psStop is met. With slab_check the whole volume is
+	reconstructed as well and compared with the slabs.
+
+	@return 0, or the IrlOsem error number of the first slab that failed
+		(SLAB_DIED if its process or rank ended without one).
+*/
+int iSlabOsem(const SlabParms_t *psSlabParms, IrlParms_t *psIrlParms, Options_t *psOptions, sAdvOptions *psAdvOpts, PrjView_t *psViews,
+	char *pchDrfTabFile, char *pchSrfKrnlFile, float *pfScatterEstimate, float *pfAtnMap, float *pfPrjImage, float *pfActImage,
+	const StopCriteria_t *psStop)
+{
+	long lNumVoxels = (long)psIrlParms->NumPixels*psIrlParms->NumPixels*psIrlParms->NumSlices;
+	size_t lSharedSize;
+	SlabVolume_t sVol;
+	Slab_t *psSlabs;
+	float *pfOut, *pfFull = NULL;
+	int *piErrNums, iNumSlabs, iSlab, iErrNum = 0;
+	double dStart = dGetWallTime(), *pdSlabStart;
+#ifndef WIN32
+	pid_t *piPids, iPid;
+	int iNumWorkers, iNumRunning = 0, iNextSlab = 0, iStatus;
+#endif
+
+	sVol.psIrlParms = psIrlParms;
+	sVol.psOptions = psOptions;
+	sVol.psAdvOpts = psAdvOpts;
+	sVol.psViews = psViews;
+	sVol.pchDrfTabFile = pchDrfTabFile;
+	sVol.pchSrfKrnlFile = pchSrfKrnlFile;
+	sVol.pfScatterEstimate = pfScatterEstimate;
+	sVol.pfAtnMap = pfAtnMap;
+	sVol.pfPrjImage = pfPrjImage;
+	sVol.pfActImage = pfActImage;
+	sVol.psStop = psStop;
+	psSlabs = (Slab_t *)pvIrlMalloc(sizeof(Slab_t)*psSlabParms->iNumSlabs, "SlabOsem:psSlabs");
+	pdSlabStart = (double *)pvIrlMalloc(sizeof(double)*psSlabParms->iNumSlabs, "SlabOsem:pdSlabStart");
+	iNumSlabs = iSplitSlabs(psIrlParms->NumSlices, psSlabParms->iNumSlabs, psSlabParms->iHalo, psSlabs);
+	if (psSlabParms->bCheck){
+		pfFull = (float *)pvIrlMalloc(sizeof(float)*lNumVoxels, "SlabOsem:pfFull");
+		memcpy(pfFull, pfActImage, sizeof(float)*lNumVoxels);
+	}
+
+	// the stitched slices followed by the error number of each slab
+	lSharedSize = sizeof(float)*lNumVoxels + sizeof(int)*iNumSlabs;
+#ifdef WIN32
+	pfOut = (float *)pvIrlMalloc((int)lSharedSize, "SlabOsem:pfOut");
+#else
+	pfOut = (float *)mmap(NULL, lSharedSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (pfOut == (float *)MAP_FAILED)
+		vErrorHandler(ECLASS_FATAL, ETYPE_MALLOC, "SlabOsem", "unable to map %.0f MB for the slabs", lSharedSize/1048576.0);
+#endif
+	piErrNums = (int *)(pfOut + lNumVoxels);
+	for (iSlab = 0; iSlab < iNumSlabs; iSlab++)
+		piErrNums[iSlab] = SLAB_DIED;
+
+#ifdef WIN32
+	for (iSlab = 0; iSlab < iNumSlabs; iSlab++){
+		pdSlabStart[iSlab] = dGetWallTime();
+		piErrNums[iSlab] = iReconSlab(&sVol, &psSlabs[iSlab], iSlab, pfOut);
+		vPrintMsg(4, "slab %d: slices %d-%d from %d-%d in %.2f s\n", iSlab + 1, psSlabs[iSlab].iCoreFirst, psSlabs[iSlab].iCoreFirst + psSlabs[iSlab].iNumCore - 1,
+			psSlabs[iSlab].iFirst, psSlabs[iSlab].iFirst + psSlabs[iSlab].iNumSlices - 1, dGetWallTime() - pdSlabStart[iSlab]);
+	}
+#else
+	if (psSlabParms->iNumRanks > 0)
+		vRunSlabRanks(psSlabParms, psSlabs, iNumSlabs, &sVol, pfOut, piErrNums);
+	else{
+		iNumWorkers = iGetNumThreads() < iNumSlabs ? iGetNumThreads() : iNumSlabs;
+		piPids = (pid_t *)pvIrlMalloc(sizeof(pid_t)*iNumSlabs, "SlabOsem:piPids");
+		vPrintMsg(4, "slabs: %d slabs of %d slices on %d processes\n", iNumSlabs, psIrlParms->NumSlices, iNumWorkers);
+		while (iNextSlab < iNumSlabs || iNumRunning > 0){
+			if (iNextSlab < iNumSlabs && iNumRunning < iNumWorkers){
+				fflush(NULL);
+				pdSlabStart[iNextSlab] = dGetWallTime();
+				if ((piPids[iNextSlab] = fork()) < 0)
+					vErrorHandler(ECLASS_FATAL, ETYPE_IO, "SlabOsem", "unable to fork a process for slab %d", iNextSlab + 1);
+				if (piPids[iNextSlab] == 0){
+					piErrNums[iNextSlab] = iReconSlab(&sVol, &psSlabs[iNextSlab], iNextSlab, pfOut);
+					exit(0);
+				}
+				iNextSlab++;
+				iNumRunning++;
+				continue;
+			}
+			if ((iPid = waitpid(-1, &iStatus, 0)) < 0)
+				break;
+			for (iSlab = 0; iSlab < iNextSlab && piPids[iSlab] != iPid; iSlab++)
+				;
+			if (iSlab == iNextSlab)
+				continue;	// not one of the slabs
+			iNumRunning--;
+			vPrintMsg(4, "slab %d: slices %d-%d from %d-%d in %.2f s%s\n", iSlab + 1, psSlabs[iSlab].iCoreFirst, psSlabs[iSlab].iCoreFirst + psSlabs[iSlab].iNumCore - 1,
+				psSlabs[iSlab].iFirst, psSlabs[iSlab].iFirst + psSlabs[iSlab].iNumSlices - 1, dGetWallTime() - pdSlabStart[iSlab],
+				piErrNums[iSlab] == SLAB_DIED ? ", process died" : "");
+		}
+		IrlFree(piPids);
+	}
+#endif
+
+	for (iSlab = 0; iSlab < iNumSlabs && iErrNum == 0; iSlab++)
+		iErrNum = piErrNums[iSlab];
+	if (iErrNum == 0){
+		memcpy(pfActImage, pfOut, sizeof(float)*lNumVoxels);
+		if (psSlabParms->bCheck)
+			vCheckSlabs(psSlabParms, psSlabs, iNumSlabs, &sVol, pfFull, dGetWallTime() - dStart);
+	}else
+		fprintf(stderr, "slab %d failed, the volume is incomplete\n", iSlab);
+
+#ifdef WIN32
+	IrlFree(pfOut);
+#else
+	munmap(pfOut, lSharedSize);
+#endif
+	if (pfFull) IrlFree(pfFull);
+	IrlFree(pdSlabStart);
+	IrlFree(psSlabs);
+	return iErrNum;
+}
+
+#ifdef STANDALONE
+
+/* Reconstructs random projections with a collimator response as a whole
+	volume and as 4 slabs on 1 and on 2 local ranks. The halo of 14 slices
+	is three FWHM of the response at the far edge of a 32 pixel field of
+	view; the noise of random projections needs more than the automatic
+	two. Returns 1 unless the ranks give the same image bit for bit and
+	it is within dTol of the image maximum of the whole volume. */
+static int iCompareRanks(int N, int Z, int iNumViews, int iNumIterations, double dTol)
+{
+	IrlParms_t sParms;
+	Options_t sOptions;
+	sAdvOptions sAdvOpts;
+	SlabParms_t sSlabParms;
+	PrjView_t *psViews;
+	float *pfPrj, *pfFull, *apfAct[2];
+	long l, lVoxels = (long)N*N*Z, lPrjLen = (long)iNumViews*Z*N;
+	double adTime[2], dStart, dFullTime, dMax = 0.0, dDiff = 0.0;
+	int iView, iRun, iErrNum, aiErrNums[2], bSame;
+
+	memset(&sParms, 0, sizeof(sParms));
+	memset(&sOptions, 0, sizeof(sOptions));
+	memset(&sAdvOpts, 0, sizeof(sAdvOpts));
+	sParms.NumPixels = N;
+	sParms.NumSlices = Z;
+	sParms.NumViews = iNumViews;
+	sParms.NumIterations = iNumIterations;
+	sParms.NumAngPerSubset = iNumViews < 4 ? iNumViews : 4;
+	sParms.BinWidth = 0.4f;
+	sParms.fHoleDiam = 0.15f;
+	sParms.fHoleLen = 2.4f;
+	sParms.fIntrinsicFWHM = 0.4f;
+	sOptions.bModelDrf = TRUE;
+	psViews = (PrjView_t *)calloc(iNumViews, sizeof(PrjView_t));
+	pfPrj = (float *)malloc(sizeof(float)*lPrjLen);
+	pfFull = (float *)malloc(sizeof(float)*lVoxels);
+	apfAct[0] = (float *)malloc(sizeof(float)*lVoxels);
+	apfAct[1] = (float *)malloc(sizeof(float)*lVoxels);
+	if (psViews == NULL || pfPrj == NULL || pfFull == NULL || apfAct[0] == NULL || apfAct[1] == NULL){
+		fprintf(stderr, "unable to allocate %d x %d x %d\n", N, N, Z);
+		exit(1);
+	}
+	for (iView = 0; iView < iNumViews; iView++){
+		psViews[iView].Angle = (float)(2.0*M_PI*iView/iNumViews);
+		psViews[iView].CFCR = 20.0f;
+		psViews[iView].Left = 0.0f;
+		psViews[iView].Right = (float)(N - 1);
+	}
+	srand(1);
+	for (l = 0; l < lPrjLen; l++)
+		pfPrj[l] = (float)(rand()%100);
+
+	for (l = 0; l < lVoxels; l++)
+		pfFull[l] = 1.0f;
+	dStart = dGetWallTime();
+	iErrNum = iOsemWithStop(&sParms, &sOptions, &sAdvOpts, psViews, NULL, NULL, NULL, NULL, NULL, pfPrj, pfFull, NULL, NULL, NULL, NULL);
+	dFullTime = dGetWallTime() - dStart;
+
+	memset(&sSlabParms, 0, sizeof(sSlabParms));
+	sSlabParms.iNumSlabs = 4;
+	sSlabParms.iHalo = 14;
+	sSlabParms.bLocalRanks = TRUE;
+	for (iRun = 0; iRun < 2; iRun++){
+		sSlabParms.iNumRanks = iRun + 1;
+		for (l = 0; l < lVoxels; l++)
+			apfAct[iRun][l] = 1.0f;
+		dStart = dGetWallTime();
+		aiErrNums[iRun] = iSlabOsem(&sSlabParms, &sParms, &sOptions, &sAdvOpts, psViews, NULL, NULL, NULL, NULL, pfPrj, apfAct[iRun], NULL);
+		adTime[iRun] = dGetWallTime() - dStart;
+	}
+	bSame = iErrNum == 0 && aiErrNums[0] == 0 && aiErrNums[1] == 0 && memcmp(apfAct[0], apfAct[1], sizeof(float)*lVoxels) == 0;
+	for (l = 0; l < lVoxels; l++){
+		if (fabs(pfFull[l]) > dMax)
+			dMax = fabs(pfFull[l]);
+		if (fabs((double)apfAct[1][l] - pfFull[l]) > dDiff)
+			dDiff = fabs((double)apfAct[1][l] - pfFull[l]);
+	}
+	if (dMax > 0.0)
+		dDiff /= dMax;
+	printf("%d x %d pixels, %d slices, %d views, %d iterations: whole volume %.2f s; 4 slabs: 1 rank %.2f s, 2 ranks %.2f s (%.1fx), %s; "
+		"slabs differ from the whole volume by %.3g of its maximum (limit %.3g)\n",
+		N, N, Z, iNumViews, iNumIterations, dFullTime, adTime[0], adTime[1], adTime[0]/adTime[1], bSame ? "identical" : "MISMATCH", dDiff, dTol);
+	free(psViews);
+	free(pfPrj);
+	free(pfFull);
+	free(apfAct[0]);
+	free(apfAct[1]);
+	return !bSame || dDiff > dTol;
+}
+
+int main(int argc, char **argv)
+{
+	if (argc != 5 && argc != 6){
+		fprintf(stderr, "usage: slab pixels slices views iterations [tolerance]\n");
+		return 2;
+	}
+	vSetMsgLevel(4);
+	return iCompareRanks(atoi(argv[1]), atoi(argv[2]), atoi(argv[3]), atoi(argv[4]), argc == 6 ? atof(argv[5]) : 1e-3);
+}
+#endif
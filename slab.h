@@ -0,0 +1,47 @@
+/*
+	slab.h
+
+	Slab parallel reconstruction: the slices are split into slabs that
+	overlap by a halo, the slabs are reconstructed at the same time, in
+	local processes or on ranks reached over TCP, and the results are
+	stitched together.
+
+	Include mip/irl.h, mip/osemhooks.h and convergence.h before this file.
+*/
+
+#ifndef SLAB_H
+#define SLAB_H
+
+#define SLAB_HALO_FWHM	2.0	// collimator response widths in the automatic halo
+#define SLAB_MAX_HOST	256
+#define SLAB_TOKEN_ENV	"OSEM_SLAB_TOKEN"	// the shared token of the root and its ranks
+#define SLAB_MAX_TOKEN	64
+
+typedef struct {
+	int iNumSlabs;			// slabs: slabs the slices are split into, 1 for the whole volume
+	int iHalo;				// slab_halo: slices added on each side of a slab
+	int bCheck;				// slab_check: also reconstruct the whole volume and compare
+	double dTolerance;		// slab_tolerance: largest difference, relative to the image maximum, the check accepts
+	int iNumRanks;			// slab_ranks: ranks the slabs are sent to, 0 for local processes without sockets
+	int iPort;				// slab_port: TCP port the ranks connect to, 0 for any free port
+	int bLocalRanks;		// slab_local_ranks: start the ranks as local processes
+	char achBind[SLAB_MAX_HOST];	// slab_bind: address the root listens on for ranks on other nodes
+} SlabParms_t;
+
+// one slab: the slices it reconstructs, halo included, and the ones it contributes to the result
+typedef struct {
+	int iFirst, iNumSlices;
+	int iCoreFirst, iNumCore;
+} Slab_t;
+
+void vGetSlabParms(SlabParms_t *psSlabs, IrlParms_t *psParms, Options_t *psOptions, PrjView_t *psViews, int bModelSrf);
+int iSplitSlabs(int iNumSlices, int iNumSlabs, int iHalo, Slab_t *psSlabs);
+int iSlabOsem(const SlabParms_t *psSlabParms, IrlParms_t *psIrlParms, Options_t *psOptions, sAdvOptions *psAdvOpts, PrjView_t *psViews,
+	char *pchDrfTabFile, char *pchSrfKrnlFile, float *pfScatterEstimate, float *pfAtnMap, float *pfPrjImage, float *pfActImage,
+	const StopCriteria_t *psStop);
+int iRunSlabRank(char *pchHost, char *pchPort);
+
+// setup.c
+void vGetCmdLineSlabParms(SlabParms_t *psSlabs);
+
+#endif
@@ -0,0 +1,1783 @@
+/*
+	sysmat.c
+
+	OSEM with a precomputed system matrix (approx_sysmat=true). This is
+	an approximate projector written here, not the one in IrlOsem: a
+	bilinear rotation and a Gaussian geometric collimator response. It
+	does not read drf_tab_file and models neither attenuation nor
+	scatter, so its images differ from those of IrlOsem and it has to be
+	asked for by name.
+
+	In the frame of a view, rotated pixel (j,i) of a slice is at depth j
+	and projects mostly onto bin i; depth increases towards the detector.
+	Rotated pixel (j,i) of a view at Angle a samples the image bilinearly
+	at x = c + s cos a + t sin a, y = c - s sin a + t cos a, where
+	(s,t) = (i-c, j-c) and c is the center of the slice. At depth j the
+	face of the collimator is CFCR - t*BinWidth away.
+
+	The matrix of a view holds, for every rotated pixel, the bins it
+	reaches and their weights: the geometric collimator response, a
+	Gaussian with FWHM = sqrt((D (L + gap + dist)/L)^2 + intrinsic^2)
+	integrated over each bin and cut where it falls below max_frac_err of
+	its peak, or just bin i without the response. The same response blurs
+	the slices of the rotated pixel, renormalized at the ends of the
+	volume so that the sensitivity of a subset only depends on the pixel
+	and not on the slice. Only views at different distances from the
+	axis need different matrices, so a circular orbit has one.
+
+	The matrices are stored by rotated pixel, with the slices of a pixel
+	contiguous, so applying an entry is one multiply-add over the slices.
+	The image is kept as [pixel][slice] while reconstructing. The threads
+	(num_threads) are a team (osemthreads.c) started once per
+	reconstruction, and their scratch is allocated before they start. The
+	views of a subset are projected in parallel. They are backprojected
+	SYSMAT_VIEW_BATCH at a time: the views of a batch go into their own
+	rotated frames in parallel over views and depths, and are gathered
+	back onto the image grid in parallel over rows, where the views of
+	each pixel are added pairwise in a fixed order. The batches do not
+	depend on the number of threads, and neither does the result.
+
+	With sysmat_ranks the views of every subset are also split over that
+	many processes on this machine, forked once the matrix, the rotation
+	tables and the sensitivities are ready. Each rank owns a contiguous
+	share of the views of the subset, projects and backprojects them with
+	its share of num_threads, and sends its partial backprojection over a
+	socket to rank 0, which adds them in rank order and sends the sum
+	back; every rank then applies the same multiplicative update. Rank 0
+	reports the time of the all-reduce of each subset. The sums are added
+	in a different order than with one rank, so the images agree to
+	rounding, not bit for bit. Ranks on other nodes split the slices
+	instead (slab_ranks).
+
+	With sysmat_cache_dir the matrices are written to <key>.sysm, a 64
+	byte header followed by the arrays, and later runs with the same
+	geometry map them instead of building them again. The key is a 64
+	bit FNV-1a hash of the sizes, the collimator parameters, max_frac_err
+	and the distinct CFCRs. The cache is not used on WIN32.
+
+	The bilinear taps of every rotated pixel of every view, and their
+	transpose for the backprojection, only depend on the angles. They are
+	worked out once and kept for later iterations, subsets and calls with
+	the same angles, and applied over all slices of a pixel at once with
+	the widest vectors the build allows (AVX-512, AVX2 with FMA or SSE).
+	All of them give the same result unless SYSMAT_FMA is defined.
+	These tables only serve approx_sysmat. The rotation IrlOsem does for
+	fastrotate is internal to libirl, which exposes no hook for it, so
+	reconstructions through IrlOsem run exactly as before.
+
+	Compile with -DSTANDALONE (and osemthreads.c) to get a benchmark that
+	compares the rotation through the tables with the one it replaced;
+	sysmat -rot pixels slices checks them against each other at a few
+	angles, including 0, 45 and 90 degrees. sysmat -threads pixels slices
+	views iterations reconstructs a phantom with 1 to 32 threads and fails
+	unless every thread count gives the image of one thread bit for bit.
+	sysmat -ranks pixels slices views iterations reconstructs it on 2 and
+	3 ranks and fails if either differs from the single process image by
+	more than 1e-5 of its maximum.
+	Linked with libirl, sysmat -irl pixels slices views iterations
+	reconstructs the phantom with IrlOsem and with the matrix, without
+	collimator response, and fails if the images differ by more than 1%
+	(or the given tolerance).
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#ifndef WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <signal.h>
+#endif
+
+#include <mip/miputil.h>
+#include <mip/errdefs.h>
+#include <mip/printmsg.h>
+#include <mip/getparms.h>
+#include <mip/irl.h>
+
+#include "protos.h"
+#include "osemthreads.h"
+#include "sysmat.h"
+
+/* the widest vectors the compiler was allowed to use; SV_FMA(a,b,c) is a*b+c.
+	The kernels run over the slices of a pixel, so every width gives the
+	same result on every call, whatever the number of threads. The product
+	is rounded before the add, as SSE has to, and the compiler is told not
+	to fuse the scalar code either, so every kernel gives the same bits on
+	every CPU. -DSYSMAT_FMA fuses them on AVX2 and AVX-512, which is
+	slightly faster, at the cost of results that depend on the CPU */
+#ifndef SYSMAT_FMA
+#if defined(__clang__)
+#pragma STDC FP_CONTRACT OFF
+#elif defined(__GNUC__)
+#pragma GCC optimize ("fp-contract=off")
+#endif
+#endif
+#if defined(__AVX512F__)
+#include <immintrin.h>
+#define SYSMAT_KERNEL	"AVX-512"
+#define SV_WIDTH		16
+typedef __m512 SysVec_t;
+#define SV_LOAD(pf)		_mm512_loadu_ps(pf)
+#define SV_STORE(pf, v)	_mm512_storeu_ps(pf, v)
+#define SV_SET1(f)		_mm512_set1_ps(f)
+#define SV_MUL(a, b)	_mm512_mul_ps(a, b)
+#ifdef SYSMAT_FMA
+#define SV_FMA(a, b, c)	_mm512_fmadd_ps(a, b, c)
+#else
+#define SV_FMA(a, b, c)	_mm512_add_ps(_mm512_mul_ps(a, b), c)
+#endif
+#elif defined(__AVX2__) && defined(__FMA__)
+#include <immintrin.h>
+#define SYSMAT_KERNEL	"AVX2"
+#define SV_WIDTH		8
+typedef __m256 SysVec_t;
+#define SV_LOAD(pf)		_mm256_loadu_ps(pf)
+#define SV_STORE(pf, v)	_mm256_storeu_ps(pf, v)
+#define SV_SET1(f)		_mm256_set1_ps(f)
+#define SV_MUL(a, b)	_mm256_mul_ps(a, b)
+#ifdef SYSMAT_FMA
+#define SV_FMA(a, b, c)	_mm256_fmadd_ps(a, b, c)
+#else
+#define SV_FMA(a, b, c)	_mm256_add_ps(_mm256_mul_ps(a, b), c)
+#endif
+#elif defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+#include <xmmintrin.h>
+#define SYSMAT_KERNEL	"SSE"
+#define SV_WIDTH		4
+typedef __m128 SysVec_t;
+#define SV_LOAD(pf)		_mm_loadu_ps(pf)
+#define SV_STORE(pf, v)	_mm_storeu_ps(pf, v)
+#define SV_SET1(f)		_mm_set1_ps(f)
+#define SV_MUL(a, b)	_mm_mul_ps(a, b)
+#define SV_FMA(a, b, c)	_mm_add_ps(_mm_mul_ps(a, b), c)
+#else
+#define SYSMAT_KERNEL	"scalar"
+#endif
+
+#define SYSMAT_MAGIC		"OSEMSYSM"
+#define SYSMAT_VERSION		1
+#define SYSMAT_HDR_SIZE		64
+#define FNV_OFFSET			0xcbf29ce484222325ULL
+#define FNV_PRIME			0x100000001b3ULL
+#define FWHM_TO_SIGMA		0.42466090014400953	// 1/(2 sqrt(2 ln 2))
+#define SYSMAT_VIEW_BATCH	4		// views of a subset backprojected at once, added by vTreeAdd
+
+typedef struct {
+	char achMagic[8];
+	uint32_t uVersion;
+	uint32_t uPad;
+	uint64_t lKey;
+	int32_t iNumPixels, iNumGroups, iMaxRadius, iPad;
+	uint64_t lNumEntries;
+} SysMatHeader_t;
+
+// the matrices of the distinct CFCRs (groups) of an orbit
+typedef struct {
+	uint64_t lKey;
+	int iNumPixels, iNumGroups, iMaxRadius;
+	size_t lNumEntries;
+	float *pfCFCR;		// [group]
+	int *piRadius;		// [group][depth]: half width of the response in bins
+	float *pfKernel;	// [group][depth][2*iMaxRadius+1]: the response, centred on tap iMaxRadius
+	int *piFirst;		// [group][rotated pixel]: entries of the pixel are piFirst[q] to piFirst[q+1]-1
+	int *piBin;			// the bin of each entry
+	float *pfWeight;	// and its weight
+	float *pfColSum;	// [group][rotated pixel]: sum of the weights of the pixel, not part of the block
+	char *pchBlock;		// header and arrays, mapped from the cache or allocated
+	size_t lBlockSize;
+	int bMapped;
+} SysMat_t;
+
+// where the rotated pixels of a view sample the image
+typedef struct {
+	int iNumSamples;		// rotated pixels inside the image
+	int *piSample;			// [sample]: the rotated pixel, in increasing order
+	int *piTapPixel;		// [sample][4]: the image pixels it interpolates
+	float *pfTapWeight;		// [sample][4]: and their bilinear weights, 0 for taps outside the image
+	int *piGatherFirst;		// [image pixel]: entries of pixel p are piGatherFirst[p] to piGatherFirst[p+1]-1
+	int *piGatherPixel;		// the rotated pixel of each entry, in increasing order
+	float *pfGatherWeight;	// and its weight; the transpose of the taps
+} ViewRotation_t;
+
+// the rotation tables of the views of an orbit, which only depend on the angles;
+// used by approx_sysmat only, IrlOsem's fastrotate path does not see them
+typedef struct {
+	int iNumPixels, iNumViews;
+	float *pfAngle;			// the angles the tables were made for
+	ViewRotation_t *psViews;
+	double dBytes;
+} SysMatRotation_t;
+
+// one pass over the views of a subset
+typedef struct {
+	const SysMat_t *psMat;
+	const SysMatRotation_t *psRot;
+	int N, Z;
+	const PrjView_t *psViews;
+	const int *piGroup;		// group of each view
+	const int *piViews;		// views of the subset
+	int iNumViews;			// in the subset
+	float fFac;				// the projections are NumViews times the true projector
+	float *pfImg;			// [pixel][slice]
+	const float *pfPrj;		// measured [view][slice][bin], NULL to keep the projections
+	const float *pfScat;	// [view][slice][bin] or NULL
+	float *pfViewPrj;		// [subset view][bin][slice]: the projections, then the ratios to the measured ones
+	float *pfRot;			// [batch view][rotated pixel][slice] of the views being backprojected
+	float *pfBack;			// [pixel][slice]
+	float *pfSens;			// [pixel] of the subset
+	int iFirst, iBatch;		// the views being backprojected are iFirst to iFirst+iBatch-1 of piViews
+	int iNumChunks;			// the work is split into one chunk per thread of the team
+	float *pfScratch;		// [batch view][chunk][3*slice]
+} SysMatPass_t;
+
+// the processes the views of each subset are split over (sysmat_ranks)
+typedef struct {
+	int iNumRanks, iRank;	// rank 0 is the process iSysMatOsem was called in
+	int *piFds;				// rank 0: [rank] socket to each other rank; others: [0] socket to rank 0
+#ifndef WIN32
+	pid_t *piPids;			// rank 0: [rank]
+#endif
+	float *pfPart;			// rank 0: [pixel][slice] partial backprojection of another rank
+} SysMatRanks_t;
+
+static SysMatOptions_t sgOpts = {FALSE, 0.02f, 1, ""};
+static SysMat_t *psgSysMat = NULL;	// the matrix of the last reconstruction
+static SysMatRotation_t *psgRotation = NULL;	// and its rotation tables
+
+/**
+	@brief Reads approx_sysmat, max_frac_err, sysmat_ranks and
+	sysmat_cache_dir from the parameter file.
+
+	The matrix does not model attenuation or scatter, so using it with
+	model a or s is fatal.
+*/
+void vReadSysMatOptions(SysMatOptions_t *psOpts, int bModelAtn, int bModelSrf)
+{
+	int bFound;
+
+	memset(psOpts, 0, sizeof(SysMatOptions_t));
+	psOpts->bEnabled = bGetBoolParm("approx_sysmat", &bFound, FALSE);
+	psOpts->fMaxFracErr = (float)dGetDblParm("max_frac_err", &bFound, 0.02);
+	psOpts->iNumRanks = iGetIntParm("sysmat_ranks", &bFound, 1);
+	strncpy(psOpts->achCacheDir, pchGetStrParm("sysmat_cache_dir", &bFound, ""), SYSMAT_MAX_NAME - 1);
+	if (!psOpts->bEnabled)
+		return;
+	if (bModelAtn || bModelSrf)
+		vErrorHandler(ECLASS_FATAL, ETYPE_ILLEGAL_VALUE, "ReadSysMatOptions", "approx_sysmat models neither attenuation nor scatter; use model=d or no model");
+	if (!(psOpts->fMaxFracErr > 0.0f && psOpts->fMaxFracErr < 1.0f))
+		vErrorHandler(ECLASS_FATAL, ETYPE_ILLEGAL_VALUE, "ReadSysMatOptions", "max_frac_err must be > 0 and < 1, not %g", psOpts->fMaxFracErr);
+	if (psOpts->iNumRanks < 1)
+		vErrorHandler(ECLASS_FATAL, ETYPE_ILLEGAL_VALUE, "ReadSysMatOptions", "sysmat_ranks must be >= 1, not %d", psOpts->iNumRanks);
+#ifdef WIN32
+	if (psOpts->iNumRanks > 1)
+		vErrorHandler(ECLASS_FATAL, ETYPE_USAGE, "ReadSysMatOptions", "sysmat_ranks needs sockets and fork");
+#endif
+}
+
+/**
+	@brief Sets the options iOsemWithStop runs with, like
+	OsemSetAdvOptions does for IrlOsem.
+*/
+void vSetSysMatOptions(const SysMatOptions_t *psOpts)
+{
+	sgOpts = *psOpts;
+}
+
+void vGetSysMatOptions(SysMatOptions_t *psOpts)
+{
+	*psOpts = sgOpts;
+}
+
+// pfY[0..iLen) += fW*pfX[0..iLen)
+static void vAxpy(float fW, const float *pfX, float *pfY, int iLen)
+{
+	int i = 0;
+#ifdef SV_WIDTH
+	SysVec_t vW = SV_SET1(fW);
+
+	for (; i + SV_WIDTH <= iLen; i += SV_WIDTH)
+		SV_STORE(pfY + i, SV_FMA(vW, SV_LOAD(pfX + i), SV_LOAD(pfY + i)));
+#endif
+	for (; i < iLen; i++)
+		pfY[i] += fW*pfX[i];
+}
+
+// pfOut[0..iLen) = the sum of the four pfWeight[t]*pfImg[piPixel[t]*iLen + ...]
+static void vSampleTaps(const float *pfImg, const int *piPixel, const float *pfWeight, float *pfOut, int iLen)
+{
+	const float *pf0 = pfImg + (long)piPixel[0]*iLen, *pf1 = pfImg + (long)piPixel[1]*iLen;
+	const float *pf2 = pfImg + (long)piPixel[2]*iLen, *pf3 = pfImg + (long)piPixel[3]*iLen;
+	int i = 0;
+#ifdef SV_WIDTH
+	SysVec_t vW0 = SV_SET1(pfWeight[0]), vW1 = SV_SET1(pfWeight[1]), vW2 = SV_SET1(pfWeight[2]), vW3 = SV_SET1(pfWeight[3]);
+
+	for (; i + SV_WIDTH <= iLen; i += SV_WIDTH)
+		SV_STORE(pfOut + i, SV_FMA(vW3, SV_LOAD(pf3 + i), SV_FMA(vW2, SV_LOAD(pf2 + i), SV_FMA(vW1, SV_LOAD(pf1 + i),
+			SV_MUL(vW0, SV_LOAD(pf0 + i))))));
+#endif
+	for (; i < iLen; i++)
+		pfOut[i] = pfWeight[0]*pf0[i] + pfWeight[1]*pf1[i] + pfWeight[2]*pf2[i] + pfWeight[3]*pf3[i];
+}
+
+// pfOut[0..iLen) += the sum over the entries of pfWeight[n]*pfRot[piPixel[n]*iLen + ...]
+static void vGatherEntries(const float *pfRot, const int *piPixel, const float *pfWeight, int iNum, float *pfOut, int iLen)
+{
+	int i = 0, n;
+	float fSum;
+#ifdef SV_WIDTH
+	SysVec_t vSum;
+
+	for (; i + SV_WIDTH <= iLen; i += SV_WIDTH){
+		vSum = SV_LOAD(pfOut + i);
+		for (n = 0; n < iNum; n++)
+			vSum = SV_FMA(SV_SET1(pfWeight[n]), SV_LOAD(pfRot + (long)piPixel[n]*iLen + i), vSum);
+		SV_STORE(pfOut + i, vSum);
+	}
+#endif
+	for (; i < iLen; i++){
+		fSum = pfOut[i];
+		for (n = 0; n < iNum; n++)
+			fSum += pfWeight[n]*pfRot[(long)piPixel[n]*iLen + i];
+		pfOut[i] = fSum;
+	}
+}
+
+// lays out the arrays of the block after the header; returns the size of the block
+static size_t lLayoutSysMat(SysMat_t *psMat)
+{
+	size_t lPixels = (size_t)psMat->iNumPixels*psMat->iNumPixels;
+	size_t lGroups = (size_t)psMat->iNumGroups, lTaps = 2*(size_t)psMat->iMaxRadius + 1;
+	size_t lCFCR, lRadius, lKernel, lFirst, lBin, lWeight, lSize = SYSMAT_HDR_SIZE;
+
+	lCFCR = lSize;		lSize += sizeof(float)*lGroups;
+	lRadius = lSize;	lSize += sizeof(int)*lGroups*psMat->iNumPixels;
+	lKernel = lSize;	lSize += sizeof(float)*lGroups*psMat->iNumPixels*lTaps;
+	lFirst = lSize;		lSize += sizeof(int)*lGroups*(lPixels + 1);
+	lBin = lSize;		lSize += sizeof(int)*psMat->lNumEntries;
+	lWeight = lSize;	lSize += sizeof(float)*psMat->lNumEntries;
+	if (psMat->pchBlock != NULL){
+		psMat->pfCFCR = (float *)(psMat->pchBlock + lCFCR);
+		psMat->piRadius = (int *)(psMat->pchBlock + lRadius);
+		psMat->pfKernel = (float *)(psMat->pchBlock + lKernel);
+		psMat->piFirst = (int *)(psMat->pchBlock + lFirst);
+		psMat->piBin = (int *)(psMat->pchBlock + lBin);
+		psMat->pfWeight = (float *)(psMat->pchBlock + lWeight);
+	}
+	return lSize;
+}
+
+// width of the collimator response at depth j of a view fCFCR from the axis, in bins
+static double dResponseSigma(const IrlParms_t *psParms, int bModelDrf, float fCFCR, int j)
+{
+	double dDist, dFWHM;
+
+	if (!bModelDrf)
+		return 0.0;
+	dDist = fCFCR - (j - 0.5*(psParms->NumPixels - 1))*psParms->BinWidth;
+	if (dDist < 0.0)
+		dDist = 0.0;
+	dFWHM = psParms->fHoleDiam*(psParms->fHoleLen + psParms->fBackToDet + dDist)/psParms->fHoleLen;
+	dFWHM = sqrt(dFWHM*dFWHM + (double)psParms->fIntrinsicFWHM*psParms->fIntrinsicFWHM);
+	return FWHM_TO_SIGMA*dFWHM/psParms->BinWidth;
+}
+
+static int iResponseRadius(double dSigma, float fMaxFracErr, int iNumPixels)
+{
+	int iRadius;
+
+	if (dSigma <= 0.0)
+		return 0;
+	iRadius = (int)ceil(dSigma*sqrt(-2.0*log((double)fMaxFracErr)));
+	return iRadius < iNumPixels - 1 ? iRadius : iNumPixels - 1;
+}
+
+// the response integrated over the bins -iRadius to iRadius, normalized to one
+static void vResponseTaps(double dSigma, int iRadius, float *pfTaps)
+{
+	double dSum = 0.0, dScale;
+	int k;
+
+	if (iRadius == 0){
+		pfTaps[0] = 1.0f;
+		return;
+	}
+	dScale = 1.0/(dSigma*sqrt(2.0));
+	for (k = -iRadius; k <= iRadius; k++)
+		dSum += pfTaps[k + iRadius] = (float)(0.5*(erf((k + 0.5)*dScale) - erf((k - 0.5)*dScale)));
+	for (k = 0; k <= 2*iRadius; k++)
+		pfTaps[k] = (float)(pfTaps[k]/dSum);
+}
+
+static SysMat_t *psBuildSysMat(const IrlParms_t *psParms, int bModelDrf, float fMaxFracErr, const float *pfCFCR, int iNumGroups, uint64_t lKey)
+{
+	SysMat_t *psMat;
+	SysMatHeader_t sHdr;
+	int N = psParms->NumPixels, g, i, j, k, iRadius, iTaps, iFirst, iLast;
+	size_t lEntry = 0;
+	float *pfTaps;
+	int *piFirst;
+
+	psMat = (SysMat_t *)pvIrlMalloc(sizeof(SysMat_t), "BuildSysMat:psMat");
+	memset(psMat, 0, sizeof(SysMat_t));
+	psMat->lKey = lKey;
+	psMat->iNumPixels = N;
+	psMat->iNumGroups = iNumGroups;
+	for (g = 0; g < iNumGroups; g++)
+		for (j = 0; j < N; j++){
+			iRadius = iResponseRadius(dResponseSigma(psParms, bModelDrf, pfCFCR[g], j), fMaxFracErr, N);
+			if (iRadius > psMat->iMaxRadius)
+				psMat->iMaxRadius = iRadius;
+			for (i = 0; i < N; i++)
+				psMat->lNumEntries += (i + iRadius < N ? i + iRadius : N - 1) - (i - iRadius > 0 ? i - iRadius : 0) + 1;
+		}
+	if (psMat->lNumEntries > 0x7fffffff)
+		vErrorHandler(ECLASS_FATAL, ETYPE_ILLEGAL_VALUE, "BuildSysMat", "system matrix of %.0f entries is too large; raise max_frac_err", (double)psMat->lNumEntries);
+	psMat->lBlockSize = lLayoutSysMat(psMat);
+	psMat->pchBlock = (char *)pvIrlMalloc(psMat->lBlockSize, "BuildSysMat:pchBlock");
+	memset(psMat->pchBlock, 0, psMat->lBlockSize);
+	lLayoutSysMat(psMat);
+
+	iTaps = 2*psMat->iMaxRadius + 1;
+	for (g = 0; g < iNumGroups; g++){
+		psMat->pfCFCR[g] = pfCFCR[g];
+		piFirst = psMat->piFirst + (size_t)g*((size_t)N*N + 1);
+		for (j = 0; j < N; j++){
+			double dSigma = dResponseSigma(psParms, bModelDrf, pfCFCR[g], j);
+
+			iRadius = psMat->piRadius[g*N + j] = iResponseRadius(dSigma, fMaxFracErr, N);
+			pfTaps = psMat->pfKernel + ((size_t)g*N + j)*iTaps + psMat->iMaxRadius - iRadius;
+			vResponseTaps(dSigma, iRadius, pfTaps);
+			pfTaps += iRadius;
+			for (i = 0; i < N; i++){
+				piFirst[j*N + i] = (int)lEntry;
+				iFirst = i - iRadius > 0 ? i - iRadius : 0;
+				iLast = i + iRadius < N ? i + iRadius : N - 1;
+				for (k = iFirst; k <= iLast; k++){
+					psMat->piBin[lEntry] = k;
+					psMat->pfWeight[lEntry++] = pfTaps[k - i];
+				}
+			}
+		}
+		piFirst[N*N] = (int)lEntry;
+	}
+
+	memset(&sHdr, 0, sizeof(sHdr));
+	memcpy(sHdr.achMagic, SYSMAT_MAGIC, sizeof(sHdr.achMagic));
+	sHdr.uVersion = SYSMAT_VERSION;
+	sHdr.lKey = lKey;
+	sHdr.iNumPixels = N;
+	sHdr.iNumGroups = iNumGroups;
+	sHdr.iMaxRadius = psMat->iMaxRadius;
+	sHdr.lNumEntries = psMat->lNumEntries;
+	memcpy(psMat->pchBlock, &sHdr, sizeof(sHdr));
+	return psMat;
+}
+
+static void vFreeSysMat(SysMat_t *psMat)
+{
+	if (psMat == NULL)
+		return;
+#ifndef WIN32
+	if (psMat->bMapped)
+		munmap(psMat->pchBlock, psMat->lBlockSize);
+	else
+#endif
+		IrlFree(psMat->pchBlock);
+	if (psMat->pfColSum) IrlFree(psMat->pfColSum);
+	IrlFree(psMat);
+}
+
+static uint64_t lFnv(uint64_t lHash, const void *pv, size_t lLen)
+{
+	const unsigned char *pch = (const unsigned char *)pv;
+
+	while (lLen--){
+		lHash ^= *pch++;
+		lHash *= FNV_PRIME;
+	}
+	return lHash;
+}
+
+#ifndef WIN32
+// maps a matrix from the cache; NULL if it is not there or does not match
+static SysMat_t *psMapSysMat(char *pchName, uint64_t lKey, int iNumPixels, int iNumGroups)
+{
+	SysMatHeader_t sHdr;
+	SysMat_t sMat, *psMat;
+	struct stat sStat;
+	void *pvMap;
+	int iFd;
+
+	if ((iFd = open(pchName, O_RDONLY)) < 0)
+		return NULL;
+	if (fstat(iFd, &sStat) || (size_t)sStat.st_size < SYSMAT_HDR_SIZE){
+		close(iFd);
+		return NULL;
+	}
+	pvMap = mmap(NULL, (size_t)sStat.st_size, PROT_READ, MAP_SHARED, iFd, 0);
+	close(iFd);
+	if (pvMap == MAP_FAILED)
+		return NULL;
+	memcpy(&sHdr, pvMap, sizeof(sHdr));
+	memset(&sMat, 0, sizeof(sMat));
+	sMat.lKey = sHdr.lKey;
+	sMat.iNumPixels = sHdr.iNumPixels;
+	sMat.iNumGroups = sHdr.iNumGroups;
+	sMat.iMaxRadius = sHdr.iMaxRadius;
+	sMat.lNumEntries = (size_t)sHdr.lNumEntries;
+	if (memcmp(sHdr.achMagic, SYSMAT_MAGIC, sizeof(sHdr.achMagic)) || sHdr.uVersion != SYSMAT_VERSION || sHdr.lKey != lKey
+		|| sHdr.iNumPixels != iNumPixels || sHdr.iNumGroups != iNumGroups || sHdr.iMaxRadius < 0
+		|| lLayoutSysMat(&sMat) != (size_t)sStat.st_size){
+		munmap(pvMap, (size_t)sStat.st_size);
+		return NULL;
+	}
+	psMat = (SysMat_t *)pvIrlMalloc(sizeof(SysMat_t), "MapSysMat:psMat");
+	*psMat = sMat;
+	psMat->pchBlock = (char *)pvMap;
+	psMat->lBlockSize = (size_t)sStat.st_size;
+	psMat->bMapped = TRUE;
+	lLayoutSysMat(psMat);
+	return psMat;
+}
+
+// writes a matrix to the cache through a temporary file, so other runs never map half of it
+static void vSaveSysMat(const SysMat_t *psMat, char *pchName)
+{
+	char achTmp[SYSMAT_MAX_NAME + 32];
+	FILE *pFile;
+	int bOk;
+
+	snprintf(achTmp, sizeof(achTmp), "%s.%d.tmp", pchName, (int)getpid());
+	if ((pFile = fopen(achTmp, "wb")) == NULL){
+		vErrorHandler(ECLASS_WARN, ETYPE_IO, "SaveSysMat", "unable to write %s", achTmp);
+		return;
+	}
+	bOk = fwrite(psMat->pchBlock, 1, psMat->lBlockSize, pFile) == psMat->lBlockSize;
+	bOk = fclose(pFile) == 0 && bOk;
+	if (!bOk || rename(achTmp, pchName)){
+		unlink(achTmp);
+		vErrorHandler(ECLASS_WARN, ETYPE_IO, "SaveSysMat", "unable to write %s", pchName);
+	}
+}
+#endif
+
+// the matrix for the geometry, reused from the last call, mapped from the cache or built
+static SysMat_t *psGetSysMat(const IrlParms_t *psParms, int bModelDrf, const float *pfCFCR, int iNumGroups)
+{
+	SysMat_t *psMat = NULL;
+	uint64_t lKey;
+	double dStart = dGetWallTime();
+	long lPixels = (long)psParms->NumPixels*psParms->NumPixels, q;
+	int g, e, aiSizes[4];
+	float afParms[6];
+#ifndef WIN32
+	char achName[SYSMAT_MAX_NAME];
+#endif
+
+	memset(afParms, 0, sizeof(afParms));
+	afParms[0] = psParms->BinWidth;
+	afParms[1] = sgOpts.fMaxFracErr;
+	if (bModelDrf){
+		afParms[2] = psParms->fHoleLen;
+		afParms[3] = psParms->fHoleDiam;
+		afParms[4] = psParms->fBackToDet;
+		afParms[5] = psParms->fIntrinsicFWHM;
+	}
+	aiSizes[0] = SYSMAT_VERSION;
+	aiSizes[1] = psParms->NumPixels;
+	aiSizes[2] = bModelDrf;
+	aiSizes[3] = iNumGroups;
+	lKey = lFnv(FNV_OFFSET, aiSizes, sizeof(aiSizes));
+	lKey = lFnv(lKey, afParms, sizeof(afParms));
+	lKey = lFnv(lKey, pfCFCR, sizeof(float)*iNumGroups);
+
+	if (psgSysMat != NULL && psgSysMat->lKey == lKey && psgSysMat->iNumPixels == psParms->NumPixels && psgSysMat->iNumGroups == iNumGroups
+		&& !memcmp(psgSysMat->pfCFCR, pfCFCR, sizeof(float)*iNumGroups))
+		return psgSysMat;
+	vFreeSysMat(psgSysMat);
+	psgSysMat = NULL;
+
+#ifndef WIN32
+	if (sgOpts.achCacheDir[0] != '\0'){
+		snprintf(achName, sizeof(achName), "%s/%016llx%s", sgOpts.achCacheDir, (unsigned long long)lKey, SYSMAT_EXTENSION);
+		if ((psMat = psMapSysMat(achName, lKey, psParms->NumPixels, iNumGroups)) != NULL)
+			vPrintMsg(6, "sysmat: mapped %s\n", achName);
+	}
+#endif
+	if (psMat == NULL){
+		psMat = psBuildSysMat(psParms, bModelDrf, sgOpts.fMaxFracErr, pfCFCR, iNumGroups, lKey);
+#ifndef WIN32
+		if (sgOpts.achCacheDir[0] != '\0')
+			vSaveSysMat(psMat, achName);
+#endif
+	}
+
+	psMat->pfColSum = (float *)pvIrlMalloc(sizeof(float)*iNumGroups*lPixels, "GetSysMat:pfColSum");
+	for (g = 0; g < iNumGroups; g++)
+		for (q = 0; q < lPixels; q++){
+			const int *piFirst = psMat->piFirst + g*(lPixels + 1) + q;
+			double dSum = 0.0;
+
+			for (e = piFirst[0]; e < piFirst[1]; e++)
+				dSum += psMat->pfWeight[e];
+			psMat->pfColSum[g*lPixels + q] = (float)dSum;
+		}
+	vPrintMsg(4, "sysmat: %d matrices, %.0f entries (%.1f MB), response up to %d bins, %.2f s\n",
+		iNumGroups, (double)psMat->lNumEntries, psMat->lBlockSize/1048576.0, psMat->iMaxRadius, dGetWallTime() - dStart);
+	psgSysMat = psMat;
+	return psMat;
+}
+
+// where rotated pixel (j,i) of a view samples the image
+static void vRotatedPoint(int N, float fCos, float fSin, int j, int i, float *pfX, float *pfY)
+{
+	float fC = 0.5f*(N - 1), fS = i - fC, fT = j - fC;
+
+	*pfX = fC + fS*fCos + fT*fSin;
+	*pfY = fC - fS*fSin + fT*fCos;
+}
+
+// the bilinear taps of rotated pixel (j,i); returns FALSE if none of them is inside the image
+static int bRotatedTaps(int N, float fCos, float fSin, int j, int i, int *piPixel, float *pfWeight)
+{
+	int dx, dy, t, x0, y0, bAny = FALSE;
+	float fX, fY;
+
+	vRotatedPoint(N, fCos, fSin, j, i, &fX, &fY);
+	x0 = (int)floor(fX);
+	y0 = (int)floor(fY);
+	if (x0 < -1 || x0 >= N || y0 < -1 || y0 >= N)
+		return FALSE;
+	for (dy = 0; dy < 2; dy++)
+		for (dx = 0; dx < 2; dx++){
+			t = 2*dy + dx;
+			piPixel[t] = 0;
+			pfWeight[t] = 0.0f;
+			if (y0 + dy < 0 || y0 + dy >= N || x0 + dx < 0 || x0 + dx >= N)
+				continue;
+			piPixel[t] = (y0 + dy)*N + x0 + dx;
+			pfWeight[t] = (1.0f - fabsf(fX - (x0 + dx)))*(1.0f - fabsf(fY - (y0 + dy)));
+			bAny = bAny || pfWeight[t] > 0.0f;
+		}
+	return bAny;
+}
+
+// counts the samples of a view and the entries of the transpose; piGatherFirst is allocated by the caller
+static void vCountViewRotation(void *pvArg, int iView)
+{
+	SysMatRotation_t *psRotation = (SysMatRotation_t *)pvArg;
+	ViewRotation_t *psRot = psRotation->psViews + iView;
+	int N = psRotation->iNumPixels, i, j, t, p, aiPixel[4];
+	float fCos = (float)cos(psRotation->pfAngle[iView]), fSin = (float)sin(psRotation->pfAngle[iView]), afWeight[4];
+
+	psRot->iNumSamples = 0;
+	memset(psRot->piGatherFirst, 0, sizeof(int)*(N*N + 1));
+	for (j = 0; j < N; j++)
+		for (i = 0; i < N; i++)
+			if (bRotatedTaps(N, fCos, fSin, j, i, aiPixel, afWeight)){
+				psRot->iNumSamples++;
+				for (t = 0; t < 4; t++)
+					if (afWeight[t] > 0.0f)
+						psRot->piGatherFirst[aiPixel[t] + 1]++;
+			}
+	for (p = 0; p < N*N; p++)
+		psRot->piGatherFirst[p + 1] += psRot->piGatherFirst[p];
+}
+
+// fills the tables of a view, allocated by the caller from the counts
+static void vFillViewRotation(void *pvArg, int iView)
+{
+	SysMatRotation_t *psRotation = (SysMatRotation_t *)pvArg;
+	ViewRotation_t *psRot = psRotation->psViews + iView;
+	int N = psRotation->iNumPixels, i, j, n, t, p;
+	float fCos = (float)cos(psRotation->pfAngle[iView]), fSin = (float)sin(psRotation->pfAngle[iView]);
+	int *piFirst = psRot->piGatherFirst;
+
+	for (n = 0, j = 0; j < N; j++)
+		for (i = 0; i < N; i++)
+			if (bRotatedTaps(N, fCos, fSin, j, i, psRot->piTapPixel + 4*n, psRot->pfTapWeight + 4*n))
+				psRot->piSample[n++] = j*N + i;
+
+	/* the transpose, with the entries of each image pixel in the order of
+		the rotated pixels; piFirst[p] is the next entry of pixel p while
+		filling, which leaves it at the first entry of pixel p+1 */
+	for (n = 0; n < psRot->iNumSamples; n++)
+		for (t = 0; t < 4; t++)
+			if (psRot->pfTapWeight[4*n + t] > 0.0f){
+				p = psRot->piTapPixel[4*n + t];
+				psRot->piGatherPixel[piFirst[p]] = psRot->piSample[n];
+				psRot->pfGatherWeight[piFirst[p]++] = psRot->pfTapWeight[4*n + t];
+			}
+	for (p = N*N; p > 0; p--)
+		piFirst[p] = piFirst[p - 1];
+	piFirst[0] = 0;
+}
+
+static void vFreeRotation(SysMatRotation_t *psRotation)
+{
+	ViewRotation_t *psRot;
+	int iView;
+
+	if (psRotation == NULL)
+		return;
+	for (iView = 0; iView < psRotation->iNumViews; iView++){
+		psRot = psRotation->psViews + iView;
+		IrlFree(psRot->piSample);
+		IrlFree(psRot->piTapPixel);
+		IrlFree(psRot->pfTapWeight);
+		IrlFree(psRot->piGatherFirst);
+		IrlFree(psRot->piGatherPixel);
+		IrlFree(psRot->pfGatherWeight);
+	}
+	IrlFree(psRotation->psViews);
+	IrlFree(psRotation->pfAngle);
+	IrlFree(psRotation);
+}
+
+// the rotation tables of the views, reused from the last call if the angles are the same
+static SysMatRotation_t *psGetRotation(int N, const PrjView_t *psViews, int iNumViews, OsemTeam_t *psTeam)
+{
+	SysMatRotation_t *psRotation;
+	ViewRotation_t *psRot;
+	double dStart = dGetWallTime();
+	int iView, bSame;
+
+	if (psgRotation != NULL && psgRotation->iNumPixels == N && psgRotation->iNumViews == iNumViews){
+		for (bSame = TRUE, iView = 0; iView < iNumViews && bSame; iView++)
+			bSame = psgRotation->pfAngle[iView] == psViews[iView].Angle;
+		if (bSame)
+			return psgRotation;
+	}
+	vFreeRotation(psgRotation);
+
+	psRotation = (SysMatRotation_t *)pvIrlMalloc(sizeof(SysMatRotation_t), "GetRotation:psRotation");
+	psRotation->iNumPixels = N;
+	psRotation->iNumViews = iNumViews;
+	psRotation->pfAngle = (float *)pvIrlMalloc(sizeof(float)*iNumViews, "GetRotation:pfAngle");
+	psRotation->psViews = (ViewRotation_t *)pvIrlMalloc(sizeof(ViewRotation_t)*iNumViews, "GetRotation:psViews");
+	// the views are counted and filled in parallel, and allocated in between on this thread
+	for (iView = 0; iView < iNumViews; iView++){
+		psRotation->pfAngle[iView] = psViews[iView].Angle;
+		psRotation->psViews[iView].piGatherFirst = (int *)pvIrlMalloc(sizeof(int)*(N*N + 1), "GetRotation:piGatherFirst");
+	}
+	vTeamFor(psTeam, iNumViews, vCountViewRotation, psRotation);
+	for (iView = 0; iView < iNumViews; iView++){
+		psRot = psRotation->psViews + iView;
+		psRot->piSample = (int *)pvIrlMalloc(sizeof(int)*(psRot->iNumSamples + 1), "GetRotation:piSample");
+		psRot->piTapPixel = (int *)pvIrlMalloc(sizeof(int)*4*(psRot->iNumSamples + 1), "GetRotation:piTapPixel");
+		psRot->pfTapWeight = (float *)pvIrlMalloc(sizeof(float)*4*(psRot->iNumSamples + 1), "GetRotation:pfTapWeight");
+		psRot->piGatherPixel = (int *)pvIrlMalloc(sizeof(int)*(psRot->piGatherFirst[N*N] + 1), "GetRotation:piGatherPixel");
+		psRot->pfGatherWeight = (float *)pvIrlMalloc(sizeof(float)*(psRot->piGatherFirst[N*N] + 1), "GetRotation:pfGatherWeight");
+	}
+	vTeamFor(psTeam, iNumViews, vFillViewRotation, psRotation);
+	psRotation->dBytes = 0.0;
+	for (iView = 0; iView < iNumViews; iView++)
+		psRotation->dBytes += 36.0*psRotation->psViews[iView].iNumSamples + 4.0*N*N
+			+ 8.0*psRotation->psViews[iView].piGatherFirst[N*N];
+	vPrintMsg(4, "sysmat: rotation tables of %d views, %.1f MB, %.2f s, %s kernels\n",
+		iNumViews, psRotation->dBytes/1048576.0, dGetWallTime() - dStart, SYSMAT_KERNEL);
+	psgRotation = psRotation;
+	return psRotation;
+}
+
+// 1/sum of the taps that stay inside the slices, for each slice
+static void vAxialNorm(const float *pfTaps, int iRadius, int Z, float *pfNorm)
+{
+	int z, k;
+	double dSum;
+
+	for (z = 0; z < Z; z++){
+		if (z >= iRadius && z + iRadius < Z){
+			pfNorm[z] = 1.0f;
+			continue;
+		}
+		dSum = 0.0;
+		for (k = -iRadius; k <= iRadius; k++)
+			if (z + k >= 0 && z + k < Z)
+				dSum += pfTaps[k];
+		pfNorm[z] = dSum > 0.0 ? (float)(1.0/dSum) : 0.0f;
+	}
+}
+
+// pfOut = the slices of pfIn blurred by the taps, each slice spreading one in total
+static void vBlurSlices(const float *pfTaps, int iRadius, const float *pfNorm, float *pfIn, float *pfOut, int Z)
+{
+	int z, k, z0, z1;
+
+	for (z = 0; z < Z; z++){
+		pfIn[z] *= pfNorm[z];
+		pfOut[z] = 0.0f;
+	}
+	for (k = -iRadius; k <= iRadius; k++){
+		z0 = k < 0 ? -k : 0;
+		z1 = k > 0 ? Z - k : Z;
+		if (z1 > z0)
+			vAxpy(pfTaps[k], pfIn + z0, pfOut + z0 + k, z1 - z0);
+	}
+}
+
+// the adjoint of vBlurSlices
+static void vBlurSlicesAdjoint(const float *pfTaps, int iRadius, const float *pfNorm, const float *pfIn, float *pfOut, int Z)
+{
+	int z, k, z0, z1;
+
+	memset(pfOut, 0, sizeof(float)*Z);
+	for (k = -iRadius; k <= iRadius; k++){
+		z0 = k < 0 ? -k : 0;
+		z1 = k > 0 ? Z - k : Z;
+		if (z1 > z0)
+			vAxpy(pfTaps[k], pfIn + z0 + k, pfOut + z0, z1 - z0);
+	}
+	for (z = 0; z < Z; z++)
+		pfOut[z] *= pfNorm[z];
+}
+
+// projects view iItem of the subset and, if there are measured projections, turns it into their ratio
+static void vForwardView(SysMatPass_t *ps, int iItem, float *pfScratch)
+{
+	const SysMat_t *psMat = ps->psMat;
+	int N = ps->N, Z = ps->Z, iView = ps->piViews[iItem], g = ps->piGroup[iView];
+	const ViewRotation_t *psRot = ps->psRot->psViews + iView;
+	int n, q, j, jPrev = -1, u, z, e, iRadius = 0;
+	long lPixels = (long)N*N;
+	const int *piFirst = psMat->piFirst + g*(lPixels + 1);
+	const float *pfTaps = NULL, *pfSrc;
+	float *pfOut = ps->pfViewPrj + (long)iItem*N*Z;
+	float *pfRot = pfScratch, *pfBlur = pfScratch + Z, *pfNorm = pfScratch + 2*Z;
+	float fModel;
+
+	memset(pfOut, 0, sizeof(float)*N*Z);
+	for (n = 0; n < psRot->iNumSamples; n++){
+		q = psRot->piSample[n];
+		if ((j = q/N) != jPrev){
+			iRadius = psMat->piRadius[g*N + j];
+			pfTaps = psMat->pfKernel + ((long)g*N + j)*(2*psMat->iMaxRadius + 1) + psMat->iMaxRadius;
+			vAxialNorm(pfTaps, iRadius, Z, pfNorm);
+			jPrev = j;
+		}
+		vSampleTaps(ps->pfImg, psRot->piTapPixel + 4*n, psRot->pfTapWeight + 4*n, pfRot, Z);
+		pfSrc = pfRot;
+		if (iRadius > 0){
+			vBlurSlices(pfTaps, iRadius, pfNorm, pfRot, pfBlur, Z);
+			pfSrc = pfBlur;
+		}
+		for (e = piFirst[q]; e < piFirst[q + 1]; e++)
+			vAxpy(ps->fFac*psMat->pfWeight[e], pfSrc, pfOut + (long)psMat->piBin[e]*Z, Z);
+	}
+
+	if (ps->pfPrj == NULL)
+		return;
+	for (z = 0; z < Z; z++)
+		for (u = 0; u < N; u++){
+			long lIndex = ((long)iView*Z + z)*N + u;
+
+			fModel = pfOut[(long)u*Z + z] + (ps->pfScat != NULL ? ps->pfScat[lIndex] : 0.0f);
+			pfOut[(long)u*Z + z] = fModel > 0.0f ? ps->pfPrj[lIndex]/fModel : 0.0f;
+		}
+}
+
+// the views of the subset that chunk iChunk projects: iChunk, iChunk + iNumChunks, ...
+static void vForwardChunk(void *pvArg, int iChunk)
+{
+	SysMatPass_t *ps = (SysMatPass_t *)pvArg;
+	int iItem;
+
+	for (iItem = iChunk; iItem < ps->iNumViews; iItem += ps->iNumChunks)
+		vForwardView(ps, iItem, ps->pfScratch + (long)iChunk*3*ps->Z);
+}
+
+// backprojects depth j of view iItem of the subset into rotated frame b
+static void vBackRotRow(SysMatPass_t *ps, int iItem, int b, int j, float *pfScratch)
+{
+	const SysMat_t *psMat = ps->psMat;
+	int N = ps->N, Z = ps->Z, g = ps->piGroup[ps->piViews[iItem]], i, e;
+	int iRadius = psMat->piRadius[g*N + j];
+	long lPixels = (long)N*N;
+	const int *piFirst = psMat->piFirst + g*(lPixels + 1);
+	const float *pfRatio = ps->pfViewPrj + (long)iItem*N*Z;
+	const float *pfTaps = psMat->pfKernel + ((long)g*N + j)*(2*psMat->iMaxRadius + 1) + psMat->iMaxRadius;
+	float *pfDst, *pfSum = pfScratch, *pfNorm = pfScratch + Z;
+
+	vAxialNorm(pfTaps, iRadius, Z, pfNorm);
+	for (i = 0; i < N; i++){
+		pfDst = ps->pfRot + (((long)b*N + j)*N + i)*Z;
+		memset(iRadius > 0 ? pfSum : pfDst, 0, sizeof(float)*Z);
+		for (e = piFirst[j*N + i]; e < piFirst[j*N + i + 1]; e++)
+			vAxpy(psMat->pfWeight[e], pfRatio + (long)psMat->piBin[e]*Z, iRadius > 0 ? pfSum : pfDst, Z);
+		if (iRadius > 0)
+			vBlurSlicesAdjoint(pfTaps, iRadius, pfNorm, pfSum, pfDst, Z);
+	}
+}
+
+// item b*iNumChunks + c: the depths of chunk c, a contiguous range, of view b of the batch
+static void vBackRotChunk(void *pvArg, int iItem)
+{
+	SysMatPass_t *ps = (SysMatPass_t *)pvArg;
+	int b = iItem/ps->iNumChunks, c = iItem%ps->iNumChunks;
+	int j, j1 = (int)((long)(c + 1)*ps->N/ps->iNumChunks);
+
+	for (j = (int)((long)c*ps->N/ps->iNumChunks); j < j1; j++)
+		vBackRotRow(ps, ps->iFirst + b, b, j, ps->pfScratch + (long)iItem*3*ps->Z);
+}
+
+// adds the iNum rows of pfParts [part][slice] into the first, pairwise in the order of dTreeSum
+static void vTreeAdd(float *pfParts, int iNum, int Z)
+{
+	int iHalf = iNum/2, z;
+
+	if (iNum <= 1)
+		return;
+	vTreeAdd(pfParts, iHalf, Z);
+	vTreeAdd(pfParts + (long)iHalf*Z, iNum - iHalf, Z);
+	for (z = 0; z < Z; z++)
+		pfParts[z] += pfParts[(long)iHalf*Z + z];
+}
+
+/* gathers the rotated frames of the batch onto the image rows of chunk
+	iChunk. Each view is gathered on its own and the views are added with
+	vTreeAdd, so the sum only depends on the batch */
+static void vBackGatherChunk(void *pvArg, int iChunk)
+{
+	SysMatPass_t *ps = (SysMatPass_t *)pvArg;
+	const ViewRotation_t *psRot;
+	int N = ps->N, Z = ps->Z, b, p, z, iFirst;
+	long lPixels = (long)N*N;
+	long p0 = (long)iChunk*N/ps->iNumChunks*N, p1 = (long)(iChunk + 1)*N/ps->iNumChunks*N;
+	float *pfParts = ps->pfScratch + (long)iChunk*SYSMAT_VIEW_BATCH*3*Z;
+
+	for (p = p0; p < p1; p++){
+		for (b = 0; b < ps->iBatch; b++){
+			psRot = ps->psRot->psViews + ps->piViews[ps->iFirst + b];
+			iFirst = psRot->piGatherFirst[p];
+			memset(pfParts + (long)b*Z, 0, sizeof(float)*Z);
+			if (psRot->piGatherFirst[p + 1] > iFirst)
+				vGatherEntries(ps->pfRot + b*lPixels*Z, psRot->piGatherPixel + iFirst, psRot->pfGatherWeight + iFirst,
+					psRot->piGatherFirst[p + 1] - iFirst, pfParts + (long)b*Z, Z);
+		}
+		vTreeAdd(pfParts, ps->iBatch, Z);
+		for (z = 0; z < Z; z++)
+			ps->pfBack[(long)p*Z + z] += pfParts[z];
+	}
+}
+
+// the sensitivity of row y for the views of the subset
+static void vSensRow(void *pvArg, int y)
+{
+	SysMatPass_t *ps = (SysMatPass_t *)pvArg;
+	const ViewRotation_t *psRot;
+	const float *pfColSum;
+	int N = ps->N, p, k, e;
+	double dSum;
+
+	for (p = y*N; p < (y + 1)*N; p++){
+		dSum = 0.0;
+		for (k = 0; k < ps->iNumViews; k++){
+			psRot = ps->psRot->psViews + ps->piViews[k];
+			pfColSum = ps->psMat->pfColSum + (long)ps->piGroup[ps->piViews[k]]*N*N;
+			for (e = psRot->piGatherFirst[p]; e < psRot->piGatherFirst[p + 1]; e++)
+				dSum += psRot->pfGatherWeight[e]*pfColSum[psRot->piGatherPixel[e]];
+		}
+		ps->pfSens[p] = (float)dSum;
+	}
+}
+
+static void vUpdateRow(void *pvArg, int y)
+{
+	SysMatPass_t *ps = (SysMatPass_t *)pvArg;
+	int N = ps->N, Z = ps->Z, x, z;
+	float *pfImg, *pfBack, fSens;
+
+	for (x = 0; x < N; x++){
+		pfImg = ps->pfImg + ((long)y*N + x)*Z;
+		pfBack = ps->pfBack + ((long)y*N + x)*Z;
+		fSens = ps->pfSens[(long)y*N + x];
+		for (z = 0; z < Z; z++)
+			pfImg[z] = fSens > 0.0f ? pfImg[z]*pfBack[z]/fSens : 0.0f;
+	}
+}
+
+// [slice][pixel] to [pixel][slice] and back
+static void vToPixelMajor(const float *pfIn, float *pfOut, long lPixels, int Z)
+{
+	long p;
+	int z;
+
+	for (z = 0; z < Z; z++)
+		for (p = 0; p < lPixels; p++)
+			pfOut[p*Z + z] = pfIn[z*lPixels + p];
+}
+
+static void vToSliceMajor(const float *pfIn, float *pfOut, long lPixels, int Z)
+{
+	long p;
+	int z;
+
+	for (z = 0; z < Z; z++)
+		for (p = 0; p < lPixels; p++)
+			pfOut[z*lPixels + p] = pfIn[p*Z + z];
+}
+
+// puts the views of subset s in piViews and returns how many there are
+static int iSubsetViews(int iNumViews, int iNumSubsets, int s, int *piViews)
+{
+	int iView, iNum = 0;
+
+	for (iView = s; iView < iNumViews; iView += iNumSubsets)
+		piViews[iNum++] = iView;
+	return iNum;
+}
+
+#ifndef WIN32
+static int bSendAll(int iFd, const void *pv, size_t lSize)
+{
+	const char *pch = (const char *)pv;
+	ssize_t lWritten;
+
+	while (lSize > 0){
+		if ((lWritten = write(iFd, pch, lSize)) <= 0)
+			return FALSE;
+		pch += lWritten;
+		lSize -= lWritten;
+	}
+	return TRUE;
+}
+
+static int bRecvAll(int iFd, void *pv, size_t lSize)
+{
+	char *pch = (char *)pv;
+	ssize_t lRead;
+
+	while (lSize > 0){
+		if ((lRead = read(iFd, pch, lSize)) <= 0)
+			return FALSE;
+		pch += lRead;
+		lSize -= lRead;
+	}
+	return TRUE;
+}
+#endif
+
+/* forks ranks 1 to iNumRanks-1, each connected to rank 0 by a socket
+	pair, and returns in every rank with psRanks->iRank set */
+static void vStartRanks(SysMatRanks_t *psRanks, int iNumRanks, long lVoxels)
+{
+#ifndef WIN32
+	int aiPair[2], iRank, i;
+#endif
+
+	memset(psRanks, 0, sizeof(SysMatRanks_t));
+	psRanks->iNumRanks = iNumRanks;
+#ifndef WIN32
+	if (iNumRanks <= 1)
+		return;
+	signal(SIGPIPE, SIG_IGN);
+	psRanks->piFds = (int *)pvIrlMalloc(sizeof(int)*iNumRanks, "SysMatRanks:piFds");
+	psRanks->piPids = (pid_t *)pvIrlMalloc(sizeof(pid_t)*iNumRanks, "SysMatRanks:piPids");
+	psRanks->piFds[0] = -1;
+	for (iRank = 1; iRank < iNumRanks; iRank++){
+		if (socketpair(AF_UNIX, SOCK_STREAM, 0, aiPair))
+			vErrorHandler(ECLASS_FATAL, ETYPE_IO, "SysMatRanks", "unable to connect rank %d", iRank);
+		fflush(NULL);
+		if ((psRanks->piPids[iRank] = fork()) < 0)
+			vErrorHandler(ECLASS_FATAL, ETYPE_IO, "SysMatRanks", "unable to fork rank %d", iRank);
+		if (psRanks->piPids[iRank] == 0){
+			for (i = 1; i < iRank; i++)
+				close(psRanks->piFds[i]);
+			close(aiPair[0]);
+			psRanks->iRank = iRank;
+			psRanks->piFds[0] = aiPair[1];
+			return;
+		}
+		close(aiPair[1]);
+		psRanks->piFds[iRank] = aiPair[0];
+	}
+	psRanks->pfPart = (float *)pvIrlMalloc(sizeof(float)*lVoxels, "SysMatRanks:pfPart");
+#endif
+}
+
+/* sums the partial backprojections of the ranks into pfBack of every
+	rank, adding them on rank 0 in rank order, and returns the seconds
+	this rank spent in it, waiting for the other ranks included */
+static double dAllReduce(SysMatRanks_t *psRanks, float *pfBack, long lVoxels)
+{
+	double dStart = dGetWallTime();
+#ifndef WIN32
+	size_t lSize = sizeof(float)*lVoxels;
+	long l;
+	int iRank;
+
+	if (psRanks->iRank > 0){
+		if (!bSendAll(psRanks->piFds[0], pfBack, lSize) || !bRecvAll(psRanks->piFds[0], pfBack, lSize))
+			_exit(1);	// rank 0 has gone
+		return dGetWallTime() - dStart;
+	}
+	for (iRank = 1; iRank < psRanks->iNumRanks; iRank++){
+		if (!bRecvAll(psRanks->piFds[iRank], psRanks->pfPart, lSize))
+			vErrorHandler(ECLASS_FATAL, ETYPE_IO, "SysMatOsem", "rank %d died", iRank);
+		for (l = 0; l < lVoxels; l++)
+			pfBack[l] += psRanks->pfPart[l];
+	}
+	for (iRank = 1; iRank < psRanks->iNumRanks; iRank++)
+		if (!bSendAll(psRanks->piFds[iRank], pfBack, lSize))
+			vErrorHandler(ECLASS_FATAL, ETYPE_IO, "SysMatOsem", "rank %d died", iRank);
+#endif
+	return dGetWallTime() - dStart;
+}
+
+// ends ranks 1 and on, and waits for them in rank 0
+static void vStopRanks(SysMatRanks_t *psRanks)
+{
+#ifndef WIN32
+	int iRank;
+
+	if (psRanks->iNumRanks <= 1)
+		return;
+	if (psRanks->iRank > 0)
+		_exit(0);
+	for (iRank = 1; iRank < psRanks->iNumRanks; iRank++){
+		close(psRanks->piFds[iRank]);
+		waitpid(psRanks->piPids[iRank], NULL, 0);
+	}
+	IrlFree(psRanks->piFds);
+	IrlFree(psRanks->piPids);
+	IrlFree(psRanks->pfPart);
+#endif
+}
+
+/**
+	@brief Reconstructs like IrlOsem, with the projector of the
+	precomputed system matrix.
+
+	Subset s holds views s, s + NumViews/NumAngPerSubset, and so on.
+	Without bReconIsInitEst the initial estimate is uniform. With
+	sysmat_ranks the ranks are forked here and have ended when it returns.
+
+	@param iStartIteration - number of the first iteration; the ones
+		before it are taken to be done.
+	@param pfnCallback - called with the estimate after each iteration, or NULL.
+	@param pfScatterEstimate - added to the projections, or NULL.
+	@param pfPrjImage - the projections, scaled by NumViews like those IrlOsem takes.
+
+	@return 0.
+*/
+int iSysMatOsem(IrlParms_t *psParms, Options_t *psOptions, PrjView_t *psViews, int iStartIteration,
+	void (*pfnCallback)(int iIteration, float *pfCurrentEstimate), float *pfScatterEstimate, float *pfPrjImage, float *pfActImage)
+{
+	SysMatPass_t sPass;
+	SysMatRanks_t sRanks;
+	int N = psParms->NumPixels, Z = psParms->NumSlices, iNumViews = psParms->NumViews;
+	int iNumSubsets, iNumGroups = 0, iIteration, s, g, k, iView, iSubsetLen, iFirstView, iNumThreads;
+	long lPixels = (long)N*N, lVoxels = lPixels*Z, l;
+	int *piGroup, *piViews;
+	float *pfCFCR, *pfSens;
+	double dStart, dForward, dBack, dComm, dTime;
+	OsemTeam_t *psTeam;
+
+	if (psOptions->bModelDrf && psParms->fHoleLen <= 0.0f)
+		vErrorHandler(ECLASS_FATAL, ETYPE_ILLEGAL_VALUE, "SysMatOsem", "approx_sysmat needs the collimator parameters, not a response table");
+	if (iStartIteration <= 1)
+		vPrintMsg(2, "approx_sysmat: approximate projector with a Gaussian collimator response, not the IrlOsem projector\n");
+	iNumSubsets = psParms->NumAngPerSubset > 0 ? (iNumViews + psParms->NumAngPerSubset - 1)/psParms->NumAngPerSubset : 1;
+
+	// views at the same distance from the axis share a matrix
+	pfCFCR = (float *)pvIrlMalloc(sizeof(float)*iNumViews, "SysMatOsem:pfCFCR");
+	piGroup = (int *)pvIrlMalloc(sizeof(int)*iNumViews, "SysMatOsem:piGroup");
+	for (iView = 0; iView < iNumViews; iView++){
+		float fCFCR = psOptions->bModelDrf ? psViews[iView].CFCR : 0.0f;
+
+		for (g = 0; g < iNumGroups && pfCFCR[g] != fCFCR; g++)
+			;
+		if (g == iNumGroups)
+			pfCFCR[iNumGroups++] = fCFCR;
+		piGroup[iView] = g;
+	}
+
+	// the threads are kept for the whole reconstruction, and each chunk of the work has its own scratch
+	psTeam = psStartTeam(iGetNumThreads());
+	memset(&sPass, 0, sizeof(sPass));
+	sPass.psMat = psGetSysMat(psParms, psOptions->bModelDrf, pfCFCR, iNumGroups);
+	sPass.psRot = psGetRotation(N, psViews, iNumViews, psTeam);
+	sPass.N = N;
+	sPass.Z = Z;
+	sPass.psViews = psViews;
+	sPass.piGroup = piGroup;
+	sPass.fFac = (float)iNumViews;
+	sPass.pfPrj = pfPrjImage;
+	sPass.pfScat = pfScatterEstimate;
+	sPass.pfImg = (float *)pvIrlMalloc(sizeof(float)*lVoxels, "SysMatOsem:pfImg");
+	sPass.pfRot = (float *)pvIrlMalloc(sizeof(float)*SYSMAT_VIEW_BATCH*lVoxels, "SysMatOsem:pfRot");
+	sPass.pfBack = (float *)pvIrlMalloc(sizeof(float)*lVoxels, "SysMatOsem:pfBack");
+	piViews = (int *)pvIrlMalloc(sizeof(int)*iNumViews, "SysMatOsem:piViews");
+	sPass.pfViewPrj = (float *)pvIrlMalloc(sizeof(float)*((iNumViews + iNumSubsets - 1)/iNumSubsets)*N*Z, "SysMatOsem:pfViewPrj");
+	pfSens = (float *)pvIrlMalloc(sizeof(float)*iNumSubsets*lPixels, "SysMatOsem:pfSens");
+	sPass.piViews = piViews;
+
+	for (s = 0; s < iNumSubsets; s++){
+		sPass.iNumViews = iSubsetViews(iNumViews, iNumSubsets, s, piViews);
+		sPass.pfSens = pfSens + s*lPixels;
+		vTeamFor(psTeam, N, vSensRow, &sPass);
+	}
+	if (psOptions->bReconIsInitEst)
+		vToPixelMajor(pfActImage, sPass.pfImg, lPixels, Z);
+	else
+		for (l = 0; l < lVoxels; l++)
+			sPass.pfImg[l] = 1.0f;
+
+	// threads do not survive fork, so the ranks share num_threads between new teams
+	vStartRanks(&sRanks, sgOpts.iNumRanks, lVoxels);
+	if (sRanks.iNumRanks > 1){
+		vStopTeam(psTeam);
+		iNumThreads = iGetNumThreads()/sRanks.iNumRanks;
+		psTeam = psStartTeam(iNumThreads > 1 ? iNumThreads : 1);
+	}
+	sPass.iNumChunks = iTeamSize(psTeam);
+	sPass.pfScratch = (float *)pvIrlMalloc(sizeof(float)*SYSMAT_VIEW_BATCH*sPass.iNumChunks*3*Z, "SysMatOsem:pfScratch");
+
+	for (iIteration = iStartIteration > 0 ? iStartIteration : 1; iIteration <= psParms->NumIterations; iIteration++){
+		dForward = dBack = dComm = 0.0;
+		for (s = 0; s < iNumSubsets; s++){
+			// the views of the subset this rank owns
+			iSubsetLen = iSubsetViews(iNumViews, iNumSubsets, s, piViews);
+			iFirstView = (int)((long)sRanks.iRank*iSubsetLen/sRanks.iNumRanks);
+			sPass.piViews = piViews + iFirstView;
+			sPass.iNumViews = (int)((long)(sRanks.iRank + 1)*iSubsetLen/sRanks.iNumRanks) - iFirstView;
+			sPass.pfSens = pfSens + s*lPixels;
+			dStart = dGetWallTime();
+			vTeamFor(psTeam, sPass.iNumChunks, vForwardChunk, &sPass);
+			dForward += dGetWallTime() - dStart;
+			dStart = dGetWallTime();
+			memset(sPass.pfBack, 0, sizeof(float)*lVoxels);
+			for (k = 0; k < sPass.iNumViews; k += SYSMAT_VIEW_BATCH){
+				sPass.iFirst = k;
+				sPass.iBatch = sPass.iNumViews - k < SYSMAT_VIEW_BATCH ? sPass.iNumViews - k : SYSMAT_VIEW_BATCH;
+				vTeamFor(psTeam, sPass.iBatch*sPass.iNumChunks, vBackRotChunk, &sPass);
+				vTeamFor(psTeam, sPass.iNumChunks, vBackGatherChunk, &sPass);
+			}
+			dBack += dGetWallTime() - dStart;
+			if (sRanks.iNumRanks > 1){
+				dTime = dAllReduce(&sRanks, sPass.pfBack, lVoxels);
+				dComm += dTime;
+				if (sRanks.iRank == 0)
+					vPrintMsg(4, "sysmat: iteration %d, subset %d: all-reduce of %.1f MB over %d ranks in %.3f s\n",
+						iIteration, s + 1, sizeof(float)*lVoxels/1048576.0, sRanks.iNumRanks, dTime);
+			}
+			dStart = dGetWallTime();
+			vTeamFor(psTeam, N, vUpdateRow, &sPass);
+			dBack += dGetWallTime() - dStart;
+		}
+		if (sRanks.iRank > 0)
+			continue;
+		vPrintMsg(4, "sysmat: iteration %d, projection %.2f s, backprojection and update %.2f s", iIteration, dForward, dBack);
+		if (sRanks.iNumRanks > 1)
+			vPrintMsg(4, ", all-reduce %.2f s (%.3f s per subset)", dComm, dComm/iNumSubsets);
+		vPrintMsg(4, "\n");
+		if (pfnCallback != NULL){
+			vToSliceMajor(sPass.pfImg, pfActImage, lPixels, Z);
+			pfnCallback(iIteration, pfActImage);
+		}
+	}
+	vStopTeam(psTeam);
+	vStopRanks(&sRanks);
+	vToSliceMajor(sPass.pfImg, pfActImage, lPixels, Z);
+
+	IrlFree(sPass.pfScratch);
+	IrlFree(sPass.pfImg);
+	IrlFree(sPass.pfRot);
+	IrlFree(sPass.pfBack);
+	IrlFree(sPass.pfViewPrj);
+	IrlFree(pfSens);
+	IrlFree(piViews);
+	IrlFree(piGroup);
+	IrlFree(pfCFCR);
+	return 0;
+}
+
+#ifdef STANDALONE
+
+// a rotation benchmark pass: view iView of psRotation, rows in parallel
+typedef struct {
+	const SysMatRotation_t *psRotation;
+	int N, Z, iView;
+	const float *pfImg;		// [pixel][slice]
+	float *pfRot;			// [rotated pixel][slice]
+	float *pfBack;			// [pixel][slice]
+} RotBench_t;
+
+/* the rotation previously used in vForwardView: the taps of every rotated
+	pixel worked out again for every view of every subset */
+static void vLegacySampleRow(void *pvArg, int j)
+{
+	RotBench_t *ps = (RotBench_t *)pvArg;
+	int N = ps->N, Z = ps->Z, i, dx, dy, x0, y0;
+	float fAngle = ps->psRotation->pfAngle[ps->iView], fCos = (float)cos(fAngle), fSin = (float)sin(fAngle), fX, fY, fW;
+	float *pfOut;
+
+	for (i = 0; i < N; i++){
+		pfOut = ps->pfRot + ((long)j*N + i)*Z;
+		memset(pfOut, 0, sizeof(float)*Z);
+		vRotatedPoint(N, fCos, fSin, j, i, &fX, &fY);
+		x0 = (int)floor(fX);
+		y0 = (int)floor(fY);
+		if (x0 < -1 || x0 >= N || y0 < -1 || y0 >= N)
+			continue;
+		for (dy = 0; dy < 2; dy++)
+			for (dx = 0; dx < 2; dx++){
+				if (y0 + dy < 0 || y0 + dy >= N || x0 + dx < 0 || x0 + dx >= N)
+					continue;
+				fW = (1.0f - fabsf(fX - (x0 + dx)))*(1.0f - fabsf(fY - (y0 + dy)));
+				if (fW > 0.0f)
+					vAxpy(fW, ps->pfImg + ((long)(y0 + dy)*N + x0 + dx)*Z, pfOut, Z);
+			}
+	}
+}
+
+// and in vBackGatherRow: the rotated pixels near each image pixel searched for every view
+static void vLegacyGatherRow(void *pvArg, int y)
+{
+	RotBench_t *ps = (RotBench_t *)pvArg;
+	int N = ps->N, Z = ps->Z, x, i, j, i0, j0;
+	float fAngle = ps->psRotation->pfAngle[ps->iView], fCos = (float)cos(fAngle), fSin = (float)sin(fAngle);
+	float fC = 0.5f*(N - 1), fDx, fDy = y - fC, fX, fY;
+
+	for (x = 0; x < N; x++){
+		fDx = x - fC;
+		i0 = (int)floor(fC + fDx*fCos - fDy*fSin) - 1;
+		j0 = (int)floor(fC + fDx*fSin + fDy*fCos) - 1;
+		for (j = j0 < 0 ? 0 : j0; j <= j0 + 3 && j < N; j++)
+			for (i = i0 < 0 ? 0 : i0; i <= i0 + 3 && i < N; i++){
+				vRotatedPoint(N, fCos, fSin, j, i, &fX, &fY);
+				if (fabsf(fX - x) >= 1.0f || fabsf(fY - y) >= 1.0f)
+					continue;
+				vAxpy((1.0f - fabsf(fX - x))*(1.0f - fabsf(fY - y)), ps->pfRot + ((long)j*N + i)*Z, ps->pfBack + ((long)y*N + x)*Z, Z);
+			}
+	}
+}
+
+static void vTableSampleRow(void *pvArg, int j)
+{
+	RotBench_t *ps = (RotBench_t *)pvArg;
+	const ViewRotation_t *psRot = ps->psRotation->psViews + ps->iView;
+	int N = ps->N, Z = ps->Z, n;
+
+	memset(ps->pfRot + (long)j*N*Z, 0, sizeof(float)*N*Z);
+	// the samples of row j, found by bisection since they are in increasing order
+	{
+		int iLo = 0, iHi = psRot->iNumSamples, iMid;
+
+		while (iLo < iHi){
+			iMid = (iLo + iHi)/2;
+			if (psRot->piSample[iMid] < j*N)
+				iLo = iMid + 1;
+			else
+				iHi = iMid;
+		}
+		for (n = iLo; n < psRot->iNumSamples && psRot->piSample[n] < (j + 1)*N; n++)
+			vSampleTaps(ps->pfImg, psRot->piTapPixel + 4*n, psRot->pfTapWeight + 4*n, ps->pfRot + (long)psRot->piSample[n]*Z, Z);
+	}
+}
+
+static void vTableGatherRow(void *pvArg, int y)
+{
+	RotBench_t *ps = (RotBench_t *)pvArg;
+	const ViewRotation_t *psRot = ps->psRotation->psViews + ps->iView;
+	int N = ps->N, Z = ps->Z, p;
+
+	for (p = y*N; p < (y + 1)*N; p++)
+		vGatherEntries(ps->pfRot, psRot->piGatherPixel + psRot->piGatherFirst[p], psRot->pfGatherWeight + psRot->piGatherFirst[p],
+			psRot->piGatherFirst[p + 1] - psRot->piGatherFirst[p], ps->pfBack + (long)p*Z, Z);
+}
+
+static double dMaxRelDiff(const float *pf1, const float *pf2, long lLen)
+{
+	double dMax = 0.0, dDiff, dScale = 0.0;
+	long l;
+
+	for (l = 0; l < lLen; l++)
+		if (fabs(pf1[l]) > dScale)
+			dScale = fabs(pf1[l]);
+	for (l = 0; l < lLen; l++)
+		if ((dDiff = fabs((double)pf1[l] - pf2[l])) > dMax)
+			dMax = dDiff;
+	return dScale > 0.0 ? dMax/dScale : dMax;
+}
+
+// times the rotation through the tables against the one it replaced
+static int iRotationBench(int N, int Z, int iNumViews)
+{
+	RotBench_t sBench;
+	PrjView_t *psViews;
+	OsemTeam_t *psTeam;
+	float *pfImg, *pfLegacyRot, *pfLegacyBack, *pfTableBack;
+	int iView, iRep, iNumReps = 3;
+	long l, lVoxels;
+	double dStart, dBuild, dLegacySample, dTableSample, dLegacyGather, dTableGather, dSampleDiff, dGatherDiff;
+
+	lVoxels = (long)N*N*Z;
+	pfImg = (float *)malloc(sizeof(float)*lVoxels);
+	pfLegacyRot = (float *)malloc(sizeof(float)*lVoxels);
+	pfLegacyBack = (float *)malloc(sizeof(float)*lVoxels);
+	pfTableBack = (float *)malloc(sizeof(float)*lVoxels);
+	sBench.pfRot = (float *)malloc(sizeof(float)*lVoxels);
+	psViews = (PrjView_t *)calloc(iNumViews, sizeof(PrjView_t));
+	if (pfImg == NULL || pfLegacyRot == NULL || pfLegacyBack == NULL || pfTableBack == NULL || sBench.pfRot == NULL || psViews == NULL){
+		fprintf(stderr, "unable to allocate %d x %d x %d\n", N, N, Z);
+		exit(1);
+	}
+	srand(1);
+	for (l = 0; l < lVoxels; l++)
+		pfImg[l] = (float)rand()/RAND_MAX;
+	for (iView = 0; iView < iNumViews; iView++)
+		psViews[iView].Angle = (float)(2.0*M_PI*iView/iNumViews);
+
+	printf("%d x %d pixels, %d slices, %d views, %s kernels, %d threads\n", N, N, Z, iNumViews, SYSMAT_KERNEL, iGetNumThreads());
+	dStart = dGetWallTime();
+	psTeam = psStartTeam(iGetNumThreads());
+	sBench.psRotation = psGetRotation(N, psViews, iNumViews, psTeam);
+	vStopTeam(psTeam);
+	dBuild = dGetWallTime() - dStart;
+	sBench.N = N;
+	sBench.Z = Z;
+	sBench.pfImg = pfImg;
+
+	/* every view once per repetition, like one iteration; the last view
+		is left in the buffers for the comparison */
+	dStart = dGetWallTime();
+	for (iRep = 0; iRep < iNumReps; iRep++)
+		for (sBench.iView = 0; sBench.iView < iNumViews; sBench.iView++)
+			vParallelFor(N, vLegacySampleRow, &sBench);
+	dLegacySample = (dGetWallTime() - dStart)/iNumReps;
+	memcpy(pfLegacyRot, sBench.pfRot, sizeof(float)*lVoxels);
+	dStart = dGetWallTime();
+	for (iRep = 0; iRep < iNumReps; iRep++)
+		for (sBench.iView = 0; sBench.iView < iNumViews; sBench.iView++)
+			vParallelFor(N, vTableSampleRow, &sBench);
+	dTableSample = (dGetWallTime() - dStart)/iNumReps;
+	dSampleDiff = dMaxRelDiff(pfLegacyRot, sBench.pfRot, lVoxels);
+
+	// the back rotation of the last rotated view into every view
+	memset(pfLegacyBack, 0, sizeof(float)*lVoxels);
+	memset(pfTableBack, 0, sizeof(float)*lVoxels);
+	sBench.pfBack = pfLegacyBack;
+	dStart = dGetWallTime();
+	for (sBench.iView = 0; sBench.iView < iNumViews; sBench.iView++)
+		vParallelFor(N, vLegacyGatherRow, &sBench);
+	dLegacyGather = dGetWallTime() - dStart;
+	sBench.pfBack = pfTableBack;
+	dStart = dGetWallTime();
+	for (sBench.iView = 0; sBench.iView < iNumViews; sBench.iView++)
+		vParallelFor(N, vTableGatherRow, &sBench);
+	dTableGather = dGetWallTime() - dStart;
+	dGatherDiff = dMaxRelDiff(pfLegacyBack, pfTableBack, lVoxels);
+
+	printf("tables built in %.2f ms, %.1f MB\n", 1e3*dBuild, sBench.psRotation->dBytes/1048576.0);
+	printf("rotate  legacy %8.2f ms  tables %8.2f ms (%5.1fx)  max rel diff %.2g\n",
+		1e3*dLegacySample, 1e3*dTableSample, dLegacySample/dTableSample, dSampleDiff);
+	printf("back    legacy %8.2f ms  tables %8.2f ms (%5.1fx)  max rel diff %.2g\n",
+		1e3*dLegacyGather, 1e3*dTableGather, dLegacyGather/dTableGather, dGatherDiff);
+
+	vFreeRotation(psgRotation);
+	free(pfImg);
+	free(pfLegacyRot);
+	free(pfLegacyBack);
+	free(pfTableBack);
+	free(sBench.pfRot);
+	free(psViews);
+	return 0;
+}
+
+/* Rotates a random image through the tables and as it was done before
+	them at 0, 30, 45, 90, 180 and 270 degrees and returns 1 if they differ
+	by more than 1e-6 of the largest value, forwards or back. At 0 degrees
+	the rotation must also be the image itself, and at 90 degrees rotated
+	pixel (j,i) must be image pixel (x,y) = (j,N-1-i), within 1e-5 since
+	the cosine of 90 degrees in single precision is not quite 0. */
+static int iRotationCheck(int N, int Z)
+{
+	static const double adDegrees[] = { 0.0, 30.0, 45.0, 90.0, 180.0, 270.0 };
+	int iNumViews = (int)(sizeof(adDegrees)/sizeof(adDegrees[0]));
+	RotBench_t sBench;
+	PrjView_t asViews[sizeof(adDegrees)/sizeof(adDegrees[0])];
+	OsemTeam_t *psTeam;
+	float *pfImg, *pfLegacy, *pfExpected;
+	long l, lVoxels = (long)N*N*Z;
+	double dSampleDiff, dGatherDiff, dExactDiff;
+	int i, j, iFailed = 0;
+
+	pfImg = (float *)malloc(sizeof(float)*lVoxels);
+	pfLegacy = (float *)malloc(sizeof(float)*lVoxels);
+	pfExpected = (float *)malloc(sizeof(float)*lVoxels);
+	sBench.pfRot = (float *)malloc(sizeof(float)*lVoxels);
+	sBench.pfBack = (float *)malloc(sizeof(float)*lVoxels);
+	if (pfImg == NULL || pfLegacy == NULL || pfExpected == NULL || sBench.pfRot == NULL || sBench.pfBack == NULL){
+		fprintf(stderr, "unable to allocate %d x %d x %d\n", N, N, Z);
+		exit(1);
+	}
+	srand(1);
+	for (l = 0; l < lVoxels; l++)
+		pfImg[l] = (float)rand()/RAND_MAX;
+	memset(asViews, 0, sizeof(asViews));
+	for (sBench.iView = 0; sBench.iView < iNumViews; sBench.iView++)
+		asViews[sBench.iView].Angle = (float)(adDegrees[sBench.iView]*M_PI/180.0);
+	psTeam = psStartTeam(iGetNumThreads());
+	sBench.psRotation = psGetRotation(N, asViews, iNumViews, psTeam);
+	vStopTeam(psTeam);
+	sBench.N = N;
+	sBench.Z = Z;
+	sBench.pfImg = pfImg;
+
+	for (sBench.iView = 0; sBench.iView < iNumViews; sBench.iView++){
+		vParallelFor(N, vLegacySampleRow, &sBench);
+		memcpy(pfLegacy, sBench.pfRot, sizeof(float)*lVoxels);
+		vParallelFor(N, vTableSampleRow, &sBench);
+		dSampleDiff = dMaxRelDiff(pfLegacy, sBench.pfRot, lVoxels);
+		dExactDiff = 0.0;
+		if (adDegrees[sBench.iView] == 0.0 || adDegrees[sBench.iView] == 90.0){
+			for (j = 0; j < N; j++)
+				for (i = 0; i < N; i++)
+					memcpy(pfExpected + ((long)j*N + i)*Z, pfImg + (adDegrees[sBench.iView] == 0.0 ? (long)j*N + i : (long)(N - 1 - i)*N + j)*Z, sizeof(float)*Z);
+			dExactDiff = dMaxRelDiff(pfExpected, sBench.pfRot, lVoxels);
+		}
+
+		// the back rotation of the rotated image
+		memset(sBench.pfBack, 0, sizeof(float)*lVoxels);
+		vParallelFor(N, vLegacyGatherRow, &sBench);
+		memcpy(pfLegacy, sBench.pfBack, sizeof(float)*lVoxels);
+		memset(sBench.pfBack, 0, sizeof(float)*lVoxels);
+		vParallelFor(N, vTableGatherRow, &sBench);
+		dGatherDiff = dMaxRelDiff(pfLegacy, sBench.pfBack, lVoxels);
+
+		printf("%5.1f degrees: rotate max rel diff %.2g, back %.2g", adDegrees[sBench.iView], dSampleDiff, dGatherDiff);
+		if (adDegrees[sBench.iView] == 0.0 || adDegrees[sBench.iView] == 90.0)
+			printf(", from the exact rotation %.2g", dExactDiff);
+		printf("\n");
+		if (dSampleDiff > 1e-6 || dGatherDiff > 1e-6 || dExactDiff > 1e-5)
+			iFailed = 1;
+	}
+	vFreeRotation(psgRotation);
+	psgRotation = NULL;
+	free(pfImg);
+	free(pfLegacy);
+	free(pfExpected);
+	free(sBench.pfRot);
+	free(sBench.pfBack);
+	return iFailed;
+}
+
+/* adds NumViews times the line integrals through a disc of activity fAct,
+	radius fRadius and centre (fX0, fY0) in pixels to the projections,
+	[view][slice][bin] over slices iZ0 to iZ1-1 */
+static void vDiscProjections(int N, int Z, int iNumViews, const PrjView_t *psViews, float fX0, float fY0, float fRadius,
+	int iZ0, int iZ1, float fAct, float *pfPrj)
+{
+	float fC = 0.5f*(N - 1), fS0, fU, fChord;
+	int iView, z, u;
+
+	for (iView = 0; iView < iNumViews; iView++){
+		fS0 = (fX0 - fC)*(float)cos(psViews[iView].Angle) - (fY0 - fC)*(float)sin(psViews[iView].Angle);
+		for (u = 0; u < N; u++){
+			fU = u - fC - fS0;
+			if (fabsf(fU) >= fRadius)
+				continue;
+			fChord = 2.0f*(float)sqrt(fRadius*fRadius - fU*fU);
+			for (z = iZ0; z < iZ1 && z < Z; z++)
+				pfPrj[((long)iView*Z + z)*N + u] += iNumViews*fAct*fChord;
+		}
+	}
+}
+
+/* the parameters, views and projections of a cylinder with a hot rod off
+	the axis, without collimator response and with one subset; the views
+	and projections are for the caller to free */
+static void vPhantomStudy(int N, int Z, int iNumViews, int iNumIterations, IrlParms_t *psParms, Options_t *psOptions,
+	PrjView_t **ppsViews, float **ppfPrj)
+{
+	PrjView_t *psViews;
+	float *pfPrj;
+	int iView;
+
+	memset(psParms, 0, sizeof(*psParms));
+	memset(psOptions, 0, sizeof(*psOptions));
+	psParms->NumPixels = N;
+	psParms->NumSlices = Z;
+	psParms->NumViews = iNumViews;
+	psParms->NumIterations = iNumIterations;
+	psParms->NumAngPerSubset = iNumViews;
+	psParms->BinWidth = 0.4f;
+	psViews = (PrjView_t *)calloc(iNumViews, sizeof(PrjView_t));
+	pfPrj = (float *)calloc((size_t)iNumViews*Z*N, sizeof(float));
+	if (psViews == NULL || pfPrj == NULL){
+		fprintf(stderr, "unable to allocate %d views\n", iNumViews);
+		exit(1);
+	}
+	for (iView = 0; iView < iNumViews; iView++){
+		psViews[iView].Angle = (float)(2.0*M_PI*iView/iNumViews);
+		psViews[iView].CFCR = 20.0f;
+		psViews[iView].Left = 0.0f;
+		psViews[iView].Right = (float)(N - 1);
+	}
+	vDiscProjections(N, Z, iNumViews, psViews, 0.5f*(N - 1), 0.5f*(N - 1), 0.35f*N, Z/8, Z - Z/8, 1.0f, pfPrj);
+	vDiscProjections(N, Z, iNumViews, psViews, 0.6f*N, 0.4f*N, 0.08f*N, Z/4, Z - Z/4, 3.0f, pfPrj);
+	*ppsViews = psViews;
+	*ppfPrj = pfPrj;
+}
+
+/* Reconstructs the phantom with subsets of 8 views with 1 to 32 threads
+	and returns 1 unless every thread count gives the image of one thread
+	bit for bit. */
+static int iThreadScaling(int N, int Z, int iNumViews, int iNumIterations)
+{
+	IrlParms_t sParms;
+	Options_t sOptions;
+	PrjView_t *psViews;
+	float *pfPrj, *pfOne, *pfImg;
+	long lVoxels = (long)N*N*Z;
+	double dStart, dTime, dOneTime = 0.0;
+	int iThreads, bSame, bAllSame = TRUE;
+
+	vPhantomStudy(N, Z, iNumViews, iNumIterations, &sParms, &sOptions, &psViews, &pfPrj);
+	sParms.NumAngPerSubset = iNumViews < 8 ? iNumViews : 8;
+	pfOne = (float *)malloc(sizeof(float)*lVoxels);
+	pfImg = (float *)malloc(sizeof(float)*lVoxels);
+	if (pfOne == NULL || pfImg == NULL){
+		fprintf(stderr, "unable to allocate %d x %d x %d\n", N, N, Z);
+		exit(1);
+	}
+	printf("%d x %d pixels, %d slices, %d views in subsets of %d, %d iterations, %s kernels\n",
+		N, N, Z, iNumViews, sParms.NumAngPerSubset, iNumIterations, SYSMAT_KERNEL);
+	printf("threads   reconstruction\n");
+	for (iThreads = 1; iThreads <= 32; iThreads *= 2){
+		vSetNumThreads(iThreads);
+		dStart = dGetWallTime();
+		iSysMatOsem(&sParms, &sOptions, psViews, 1, NULL, NULL, pfPrj, iThreads == 1 ? pfOne : pfImg);
+		dTime = dGetWallTime() - dStart;
+		if (iThreads == 1)
+			dOneTime = dTime;
+		bSame = iThreads == 1 || memcmp(pfOne, pfImg, sizeof(float)*lVoxels) == 0;
+		bAllSame = bAllSame && bSame;
+		printf("%7d %8.2f s (%5.1fx)  %s\n", iThreads, dTime, dOneTime/dTime, bSame ? "identical" : "MISMATCH");
+	}
+	free(psViews);
+	free(pfPrj);
+	free(pfOne);
+	free(pfImg);
+	return !bAllSame;
+}
+
+/* Reconstructs the phantom with subsets of 8 views in one process and on
+	2 and 3 ranks, and returns 1 if a rank count gives an image more than
+	1e-5 of its maximum away from that of one process. */
+static int iRankScaling(int N, int Z, int iNumViews, int iNumIterations)
+{
+	IrlParms_t sParms;
+	Options_t sOptions;
+	SysMatOptions_t sOpts;
+	PrjView_t *psViews;
+	float *pfPrj, *pfOne, *pfImg;
+	long lVoxels = (long)N*N*Z;
+	double dStart, dTime, dOneTime = 0.0, dDiff;
+	int iRanks, bAllClose = TRUE;
+
+	vPhantomStudy(N, Z, iNumViews, iNumIterations, &sParms, &sOptions, &psViews, &pfPrj);
+	sParms.NumAngPerSubset = iNumViews < 8 ? iNumViews : 8;
+	pfOne = (float *)malloc(sizeof(float)*lVoxels);
+	pfImg = (float *)malloc(sizeof(float)*lVoxels);
+	if (pfOne == NULL || pfImg == NULL){
+		fprintf(stderr, "unable to allocate %d x %d x %d\n", N, N, Z);
+		exit(1);
+	}
+	printf("%d x %d pixels, %d slices, %d views in subsets of %d, %d iterations, %d threads\n",
+		N, N, Z, iNumViews, sParms.NumAngPerSubset, iNumIterations, iGetNumThreads());
+	printf("ranks   reconstruction   difference\n");
+	vGetSysMatOptions(&sOpts);
+	for (iRanks = 1; iRanks <= 3; iRanks++){
+		sOpts.iNumRanks = iRanks;
+		vSetSysMatOptions(&sOpts);
+		dStart = dGetWallTime();
+		iSysMatOsem(&sParms, &sOptions, psViews, 1, NULL, NULL, pfPrj, iRanks == 1 ? pfOne : pfImg);
+		dTime = dGetWallTime() - dStart;
+		if (iRanks == 1)
+			dOneTime = dTime;
+		dDiff = iRanks == 1 ? 0.0 : dMaxRelDiff(pfOne, pfImg, lVoxels);
+		bAllClose = bAllClose && dDiff <= 1e-5;
+		printf("%5d %8.2f s (%4.1fx)   %.3g%s\n", iRanks, dTime, dOneTime/dTime, dDiff, dDiff <= 1e-5 ? "" : "  MISMATCH");
+	}
+	free(psViews);
+	free(pfPrj);
+	free(pfOne);
+	free(pfImg);
+	return !bAllClose;
+}
+
+/* Reconstructs the phantom with IrlOsem and with iSysMatOsem and returns
+	1 if the relative difference of the images is above dTol. Needs
+	libirl. */
+static int iCompareWithIrlOsem(int N, int Z, int iNumViews, int iNumIterations, double dTol)
+{
+	IrlParms_t sParms;
+	Options_t sOptions;
+	PrjView_t *psViews;
+	float *pfPrj, *pfIrl, *pfSysMat;
+	long l, lVoxels = (long)N*N*Z;
+	double dDiff = 0.0, dNorm = 0.0, dStart, dIrlTime, dSysMatTime;
+	int iErrNum;
+
+	vPhantomStudy(N, Z, iNumViews, iNumIterations, &sParms, &sOptions, &psViews, &pfPrj);
+	pfIrl = (float *)malloc(sizeof(float)*lVoxels);
+	pfSysMat = (float *)malloc(sizeof(float)*lVoxels);
+	if (pfIrl == NULL || pfSysMat == NULL){
+		fprintf(stderr, "unable to allocate %d x %d x %d\n", N, N, Z);
+		exit(1);
+	}
+
+	dStart = dGetWallTime();
+	iErrNum = IrlOsem(&sParms, &sOptions, psViews, NULL, NULL, NULL, NULL, NULL, pfPrj, pfIrl, NULL, NULL);
+	dIrlTime = dGetWallTime() - dStart;
+	if (iErrNum){
+		fprintf(stderr, "IrlOsem failed: %s\n", pchIrlErrorString());
+		exit(1);
+	}
+	dStart = dGetWallTime();
+	iSysMatOsem(&sParms, &sOptions, psViews, 1, NULL, NULL, pfPrj, pfSysMat);
+	dSysMatTime = dGetWallTime() - dStart;
+	for (l = 0; l < lVoxels; l++){
+		dDiff += ((double)pfSysMat[l] - pfIrl[l])*((double)pfSysMat[l] - pfIrl[l]);
+		dNorm += (double)pfIrl[l]*pfIrl[l];
+	}
+	dDiff = dNorm > 0.0 ? sqrt(dDiff/dNorm) : sqrt(dDiff);
+	printf("%d x %d pixels, %d slices, %d views, %d iterations: IrlOsem %.2f s, sysmat %.2f s (%s kernels), relative difference %.3g (limit %.3g)\n",
+		N, N, Z, iNumViews, iNumIterations, dIrlTime, dSysMatTime, SYSMAT_KERNEL, dDiff, dTol);
+	free(psViews);
+	free(pfPrj);
+	free(pfIrl);
+	free(pfSysMat);
+	return dDiff > dTol;
+}
+
+int main(int argc, char **argv)
+{
+	if (argc == 4 && argv[1][0] != '-')
+		return iRotationBench(atoi(argv[1]), atoi(argv[2]), atoi(argv[3]));
+	if (argc == 4 && strcmp(argv[1], "-rot") == 0)
+		return iRotationCheck(atoi(argv[2]), atoi(argv[3]));
+	if (argc == 6 && strcmp(argv[1], "-threads") == 0)
+		return iThreadScaling(atoi(argv[2]), atoi(argv[3]), atoi(argv[4]), atoi(argv[5]));
+	if (argc == 6 && strcmp(argv[1], "-ranks") == 0)
+		return iRankScaling(atoi(argv[2]), atoi(argv[3]), atoi(argv[4]), atoi(argv[5]));
+	if ((argc == 6 || argc == 7) && strcmp(argv[1], "-irl") == 0)
+		return iCompareWithIrlOsem(atoi(argv[2]), atoi(argv[3]), atoi(argv[4]), atoi(argv[5]), argc == 7 ? atof(argv[6]) : 0.01);
+	fprintf(stderr, "usage: sysmat pixels slices views\n"
+		"       sysmat -rot pixels slices\n"
+		"       sysmat -threads pixels slices views iterations\n"
+		"       sysmat -ranks pixels slices views iterations\n"
+		"       sysmat -irl pixels slices views iterations [tolerance]\n");
+	return 2;
+}
+#endif
@@ -0,0 +1,36 @@
+/*
+	sysmat.h
+
+	Approximate precomputed system matrix (approx_sysmat): a projector
+	written here, without attenuation and with a Gaussian collimator
+	response if the response is modeled, is worked out once as a
+	sparse matrix in the frame of a view and applied to every view of the
+	orbit by rotating the image into that frame. Views at the same
+	distance from the axis share a matrix, so a circular orbit needs one.
+	Matrices can be kept in a directory and mapped by later runs. The
+	views of each subset can be split over local processes whose
+	backprojections are summed before the update.
+
+	Include mip/irl.h before this file.
+*/
+
+#ifndef SYSMAT_H
+#define SYSMAT_H
+
+#define SYSMAT_EXTENSION	".sysm"
+#define SYSMAT_MAX_NAME		1024
+
+typedef struct {
+	int bEnabled;						// approx_sysmat: reconstruct with the approximate precomputed matrix instead of the IrlOsem projectors
+	float fMaxFracErr;					// max_frac_err: the collimator response is cut where it falls below this fraction of its peak
+	int iNumRanks;						// sysmat_ranks: local processes the views of each subset are split over
+	char achCacheDir[SYSMAT_MAX_NAME];	// sysmat_cache_dir: where matrices are kept, empty for nowhere
+} SysMatOptions_t;
+
+void vReadSysMatOptions(SysMatOptions_t *psOpts, int bModelAtn, int bModelSrf);
+void vSetSysMatOptions(const SysMatOptions_t *psOpts);
+void vGetSysMatOptions(SysMatOptions_t *psOpts);
+int iSysMatOsem(IrlParms_t *psParms, Options_t *psOptions, PrjView_t *psViews, int iStartIteration,
+	void (*pfnCallback)(int iIteration, float *pfCurrentEstimate), float *pfScatterEstimate, float *pfPrjImage, float *pfActImage);
+
+#endif